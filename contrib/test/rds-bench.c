@@ -0,0 +1,235 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * rds-bench: compare the speed of the libv4l2rds decoding functions
+ *
+ * Decodes RDS stream files (as read from a radio device, or as written
+ * by e.g. cat /dev/radio0 >file) or, if no files are given, synthetic
+ * streams, once per block with v4l2_rds_add(), once per stream with
+ * v4l2_rds_add_blocks() and with all streams at once with
+ * v4l2_rds_add_streams(), and checks that the results are the same.
+ *
+ * Usage: rds-bench [-n <streams>] [-b <blocks>] [-j <threads>] [file...]
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "../../lib/include/libv4l2rds.h"
+
+struct stream {
+	struct v4l2_rds_data *blocks;
+	unsigned count;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void add_block(struct stream *s, unsigned block, uint16_t data, unsigned i)
+{
+	struct v4l2_rds_data *b = &s->blocks[s->count++];
+
+	b->lsb = data & 0xff;
+	b->msb = data >> 8;
+	b->block = block;
+	/* every 97th block has an uncorrectable error */
+	if (i % 97 == 96)
+		b->block |= V4L2_RDS_BLOCK_ERROR;
+}
+
+/* station number nr sends its PS name and a radio text */
+static void gen_stream(struct stream *s, unsigned nr, unsigned count)
+{
+	char ps[9], rt[65];
+	uint16_t pi = 0xd000 + nr;
+	unsigned i;
+
+	snprintf(ps, sizeof(ps), "STAT%04u", nr % 10000);
+	snprintf(rt, sizeof(rt), "Radio text of station %u, recorded for the benchmark", nr);
+	memset(rt + strlen(rt), ' ', sizeof(rt) - 1 - strlen(rt));
+	count &= ~3;
+	s->blocks = calloc(count, sizeof(*s->blocks));
+	s->count = 0;
+	for (i = 0; s->count < count; i++) {
+		unsigned seg;
+
+		add_block(s, V4L2_RDS_BLOCK_A, pi, s->count);
+		if (i & 1) {
+			/* group 2A: radio text */
+			seg = (i / 2) % 16;
+			add_block(s, V4L2_RDS_BLOCK_B, 0x2000 | 0x0a0 | seg, s->count);
+			add_block(s, V4L2_RDS_BLOCK_C, (rt[seg * 4] << 8) | rt[seg * 4 + 1], s->count);
+			add_block(s, V4L2_RDS_BLOCK_D, (rt[seg * 4 + 2] << 8) | rt[seg * 4 + 3], s->count);
+		} else {
+			/* group 0A: PS name */
+			seg = (i / 2) % 4;
+			add_block(s, V4L2_RDS_BLOCK_B, 0x0000 | 0x0a0 | seg, s->count);
+			add_block(s, V4L2_RDS_BLOCK_C, 0xe0cd, s->count);
+			add_block(s, V4L2_RDS_BLOCK_D, (ps[seg * 2] << 8) | ps[seg * 2 + 1], s->count);
+		}
+	}
+}
+
+static int read_stream(struct stream *s, const char *fname)
+{
+	struct stat st;
+	int fd = open(fname, O_RDONLY);
+	ssize_t n;
+
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(fname);
+		return -1;
+	}
+	s->count = st.st_size / sizeof(*s->blocks);
+	s->blocks = calloc(s->count ? s->count : 1, sizeof(*s->blocks));
+	n = read(fd, s->blocks, s->count * sizeof(*s->blocks));
+	close(fd);
+	if (n != (ssize_t)(s->count * sizeof(*s->blocks))) {
+		fprintf(stderr, "%s: short read\n", fname);
+		return -1;
+	}
+	return 0;
+}
+
+static struct v4l2_rds **create_handles(unsigned nr)
+{
+	struct v4l2_rds **handles = calloc(nr, sizeof(*handles));
+	unsigned i;
+
+	for (i = 0; i < nr; i++)
+		handles[i] = v4l2_rds_create(false);
+	return handles;
+}
+
+static void destroy_handles(struct v4l2_rds **handles, unsigned nr)
+{
+	unsigned i;
+
+	for (i = 0; i < nr; i++)
+		v4l2_rds_destroy(handles[i]);
+	free(handles);
+}
+
+static int compare_handles(struct v4l2_rds **ref, struct v4l2_rds **handles,
+			   unsigned nr, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < nr; i++) {
+		if (ref[i]->valid_fields != handles[i]->valid_fields ||
+		    ref[i]->pi != handles[i]->pi ||
+		    memcmp(ref[i]->ps, handles[i]->ps, sizeof(ref[i]->ps)) ||
+		    memcmp(ref[i]->rt, handles[i]->rt, sizeof(ref[i]->rt)) ||
+		    memcmp(&ref[i]->rds_statistics, &handles[i]->rds_statistics,
+			   sizeof(ref[i]->rds_statistics))) {
+			fprintf(stderr, "%s: stream %u differs from v4l2_rds_add\n",
+				name, i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void report(const char *name, double secs, unsigned long long blocks,
+		   double ref_secs)
+{
+	printf("%-22s %9.3f s %12.0f blocks/s", name, secs, blocks / secs);
+	if (ref_secs)
+		printf(" %6.2fx", ref_secs / secs);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	unsigned nr_streams = 16, nr_blocks = 1000000, nr_threads = 0;
+	struct v4l2_rds_stream *rds_streams;
+	struct v4l2_rds **ref, **handles;
+	unsigned long long total = 0;
+	struct stream *streams;
+	double t, t_add;
+	unsigned i, j;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:j:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			nr_streams = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			nr_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'j':
+			nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n <streams>] [-b <blocks>] [-j <threads>] [file...]\n",
+				argv[0]);
+			return opt != 'h';
+		}
+	}
+	if (optind < argc)
+		nr_streams = argc - optind;
+	if (!nr_streams) {
+		fprintf(stderr, "no streams\n");
+		return 1;
+	}
+
+	streams = calloc(nr_streams, sizeof(*streams));
+	for (i = 0; i < nr_streams; i++) {
+		if (optind < argc) {
+			if (read_stream(&streams[i], argv[optind + i]))
+				return 1;
+		} else {
+			gen_stream(&streams[i], i, nr_blocks);
+		}
+		total += streams[i].count;
+	}
+	printf("%u streams, %llu blocks\n\n", nr_streams, total);
+
+	ref = create_handles(nr_streams);
+	t = now();
+	for (i = 0; i < nr_streams; i++)
+		for (j = 0; j < streams[i].count; j++)
+			v4l2_rds_add(ref[i], &streams[i].blocks[j]);
+	t_add = now() - t;
+	report("v4l2_rds_add", t_add, total, 0);
+
+	handles = create_handles(nr_streams);
+	t = now();
+	for (i = 0; i < nr_streams; i++)
+		v4l2_rds_add_blocks(handles[i], streams[i].blocks, streams[i].count,
+				    0, NULL);
+	report("v4l2_rds_add_blocks", now() - t, total, t_add);
+	ret |= compare_handles(ref, handles, nr_streams, "v4l2_rds_add_blocks");
+	destroy_handles(handles, nr_streams);
+
+	handles = create_handles(nr_streams);
+	rds_streams = calloc(nr_streams, sizeof(*rds_streams));
+	for (i = 0; i < nr_streams; i++) {
+		rds_streams[i].handle = handles[i];
+		rds_streams[i].rds_data = streams[i].blocks;
+		rds_streams[i].count = streams[i].count;
+	}
+	t = now();
+	v4l2_rds_add_streams(rds_streams, nr_streams, nr_threads);
+	report("v4l2_rds_add_streams", now() - t, total, t_add);
+	ret |= compare_handles(ref, handles, nr_streams, "v4l2_rds_add_streams");
+	destroy_handles(handles, nr_streams);
+	free(rds_streams);
+
+	destroy_handles(ref, nr_streams);
+	for (i = 0; i < nr_streams; i++)
+		free(streams[i].blocks);
+	free(streams);
+	return ret ? 1 : 0;
+}
@@ -321,6 +321,33 @@ LIBV4L_PUBLIC void v4l2_rds_reset(struct v4l2_rds *handle, bool reset_statistics
  * 				on RDS capable V4L2 devices */
 LIBV4L_PUBLIC uint32_t v4l2_rds_add(struct v4l2_rds *handle, struct v4l2_rds_data *rds_data);
 
+/* adds an array of raw RDS blocks, e.g. read from a recorded RDS stream,
+ * which is faster than calling v4l2_rds_add for every block
+ * @rds_data:	array of raw RDS blocks
+ * @count:	number of blocks in the array
+ * @stop_mask:	stop after a block that updated one of these fields, so the
+ * 		caller can look at the handle, 0 = add all blocks
+ * @updated_fields: if not NULL, set to the bitmask of all updated fields
+ * @return:	number of blocks that were added */
+LIBV4L_PUBLIC unsigned v4l2_rds_add_blocks(struct v4l2_rds *handle,
+		const struct v4l2_rds_data *rds_data, unsigned count,
+		uint32_t stop_mask, uint32_t *updated_fields);
+
+/* an independent RDS stream for v4l2_rds_add_streams */
+struct v4l2_rds_stream {
+	struct v4l2_rds *handle;		/* handle of this stream */
+	const struct v4l2_rds_data *rds_data;	/* raw RDS blocks */
+	unsigned count;				/* number of blocks */
+	uint32_t updated_fields;		/* set to all updated fields */
+};
+
+/* adds the blocks of several independent RDS streams (e.g. recordings of
+ * different stations), decoding the streams in parallel
+ * @nr_threads:	maximum number of threads to use, 0 = number of CPUs
+ * A handle must not be used by more than one of the streams */
+LIBV4L_PUBLIC void v4l2_rds_add_streams(struct v4l2_rds_stream *streams,
+		unsigned nr_streams, unsigned nr_threads);
+
 /*
  * group of functions to translate numerical RDS data into strings
  *
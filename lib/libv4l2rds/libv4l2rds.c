@@ -5,6 +5,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -1365,9 +1366,10 @@ void v4l2_rds_reset(struct v4l2_rds *handle, bool reset_statistics)
  * Decoding is only done once a complete group was received. This is slower compared
  * to decoding the group type independent information up front, but adds a barrier
  * against corrupted data (happens regularly when reception is weak) */
-uint32_t v4l2_rds_add(struct v4l2_rds *handle, struct v4l2_rds_data *rds_data)
+static inline uint32_t rds_add_block(struct rds_private_state *priv_state,
+				     const struct v4l2_rds_data *rds_data)
 {
-	struct rds_private_state *priv_state = (struct rds_private_state *) handle;
+	struct v4l2_rds *handle = &priv_state->handle;
 	struct v4l2_rds_data *rds_data_raw = priv_state->rds_data_raw;
 	struct v4l2_rds_statistics *rds_stats = &handle->rds_statistics;
 	uint32_t updated_fields = 0;
@@ -1450,6 +1452,86 @@ uint32_t v4l2_rds_add(struct v4l2_rds *handle, struct v4l2_rds_data *rds_data)
 	return 0;
 }
 
+uint32_t v4l2_rds_add(struct v4l2_rds *handle, struct v4l2_rds_data *rds_data)
+{
+	return rds_add_block((struct rds_private_state *) handle, rds_data);
+}
+
+/* same as v4l2_rds_add, but for an array of blocks: the per block state
+ * machine is inlined in the loop, so there is no call per block */
+unsigned v4l2_rds_add_blocks(struct v4l2_rds *handle,
+			     const struct v4l2_rds_data *rds_data, unsigned count,
+			     uint32_t stop_mask, uint32_t *updated_fields)
+{
+	struct rds_private_state *priv_state = (struct rds_private_state *) handle;
+	uint32_t updated = 0;
+	unsigned i = 0;
+
+	while (i < count) {
+		uint32_t fields = rds_add_block(priv_state, &rds_data[i++]);
+
+		updated |= fields;
+		if (fields & stop_mask)
+			break;
+	}
+	if (updated_fields)
+		*updated_fields = updated;
+	return i;
+}
+
+struct rds_streams_work {
+	struct v4l2_rds_stream *streams;
+	unsigned nr_streams;
+	unsigned next_stream;
+};
+
+static void *rds_streams_worker(void *arg)
+{
+	struct rds_streams_work *work = arg;
+	unsigned i;
+
+	/* every worker takes the next stream that was not yet decoded */
+	while ((i = __atomic_fetch_add(&work->next_stream, 1, __ATOMIC_RELAXED)) <
+	       work->nr_streams) {
+		struct v4l2_rds_stream *stream = &work->streams[i];
+
+		v4l2_rds_add_blocks(stream->handle, stream->rds_data, stream->count,
+				    0, &stream->updated_fields);
+	}
+	return NULL;
+}
+
+void v4l2_rds_add_streams(struct v4l2_rds_stream *streams, unsigned nr_streams,
+			  unsigned nr_threads)
+{
+	struct rds_streams_work work = { streams, nr_streams, 0 };
+	pthread_t *threads;
+	unsigned i, started = 0;
+
+	if (!nr_threads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nr_threads = cpus > 0 ? cpus : 1;
+	}
+	if (nr_threads > nr_streams)
+		nr_threads = nr_streams;
+
+	/* the calling thread is one of the workers, if threads cannot be
+	 * created it just decodes more streams itself */
+	threads = nr_threads > 1 ? calloc(nr_threads - 1, sizeof(*threads)) : NULL;
+	if (threads) {
+		for (i = 0; i < nr_threads - 1; i++) {
+			if (pthread_create(&threads[i], NULL, rds_streams_worker, &work))
+				break;
+			started++;
+		}
+	}
+	rds_streams_worker(&work);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
+
 const char *v4l2_rds_get_pty_str(const struct v4l2_rds *handle)
 {
 	const uint8_t pty = handle->pty;
@@ -13,11 +13,15 @@
 #include <vector>
 
 #include <dirent.h>
+#include <endian.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #include <linux/cec-funcs.h>
@@ -37,6 +41,8 @@ static bool is_paused;
 
 #define CEC_CTL_VERSION 2
 
+#define MSG_STORE_DEFAULT_KB 16384
+
 #define POLL_FAKE_OPCODE 256
 static unsigned short ignore_opcode[257];
 
@@ -106,7 +112,12 @@ enum Option {
 	OptMonitorPin,
 	OptIgnore,
 	OptStorePin,
+	OptStorePinBinary,
 	OptAnalyzePin,
+	OptAnalyzeJobs,
+	OptStoreMsgs,
+	OptStoreMsgsSize,
+	OptAnalyzeMsgs,
 	OptRcTVProfile1,
 	OptRcTVProfile2,
 	OptRcTVProfile3,
@@ -177,7 +188,12 @@ static struct option long_options[] = {
 	{ "monitor-time", required_argument, nullptr, OptMonitorTime },
 	{ "ignore", required_argument, nullptr, OptIgnore },
 	{ "store-pin", required_argument, nullptr, OptStorePin },
+	{ "store-pin-binary", required_argument, nullptr, OptStorePinBinary },
 	{ "analyze-pin", required_argument, nullptr, OptAnalyzePin },
+	{ "analyze-jobs", required_argument, nullptr, OptAnalyzeJobs },
+	{ "store-msgs", required_argument, nullptr, OptStoreMsgs },
+	{ "store-msgs-size", required_argument, nullptr, OptStoreMsgsSize },
+	{ "analyze-msgs", required_argument, nullptr, OptAnalyzeMsgs },
 	{ "no-reply", no_argument, nullptr, OptToggleNoReply },
 	{ "non-blocking", no_argument, nullptr, OptNonBlocking },
 	{ "logical-address", no_argument, nullptr, OptShowLogicalAddress },
@@ -329,8 +345,17 @@ static void usage()
 	       "                           To ignore poll messages use 'poll' as <opcode>.\n"
 	       "  --store-pin <to>         Store the low-level CEC pin changes to the file <to>.\n"
 	       "                           Use - for stdout.\n"
+	       "  --store-pin-binary <to>  Store the low-level CEC pin changes to the file <to> in\n"
+	       "                           the compact binary format. Use - for stdout.\n"
 	       "  --analyze-pin <from>     Analyze the low-level CEC pin changes from the file <from>.\n"
 	       "                           Use - for stdin.\n"
+	       "  --analyze-jobs <n>       Analyze a binary pin file with <n> parallel jobs\n"
+	       "                           (default is the number of CPUs).\n"
+	       "  --store-msgs <to>        Store the monitored messages in the ring file <to>\n"
+	       "                           instead of showing them.\n"
+	       "  --store-msgs-size <kb>   The size of the ring file in kB (default is 16384).\n"
+	       "                           When it is full, the oldest messages are overwritten.\n"
+	       "  --analyze-msgs <from>    Show the messages stored in the ring file <from>.\n"
 	       "  --test-reliability <secs>\n"
 	       "                           Test CEC line reliability. It continuously transmits <Give Physical Address>\n"
 	       "                           for <secs> seconds, checking that the broadcast reply is always the same.\n"
@@ -799,6 +824,91 @@ static inline unsigned response_time_ms(const struct cec_msg &msg)
 	return 0;
 }
 
+#define MONITOR_STATE_CHANGE		0x10
+#define MONITOR_START_MONOTONIC		0x20
+#define MONITOR_START_TIMEOFDAY		0x21
+#define MONITOR_FL_DROPPED_EVENTS	(1 << 16)
+
+/*
+ * The binary pin store format is a header followed by fixed size records,
+ * all in little endian. A record is either an event, using the same values
+ * as the text format, or one of the start_monotonic and start_timeofday
+ * comments of the text format. Since all records have the same size, the
+ * analyzer can split the file and process the pieces in parallel.
+ */
+static const char pin_store_magic[8] = "CEC-PIN";
+
+struct pin_store_hdr {
+	char magic[8];
+	__u32 version;
+	__u16 phys_addr;
+	__u16 log_addr_mask;
+};
+
+struct pin_store_rec {
+	__u64 ts;
+	__u32 event;
+	__u16 phys_addr;
+	__u16 log_addr_mask;
+};
+
+static void store_pin_event(FILE *fstore, __u64 ts, unsigned event,
+			    __u16 pa = 0, __u16 la_mask = 0)
+{
+	if (options[OptStorePinBinary]) {
+		struct pin_store_rec rec = {
+			htole64(ts), htole32(event), htole16(pa), htole16(la_mask)
+		};
+
+		fwrite(&rec, sizeof(rec), 1, fstore);
+	} else if ((event & ~MONITOR_FL_DROPPED_EVENTS) == MONITOR_STATE_CHANGE) {
+		fprintf(fstore, "%llu.%09llu 0x%x 0x%04x 0x%04x\n",
+			ts / 1000000000, ts % 1000000000, event, pa, la_mask);
+	} else {
+		fprintf(fstore, "%llu.%09llu 0x%x\n",
+			ts / 1000000000, ts % 1000000000, event);
+	}
+	fflush(fstore);
+}
+
+static void store_pin_start(FILE *fstore)
+{
+	if (options[OptStorePinBinary]) {
+		store_pin_event(fstore, start_monotonic.tv_sec * 1000000000ULL +
+				start_monotonic.tv_nsec, MONITOR_START_MONOTONIC);
+		store_pin_event(fstore, start_timeofday.tv_sec * 1000000ULL +
+				start_timeofday.tv_usec, MONITOR_START_TIMEOFDAY);
+		return;
+	}
+	fprintf(fstore, "# start_monotonic %llu.%09llu\n",
+		(__u64)start_monotonic.tv_sec, (__u64)start_monotonic.tv_nsec);
+	fprintf(fstore, "# start_timeofday %llu.%06llu\n",
+		(__u64)start_timeofday.tv_sec, (__u64)start_timeofday.tv_usec);
+	fflush(fstore);
+}
+
+static void store_pin_header(FILE *fstore, const struct node &node)
+{
+	if (options[OptStorePinBinary]) {
+		struct pin_store_hdr hdr = { };
+
+		memcpy(hdr.magic, pin_store_magic, sizeof(hdr.magic));
+		hdr.version = htole32(CEC_CTL_VERSION);
+		hdr.phys_addr = htole16(node.phys_addr);
+		hdr.log_addr_mask = htole16(node.log_addr_mask);
+		fwrite(&hdr, sizeof(hdr), 1, fstore);
+	} else {
+		fprintf(fstore, "# cec-ctl --store-pin\n");
+		fprintf(fstore, "# version %d\n", CEC_CTL_VERSION);
+	}
+	store_pin_start(fstore);
+	if (!options[OptStorePinBinary]) {
+		fprintf(fstore, "# log_addr_mask 0x%04x\n", node.log_addr_mask);
+		fprintf(fstore, "# phys_addr %x.%x.%x.%x\n",
+			cec_phys_addr_exp(node.phys_addr));
+	}
+}
+
 static void generate_eob_event(__u64 ts, FILE *fstore)
 {
 	if (!eob_ts || eob_ts_max >= ts)
@@ -809,16 +919,12 @@ static void generate_eob_event(__u64 ts, FILE *fstore)
 		CEC_EVENT_PIN_CEC_HIGH
 	};
 
-	if (fstore) {
-		fprintf(fstore, "%llu.%09llu 0x%x\n",
-			ev_eob.ts / 1000000000, ev_eob.ts % 1000000000,
-			ev_eob.event - CEC_EVENT_PIN_CEC_LOW);
-		fflush(fstore);
-	}
+	if (fstore)
+		store_pin_event(fstore, ev_eob.ts, ev_eob.event - CEC_EVENT_PIN_CEC_LOW);
 	log_event(ev_eob, fstore != stdout, true);
 }
 
-static void show_msg(const cec_msg &msg)
+static void show_msg(const cec_msg &msg, bool live = true)
 {
 	__u8 from = cec_msg_initiator(&msg);
 	__u8 to = cec_msg_destination(&msg);
@@ -840,7 +946,7 @@ static void show_msg(const cec_msg &msg)
 	if ((msg.tx_status & ~CEC_TX_STATUS_OK) ||
 	    (msg.rx_status & ~CEC_RX_STATUS_OK)) {
 		status = std::string(" ") + cec_status2s(msg);
-		if (verbose)
+		if (verbose && live)
 			printf("\tTimestamp: %s\n", ts2s(current_ts()).c_str());
 	}
 	if (verbose && transmitted)
@@ -853,6 +959,200 @@ static void show_msg(const cec_msg &msg)
 		       status.c_str());
 }
 
+/*
+ * The message store is a ring of fixed size records in a memory mapped
+ * file, so storing a message costs little more than the CEC_RECEIVE ioctl
+ * itself: nothing is formatted and there are no write() calls. The header
+ * contains the total number of records ever written, once the ring is full
+ * the oldest record is overwritten. Each record contains its index, so a
+ * reader can tell whether a record was overwritten while it was reading it.
+ * Unlike the pin store this is all in host byte order: the records are the
+ * raw struct cec_msg.
+ */
+static const char msg_store_magic[8] = "CEC-MSG";
+
+#define MSG_STORE_INVALID	(~0ULL)
+
+struct msg_store_hdr {
+	char magic[8];
+	__u32 version;
+	__u32 rec_size;
+	__u64 nr_recs;
+	__u64 head;
+	__u64 start_monotonic;	/* in ns */
+	__u64 start_timeofday;	/* in us */
+	__u16 phys_addr;
+	__u16 log_addr_mask;
+	__u32 reserved;
+};
+
+struct msg_store_rec {
+	__u64 index;
+	struct cec_msg msg;
+};
+
+struct msg_store {
+	struct msg_store_hdr *hdr;
+	struct msg_store_rec *recs;
+	size_t size;
+};
+
+static void store_msgs_start(struct msg_store &store)
+{
+	store.hdr->start_monotonic = start_monotonic.tv_sec * 1000000000ULL +
+				     start_monotonic.tv_nsec;
+	store.hdr->start_timeofday = start_timeofday.tv_sec * 1000000ULL +
+				     start_timeofday.tv_usec;
+}
+
+static void store_msgs_open(struct msg_store &store, const char *store_msgs,
+			    unsigned kbytes, const struct node &node)
+{
+	size_t size = kbytes * 1024ULL;
+	void *map;
+	int fd;
+
+	if (size < sizeof(*store.hdr) + sizeof(*store.recs)) {
+		fprintf(stderr, "The message store size is too small\n");
+		std::exit(EXIT_FAILURE);
+	}
+	fd = open(store_msgs, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || ftruncate(fd, size)) {
+		fprintf(stderr, "Failed to create %s: %s\n", store_msgs,
+			strerror(errno));
+		std::exit(EXIT_FAILURE);
+	}
+	map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to mmap %s: %s\n", store_msgs,
+			strerror(errno));
+		std::exit(EXIT_FAILURE);
+	}
+	store.size = size;
+	store.hdr = static_cast<struct msg_store_hdr *>(map);
+	store.recs = reinterpret_cast<struct msg_store_rec *>(store.hdr + 1);
+	memcpy(store.hdr->magic, msg_store_magic, sizeof(store.hdr->magic));
+	store.hdr->version = CEC_CTL_VERSION;
+	store.hdr->rec_size = sizeof(*store.recs);
+	store.hdr->nr_recs = (size - sizeof(*store.hdr)) / sizeof(*store.recs);
+	store.hdr->phys_addr = node.phys_addr;
+	store.hdr->log_addr_mask = node.log_addr_mask;
+	store_msgs_start(store);
+}
+
+static void store_msgs_close(struct msg_store &store)
+{
+	msync(store.hdr, store.size, MS_SYNC);
+	munmap(store.hdr, store.size);
+	store.hdr = nullptr;
+}
+
+/*
+ * Receive all pending messages into the ring. A record is marked invalid
+ * while it is overwritten and gets its index when it is complete, after
+ * which the head is advanced.
+ */
+static int store_msgs_receive(const struct node &node, struct msg_store &store)
+{
+	__u64 head = store.hdr->head;
+	struct cec_msg msg;
+	int res;
+
+	while (true) {
+		struct msg_store_rec *rec = &store.recs[head % store.hdr->nr_recs];
+
+		memset(&msg, 0, sizeof(msg));
+		res = doioctl(&node, CEC_RECEIVE, &msg);
+		if (res)
+			break;
+		__atomic_store_n(&rec->index, MSG_STORE_INVALID, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		rec->msg = msg;
+		__atomic_store_n(&rec->index, head, __ATOMIC_RELEASE);
+		__atomic_store_n(&store.hdr->head, ++head, __ATOMIC_RELEASE);
+	}
+	return res;
+}
+
+static void analyze_msgs(const char *analyze_msgs)
+{
+	const struct msg_store_hdr *hdr;
+	const struct msg_store_rec *recs;
+	struct stat st;
+	__u64 head, first, lost = 0;
+	void *map;
+	int fd;
+
+	fd = open(analyze_msgs, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "Failed to open %s: %s\n", analyze_msgs,
+			strerror(errno));
+		std::exit(EXIT_FAILURE);
+	}
+	if (static_cast<size_t>(st.st_size) < sizeof(*hdr)) {
+		fprintf(stderr, "%s is not a message store file\n", analyze_msgs);
+		std::exit(EXIT_FAILURE);
+	}
+	map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Failed to mmap %s: %s\n", analyze_msgs,
+			strerror(errno));
+		std::exit(EXIT_FAILURE);
+	}
+	hdr = static_cast<const struct msg_store_hdr *>(map);
+	recs = reinterpret_cast<const struct msg_store_rec *>(hdr + 1);
+	if (memcmp(hdr->magic, msg_store_magic, sizeof(hdr->magic))) {
+		fprintf(stderr, "%s is not a message store file\n", analyze_msgs);
+		std::exit(EXIT_FAILURE);
+	}
+	if (hdr->version > CEC_CTL_VERSION) {
+		fprintf(stderr, "Message store file has version %d, but we only support up to version %d\n",
+			hdr->version, CEC_CTL_VERSION);
+		std::exit(EXIT_FAILURE);
+	}
+	if (hdr->rec_size != sizeof(*recs) || !hdr->nr_recs ||
+	    hdr->nr_recs > (st.st_size - sizeof(*hdr)) / sizeof(*recs)) {
+		fprintf(stderr, "%s has an unsupported record layout\n", analyze_msgs);
+		std::exit(EXIT_FAILURE);
+	}
+
+	start_monotonic.tv_sec = hdr->start_monotonic / 1000000000;
+	start_monotonic.tv_nsec = hdr->start_monotonic % 1000000000;
+	start_timeofday.tv_sec = hdr->start_timeofday / 1000000;
+	start_timeofday.tv_usec = hdr->start_timeofday % 1000000;
+
+	printf("Physical Address:     %x.%x.%x.%x\n", cec_phys_addr_exp(hdr->phys_addr));
+	printf("Logical Address Mask: 0x%04x\n\n", hdr->log_addr_mask);
+
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	first = head > hdr->nr_recs ? head - hdr->nr_recs : 0;
+	if (first)
+		printf("%llu older messages were overwritten\n\n", first);
+
+	for (__u64 i = first; i < head; i++) {
+		const struct msg_store_rec *rec = &recs[i % hdr->nr_recs];
+		struct cec_msg msg;
+
+		// The file may still be written to while it is analyzed
+		if (__atomic_load_n(&rec->index, __ATOMIC_ACQUIRE) != i) {
+			lost++;
+			continue;
+		}
+		memcpy(&msg, &rec->msg, sizeof(msg));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&rec->index, __ATOMIC_RELAXED) != i) {
+			lost++;
+			continue;
+		}
+		show_msg(msg, false);
+	}
+	if (lost)
+		printf("\n%llu messages were overwritten while analyzing\n", lost);
+	munmap(map, st.st_size);
+}
+
 static void wait_for_msgs(const struct node &node, __u32 monitor_time)
 {
 	fd_set rd_fds;
@@ -896,16 +1196,15 @@ static void wait_for_msgs(const struct node &node, __u32 monitor_time)
 	}
 }
 
-#define MONITOR_STATE_CHANGE		0x10
-#define MONITOR_FL_DROPPED_EVENTS	(1 << 16)
-
-static void monitor(const struct node &node, __u32 monitor_time, const char *store_pin)
+static void monitor(const struct node &node, __u32 monitor_time, const char *store_pin,
+		    const char *store_msgs, unsigned store_msgs_kb)
 {
 	__u32 monitor = CEC_MODE_MONITOR;
 	fd_set rd_fds;
 	fd_set ex_fds;
 	int fd = node.fd;
 	FILE *fstore = nullptr;
+	struct msg_store mstore = { };
 	time_t t, start_minute;
 
 	if (options[OptMonitorAll])
@@ -948,15 +1247,12 @@ static void monitor(const struct node &node, __u32 monitor_time, const char *sto
 				strerror(errno));
 			std::exit(EXIT_FAILURE);
 		}
-		fprintf(fstore, "# cec-ctl --store-pin\n");
-		fprintf(fstore, "# version %d\n", CEC_CTL_VERSION);
-		fprintf(fstore, "# start_monotonic %llu.%09llu\n",
-			(__u64)start_monotonic.tv_sec, (__u64)start_monotonic.tv_nsec);
-		fprintf(fstore, "# start_timeofday %llu.%06llu\n",
-			(__u64)start_timeofday.tv_sec, (__u64)start_timeofday.tv_usec);
-		fprintf(fstore, "# log_addr_mask 0x%04x\n", node.log_addr_mask);
-		fprintf(fstore, "# phys_addr %x.%x.%x.%x\n",
-			cec_phys_addr_exp(node.phys_addr));
+		store_pin_header(fstore, node);
+	}
+	if (store_msgs) {
+		store_msgs_open(mstore, store_msgs, store_msgs_kb, node);
+		printf("\nStoring messages to %s, use --analyze-msgs to show them\n",
+		       store_msgs);
 	}
 
 	if (fstore != stdout)
@@ -982,7 +1278,7 @@ static void monitor(const struct node &node, __u32 monitor_time, const char *sto
 		res = select(fd + 1, &rd_fds, nullptr, &ex_fds, &tv);
 		if (res < 0)
 			break;
-		if (store_pin && now - start_minute > 60 &&
+		if ((store_pin || store_msgs) && now - start_minute > 60 &&
 		    (FD_ISSET(fd, &rd_fds) || FD_ISSET(fd, &ex_fds))) {
 			/*
 			 * The drift between the monotonic and wallclock
@@ -992,14 +1288,20 @@ static void monitor(const struct node &node, __u32 monitor_time, const char *sto
 			 */
 			clock_gettime(CLOCK_MONOTONIC, &start_monotonic);
 			gettimeofday(&start_timeofday, nullptr);
-			fprintf(fstore, "# start_monotonic %llu.%09llu\n",
-				(__u64)start_monotonic.tv_sec, (__u64)start_monotonic.tv_nsec);
-			fprintf(fstore, "# start_timeofday %llu.%06llu\n",
-				(__u64)start_timeofday.tv_sec, (__u64)start_timeofday.tv_usec);
-			fflush(fstore);
+			if (store_pin)
+				store_pin_start(fstore);
+			if (store_msgs)
+				store_msgs_start(mstore);
 			start_minute = now;
 		}
-		if (FD_ISSET(fd, &rd_fds)) {
+		if (FD_ISSET(fd, &rd_fds) && store_msgs) {
+			res = store_msgs_receive(node, mstore);
+			if (res == ENODEV) {
+				fprintf(stderr, "Device was disconnected.\n");
+				break;
+			}
+			res = 0;
+		} else if (FD_ISSET(fd, &rd_fds)) {
 			struct cec_msg msg = { };
 
 			res = doioctl(&node, CEC_RECEIVE, &msg);
@@ -1031,18 +1333,14 @@ static void monitor(const struct node &node, __u32 monitor_time, const char *sto
 				if (ev.flags & CEC_EVENT_FL_DROPPED_EVENTS)
 					v |= MONITOR_FL_DROPPED_EVENTS;
 
-				fprintf(fstore, "%llu.%09llu 0x%x 0x%04x 0x%04x\n",
-					ev.ts / 1000000000, ev.ts % 1000000000, v,
-					ev.state_change.phys_addr, ev.state_change.log_addr_mask);
-				fflush(fstore);
+				store_pin_event(fstore, ev.ts, v, ev.state_change.phys_addr,
+						ev.state_change.log_addr_mask);
 			} else if (fstore && pin_event) {
 				unsigned int v = ev.event - CEC_EVENT_PIN_CEC_LOW;
 
 				if (ev.flags & CEC_EVENT_FL_DROPPED_EVENTS)
 					v |= MONITOR_FL_DROPPED_EVENTS;
-				fprintf(fstore, "%llu.%09llu 0x%x\n",
-					ev.ts / 1000000000, ev.ts % 1000000000, v);
-				fflush(fstore);
+				store_pin_event(fstore, ev.ts, v);
 			}
 			if (!pin_event || options[OptMonitorPin])
 				log_event(ev, fstore != stdout, true);
@@ -1058,6 +1356,8 @@ static void monitor(const struct node &node, __u32 monitor_time, const char *sto
 	}
 	if (fstore && fstore != stdout)
 		fclose(fstore);
+	if (store_msgs)
+		store_msgs_close(mstore);
 }
 
 static unsigned read_val(char **p)
@@ -1085,10 +1385,312 @@ static unsigned read_val(char **p)
 	return v;
 }
 
-static void analyze(const char *analyze_pin)
+static bool log_pin_event(__u64 ts, unsigned event, __u16 pa, __u16 la_mask)
 {
-	FILE *fanalyze;
 	struct cec_event ev = { };
+	bool dropped_events = event & MONITOR_FL_DROPPED_EVENTS;
+
+	event &= ~MONITOR_FL_DROPPED_EVENTS;
+	if (event != MONITOR_STATE_CHANGE && event > 5)
+		return false;
+
+	ev.ts = ts;
+	if (dropped_events)
+		ev.flags = CEC_EVENT_FL_DROPPED_EVENTS;
+	if (event == MONITOR_STATE_CHANGE) {
+		ev.event = CEC_EVENT_STATE_CHANGE;
+		ev.state_change.phys_addr = pa;
+		ev.state_change.log_addr_mask = la_mask;
+	} else {
+		ev.event = event + CEC_EVENT_PIN_CEC_LOW;
+	}
+	log_event(ev, true, true);
+	return true;
+}
+
+static void log_pin_eob()
+{
+	if (eob_ts) {
+		struct cec_event ev = { };
+
+		ev.event = CEC_EVENT_PIN_CEC_HIGH;
+		ev.ts = eob_ts;
+		log_event(ev, true, true);
+	}
+}
+
+/*
+ * Where to split a binary pin file for parallel analysis: the next CEC
+ * pin falling edge after the bus has been high for at least 10 bit
+ * periods following the end of a message (the rising edge of the last
+ * bit followed by the generated end of bit event). The state machine is
+ * idle at that point and no signal free time can be too short, so the
+ * analysis of the pieces gives the same result as that of the whole.
+ */
+#define PIN_SPLIT_IDLE_NS	(10 * 2400 * 1000ULL)
+#define PIN_SPLIT_MIN_RECS	100000
+
+static inline unsigned pin_rec_event(const struct pin_store_rec *rec)
+{
+	return le32toh(rec->event);
+}
+
+static size_t pin_split(const struct pin_store_rec *recs, size_t nrecs, size_t from)
+{
+	const unsigned low = CEC_EVENT_PIN_CEC_LOW - CEC_EVENT_PIN_CEC_LOW;
+	const unsigned high = CEC_EVENT_PIN_CEC_HIGH - CEC_EVENT_PIN_CEC_LOW;
+
+	for (size_t i = from < 2 ? 2 : from; i < nrecs; i++) {
+		if (pin_rec_event(&recs[i]) == low &&
+		    pin_rec_event(&recs[i - 1]) == high &&
+		    pin_rec_event(&recs[i - 2]) == high &&
+		    le64toh(recs[i].ts) - le64toh(recs[i - 1].ts) >= PIN_SPLIT_IDLE_NS)
+			return i;
+	}
+	return nrecs;
+}
+
+/*
+ * Whether the first message after a split point is a retransmission, and
+ * which signal free time applies to it, depends on the header of the
+ * message before it and on whether that one was ACKed. So a piece starts
+ * by replaying the last message before it with a complete first block,
+ * without any output or statistics. A bus high for at least 2 bit periods
+ * before a falling edge marks the start of a message.
+ */
+#define PIN_MSG_GAP_NS		(2 * 2400 * 1000ULL)
+
+static void pin_replay_prev_msg(const struct pin_store_rec *recs, size_t first)
+{
+	const unsigned low = CEC_EVENT_PIN_CEC_LOW - CEC_EVENT_PIN_CEC_LOW;
+	const unsigned high = CEC_EVENT_PIN_CEC_HIGH - CEC_EVENT_PIN_CEC_LOW;
+	struct cec_pin_stats stats = pin_stats;
+	size_t start = 0, next_low = 0;
+	bool have_low = false;
+	unsigned falls = 0;
+
+	for (size_t i = first; i-- > 0; ) {
+		unsigned event = pin_rec_event(&recs[i]);
+
+		if (event == low) {
+			next_low = i;
+			have_low = true;
+			falls++;
+		} else if (event == high && have_low) {
+			have_low = false;
+			if (le64toh(recs[next_low].ts) - le64toh(recs[i].ts) < PIN_MSG_GAP_NS)
+				continue;
+			// start bit and the 10 bits of the first block
+			if (falls >= 11) {
+				start = i;
+				break;
+			}
+			falls = 0;
+		}
+	}
+
+	for (size_t i = start; i < first; i++) {
+		unsigned event = pin_rec_event(&recs[i]);
+
+		if (event == low || event == high)
+			log_event_pin(event == high, le64toh(recs[i].ts), false);
+	}
+	pin_stats = stats;
+}
+
+static void analyze_recs(const struct pin_store_rec *recs, size_t first,
+			 size_t last, bool is_last)
+{
+	bool have_monotonic = false, have_timeofday = false;
+
+	// Find the wallclock time that applies to the first record
+	for (size_t i = first; i-- > 0 && !(have_monotonic && have_timeofday); ) {
+		__u64 ts = le64toh(recs[i].ts);
+
+		if (pin_rec_event(&recs[i]) == MONITOR_START_MONOTONIC && !have_monotonic) {
+			start_monotonic.tv_sec = ts / 1000000000;
+			start_monotonic.tv_nsec = ts % 1000000000;
+			have_monotonic = true;
+		} else if (pin_rec_event(&recs[i]) == MONITOR_START_TIMEOFDAY && !have_timeofday) {
+			start_timeofday.tv_sec = ts / 1000000;
+			start_timeofday.tv_usec = ts % 1000000;
+			have_timeofday = true;
+		}
+	}
+
+	// Let the state machine see the message before the split point
+	if (first)
+		pin_replay_prev_msg(recs, first);
+
+	for (size_t i = first; i < last; i++) {
+		unsigned event = pin_rec_event(&recs[i]);
+		__u64 ts = le64toh(recs[i].ts);
+
+		if (event == MONITOR_START_MONOTONIC) {
+			start_monotonic.tv_sec = ts / 1000000000;
+			start_monotonic.tv_nsec = ts % 1000000000;
+		} else if (event == MONITOR_START_TIMEOFDAY) {
+			start_timeofday.tv_sec = ts / 1000000;
+			start_timeofday.tv_usec = ts % 1000000;
+			valid_until_t = 0;
+		} else if (!log_pin_event(ts, event, le16toh(recs[i].phys_addr),
+					  le16toh(recs[i].log_addr_mask))) {
+			fprintf(stderr, "unknown event at record %zu\n", i);
+			break;
+		}
+	}
+
+	if (is_last)
+		log_pin_eob();
+}
+
+static void analyze_binary(const char *analyze_pin, FILE *fanalyze, unsigned jobs)
+{
+	const struct pin_store_hdr *hdr;
+	const struct pin_store_rec *recs;
+	std::vector<char> buf;
+	std::vector<size_t> splits;
+	struct cec_pin_stats *stats;
+	struct stat st;
+	size_t size, nrecs;
+	void *map = MAP_FAILED;
+	const char *base;
+	bool failed = false;
+
+	// mmap the file if possible, otherwise (a pipe) read it all
+	if (!fstat(fileno(fanalyze), &st) && S_ISREG(st.st_mode) && st.st_size) {
+		size = st.st_size;
+		map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(fanalyze), 0);
+		if (map == MAP_FAILED) {
+			fprintf(stderr, "Failed to mmap %s: %s\n", analyze_pin,
+				strerror(errno));
+			std::exit(EXIT_FAILURE);
+		}
+		base = static_cast<const char *>(map);
+	} else {
+		char tmp[65536];
+		size_t n;
+
+		while ((n = fread(tmp, 1, sizeof(tmp), fanalyze)))
+			buf.insert(buf.end(), tmp, tmp + n);
+		size = buf.size();
+		base = buf.data();
+	}
+
+	hdr = reinterpret_cast<const struct pin_store_hdr *>(base);
+	if (size < sizeof(*hdr) ||
+	    memcmp(hdr->magic, pin_store_magic, sizeof(hdr->magic))) {
+		fprintf(stderr, "Not a pin store file: malformed header\n");
+		std::exit(EXIT_FAILURE);
+	}
+	if (le32toh(hdr->version) > CEC_CTL_VERSION) {
+		fprintf(stderr, "Pin store file has version %d, but we only support up to version %d\n",
+			le32toh(hdr->version), CEC_CTL_VERSION);
+		std::exit(EXIT_FAILURE);
+	}
+
+	recs = reinterpret_cast<const struct pin_store_rec *>(base + sizeof(*hdr));
+	nrecs = (size - sizeof(*hdr)) / sizeof(*recs);
+	if ((size - sizeof(*hdr)) % sizeof(*recs))
+		fprintf(stderr, "warn: ignoring truncated record at the end of the file\n");
+
+	printf("Physical Address:     %x.%x.%x.%x\n",
+	       cec_phys_addr_exp(le16toh(hdr->phys_addr)));
+	printf("Logical Address Mask: 0x%04x\n\n", le16toh(hdr->log_addr_mask));
+
+	if (!jobs)
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nrecs / PIN_SPLIT_MIN_RECS < jobs)
+		jobs = nrecs / PIN_SPLIT_MIN_RECS ? : 1;
+
+	splits.push_back(0);
+	for (unsigned j = 1; j < jobs; j++) {
+		size_t at = pin_split(recs, nrecs,
+				      std::max(nrecs * j / jobs, splits.back() + 1));
+
+		if (at >= nrecs)
+			break;
+		splits.push_back(at);
+	}
+	splits.push_back(nrecs);
+	jobs = splits.size() - 1;
+
+	if (jobs == 1) {
+		analyze_recs(recs, 0, nrecs, true);
+		print_pin_stats(pin_stats);
+		goto done;
+	}
+
+	/*
+	 * Each piece is analyzed in its own process, so the state machine
+	 * and wallclock state need no changes. The output of each piece goes
+	 * to a temporary file, which is copied to stdout in order.
+	 */
+	stats = static_cast<struct cec_pin_stats *>(
+		mmap(nullptr, jobs * sizeof(*stats), PROT_READ | PROT_WRITE,
+		     MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+	if (stats == MAP_FAILED) {
+		fprintf(stderr, "Failed to allocate statistics: %s\n", strerror(errno));
+		std::exit(EXIT_FAILURE);
+	}
+
+	{
+		std::vector<FILE *> outs(jobs);
+		std::vector<pid_t> pids(jobs);
+
+		fflush(stdout);
+		for (unsigned j = 0; j < jobs; j++) {
+			outs[j] = tmpfile();
+			if (!outs[j]) {
+				fprintf(stderr, "Failed to create temporary file: %s\n",
+					strerror(errno));
+				std::exit(EXIT_FAILURE);
+			}
+			pids[j] = fork();
+			if (pids[j] < 0) {
+				fprintf(stderr, "Failed to fork: %s\n", strerror(errno));
+				std::exit(EXIT_FAILURE);
+			}
+			if (pids[j] == 0) {
+				dup2(fileno(outs[j]), STDOUT_FILENO);
+				analyze_recs(recs, splits[j], splits[j + 1], j == jobs - 1);
+				fflush(stdout);
+				stats[j] = pin_stats;
+				_exit(EXIT_SUCCESS);
+			}
+		}
+
+		for (unsigned j = 0; j < jobs; j++) {
+			char tmp[65536];
+			size_t n;
+			int status;
+
+			if (waitpid(pids[j], &status, 0) < 0 ||
+			    !WIFEXITED(status) || WEXITSTATUS(status))
+				failed = true;
+			rewind(outs[j]);
+			while ((n = fread(tmp, 1, sizeof(tmp), outs[j])))
+				fwrite(tmp, 1, n, stdout);
+			fclose(outs[j]);
+			add_pin_stats(pin_stats, stats[j]);
+		}
+	}
+	munmap(stats, jobs * sizeof(*stats));
+
+	if (failed) {
+		fprintf(stderr, "Analyzing %s failed\n", analyze_pin);
+		std::exit(EXIT_FAILURE);
+	}
+	print_pin_stats(pin_stats);
+
+done:
+	if (map != MAP_FAILED)
+		munmap(map, size);
+}
+
+static void analyze(const char *analyze_pin, unsigned jobs)
+{
+	FILE *fanalyze;
 	unsigned long tv_sec, tv_nsec, tv_usec;
 	unsigned version;
 	unsigned log_addr_mask;
@@ -1105,6 +1707,17 @@ static void analyze(const char *analyze_pin)
 			strerror(errno));
 		std::exit(EXIT_FAILURE);
 	}
+
+	int c = getc(fanalyze);
+
+	ungetc(c, fanalyze);
+	if (c == pin_store_magic[0]) {
+		analyze_binary(analyze_pin, fanalyze, jobs);
+		if (fanalyze != stdin)
+			fclose(fanalyze);
+		return;
+	}
+
 	if (!fgets(s, sizeof(s), fanalyze) ||
 	    strcmp(s, "# cec-ctl --store-pin\n"))
 		goto err;
@@ -1174,13 +1787,10 @@ static void analyze(const char *analyze_pin)
 			tv_nsec = tv_nsec * 10 + *p++ - '0';
 		event = read_val(&p);
 
-		bool dropped_events = event & MONITOR_FL_DROPPED_EVENTS;
-		event &= ~MONITOR_FL_DROPPED_EVENTS;
-
 		__u16 pa = 0;
 		__u16 la_mask = 0;
 
-		if (event == MONITOR_STATE_CHANGE) {
+		if ((event & ~MONITOR_FL_DROPPED_EVENTS) == MONITOR_STATE_CHANGE) {
 			pa = read_val(&p);
 			la_mask = read_val(&p);
 		}
@@ -1188,30 +1798,15 @@ static void analyze(const char *analyze_pin)
 			fprintf(stderr, "malformed data at line %d\n", line);
 			break;
 		}
-		if (event != MONITOR_STATE_CHANGE && event > 5) {
+		if (!log_pin_event(tv_sec * 1000000000ULL + tv_nsec, event, pa, la_mask)) {
 			fprintf(stderr, "unknown event at line %d\n", line);
 			break;
 		}
-		ev.ts = tv_sec * 1000000000ULL + tv_nsec;
-		ev.flags = 0;
-		if (dropped_events)
-			ev.flags = CEC_EVENT_FL_DROPPED_EVENTS;
-		if (event == MONITOR_STATE_CHANGE) {
-			ev.event = CEC_EVENT_STATE_CHANGE;
-			ev.state_change.phys_addr = pa;
-			ev.state_change.log_addr_mask = la_mask;
-		} else {
-			ev.event = event + CEC_EVENT_PIN_CEC_LOW;
-		}
-		log_event(ev, true, true);
 		line++;
 	}
 
-	if (eob_ts) {
-		ev.event = CEC_EVENT_PIN_CEC_HIGH;
-		ev.ts = eob_ts;
-		log_event(ev, true, true);
-	}
+	log_pin_eob();
+	print_pin_stats(pin_stats);
 
 	if (fanalyze != stdin)
 		fclose(fanalyze);
@@ -2425,6 +3020,10 @@ int main(int argc, char **argv)
 	const char *osd_name = "";
 	const char *store_pin = nullptr;
 	const char *analyze_pin = nullptr;
+	unsigned analyze_jobs = 0;
+	const char *store_msgs = nullptr;
+	const char *analyze_msgs_file = nullptr;
+	unsigned store_msgs_kb = MSG_STORE_DEFAULT_KB;
 	bool reply = true;
 	int idx = 0;
 	int fd = -1;
@@ -2547,11 +3146,24 @@ int main(int argc, char **argv)
 			break;
 		}
 		case OptStorePin:
+		case OptStorePinBinary:
 			store_pin = optarg;
 			break;
 		case OptAnalyzePin:
 			analyze_pin = optarg;
 			break;
+		case OptAnalyzeJobs:
+			analyze_jobs = strtoul(optarg, nullptr, 0);
+			break;
+		case OptStoreMsgs:
+			store_msgs = optarg;
+			break;
+		case OptStoreMsgsSize:
+			store_msgs_kb = strtoul(optarg, nullptr, 0);
+			break;
+		case OptAnalyzeMsgs:
+			analyze_msgs_file = optarg;
+			break;
 		case OptToggleNoReply:
 			reply = !reply;
 			break;
@@ -2986,13 +3598,30 @@ int main(int argc, char **argv)
 	}
 
 	if (analyze_pin) {
-		analyze(analyze_pin);
+		analyze(analyze_pin, analyze_jobs);
 		return 0;
 	}
 
+	if (analyze_msgs_file && (store_msgs || options[OptSetDevice])) {
+		fprintf(stderr, "--analyze-msgs cannot be combined with --store-msgs or --device.\n\n");
+		usage();
+		return 1;
+	}
+
+	if (store_msgs && !strcmp(store_msgs, "-")) {
+		fprintf(stderr, "--store-msgs needs a file, it cannot write to stdout.\n\n");
+		usage();
+		return 1;
+	}
+
 	if (options[OptWallClock] && !options[OptMonitorPin])
 		verbose = true;
 
+	if (analyze_msgs_file) {
+		analyze_msgs(analyze_msgs_file);
+		return 0;
+	}
+
 	if (store_pin && !strcmp(store_pin, "-"))
 		options[OptSkipInfo] = 1;
 
@@ -3350,7 +3979,7 @@ int main(int argc, char **argv)
 skip_la:
 	if (options[OptMonitor] || options[OptMonitorAll] ||
 	    options[OptMonitorPin]) {
-		monitor(node, monitor_time, store_pin);
+		monitor(node, monitor_time, store_pin, store_msgs, store_msgs_kb);
 	} else if (options[OptWaitForMsgs]) {
 		wait_for_msgs(node, monitor_time);
 	} else if (options[OptPhysAddrFromEDIDPoll]) {
@@ -14,8 +14,27 @@ std::string ts2s(__u64 ts);
 std::string ts2s(double ts);
 
 // cec-pin.cpp
+#define CEC_PIN_HIST_USECS	100
+#define CEC_PIN_HIST_SIZE	60
+
+struct cec_pin_stats {
+	__u64 msgs;
+	__u64 nacks;
+	__u64 retries;
+	__u64 sft_too_short;
+	__u64 low_drives;
+	// bit timings in CEC_PIN_HIST_USECS buckets, the last one is for longer times
+	__u64 start_bit_low[CEC_PIN_HIST_SIZE];
+	__u64 start_bit_period[CEC_PIN_HIST_SIZE];
+	__u64 data_bit_low[CEC_PIN_HIST_SIZE];
+	__u64 data_bit_period[CEC_PIN_HIST_SIZE];
+};
+
 extern __u64 eob_ts;
 extern __u64 eob_ts_max;
+extern struct cec_pin_stats pin_stats;
 void log_event_pin(bool is_high, __u64 ts, bool show);
+void add_pin_stats(struct cec_pin_stats &to, const struct cec_pin_stats &from);
+void print_pin_stats(const struct cec_pin_stats &stats);
 
 #endif
@@ -3,6 +3,7 @@
  * Copyright 2017 Cisco Systems, Inc. and/or its affiliates. All rights reserved.
  */
 
+#include <cstring>
 #include <string>
 
 #include <linux/cec.h>
@@ -79,6 +80,14 @@ enum cec_state {
 
 __u64 eob_ts;
 __u64 eob_ts_max;
+struct cec_pin_stats pin_stats;
+
+static void pin_hist_add(__u64 *hist, __u64 usecs)
+{
+	unsigned bucket = usecs / CEC_PIN_HIST_USECS;
+
+	hist[bucket < CEC_PIN_HIST_SIZE ? bucket : CEC_PIN_HIST_SIZE - 1]++;
+}
 
 // Global CEC state
 static enum cec_state state;
@@ -115,6 +124,7 @@ static void cec_pin_rx_start_bit_was_high(bool is_high, __u64 usecs, __u64 usecs
 		state = CEC_ST_IDLE;
 		return;
 	}
+	pin_hist_add(pin_stats.start_bit_period, low_usecs + usecs);
 	if (low_usecs + usecs < CEC_TIM_START_BIT_TOTAL_MIN - CEC_TIM_MARGIN && show)
 		printf("%s: warn: start bit: total period too short (%.2f < %.2f ms)\n",
 		       ts2s(ts).c_str(), (low_usecs + usecs) / 1000.0,
@@ -127,7 +137,8 @@ static void cec_pin_rx_start_bit_was_high(bool is_high, __u64 usecs, __u64 usecs
 	byte_cnt = 0;
 	bcast = false;
 	cdc = false;
-	msg.len = 0;
+	// don't let the log of a short message show bytes of the previous one
+	memset(&msg, 0, sizeof(msg));
 }
 
 static void cec_pin_rx_start_bit_was_low(__u64 ev_ts, __u64 usecs, __u64 usecs_min, bool show)
@@ -146,6 +157,7 @@ static void cec_pin_rx_start_bit_was_low(__u64 ev_ts, __u64 usecs, __u64 usecs_m
 		state = CEC_ST_IDLE;
 		return;
 	}
+	pin_hist_add(pin_stats.start_bit_low, usecs);
 	low_usecs = usecs;
 	eob_ts = ev_ts + 1000 * (CEC_TIM_START_BIT_TOTAL - low_usecs);
 	eob_ts_max = ev_ts + 1000 * (CEC_TIM_START_BIT_TOTAL_LONG - low_usecs);
@@ -157,6 +169,9 @@ static void cec_pin_rx_data_bit_was_high(bool is_high, __u64 ev_ts,
 	bool period_too_long = low_usecs + usecs > CEC_TIM_DATA_BIT_TOTAL_LONG;
 	bool bit;
 
+	if (!is_high)
+		pin_hist_add(pin_stats.data_bit_period, low_usecs + usecs);
+
 	if (is_high && rx_bit < 9 && show)
 		printf("%s: warn: data bit %d: total period too long\n", ts2s(ts).c_str(), rx_bit);
 	else if (rx_bit < 9 && show &&
@@ -190,6 +205,8 @@ static void cec_pin_rx_data_bit_was_high(bool is_high, __u64 ev_ts,
 		if (byte_cnt == 0) {
 			new_initiator = ((byte >> 4) != (prev_header >> 4));
 			cur_retry = prev_failed && !new_initiator;
+			if (cur_retry)
+				pin_stats.retries++;
 			prev_failed = true;
 			prev_header = byte;
 		}
@@ -217,10 +234,16 @@ static void cec_pin_rx_data_bit_was_high(bool is_high, __u64 ev_ts,
 
 			if (cur_retry)
 				sft = CEC_SIGNAL_FREE_TIME_RETRY;
-			if (cur_sft + 0.5 < sft)
-				printf("%s: warn: signal free time too short (%.1f instead of %d)\n",
-				       ts2s(ts).c_str(), cur_sft, sft);
+			if (cur_sft + 0.5 < sft) {
+				if (show)
+					printf("%s: warn: signal free time too short (%.1f instead of %d)\n",
+					       ts2s(ts).c_str(), cur_sft, sft);
+				pin_stats.sft_too_short++;
+			}
 			prev_failed = !ack;
+			pin_stats.msgs++;
+			if (!ack)
+				pin_stats.nacks++;
 		}
 		if (show && eom && msg.len > 2) {
 			msg.rx_status = CEC_RX_STATUS_OK;
@@ -266,6 +289,7 @@ static void cec_pin_rx_data_bit_was_low(__u64 ev_ts, __u64 usecs, __u64 usecs_mi
 
 	low_usecs = usecs;
 	if (usecs >= CEC_TIM_LOW_DRIVE_ERROR_MIN - CEC_TIM_MARGIN) {
+		pin_stats.low_drives++;
 		if (usecs >= max_low_drive && show)
 			printf("%s: warn: low drive too long (%.2f > %.2f ms)\n\n",
 			       ts2s(ts).c_str(), usecs / 1000.0,
@@ -285,6 +309,8 @@ static void cec_pin_rx_data_bit_was_low(__u64 ev_ts, __u64 usecs, __u64 usecs_mi
 		return;
 	}
 
+	pin_hist_add(pin_stats.data_bit_low, usecs);
+
 	if (usecs_min > CEC_TIM_DATA_BIT_0_LOW_MAX) {
 		if (show)
 			printf("%s: warn: data bit %d: low time too long (%.2f ms)\n",
@@ -422,3 +448,54 @@ void log_event_pin(bool is_high, __u64 ev_ts, bool show)
 	last_ts = ev_ts;
 	was_high = is_high;
 }
+
+void add_pin_stats(struct cec_pin_stats &to, const struct cec_pin_stats &from)
+{
+	to.msgs += from.msgs;
+	to.nacks += from.nacks;
+	to.retries += from.retries;
+	to.sft_too_short += from.sft_too_short;
+	to.low_drives += from.low_drives;
+	for (unsigned i = 0; i < CEC_PIN_HIST_SIZE; i++) {
+		to.start_bit_low[i] += from.start_bit_low[i];
+		to.start_bit_period[i] += from.start_bit_period[i];
+		to.data_bit_low[i] += from.data_bit_low[i];
+		to.data_bit_period[i] += from.data_bit_period[i];
+	}
+}
+
+static void print_pin_hist(const char *name, const __u64 *hist)
+{
+	__u64 max = 0;
+
+	for (unsigned i = 0; i < CEC_PIN_HIST_SIZE; i++)
+		max = hist[i] > max ? hist[i] : max;
+	if (!max)
+		return;
+
+	printf("\t%s:\n", name);
+	for (unsigned i = 0; i < CEC_PIN_HIST_SIZE; i++) {
+		if (!hist[i])
+			continue;
+		if (i == CEC_PIN_HIST_SIZE - 1)
+			printf("\t\t   >= %5.2f ms: %10llu ", i * CEC_PIN_HIST_USECS / 1000.0, hist[i]);
+		else
+			printf("\t\t%5.2f-%5.2f ms: %10llu ", i * CEC_PIN_HIST_USECS / 1000.0,
+			       (i + 1) * CEC_PIN_HIST_USECS / 1000.0, hist[i]);
+		printf("%s\n", std::string((hist[i] * 40 + max - 1) / max, '*').c_str());
+	}
+}
+
+void print_pin_stats(const struct cec_pin_stats &stats)
+{
+	printf("\nStatistics:\n");
+	printf("\tMessages:                    %llu\n", stats.msgs);
+	printf("\tNACKed messages:             %llu\n", stats.nacks);
+	printf("\tRetransmissions:             %llu\n", stats.retries);
+	printf("\tSignal free time too short:  %llu\n", stats.sft_too_short);
+	printf("\tLow drives:                  %llu\n", stats.low_drives);
+	print_pin_hist("Start bit low time", stats.start_bit_low);
+	print_pin_hist("Start bit period", stats.start_bit_period);
+	print_pin_hist("Data bit low time", stats.data_bit_low);
+	print_pin_hist("Data bit period", stats.data_bit_period);
+}
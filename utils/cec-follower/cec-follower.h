@@ -14,6 +14,7 @@
 #include <cec-info.h>
 #include <cec-log.h>
 #include <set>
+#include <vector>
 #include <ctime>
 
 extern bool show_info;
@@ -21,7 +22,6 @@ extern bool show_msgs;
 extern bool show_state;
 extern bool show_warnings;
 extern unsigned warnings;
-extern std::set<struct Timer> programmed_timers;
 extern void print_timers(struct node *node);
 
 struct state {
@@ -59,33 +59,6 @@ struct state {
 	__u64 last_aud_rate_rx_ts;
 };
 
-struct node {
-	int fd;
-	const char *device;
-	unsigned caps;
-	unsigned available_log_addrs;
-	__u8 remote_prim_devtype[15];
-	unsigned adap_la_mask;
-	unsigned remote_la_mask;
-	__u16 remote_phys_addr[15];
-	struct state state;
-	__u16 phys_addr;
-	__u8 cec_version;
-	bool source_has_arc_rx;
-	bool sink_has_arc_tx;
-	bool has_aud_rate;
-	bool has_deck_ctl;
-	bool has_rec_tv;
-	bool has_osd_string;
-
-	bool ignore_la[16];
-	unsigned short ignore_opcode[256];
-	unsigned standby_cnt;
-	unsigned ignore_standby;
-	unsigned view_on_cnt;
-	unsigned ignore_view_on;
-};
-
 struct Timer {
 	time_t start_time;
 	int duration; /* In seconds. */
@@ -133,7 +106,43 @@ struct la_info {
 	__u16 phys_addr;
 };
 
-extern struct la_info la_info[15];
+struct node {
+	int fd;
+	const char *device;
+	unsigned caps;
+	unsigned available_log_addrs;
+	__u8 remote_prim_devtype[15];
+	unsigned adap_la_mask;
+	unsigned remote_la_mask;
+	__u16 remote_phys_addr[15];
+	struct state state;
+	__u16 phys_addr;
+	__u8 cec_version;
+	bool source_has_arc_rx;
+	bool sink_has_arc_tx;
+	bool has_aud_rate;
+	bool has_deck_ctl;
+	bool has_rec_tv;
+	bool has_osd_string;
+
+	bool ignore_la[16];
+	unsigned short ignore_opcode[256];
+	unsigned standby_cnt;
+	unsigned ignore_standby;
+	unsigned view_on_cnt;
+	unsigned ignore_view_on;
+
+	struct la_info la_info[15];
+	std::set<struct Timer> programmed_timers;
+
+	// State of the message loop in cec-processing.cpp
+	unsigned me;
+	__u8 la_type;
+	unsigned last_poll_la;
+	__u8 last_pwr_state;
+	time_t last_pwr_status_toggle;
+	int timer_fd;
+};
 
 struct short_audio_desc {
 	/* Byte 1 */
@@ -232,10 +241,10 @@ struct short_audio_desc {
 		}							\
 	} while (0)
 
-int cec_named_ioctl(int fd, const char *name,
+int cec_named_ioctl(struct node *node, const char *name,
 		    unsigned long int request, void *parm);
 
-#define doioctl(n, r, p) cec_named_ioctl((n)->fd, #r, r, p)
+#define doioctl(n, r, p) cec_named_ioctl(n, #r, r, p)
 
 #define transmit(n, m) (doioctl(n, CEC_TRANSMIT, m))
 
@@ -278,7 +287,9 @@ void process_timer_msgs(struct node *node, struct cec_msg &msg, unsigned me, __u
 // CEC processing
 void reply_feature_abort(struct node *node, struct cec_msg *msg,
 			 __u8 reason = CEC_OP_ABORT_UNRECOGNIZED_OP);
-void testProcessing(struct node *node, bool exclusive, bool wallclock);
+void processing_lock(const struct node *node);
+void processing_unlock();
+void testProcessing(std::vector<struct node> &nodes, bool exclusive, bool wallclock);
 bool enter_standby(struct node *node);
 
 #endif
@@ -4,11 +4,19 @@
  */
 
 #include <cerrno>
+#include <cstdio>
+#include <cstdlib>
 #include <ctime>
+#include <mutex>
 #include <string>
+#include <thread>
 
+#include <stdio_ext.h>
+#include <sys/epoll.h>
 #include <sys/ioctl.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
 
 #include "cec-follower.h"
 #include "compiler.h"
@@ -40,8 +48,6 @@ struct cec_enum_values {
 	__u8 value;
 };
 
-struct la_info la_info[15];
-
 static struct timespec start_monotonic;
 static struct timeval start_timeofday;
 static constexpr time_t time_to_transient = 1;
@@ -126,8 +132,8 @@ void reply_feature_abort(struct node *node, struct cec_msg *msg, __u8 reason)
 	if (cec_msg_is_broadcast(msg) || cec_msg_initiator(msg) == CEC_LOG_ADDR_UNREGISTERED)
 		return;
 	if (reason == CEC_OP_ABORT_UNRECOGNIZED_OP) {
-		la_info[la].feature_aborted[opcode].count++;
-		if (la_info[la].feature_aborted[opcode].count == 2) {
+		node->la_info[la].feature_aborted[opcode].count++;
+		if (node->la_info[la].feature_aborted[opcode].count == 2) {
 			/* If the Abort Reason was "Unrecognized opcode", the Initiator should not send
 			   the same message to the same Follower again at that time to avoid saturating
 			   the bus. */
@@ -136,12 +142,12 @@ void reply_feature_abort(struct node *node, struct cec_msg *msg, __u8 reason)
 			warn("replying Feature Abort [Unrecognized Opcode] to the same message.\n");
 		}
 	}
-	else if (la_info[la].feature_aborted[opcode].count) {
+	else if (node->la_info[la].feature_aborted[opcode].count) {
 		warn("Replying Feature Abort with abort reason different than [Unrecognized Opcode]\n");
 		warn("to message that has previously been replied Feature Abort to with [Unrecognized Opcode].\n");
 	}
 	else
-		la_info[la].feature_aborted[opcode].ts = ts_now;
+		node->la_info[la].feature_aborted[opcode].ts = ts_now;
 
 	cec_msg_reply_feature_abort(msg, reason);
 	transmit(node, msg);
@@ -392,7 +398,7 @@ static void processMsg(struct node *node, struct cec_msg &msg, unsigned me, __u8
 	case CEC_MSG_ROUTING_INFORMATION: {
 		__u8 la = cec_msg_initiator(&msg);
 
-		if (cec_has_tv(1 << la) && la_info[la].phys_addr == 0)
+		if (cec_has_tv(1 << la) && node->la_info[la].phys_addr == 0)
 			warn("TV (0) at 0.0.0.0 sent Routing Information.");
 		return;
 	}
@@ -1016,7 +1022,7 @@ static void poll_remote_devs(struct node *node, unsigned me)
 
 static void update_programmed_timers(struct node *node)
 {
-	auto it = programmed_timers.begin();
+	auto it = node->programmed_timers.begin();
 	/* Use the current minute because timers do not have second precision. */
 	time_t current_minute = time(nullptr) / 60;
 	time_t timer_start_minute = it->start_time / 60;
@@ -1032,7 +1038,7 @@ static void update_programmed_timers(struct node *node)
 	/* Delete an overlapped timer. Recording will be at best incomplete. */
 	if (timer_start_minute < current_minute &&
 	    (!node->state.recording_controlled_by_timer || !node->state.one_touch_record_on)) {
-		programmed_timers.erase(*it);
+		node->programmed_timers.erase(*it);
 		if (show_info)
 			printf("Deleted overlapped timer.\n");
 		print_timers(node);
@@ -1064,9 +1070,9 @@ static void update_programmed_timers(struct node *node)
 		last_start_time->tm_mday += days_to_move_ahead;
 		last_start_time->tm_isdst = -1;
 		next_timer.start_time = mktime(last_start_time);
-		programmed_timers.insert(next_timer);
+		node->programmed_timers.insert(next_timer);
 	}
-	programmed_timers.erase(*it);
+	node->programmed_timers.erase(*it);
 	if (show_info)
 		printf("Deleted finished timer.\n");
 	print_timers(node);
@@ -1081,170 +1087,319 @@ static void update_programmed_timers(struct node *node)
 	}
 }
 
-void testProcessing(struct node *node, bool exclusive, bool wallclock)
+static void process_init(struct node *node, bool exclusive)
 {
 	struct cec_log_addrs laddrs;
-	fd_set rd_fds;
-	fd_set ex_fds;
-	int fd = node->fd;
 	__u32 mode = CEC_MODE_INITIATOR |
 		(exclusive ? CEC_MODE_EXCL_FOLLOWER : CEC_MODE_FOLLOWER);
-	unsigned me;
-	unsigned last_poll_la = 15;
-	__u8 last_pwr_state = current_power_state(node);
-	time_t last_pwr_status_toggle = time(nullptr);
 
-	clock_gettime(CLOCK_MONOTONIC, &start_monotonic);
-	gettimeofday(&start_timeofday, nullptr);
+	node->last_poll_la = 15;
+	node->last_pwr_state = current_power_state(node);
+	node->last_pwr_status_toggle = time(nullptr);
 
 	doioctl(node, CEC_S_MODE, &mode);
 	doioctl(node, CEC_ADAP_G_LOG_ADDRS, &laddrs);
-	me = laddrs.log_addr[0];
-	__u8 type = laddrs.log_addr_type[0];
-
-	poll_remote_devs(node, me);
+	node->me = laddrs.log_addr[0];
+	node->la_type = laddrs.log_addr_type[0];
 
-	while (true) {
-		int res;
-		struct timeval timeval = {};
+	poll_remote_devs(node, node->me);
+}
 
-		fflush(stdout);
-		timeval.tv_sec = 1;
-		FD_ZERO(&rd_fds);
-		FD_ZERO(&ex_fds);
-		FD_SET(fd, &rd_fds);
-		FD_SET(fd, &ex_fds);
-		res = select(fd + 1, &rd_fds, nullptr, &ex_fds, &timeval);
-		if (res < 0)
-			break;
-		if (FD_ISSET(fd, &ex_fds)) {
-			struct cec_event ev;
+/*
+ * Each adapter has its own timerfd which fires at every whole second of
+ * the monotonic clock. The periodic work polls the logical address
+ * matching the current second, so a tick must never be skipped or
+ * delivered twice within the same second. Since all timers share the
+ * same phase, a single wakeup of the epoll loop serves all adapters.
+ */
+static int process_timer_create(void)
+{
+	struct itimerspec its = {};
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		return fd;
+	clock_gettime(CLOCK_MONOTONIC, &its.it_value);
+	its.it_value.tv_sec++;
+	its.it_value.tv_nsec = 0;
+	its.it_interval.tv_sec = 1;
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, nullptr)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
 
-			res = doioctl(node, CEC_DQEVENT, &ev);
-			if (res == ENODEV) {
-				printf("Device was disconnected.\n");
-				break;
-			}
-			if (res)
-				continue;
-			log_event(ev, wallclock);
-			if (ev.event == CEC_EVENT_STATE_CHANGE) {
-				dev_info("CEC adapter state change.\n");
-				node->phys_addr = ev.state_change.phys_addr;
-				node->adap_la_mask = ev.state_change.log_addr_mask;
-				if (node->adap_la_mask) {
-					doioctl(node, CEC_ADAP_G_LOG_ADDRS, &laddrs);
-					me = laddrs.log_addr[0];
-				} else {
-					node->state.active_source_pa = CEC_PHYS_ADDR_INVALID;
-					me = CEC_LOG_ADDR_INVALID;
-				}
-				memset(la_info, 0, sizeof(la_info));
-			}
+static int process_event(struct node *node, bool wallclock)
+{
+	struct cec_log_addrs laddrs;
+	struct cec_event ev;
+	int res;
+
+	res = doioctl(node, CEC_DQEVENT, &ev);
+	if (res)
+		return res;
+	log_event(ev, wallclock);
+	if (ev.event == CEC_EVENT_STATE_CHANGE) {
+		dev_info("CEC adapter state change.\n");
+		node->phys_addr = ev.state_change.phys_addr;
+		node->adap_la_mask = ev.state_change.log_addr_mask;
+		if (node->adap_la_mask) {
+			doioctl(node, CEC_ADAP_G_LOG_ADDRS, &laddrs);
+			node->me = laddrs.log_addr[0];
+		} else {
+			node->state.active_source_pa = CEC_PHYS_ADDR_INVALID;
+			node->me = CEC_LOG_ADDR_INVALID;
 		}
-		if (FD_ISSET(fd, &rd_fds)) {
-			struct cec_msg msg = { };
+		memset(node->la_info, 0, sizeof(node->la_info));
+	}
+	return 0;
+}
 
-			res = doioctl(node, CEC_RECEIVE, &msg);
-			if (res == ENODEV) {
-				printf("Device was disconnected.\n");
-				break;
-			}
-			if (res)
-				continue;
+static int process_receive(struct node *node, bool wallclock)
+{
+	struct cec_msg msg = { };
+	int res;
 
-			__u8 from = cec_msg_initiator(&msg);
-			__u8 to = cec_msg_destination(&msg);
-			__u8 opcode = cec_msg_opcode(&msg);
+	res = doioctl(node, CEC_RECEIVE, &msg);
+	if (res)
+		return res;
 
-			if (node->ignore_la[from])
-				continue;
-			if (node->ignore_opcode[msg.msg[1]] & (1 << from))
-				continue;
+	__u8 from = cec_msg_initiator(&msg);
+	__u8 to = cec_msg_destination(&msg);
+	__u8 opcode = cec_msg_opcode(&msg);
+
+	if (node->ignore_la[from])
+		return 0;
+	if (node->ignore_opcode[msg.msg[1]] & (1 << from))
+		return 0;
+
+	if (from != CEC_LOG_ADDR_UNREGISTERED &&
+	    node->la_info[from].feature_aborted[opcode].ts &&
+	    ts_to_ms(get_ts() - node->la_info[from].feature_aborted[opcode].ts) < 200) {
+		warn("Received message %s from LA %d (%s) less than 200 ms after\n",
+		     opcode2s(&msg).c_str(), from, cec_la2s(from));
+		warn("replying Feature Abort (not [Unrecognized Opcode]) to the same message.\n");
+	}
+	if (from != CEC_LOG_ADDR_UNREGISTERED && !node->la_info[from].ts)
+		dev_info("Logical address %d (%s) discovered.\n", from, cec_la2s(from));
+	if (show_msgs) {
+		printf("    %s to %s (%d to %d): ",
+		       cec_la2s(from), to == 0xf ? "all" : cec_la2s(to), from, to);
+		cec_log_msg(&msg);
+		if (show_info)
+			printf("\tSequence: %u Rx Timestamp: %s\n",
+			       msg.sequence, ts2s(msg.rx_ts, wallclock).c_str());
+	}
+	if (node->adap_la_mask)
+		processMsg(node, msg, node->me, node->la_type);
+	return 0;
+}
 
-			if (from != CEC_LOG_ADDR_UNREGISTERED &&
-			    la_info[from].feature_aborted[opcode].ts &&
-			    ts_to_ms(get_ts() - la_info[from].feature_aborted[opcode].ts) < 200) {
-				warn("Received message %s from LA %d (%s) less than 200 ms after\n",
-				     opcode2s(&msg).c_str(), from, cec_la2s(from));
-				warn("replying Feature Abort (not [Unrecognized Opcode]) to the same message.\n");
-			}
-			if (from != CEC_LOG_ADDR_UNREGISTERED && !la_info[from].ts)
-				dev_info("Logical address %d (%s) discovered.\n", from, cec_la2s(from));
-			if (show_msgs) {
-				printf("    %s to %s (%d to %d): ",
-				       cec_la2s(from), to == 0xf ? "all" : cec_la2s(to), from, to);
-				cec_log_msg(&msg);
-				if (show_info)
-					printf("\tSequence: %u Rx Timestamp: %s\n",
-					       msg.sequence, ts2s(msg.rx_ts, wallclock).c_str());
-			}
-			if (node->adap_la_mask)
-				processMsg(node, msg, me, type);
-		}
+static void process_periodic(struct node *node)
+{
+	unsigned me = node->me;
+	__u8 pwr_state = current_power_state(node);
 
-		__u8 pwr_state = current_power_state(node);
-		if (node->cec_version >= CEC_OP_CEC_VERSION_2_0 &&
-		    last_pwr_state != pwr_state &&
-		    (time_to_stable > 2 || pwr_state < CEC_OP_POWER_STATUS_TO_ON)) {
-			struct cec_msg msg;
+	if (node->cec_version >= CEC_OP_CEC_VERSION_2_0 &&
+	    node->last_pwr_state != pwr_state &&
+	    (time_to_stable > 2 || pwr_state < CEC_OP_POWER_STATUS_TO_ON)) {
+		struct cec_msg msg;
 
-			cec_msg_init(&msg, me, CEC_LOG_ADDR_BROADCAST);
-			cec_msg_report_power_status(&msg, pwr_state);
-			transmit(node, &msg);
-			last_pwr_state = pwr_state;
+		cec_msg_init(&msg, me, CEC_LOG_ADDR_BROADCAST);
+		cec_msg_report_power_status(&msg, pwr_state);
+		transmit(node, &msg);
+		node->last_pwr_state = pwr_state;
+	}
+
+	if (node->state.toggle_power_status && cec_has_tv(1 << me) &&
+	    (time(nullptr) - node->last_pwr_status_toggle > node->state.toggle_power_status)) {
+		node->last_pwr_status_toggle = time(nullptr);
+		if (pwr_state & 1) // standby or to-standby
+			exit_standby(node);
+		else
+			enter_standby(node);
+	}
+
+	__u64 ts_now = get_ts();
+	unsigned poll_la = ts_to_s(ts_now) % 16;
+
+	if (poll_la != me &&
+	    poll_la != node->last_poll_la && poll_la < 15 && node->la_info[poll_la].ts &&
+	    ts_to_ms(ts_now - node->la_info[poll_la].ts) > POLL_PERIOD) {
+		struct cec_msg msg;
+
+		cec_msg_init(&msg, me, poll_la);
+		transmit(node, &msg);
+		if (msg.tx_status & CEC_TX_STATUS_NACK) {
+			dev_info("Logical address %d stopped responding to polling message.\n", poll_la);
+			memset(&node->la_info[poll_la], 0, sizeof(node->la_info[poll_la]));
+			node->remote_la_mask &= ~(1 << poll_la);
+			node->remote_phys_addr[poll_la] = CEC_PHYS_ADDR_INVALID;
 		}
+	}
+	node->last_poll_la = poll_la;
 
-		if (node->state.toggle_power_status && cec_has_tv(1 << me) &&
-		    (time(nullptr) - last_pwr_status_toggle > node->state.toggle_power_status)) {
-			last_pwr_status_toggle = time(nullptr);
-			if (pwr_state & 1) // standby or to-standby
-				exit_standby(node);
-			else
-				enter_standby(node);
+	unsigned ms_since_press = ts_to_ms(ts_now - node->state.rc_press_rx_ts);
+
+	if (ms_since_press > FOLLOWER_SAFETY_TIMEOUT) {
+		if (node->state.rc_state == PRESS_HOLD)
+			rc_press_hold_stop(&node->state);
+		else if (node->state.rc_state == PRESS) {
+			dev_info("Button timeout: %s\n", get_ui_cmd_string(node->state.rc_ui_cmd));
+			node->state.rc_state = NOPRESS;
 		}
+	}
 
-		__u64 ts_now = get_ts();
-		unsigned poll_la = ts_to_s(ts_now) % 16;
+	if (node->has_aud_rate)
+		aud_rate_msg_interval_check(node, ts_now);
 
-		if (poll_la != me &&
-		    poll_la != last_poll_la && poll_la < 15 && la_info[poll_la].ts &&
-		    ts_to_ms(ts_now - la_info[poll_la].ts) > POLL_PERIOD) {
-			struct cec_msg msg;
+	if (node->state.deck_skip_start && ts_now - node->state.deck_skip_start > MAX_DECK_SKIP_NS) {
+		node->state.deck_skip_start = 0;
+		update_deck_state(node, me, CEC_OP_DECK_INFO_PLAY);
+	}
 
-			cec_msg_init(&msg, me, poll_la);
-			transmit(node, &msg);
-			if (msg.tx_status & CEC_TX_STATUS_NACK) {
-				dev_info("Logical address %d stopped responding to polling message.\n", poll_la);
-				memset(&la_info[poll_la], 0, sizeof(la_info[poll_la]));
-				node->remote_la_mask &= ~(1 << poll_la);
-				node->remote_phys_addr[poll_la] = CEC_PHYS_ADDR_INVALID;
-			}
-		}
-		last_poll_la = poll_la;
+	if (!node->programmed_timers.empty())
+		update_programmed_timers(node);
+}
+
+/*
+ * With more than one adapter, each is served by its own thread, so a
+ * transmit that blocks on one adapter (e.g. a NACKed poll that is retried)
+ * doesn't hold up the others. The processing of the threads is serialized
+ * by processing_mutex, which is only dropped while a thread waits for its
+ * adapter or for a transmit to finish. Whenever the output switches to
+ * another adapter, it is preceded by the device name. Most wakeups print
+ * nothing, so stdout is then fully buffered and the device name is dropped
+ * again if nothing followed it.
+ */
+static std::mutex processing_mutex;
+static const struct node *last_node, *prev_node;
+static size_t header_len;
+static bool show_device;
 
-		unsigned ms_since_press = ts_to_ms(ts_now - node->state.rc_press_rx_ts);
+void processing_lock(const struct node *node)
+{
+	processing_mutex.lock();
+	header_len = 0;
+	if (show_device && node != last_node) {
+		header_len = printf("\n%s:\n", node->device);
+		prev_node = last_node;
+	}
+	last_node = node;
+}
 
-		if (ms_since_press > FOLLOWER_SAFETY_TIMEOUT) {
-			if (node->state.rc_state == PRESS_HOLD)
-				rc_press_hold_stop(&node->state);
-			else if (node->state.rc_state == PRESS) {
-				dev_info("Button timeout: %s\n", get_ui_cmd_string(node->state.rc_ui_cmd));
-				node->state.rc_state = NOPRESS;
+void processing_unlock()
+{
+	if (header_len && __fpending(stdout) == header_len) {
+		__fpurge(stdout);
+		last_node = prev_node;
+	}
+	fflush(stdout);
+	processing_mutex.unlock();
+}
+
+static void process_node(struct node *node, bool exclusive, bool wallclock)
+{
+	struct epoll_event events[2];
+	struct epoll_event ev = {};
+	int epfd;
+
+	processing_lock(node);
+	process_init(node, exclusive);
+	node->timer_fd = process_timer_create();
+	if (node->timer_fd < 0) {
+		perror("timerfd");
+		std::exit(EXIT_FAILURE);
+	}
+	processing_unlock();
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		std::exit(EXIT_FAILURE);
+	}
+	/* The epoll data is 1 for the timerfd. */
+	ev.events = EPOLLIN | EPOLLPRI;
+	ev.data.u64 = 0;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, node->fd, &ev);
+	ev.events = EPOLLIN;
+	ev.data.u64 = 1;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, node->timer_fd, &ev);
+
+	while (node->fd >= 0) {
+		int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		processing_lock(node);
+		for (int i = 0; i < n && node->fd >= 0; i++) {
+			bool disconnected = false;
+
+			if (events[i].data.u64) {
+				__u64 expirations;
+
+				if (read(node->timer_fd, &expirations, sizeof(expirations)) < 0)
+					continue;
+			} else {
+				/*
+				 * The fd stays blocking, otherwise transmits would
+				 * return before they are finished. epoll is level
+				 * triggered, so dequeue a single event and message
+				 * per wakeup and let it report any that are left.
+				 */
+				if ((events[i].events & EPOLLPRI) &&
+				    process_event(node, wallclock) == ENODEV)
+					disconnected = true;
+				if (!disconnected && (events[i].events & EPOLLIN) &&
+				    process_receive(node, wallclock) == ENODEV)
+					disconnected = true;
+				if (events[i].events & (EPOLLHUP | EPOLLERR))
+					disconnected = true;
 			}
+			if (disconnected) {
+				printf("Device was disconnected.\n");
+				close(node->timer_fd);
+				close(node->fd);
+				node->timer_fd = node->fd = -1;
+				continue;
+			}
+			process_periodic(node);
 		}
+		processing_unlock();
+	}
+	close(epfd);
+}
 
-		if (node->has_aud_rate)
-			aud_rate_msg_interval_check(node, ts_now);
+void testProcessing(std::vector<struct node> &nodes, bool exclusive, bool wallclock)
+{
+	std::vector<std::thread> threads;
 
-		if (node->state.deck_skip_start && ts_now - node->state.deck_skip_start > MAX_DECK_SKIP_NS) {
-			node->state.deck_skip_start = 0;
-			update_deck_state(node, me, CEC_OP_DECK_INFO_PLAY);
-		}
+	clock_gettime(CLOCK_MONOTONIC, &start_monotonic);
+	gettimeofday(&start_timeofday, nullptr);
 
-		if (!programmed_timers.empty())
-			update_programmed_timers(node);
+	show_device = nodes.size() > 1;
+	if (show_device) {
+		fflush(stdout);
+		setvbuf(stdout, nullptr, _IOFBF, BUFSIZ);
+	}
+	if (nodes.size() == 1)
+		process_node(&nodes[0], exclusive, wallclock);
+	else
+		for (auto &node : nodes)
+			threads.emplace_back(process_node, &node, exclusive, wallclock);
+	for (auto &t : threads)
+		t.join();
+
+	for (auto &node : nodes) {
+		__u32 mode = CEC_MODE_INITIATOR;
+
+		if (node.fd < 0)
+			continue;
+		doioctl(&node, CEC_S_MODE, &mode);
+		close(node.timer_fd);
 	}
-	mode = CEC_MODE_INITIATOR;
-	doioctl(node, CEC_S_MODE, &mode);
 }
@@ -740,7 +740,7 @@ void process_record_msgs(struct node *node, struct cec_msg &msg, unsigned me, __
 		/* Delete any currently active recording timer or it may restart itself in first minute. */
 		if (node->state.recording_controlled_by_timer) {
 			node->state.recording_controlled_by_timer = false;
-			programmed_timers.erase(programmed_timers.begin());
+			node->programmed_timers.erase(node->programmed_timers.begin());
 			if (show_info)
 				printf("Deleted manually stopped timer.\n");
 			print_timers(node);
@@ -877,13 +877,13 @@ static bool timer_date_out_of_range(const struct cec_msg &msg, const struct Time
 	return false;
 }
 
-static bool timer_overlap(const struct Timer &new_timer)
+static bool timer_overlap(struct node *node, const struct Timer &new_timer)
 {
-	if (programmed_timers.size() == 1)
+	if (node->programmed_timers.size() == 1)
 		return false;
 
 	time_t new_timer_end = new_timer.start_time + new_timer.duration;
-	for (auto &t : programmed_timers) {
+	for (auto &t : node->programmed_timers) {
 
 		if (new_timer == t)
 			continue; /* Timer doesn't overlap itself. */
@@ -933,13 +933,13 @@ void process_timer_msgs(struct node *node, struct cec_msg &msg, unsigned me, __u
 		if (timer.recording_seq > 0x7f)
 			prog_error = CEC_OP_PROG_ERROR_REC_SEQ_ERROR;
 
-		if (programmed_timers.find(timer) != programmed_timers.end())
+		if (node->programmed_timers.find(timer) != node->programmed_timers.end())
 			prog_error = CEC_OP_PROG_ERROR_DUPLICATE;
 
 		if (!prog_error) {
-			programmed_timers.insert(timer);
+			node->programmed_timers.insert(timer);
 
-			if (timer_overlap(timer))
+			if (timer_overlap(node, timer))
 				timer_overlap_warning = CEC_OP_TIMER_OVERLAP_WARNING_OVERLAP;
 
 			if (node->state.media_space_available <= 0 ||
@@ -947,7 +947,7 @@ void process_timer_msgs(struct node *node, struct cec_msg &msg, unsigned me, __u
 				prog_info = CEC_OP_PROG_INFO_NOT_ENOUGH_SPACE;
 			} else {
 				int space_that_may_be_needed = 0;
-				for (auto &t : programmed_timers) {
+				for (auto &t : node->programmed_timers) {
 					space_that_may_be_needed += t.duration;
 					if (t == timer) /* Only count the space up to and including the new timer. */
 						break;
@@ -986,26 +986,26 @@ void process_timer_msgs(struct node *node, struct cec_msg &msg, unsigned me, __u
 		temp->tm_year--;
 		temp->tm_isdst = -1;
 		timer_in_previous_year.start_time = mktime(temp);
-		auto it_previous_year = programmed_timers.find(timer_in_previous_year);
+		auto it_previous_year = node->programmed_timers.find(timer_in_previous_year);
 
-		if (it_previous_year != programmed_timers.end()) {
-			if (node->state.recording_controlled_by_timer && it_previous_year == programmed_timers.begin()) {
+		if (it_previous_year != node->programmed_timers.end()) {
+			if (node->state.recording_controlled_by_timer && it_previous_year == node->programmed_timers.begin()) {
 				timer_cleared_status = CEC_OP_TIMER_CLR_STAT_RECORDING;
 				node->state.one_touch_record_on = false;
 				node->state.recording_controlled_by_timer = false;
 			} else {
 				timer_cleared_status = CEC_OP_TIMER_CLR_STAT_CLEARED;
 			}
-			programmed_timers.erase(timer_in_previous_year);
+			node->programmed_timers.erase(timer_in_previous_year);
 			print_timers(node);
 		}
 
 		/* Look for timer in the current year. */
 		struct Timer timer_in_current_year = get_timer_from_message(msg);
-		auto it_current_year = programmed_timers.find(timer_in_current_year);
+		auto it_current_year = node->programmed_timers.find(timer_in_current_year);
 
-		if (it_current_year != programmed_timers.end()) {
-			if (node->state.recording_controlled_by_timer && it_current_year == programmed_timers.begin()) {
+		if (it_current_year != node->programmed_timers.end()) {
+			if (node->state.recording_controlled_by_timer && it_current_year == node->programmed_timers.begin()) {
 				timer_cleared_status = CEC_OP_TIMER_CLR_STAT_RECORDING;
 				node->state.one_touch_record_on = false;
 				node->state.recording_controlled_by_timer = false;
@@ -1014,7 +1014,7 @@ void process_timer_msgs(struct node *node, struct cec_msg &msg, unsigned me, __u
 				if (timer_cleared_status == CEC_OP_TIMER_CLR_STAT_NO_MATCHING)
 					timer_cleared_status = CEC_OP_TIMER_CLR_STAT_CLEARED;
 			}
-			programmed_timers.erase(timer_in_current_year);
+			node->programmed_timers.erase(timer_in_current_year);
 			print_timers(node);
 		}
 
@@ -1024,11 +1024,11 @@ void process_timer_msgs(struct node *node, struct cec_msg &msg, unsigned me, __u
 		temp->tm_year++;
 		temp->tm_isdst = -1;
 		timer_in_next_year.start_time = mktime(temp);
-		if (programmed_timers.find(timer_in_next_year) != programmed_timers.end()) {
+		if (node->programmed_timers.find(timer_in_next_year) != node->programmed_timers.end()) {
 			/* Do not overwrite status if already set. */
 			if (timer_cleared_status == CEC_OP_TIMER_CLR_STAT_NO_MATCHING)
 				timer_cleared_status = CEC_OP_TIMER_CLR_STAT_CLEARED;
-			programmed_timers.erase(timer_in_next_year);
+			node->programmed_timers.erase(timer_in_next_year);
 			print_timers(node);
 		}
 		cec_msg_set_reply_to(&msg, &msg);
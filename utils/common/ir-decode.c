@@ -0,0 +1,756 @@
+/*
+ * ir-decode.c - decodes IR pulses and spaces in different protocols
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 2 of the License.
+
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The decoders follow the kernel IR decoders, and decode all protocols
+ * which ir-encode.c can encode. The header and sharp space margins are
+ * wider than the kernel's, since recordings may come from any receiver.
+ * Every pulse and space is passed to all decoders, so a stream of IR is
+ * decoded in a single pass whatever protocol it uses, without knowing the
+ * protocol in advance.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/lirc.h>
+
+#include "ir-decode.h"
+
+#define NS_TO_US(x) (((x)+500)/1000)
+
+enum {
+	STATE_INACTIVE,
+	STATE_HEADER_SPACE,
+	STATE_BIT_PULSE,
+	STATE_BIT_SPACE,
+	STATE_BIT_START,
+	STATE_BIT_END,
+	STATE_TRAILER_PULSE,
+	STATE_TRAILER_SPACE,
+	STATE_ECHO_SPACE,
+	STATE_CHECK_REPEAT,
+	STATE_CHECK_RC5X,
+	STATE_PREFIX_SPACE,
+	STATE_HEADER_BIT_START,
+	STATE_HEADER_BIT_END,
+	STATE_TOGGLE_START,
+	STATE_TOGGLE_END,
+	STATE_FINISHED,
+};
+
+struct ir_decoder {
+	ir_decoded_fn fn;
+	void *priv;
+	bool decoded;
+
+	struct {
+		int state;
+		unsigned count;
+		uint32_t bits;
+		bool is_repeat;
+		bool have_last;
+		enum rc_proto last_protocol;
+		unsigned last_scancode;
+	} nec;
+	struct {
+		int state;
+		unsigned count;
+		uint32_t bits;
+		uint32_t last_bits;
+		bool is_repeat;
+	} jvc;
+	struct {
+		int state;
+		unsigned count;
+		uint64_t bits;
+	} sanyo;
+	struct {
+		int state;
+		unsigned count;
+		uint32_t bits;
+	} sharp;
+	struct {
+		int state;
+		unsigned count;
+		uint32_t bits;
+	} sony;
+	struct {
+		int state;
+		unsigned count;
+		uint32_t bits;
+		bool is_rc5x;
+	} rc5;
+	struct {
+		int state;
+		unsigned count;
+		unsigned wanted_bits;
+		uint32_t header;
+		uint32_t body;
+		bool toggle;
+	} rc6;
+	struct {
+		int state;
+		unsigned count;
+		uint32_t bits;
+	} xbox_dvd;
+};
+
+static bool eq_margin(unsigned d1, unsigned d2, unsigned margin)
+{
+	return d1 + margin > d2 && d1 < d2 + margin;
+}
+
+static bool geq_margin(unsigned d1, unsigned d2, unsigned margin)
+{
+	return d1 + margin > d2;
+}
+
+static void decrease_duration(unsigned *duration, unsigned length)
+{
+	*duration = *duration > length ? *duration - length : 0;
+}
+
+static void decoded(struct ir_decoder *dec, enum rc_proto protocol,
+		    unsigned scancode, bool toggle, bool repeat)
+{
+	struct ir_decoded d = {
+		.protocol = protocol,
+		.scancode = scancode,
+		.toggle = toggle,
+		.repeat = repeat,
+	};
+
+	if (dec->decoded)
+		return;
+	dec->decoded = true;
+	dec->fn(&d, dec->priv);
+}
+
+static const unsigned nec_unit = 562500;
+
+static void nec_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned unit = NS_TO_US(nec_unit);
+	unsigned address, not_address, command, not_command, scancode;
+	enum rc_proto protocol;
+
+	switch (dec->nec.state) {
+	case STATE_INACTIVE:
+		if (!pulse || !eq_margin(duration, NS_TO_US(nec_unit * 16), unit * 2))
+			return;
+		dec->nec.count = 0;
+		dec->nec.bits = 0;
+		dec->nec.state = STATE_HEADER_SPACE;
+		return;
+	case STATE_HEADER_SPACE:
+		if (pulse)
+			break;
+		if (eq_margin(duration, NS_TO_US(nec_unit * 8), unit)) {
+			dec->nec.is_repeat = false;
+			dec->nec.state = STATE_BIT_PULSE;
+			return;
+		}
+		if (eq_margin(duration, NS_TO_US(nec_unit * 4), unit / 2)) {
+			dec->nec.is_repeat = true;
+			dec->nec.state = STATE_TRAILER_PULSE;
+			return;
+		}
+		break;
+	case STATE_BIT_PULSE:
+		if (!pulse || !eq_margin(duration, unit, unit / 2))
+			break;
+		dec->nec.state = STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_SPACE:
+		if (pulse)
+			break;
+		if (eq_margin(duration, NS_TO_US(nec_unit * 3), unit / 2))
+			dec->nec.bits |= 1U << dec->nec.count;
+		else if (!eq_margin(duration, unit, unit / 2))
+			break;
+		dec->nec.count++;
+		dec->nec.state = dec->nec.count == 32 ?
+			STATE_TRAILER_PULSE : STATE_BIT_PULSE;
+		return;
+	case STATE_TRAILER_PULSE:
+		if (!pulse || !eq_margin(duration, unit, unit / 2))
+			break;
+		dec->nec.state = STATE_TRAILER_SPACE;
+		return;
+	case STATE_TRAILER_SPACE:
+		if (pulse || !geq_margin(duration, NS_TO_US(nec_unit * 10), unit / 2))
+			break;
+		dec->nec.state = STATE_INACTIVE;
+		if (dec->nec.is_repeat) {
+			if (dec->nec.have_last)
+				decoded(dec, dec->nec.last_protocol,
+					dec->nec.last_scancode, false, true);
+			return;
+		}
+
+		address = dec->nec.bits & 0xff;
+		not_address = (dec->nec.bits >> 8) & 0xff;
+		command = (dec->nec.bits >> 16) & 0xff;
+		not_command = dec->nec.bits >> 24;
+
+		// the inverted address and command are not in the scancode
+		if ((command ^ not_command) != 0xff) {
+			scancode = not_address << 24 | address << 16 |
+				   not_command << 8 | command;
+			protocol = RC_PROTO_NEC32;
+		} else if ((address ^ not_address) != 0xff) {
+			scancode = address << 16 | not_address << 8 | command;
+			protocol = RC_PROTO_NECX;
+		} else {
+			scancode = address << 8 | command;
+			protocol = RC_PROTO_NEC;
+		}
+		dec->nec.have_last = true;
+		dec->nec.last_protocol = protocol;
+		dec->nec.last_scancode = scancode;
+		decoded(dec, protocol, scancode, false, false);
+		return;
+	}
+
+	dec->nec.state = STATE_INACTIVE;
+}
+
+static void jvc_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned jvc_unit = 525000;
+	const unsigned unit = NS_TO_US(jvc_unit);
+	unsigned bits;
+
+	switch (dec->jvc.state) {
+	case STATE_CHECK_REPEAT:
+		// repeats are sent without header
+		if (pulse && eq_margin(duration, unit, unit / 2)) {
+			dec->jvc.is_repeat = true;
+			dec->jvc.count = 0;
+			dec->jvc.bits = 0;
+			dec->jvc.state = STATE_BIT_SPACE;
+			return;
+		}
+		/* fall through */
+	case STATE_INACTIVE:
+		if (!pulse || !eq_margin(duration, NS_TO_US(jvc_unit * 16), unit * 2))
+			break;
+		dec->jvc.is_repeat = false;
+		dec->jvc.count = 0;
+		dec->jvc.bits = 0;
+		dec->jvc.state = STATE_HEADER_SPACE;
+		return;
+	case STATE_HEADER_SPACE:
+		if (pulse || !eq_margin(duration, NS_TO_US(jvc_unit * 8), unit))
+			break;
+		dec->jvc.state = STATE_BIT_PULSE;
+		return;
+	case STATE_BIT_PULSE:
+		if (!pulse || !eq_margin(duration, unit, unit / 2))
+			break;
+		dec->jvc.state = STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_SPACE:
+		if (pulse)
+			break;
+		if (eq_margin(duration, NS_TO_US(jvc_unit * 3), unit / 2))
+			dec->jvc.bits |= 1U << dec->jvc.count;
+		else if (!eq_margin(duration, unit, unit / 2))
+			break;
+		dec->jvc.count++;
+		dec->jvc.state = dec->jvc.count == 16 ?
+			STATE_TRAILER_PULSE : STATE_BIT_PULSE;
+		return;
+	case STATE_TRAILER_PULSE:
+		if (!pulse || !eq_margin(duration, unit, unit / 2))
+			break;
+		dec->jvc.state = STATE_TRAILER_SPACE;
+		return;
+	case STATE_TRAILER_SPACE:
+		if (pulse || !geq_margin(duration, NS_TO_US(jvc_unit * 35), unit / 2))
+			break;
+		bits = dec->jvc.bits;
+		if (dec->jvc.is_repeat && bits != dec->jvc.last_bits)
+			break;
+		dec->jvc.last_bits = bits;
+		// the address is sent first
+		decoded(dec, RC_PROTO_JVC, (bits & 0xff) << 8 | bits >> 8,
+			false, dec->jvc.is_repeat);
+		dec->jvc.state = STATE_CHECK_REPEAT;
+		return;
+	}
+
+	dec->jvc.state = STATE_INACTIVE;
+}
+
+static const unsigned sanyo_unit = 562500;
+
+static void sanyo_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned unit = NS_TO_US(sanyo_unit);
+	unsigned address, command, not_command;
+
+	switch (dec->sanyo.state) {
+	case STATE_INACTIVE:
+		if (!pulse || !eq_margin(duration, NS_TO_US(sanyo_unit * 16), unit * 2))
+			return;
+		dec->sanyo.count = 0;
+		dec->sanyo.bits = 0;
+		dec->sanyo.state = STATE_HEADER_SPACE;
+		return;
+	case STATE_HEADER_SPACE:
+		if (pulse || !eq_margin(duration, NS_TO_US(sanyo_unit * 8), unit))
+			break;
+		dec->sanyo.state = STATE_BIT_PULSE;
+		return;
+	case STATE_BIT_PULSE:
+		if (!pulse || !eq_margin(duration, unit, unit / 2))
+			break;
+		dec->sanyo.state = STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_SPACE:
+		if (pulse)
+			break;
+		if (eq_margin(duration, NS_TO_US(sanyo_unit * 3), unit / 2))
+			dec->sanyo.bits |= 1ULL << dec->sanyo.count;
+		else if (!eq_margin(duration, unit, unit / 2))
+			break;
+		dec->sanyo.count++;
+		dec->sanyo.state = dec->sanyo.count == 42 ?
+			STATE_TRAILER_PULSE : STATE_BIT_PULSE;
+		return;
+	case STATE_TRAILER_PULSE:
+		if (!pulse || !eq_margin(duration, unit, unit / 2))
+			break;
+		dec->sanyo.state = STATE_TRAILER_SPACE;
+		return;
+	case STATE_TRAILER_SPACE:
+		if (pulse || !geq_margin(duration, NS_TO_US(sanyo_unit * 10), unit / 2))
+			break;
+		address = dec->sanyo.bits & 0x1fff;
+		command = (dec->sanyo.bits >> 26) & 0xff;
+		not_command = (dec->sanyo.bits >> 34) & 0xff;
+		// like the kernel, only the command is checked
+		if ((command ^ not_command) == 0xff)
+			decoded(dec, RC_PROTO_SANYO, address << 8 | command,
+				false, false);
+		break;
+	}
+
+	dec->sanyo.state = STATE_INACTIVE;
+}
+
+static void sharp_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned sharp_unit = 40000;
+	const unsigned bit_pulse = NS_TO_US(sharp_unit * 8);
+	const unsigned echo_space = NS_TO_US(sharp_unit * 1000);
+	unsigned msg, echo;
+
+	switch (dec->sharp.state) {
+	case STATE_INACTIVE:
+		if (!pulse || !eq_margin(duration, bit_pulse, bit_pulse / 2))
+			return;
+		dec->sharp.count = 0;
+		dec->sharp.bits = 0;
+		dec->sharp.state = STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_PULSE:
+		if (!pulse || !eq_margin(duration, bit_pulse, bit_pulse / 2))
+			break;
+		dec->sharp.state = STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_SPACE:
+		if (pulse)
+			break;
+		if (eq_margin(duration, NS_TO_US(sharp_unit * 42), bit_pulse))
+			dec->sharp.bits |= 1U << dec->sharp.count;
+		else if (!eq_margin(duration, NS_TO_US(sharp_unit * 17), bit_pulse))
+			break;
+		dec->sharp.count++;
+		dec->sharp.state = dec->sharp.count % 15 ?
+			STATE_BIT_PULSE : STATE_TRAILER_PULSE;
+		return;
+	case STATE_TRAILER_PULSE:
+		if (!pulse || !eq_margin(duration, bit_pulse, bit_pulse / 2))
+			break;
+		dec->sharp.state = dec->sharp.count == 15 ?
+			STATE_ECHO_SPACE : STATE_TRAILER_SPACE;
+		return;
+	case STATE_ECHO_SPACE:
+		if (pulse || !eq_margin(duration, echo_space, echo_space / 4))
+			break;
+		dec->sharp.state = STATE_BIT_PULSE;
+		return;
+	case STATE_TRAILER_SPACE:
+		if (pulse || !geq_margin(duration, NS_TO_US(sharp_unit * 125), bit_pulse / 2))
+			break;
+		/*
+		 * The echo has the same address, and the inverted command
+		 * and expansion/check bits.
+		 */
+		msg = dec->sharp.bits & 0x7fff;
+		echo = dec->sharp.bits >> 15;
+		if ((msg >> 13) == 1 && (msg ^ echo) == 0x7fe0)
+			decoded(dec, RC_PROTO_SHARP, (msg & 0x1f) << 8 | ((msg >> 5) & 0xff),
+				false, false);
+		break;
+	}
+
+	dec->sharp.state = STATE_INACTIVE;
+}
+
+static void sony_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned sony_unit = 600000;
+	const unsigned unit = NS_TO_US(sony_unit);
+	unsigned bits = dec->sony.bits;
+
+	switch (dec->sony.state) {
+	case STATE_INACTIVE:
+		if (!pulse || !eq_margin(duration, NS_TO_US(sony_unit * 4), unit / 2))
+			return;
+		dec->sony.count = 0;
+		dec->sony.bits = 0;
+		dec->sony.state = STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_PULSE:
+		if (!pulse)
+			break;
+		if (eq_margin(duration, NS_TO_US(sony_unit * 2), unit / 2))
+			dec->sony.bits |= 1U << dec->sony.count;
+		else if (!eq_margin(duration, unit, unit / 2))
+			break;
+		dec->sony.count++;
+		dec->sony.state = STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_SPACE:
+		if (pulse || !geq_margin(duration, unit, unit / 2))
+			break;
+		decrease_duration(&duration, unit);
+		if (!geq_margin(duration, unit, unit / 2)) {
+			dec->sony.state = STATE_BIT_PULSE;
+			return;
+		}
+		// a longer space ends the message
+		if (!geq_margin(duration, NS_TO_US(sony_unit * 10), unit / 2))
+			break;
+		switch (dec->sony.count) {
+		case 12:
+			decoded(dec, RC_PROTO_SONY12,
+				((bits >> 7) & 0x1f) << 16 | (bits & 0x7f), false, false);
+			break;
+		case 15:
+			decoded(dec, RC_PROTO_SONY15,
+				((bits >> 7) & 0xff) << 16 | (bits & 0x7f), false, false);
+			break;
+		case 20:
+			decoded(dec, RC_PROTO_SONY20,
+				((bits >> 7) & 0x1f) << 16 | ((bits >> 12) & 0xff) << 8 |
+				(bits & 0x7f), false, false);
+			break;
+		}
+		break;
+	}
+
+	dec->sony.state = STATE_INACTIVE;
+}
+
+static void rc5_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned rc5_unit = 888888;
+	const unsigned unit = NS_TO_US(rc5_unit);
+	unsigned bits = dec->rc5.bits;
+
+	if (!geq_margin(duration, unit, unit / 2))
+		goto out;
+
+	// a pulse or space may cover the halves of two bits
+again:
+	if (!geq_margin(duration, unit, unit / 2))
+		return;
+
+	switch (dec->rc5.state) {
+	case STATE_INACTIVE:
+		if (!pulse)
+			break;
+		// the first half of the start bit is a space
+		dec->rc5.state = STATE_BIT_START;
+		dec->rc5.count = 1;
+		dec->rc5.bits = 0;
+		decrease_duration(&duration, unit);
+		goto again;
+	case STATE_BIT_START:
+		if (!pulse && geq_margin(duration, NS_TO_US(rc5_unit * 6), unit / 2)) {
+			dec->rc5.state = STATE_FINISHED;
+			goto again;
+		}
+		if (!eq_margin(duration, unit, unit / 2))
+			break;
+		dec->rc5.bits <<= 1;
+		if (!pulse)
+			dec->rc5.bits |= 1;
+		dec->rc5.count++;
+		dec->rc5.state = STATE_BIT_END;
+		return;
+	case STATE_BIT_END:
+		dec->rc5.state = dec->rc5.count == 8 ?
+			STATE_CHECK_RC5X : STATE_BIT_START;
+		decrease_duration(&duration, unit);
+		goto again;
+	case STATE_CHECK_RC5X:
+		dec->rc5.is_rc5x = !pulse &&
+			geq_margin(duration, NS_TO_US(rc5_unit * 4), unit / 2);
+		if (dec->rc5.is_rc5x)
+			decrease_duration(&duration, NS_TO_US(rc5_unit * 4));
+		dec->rc5.state = STATE_BIT_START;
+		goto again;
+	case STATE_FINISHED:
+		if (pulse)
+			break;
+		dec->rc5.state = STATE_INACTIVE;
+		// the second start bit is the inverted 7th command bit
+		if (dec->rc5.is_rc5x && dec->rc5.count == 20)
+			decoded(dec, RC_PROTO_RC5X_20,
+				((bits >> 12) & 0x1f) << 16 |
+				(((bits >> 6) & 0x3f) | (bits & 0x40000 ? 0 : 0x40)) << 8 |
+				(bits & 0x3f), bits & 0x20000, false);
+		else if (!dec->rc5.is_rc5x && dec->rc5.count == 14)
+			decoded(dec, RC_PROTO_RC5,
+				((bits >> 6) & 0x1f) << 8 |
+				(bits & 0x3f) | (bits & 0x1000 ? 0 : 0x40),
+				bits & 0x800, false);
+		else if (!dec->rc5.is_rc5x && dec->rc5.count == 15)
+			decoded(dec, RC_PROTO_RC5_SZ, bits & 0x2fff,
+				bits & 0x1000, false);
+		return;
+	}
+
+out:
+	dec->rc5.state = STATE_INACTIVE;
+}
+
+static void rc6_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned rc6_unit = 444444;
+	const unsigned unit = NS_TO_US(rc6_unit);
+	unsigned mode = dec->rc6.header & 0x07;
+	unsigned scancode;
+	enum rc_proto protocol;
+	bool toggle;
+
+	if (!geq_margin(duration, unit, unit / 2))
+		goto out;
+
+	// a pulse or space may cover the halves of two bits
+again:
+	if (!geq_margin(duration, unit, unit / 2))
+		return;
+
+	switch (dec->rc6.state) {
+	case STATE_INACTIVE:
+		// larger margin, receivers take a while to adjust to the signal
+		if (!pulse || !eq_margin(duration, NS_TO_US(rc6_unit * 6), unit))
+			break;
+		dec->rc6.state = STATE_PREFIX_SPACE;
+		dec->rc6.count = 0;
+		return;
+	case STATE_PREFIX_SPACE:
+		if (pulse || !eq_margin(duration, NS_TO_US(rc6_unit * 2), unit / 2))
+			break;
+		dec->rc6.state = STATE_HEADER_BIT_START;
+		dec->rc6.header = 0;
+		return;
+	case STATE_HEADER_BIT_START:
+		if (!eq_margin(duration, unit, unit / 2))
+			break;
+		dec->rc6.header <<= 1;
+		if (pulse)
+			dec->rc6.header |= 1;
+		dec->rc6.count++;
+		dec->rc6.state = STATE_HEADER_BIT_END;
+		return;
+	case STATE_HEADER_BIT_END:
+		dec->rc6.state = dec->rc6.count == 4 ?
+			STATE_TOGGLE_START : STATE_HEADER_BIT_START;
+		decrease_duration(&duration, unit);
+		goto again;
+	case STATE_TOGGLE_START:
+		if (!eq_margin(duration, NS_TO_US(rc6_unit * 2), unit / 2))
+			break;
+		dec->rc6.toggle = pulse;
+		dec->rc6.state = STATE_TOGGLE_END;
+		return;
+	case STATE_TOGGLE_END:
+		// the start bit has to be set, and only mode 0 and 6A exist
+		mode = dec->rc6.header & 0x07;
+		if (!(dec->rc6.header & 0x08) || (mode != 0 && mode != 6))
+			break;
+		dec->rc6.wanted_bits = mode ? 128 : 16;
+		dec->rc6.count = 0;
+		dec->rc6.body = 0;
+		dec->rc6.state = STATE_BIT_START;
+		decrease_duration(&duration, NS_TO_US(rc6_unit * 2));
+		goto again;
+	case STATE_BIT_START:
+		if (eq_margin(duration, unit, unit / 2)) {
+			// discard bits that don't fit in the body
+			if (dec->rc6.count++ < 32) {
+				dec->rc6.body <<= 1;
+				if (pulse)
+					dec->rc6.body |= 1;
+			}
+			dec->rc6.state = STATE_BIT_END;
+			return;
+		}
+		// mode 6A has a variable length, ending in a long space
+		if (mode == 6 && !pulse &&
+		    geq_margin(duration, NS_TO_US(rc6_unit * 6), unit / 2)) {
+			dec->rc6.state = STATE_FINISHED;
+			goto again;
+		}
+		break;
+	case STATE_BIT_END:
+		dec->rc6.state = dec->rc6.count == dec->rc6.wanted_bits ?
+			STATE_FINISHED : STATE_BIT_START;
+		decrease_duration(&duration, unit);
+		goto again;
+	case STATE_FINISHED:
+		if (pulse)
+			break;
+		scancode = dec->rc6.body;
+		toggle = false;
+		if (mode == 0) {
+			protocol = RC_PROTO_RC6_0;
+			toggle = dec->rc6.toggle;
+		} else if (dec->rc6.count == 20) {
+			protocol = RC_PROTO_RC6_6A_20;
+		} else if (dec->rc6.count == 24) {
+			protocol = RC_PROTO_RC6_6A_24;
+		} else if (dec->rc6.count != 32) {
+			break;
+		} else if ((scancode & 0xffff0000) == 0x800f0000 ||
+			   (scancode & 0xffff0000) == 0x80340000 ||
+			   (scancode & 0xffff0000) == 0x80460000) {
+			// MCE, Zotac and Kathrein remotes have a toggle bit in the body
+			protocol = RC_PROTO_RC6_MCE;
+			toggle = scancode & 0x8000;
+			scancode &= ~0x8000;
+		} else {
+			protocol = RC_PROTO_RC6_6A_32;
+		}
+		dec->rc6.state = STATE_INACTIVE;
+		decoded(dec, protocol, scancode, toggle, false);
+		return;
+	}
+
+out:
+	dec->rc6.state = STATE_INACTIVE;
+}
+
+static void xbox_dvd_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	const unsigned bit_pulse = 550;
+	unsigned bits = dec->xbox_dvd.bits;
+
+	switch (dec->xbox_dvd.state) {
+	case STATE_INACTIVE:
+		if (!pulse || !eq_margin(duration, 4000, bit_pulse))
+			return;
+		dec->xbox_dvd.count = 0;
+		dec->xbox_dvd.bits = 0;
+		dec->xbox_dvd.state = STATE_HEADER_SPACE;
+		return;
+	case STATE_HEADER_SPACE:
+		if (pulse || !eq_margin(duration, 3900, bit_pulse))
+			break;
+		dec->xbox_dvd.state = STATE_BIT_PULSE;
+		return;
+	case STATE_BIT_PULSE:
+		if (!pulse || !eq_margin(duration, bit_pulse, bit_pulse / 2))
+			break;
+		dec->xbox_dvd.state = dec->xbox_dvd.count == 24 ?
+			STATE_TRAILER_SPACE : STATE_BIT_SPACE;
+		return;
+	case STATE_BIT_SPACE:
+		if (pulse)
+			break;
+		dec->xbox_dvd.bits <<= 1;
+		if (eq_margin(duration, 1900, bit_pulse / 2))
+			dec->xbox_dvd.bits |= 1;
+		else if (!eq_margin(duration, 900, bit_pulse / 2))
+			break;
+		dec->xbox_dvd.count++;
+		dec->xbox_dvd.state = STATE_BIT_PULSE;
+		return;
+	case STATE_TRAILER_SPACE:
+		if (pulse || !geq_margin(duration, 3900, bit_pulse))
+			break;
+		// the upper 12 bits are the inverted scancode
+		if ((((bits >> 12) ^ bits) & 0xfff) == 0xfff)
+			decoded(dec, RC_PROTO_XBOX_DVD, bits & 0xfff, false, false);
+		break;
+	}
+
+	dec->xbox_dvd.state = STATE_INACTIVE;
+}
+
+struct ir_decoder *ir_decoder_new(ir_decoded_fn fn, void *priv)
+{
+	struct ir_decoder *dec = calloc(1, sizeof(*dec));
+
+	if (!dec)
+		return NULL;
+
+	dec->fn = fn;
+	dec->priv = priv;
+	return dec;
+}
+
+void ir_decoder_free(struct ir_decoder *dec)
+{
+	free(dec);
+}
+
+void ir_decoder_reset(struct ir_decoder *dec)
+{
+	ir_decoded_fn fn = dec->fn;
+	void *priv = dec->priv;
+
+	memset(dec, 0, sizeof(*dec));
+	dec->fn = fn;
+	dec->priv = priv;
+}
+
+/*
+ * With the margins the kernel uses, a message in one protocol can also
+ * be valid in another; e.g. rc-6 is also valid sony, and sony is also
+ * valid rc-5. The decoders complete a message on the same space, so only
+ * report the first one, with the protocols with the most distinctive
+ * timings first.
+ */
+void ir_decode(struct ir_decoder *dec, bool pulse, unsigned duration)
+{
+	dec->decoded = false;
+	nec_decode(dec, pulse, duration);
+	jvc_decode(dec, pulse, duration);
+	sanyo_decode(dec, pulse, duration);
+	sharp_decode(dec, pulse, duration);
+	xbox_dvd_decode(dec, pulse, duration);
+	rc6_decode(dec, pulse, duration);
+	sony_decode(dec, pulse, duration);
+	rc5_decode(dec, pulse, duration);
+}
@@ -0,0 +1,21 @@
+
+#ifndef __IR_DECODE_H__
+#define __IR_DECODE_H__
+
+struct ir_decoded {
+	enum rc_proto protocol;
+	unsigned scancode;
+	bool toggle;
+	bool repeat;
+};
+
+typedef void (*ir_decoded_fn)(const struct ir_decoded *decoded, void *priv);
+
+struct ir_decoder;
+
+struct ir_decoder *ir_decoder_new(ir_decoded_fn fn, void *priv);
+void ir_decoder_free(struct ir_decoder *dec);
+void ir_decoder_reset(struct ir_decoder *dec);
+void ir_decode(struct ir_decoder *dec, bool pulse, unsigned duration);
+
+#endif
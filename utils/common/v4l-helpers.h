@@ -460,10 +460,19 @@ static inline int v4l_s_fd(struct v4l_fd *f, int fd, const char *devname, bool d
 	struct v4l2_ext_controls ec;
 	struct v4l2_queryctrl qc;
 	struct v4l2_selection sel;
+	struct v4l2_capability old_cap = f->cap;
+	bool same_node;
 
 	if (f->fd >= 0)
 		f->close(f);
 
+	/*
+	 * The probes below only depend on the driver, so they can be kept
+	 * when the same video node is reopened by the same driver instance.
+	 */
+	same_node = !f->is_subdev && !f->is_media && old_cap.driver[0] &&
+		    f->direct == direct && !strcmp(f->devname, devname);
+
 	f->fd = fd;
 	f->direct = direct;
 	if (fd < 0)
@@ -490,6 +499,13 @@ static inline int v4l_s_fd(struct v4l_fd *f, int fd, const char *devname, bool d
 	f->caps = v4l_capability_g_caps(&f->cap);
 	f->type = v4l_determine_type(f);
 
+	/*
+	 * QUERYCAP reports the driver version, so a rebuilt or reloaded
+	 * driver will invalidate the cached probe results.
+	 */
+	if (same_node && !memcmp(&old_cap, &f->cap, sizeof(old_cap)))
+		return f->fd;
+
 	f->have_query_ext_ctrl = v4l_ioctl(f, VIDIOC_QUERY_EXT_CTRL, &qec) == 0;
 	f->have_ext_ctrls = v4l_ioctl(f, VIDIOC_TRY_EXT_CTRLS, &ec) == 0;
 	f->have_next_ctrl = v4l_ioctl(f, VIDIOC_QUERYCTRL, &qc) == 0;
@@ -2611,8 +2611,19 @@ static void tpg_fill_plane_pattern(const struct tpg_data *tpg,
 	}
 }
 
-void tpg_fill_plane_buffer(struct tpg_data *tpg, v4l2_std_id std,
-			   unsigned p, u8 *vbuf)
+void tpg_prepare_fill(struct tpg_data *tpg)
+{
+	tpg_recalc(tpg);
+}
+
+/*
+ * Fill lines [first, last) of the composed image. The lines only depend
+ * on the tpg state and not on each other, so different line ranges of
+ * the same buffer can be filled concurrently, provided tpg_prepare_fill()
+ * was called first.
+ */
+void tpg_fill_plane_lines(const struct tpg_data *tpg, v4l2_std_id std,
+			  unsigned p, u8 *vbuf, unsigned first, unsigned last)
 {
 	struct tpg_draw_params params;
 	unsigned factor = V4L2_FIELD_HAS_T_OR_B(tpg->field) ? 2 : 1;
@@ -2620,11 +2631,13 @@ void tpg_fill_plane_buffer(struct tpg_data *tpg, v4l2_std_id std,
 	/* Coarse scaling with Bresenham */
 	unsigned int_part = (tpg->crop.height / factor) / tpg->compose.height;
 	unsigned fract_part = (tpg->crop.height / factor) % tpg->compose.height;
-	unsigned src_y = 0;
-	unsigned error = 0;
+	unsigned src_y = first * int_part +
+			 (first * fract_part) / tpg->compose.height;
+	unsigned error = (first * fract_part) % tpg->compose.height;
 	unsigned h;
 
-	tpg_recalc(tpg);
+	if (last > tpg->compose.height)
+		last = tpg->compose.height;
 
 	params.is_tv = std;
 	params.is_60hz = std & V4L2_STD_525_60;
@@ -2638,7 +2651,7 @@ void tpg_fill_plane_buffer(struct tpg_data *tpg, v4l2_std_id std,
 
 	vbuf += tpg_hdiv(tpg, p, tpg->compose.left);
 
-	for (h = 0; h < tpg->compose.height; h++) {
+	for (h = first; h < last; h++) {
 		unsigned buf_line;
 
 		params.frame_line = tpg_calc_frameline(tpg, src_y, tpg->field);
@@ -2694,6 +2707,13 @@ void tpg_fill_plane_buffer(struct tpg_data *tpg, v4l2_std_id std,
 	}
 }
 
+void tpg_fill_plane_buffer(struct tpg_data *tpg, v4l2_std_id std,
+			   unsigned p, u8 *vbuf)
+{
+	tpg_recalc(tpg);
+	tpg_fill_plane_lines(tpg, std, p, vbuf, 0, tpg->compose.height);
+}
+
 void tpg_fillbuffer(struct tpg_data *tpg, v4l2_std_id std, unsigned p, u8 *vbuf)
 {
 	unsigned offset = 0;
@@ -299,6 +299,9 @@ void tpg_gen_text(const struct tpg_data *tpg,
 void tpg_calc_text_basep(struct tpg_data *tpg,
 		u8 *basep[TPG_MAX_PLANES][2], unsigned p, u8 *vbuf);
 unsigned tpg_g_interleaved_plane(const struct tpg_data *tpg, unsigned buf_line);
+void tpg_prepare_fill(struct tpg_data *tpg);
+void tpg_fill_plane_lines(const struct tpg_data *tpg, v4l2_std_id std,
+			  unsigned p, u8 *vbuf, unsigned first, unsigned last);
 void tpg_fill_plane_buffer(struct tpg_data *tpg, v4l2_std_id std,
 			   unsigned p, u8 *vbuf);
 void tpg_fillbuffer(struct tpg_data *tpg, v4l2_std_id std,
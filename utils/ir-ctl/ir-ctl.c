@@ -25,10 +25,12 @@
 #include <fcntl.h>
 #include <argp.h>
 #include <sysexits.h>
+#include <time.h>
 
 #include <linux/lirc.h>
 
 #include "ir-encode.h"
+#include "ir-decode.h"
 #include "keymap.h"
 #include "bpf_encoder.h"
 
@@ -97,6 +99,9 @@ struct arguments {
 	bool receive;
 	bool verbose;
 	bool mode2;
+	bool decode;
+	const char *decode_file;
+	const char *batch_file;
 	struct keymap *keymap;
 	struct send *send;
 	bool oneshot;
@@ -122,6 +127,7 @@ static const struct argp_option options[] = {
 		{ .doc = N_("Receiving options:") },
 	{ "one-shot",	'1',	0,		0,	N_("end receiving after first message") },
 	{ "mode2",	2,	0,		0,	N_("output in mode2 format") },
+	{ "decode",	3,	N_("FILE"),	OPTION_ARG_OPTIONAL, N_("decode received IR, or IR in FILE, to scancodes") },
 	{ "wideband",	'w',	0,		0,	N_("use wideband receiver aka learning mode") },
 	{ "narrowband",	'n',	0,		0,	N_("use narrowband receiver, disable learning mode") },
 	{ "carrier-range", 'R', N_("RANGE"),	0,	N_("set receiver carrier range") },
@@ -134,6 +140,7 @@ static const struct argp_option options[] = {
 	{ "duty-cycle",	'D',	N_("DUTY"),	0,	N_("set send duty cycle") },
 	{ "emitters",	'e',	N_("EMITTERS"),	0,	N_("set send emitters") },
 	{ "gap",	'g',	N_("GAP"),	0,	N_("set gap between files or scancodes") },
+	{ "batch",	4,	N_("BATCH"),	0,	N_("send IR messages listed in BATCH file") },
 	{ }
 };
 
@@ -143,6 +150,8 @@ static const char args_doc[] = N_(
 	"--send [file to send]\n"
 	"--scancode [scancode to send]\n"
 	"--keycode [keycode to send]\n"
+	"--decode=[file to decode]\n"
+	"--batch [batch file to send]\n"
 	"[to set lirc option]");
 
 static const char doc[] = N_(
@@ -159,7 +168,9 @@ static const char doc[] = N_(
 	"  TIMEOUT  - set length of space before receiving stops in microseconds\n"
 	"  KEYCODE  - key code in keymap\n"
 	"  SCANCODE - protocol:scancode, e.g. nec:0xa814\n"
-	"  KEYMAP   - a rc keymap file from which to send keys\n\n"
+	"  KEYMAP   - a rc keymap file from which to send keys\n"
+	"  BATCH    - a file with one send, scancode, keycode, gap, repeat or end\n"
+	"             command per line; - for standard input\n\n"
 	"Note that most lirc setting have global state, i.e. the device will remain\n"
 	"in this state until set otherwise.");
 
@@ -591,14 +602,14 @@ static error_t parse_opt(int k, char *arg, struct argp_state *state)
 
 	switch (k) {
 	case 'f':
-		if (arguments->receive || arguments->send)
-			argp_error(state, _("features can not be combined with receive or send option"));
+		if (arguments->receive || arguments->send || arguments->batch_file)
+			argp_error(state, _("features can not be combined with receive, send or batch option"));
 		arguments->features = true;
 		break;
 	// receiving
 	case 'r':
-		if (arguments->features || arguments->send)
-			argp_error(state, _("receive can not be combined with features or send option"));
+		if (arguments->features || arguments->send || arguments->batch_file)
+			argp_error(state, _("receive can not be combined with features, send or batch option"));
 
 		arguments->receive = true;
 		break;
@@ -608,6 +619,10 @@ static error_t parse_opt(int k, char *arg, struct argp_state *state)
 	case 2:
 		arguments->mode2 = true;
 		break;
+	case 3:
+		arguments->decode = true;
+		arguments->decode_file = arg;
+		break;
 	case 'v':
 		arguments->verbose = true;
 		break;
@@ -672,6 +687,11 @@ static error_t parse_opt(int k, char *arg, struct argp_state *state)
 		if (!strtoint(arg, "", &arguments->gap) || arguments->gap == 0)
 			argp_error(state, _("cannot parse gap `%s'"), arg);
 		break;
+	case 4:
+		if (arguments->receive || arguments->features)
+			argp_error(state, _("batch can not be combined with receive or features option"));
+		arguments->batch_file = arg;
+		break;
 	case 'D':
 		if (!strtoint(arg, "%", &arguments->duty) ||
 		     arguments->duty == 0 || arguments->duty >= 100)
@@ -725,12 +745,18 @@ static error_t parse_opt(int k, char *arg, struct argp_state *state)
 		if (!arguments->work_to_do)
 			argp_usage(state);
 
+		if (arguments->decode_file &&
+		    (arguments->receive || arguments->send || arguments->features ||
+		     arguments->batch_file))
+			argp_error(state, _("decoding a file can not be combined with receive, send, batch or features option"));
+
 		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
 
-	if (k != '1' && k != 'd' && k != 'v' && k != 'k' && k != 2)
+	if (k != '1' && k != 'd' && k != 'v' && k != 'k' && k != 2 &&
+	    (k != 3 || arg))
 		arguments->work_to_do = true;
 
 	return 0;
@@ -1116,6 +1142,590 @@ static int lirc_send(struct arguments *args, int fd, unsigned features, struct s
 	return 0;
 }
 
+/*
+ * A batch is a script of IR messages to send. Every message is encoded to
+ * pulses and spaces when the script is read, so that while sending, all
+ * that is left to do is wait until the message is due and write it to the
+ * lirc device, which stays open and in pulse mode throughout.
+ */
+enum batch_ty {
+	BATCH_SEND,
+	BATCH_GAP,
+	BATCH_REPEAT,
+	BATCH_END,
+};
+
+#define BATCH_MAX_DEPTH 16
+
+struct batch_op {
+	enum batch_ty ty;
+	int lineno;
+	union {
+		struct send *send;
+		unsigned gap;
+		struct {
+			// for repeat, the op after its end; for end, its repeat
+			unsigned count;
+			unsigned jump;
+		};
+	};
+};
+
+struct batch {
+	const char *fname;
+	struct batch_op *ops;
+	unsigned nr_ops;
+};
+
+static void free_batch(struct batch *batch)
+{
+	unsigned i;
+
+	for (i = 0; i < batch->nr_ops; i++) {
+		if (batch->ops[i].ty == BATCH_SEND)
+			free(batch->ops[i].send);
+	}
+
+	free(batch->ops);
+}
+
+// Convert a message to pulses and spaces, so it is ready to be written
+static struct send *batch_encode(struct arguments *args, struct send *s,
+				 const char *fname, int lineno)
+{
+	if (s->ty == SEND_KEYCODE) {
+		struct send *k;
+
+		if (!args->keymap) {
+			fprintf(stderr, _("%s:%d: error: no keymap specified\n"), fname, lineno);
+			return NULL;
+		}
+
+		k = convert_keycode(args->keymap, s->keycode);
+		if (!k)
+			return NULL;
+
+		free(s);
+		s = k;
+	}
+
+	if (s->ty == SEND_SCANCODE) {
+		enum rc_proto proto = s->protocol;
+		unsigned scancode = s->scancode;
+
+		if (!protocol_encoder_available(proto)) {
+			fprintf(stderr, _("%s:%d: error: no encoder available for `%s'\n"),
+				fname, lineno, protocol_name(proto));
+			free(s);
+			return NULL;
+		}
+
+		s->ty = SEND_RAW;
+		s->len = protocol_encode(proto, scancode, s->buf);
+		s->carrier = protocol_carrier(proto);
+	}
+
+	if (args->carrier != UNSET && s->carrier != UNSET && s->carrier != 0)
+		fprintf(stderr, _("warning: %s:%d: carrier specified but overwritten on command line\n"), fname, lineno);
+
+	return s;
+}
+
+static bool batch_add(struct batch *batch, struct batch_op *op)
+{
+	struct batch_op *ops;
+
+	// grow in chunks, scripts are usually short
+	if ((batch->nr_ops % 64) == 0) {
+		ops = realloc(batch->ops, (batch->nr_ops + 64) * sizeof(*ops));
+		if (!ops) {
+			fprintf(stderr, _("Failed to allocate memory\n"));
+			return false;
+		}
+		batch->ops = ops;
+	}
+
+	batch->ops[batch->nr_ops++] = *op;
+
+	return true;
+}
+
+/*
+ * Read a batch script. Each line has one command:
+ *
+ *	send FILE
+ *	scancode PROTOCOL:SCANCODE
+ *	keycode KEYCODE
+ *	gap MICROSECONDS
+ *	repeat COUNT
+ *	end
+ */
+static int read_batch(struct arguments *args, const char *fname, struct batch *batch)
+{
+	static const char whitespace[] = " \n\r\t";
+	unsigned stack[BATCH_MAX_DEPTH];
+	unsigned depth = 0;
+	char *line = NULL;
+	size_t line_size;
+	int lineno = 0;
+	FILE *input;
+	int rc = EX_DATAERR;
+
+	memset(batch, 0, sizeof(*batch));
+	batch->fname = fname;
+
+	if (strcmp(fname, "-")) {
+		input = fopen(fname, "r");
+		if (!input) {
+			fprintf(stderr, _("%s: could not open: %m\n"), fname);
+			return EX_NOINPUT;
+		}
+	} else {
+		input = stdin;
+	}
+
+	while (getline(&line, &line_size, input) > 0) {
+		struct batch_op op = { .lineno = ++lineno };
+		char *keyword, *arg, *saveptr;
+		struct send *s = NULL;
+
+		keyword = strtok_r(line, whitespace, &saveptr);
+		if (keyword == NULL || *keyword == '#' ||
+		    (keyword[0] == '/' && keyword[1] == '/'))
+			continue;
+
+		arg = strtok_r(NULL, whitespace, &saveptr);
+
+		if (strcmp(keyword, "end") == 0) {
+			if (depth == 0) {
+				fprintf(stderr, _("%s:%d: error: end without repeat\n"), fname, lineno);
+				goto out;
+			}
+			op.ty = BATCH_END;
+			op.jump = stack[--depth];
+			batch->ops[op.jump].jump = batch->nr_ops + 1;
+			if (!batch_add(batch, &op))
+				goto out;
+			continue;
+		}
+
+		if (!arg) {
+			fprintf(stderr, _("%s:%d: error: missing argument for `%s'\n"), fname, lineno, keyword);
+			goto out;
+		}
+
+		if (strcmp(keyword, "send") == 0) {
+			char *name = strdup(arg);
+
+			if (name)
+				s = read_file(args, name);
+			if (!s) {
+				free(name);
+				goto out;
+			}
+		} else if (strcmp(keyword, "scancode") == 0) {
+			s = read_scancode(arg);
+			if (!s)
+				goto out;
+		} else if (strcmp(keyword, "keycode") == 0) {
+			s = malloc(sizeof(*s) + strlen(arg));
+			if (!s) {
+				fprintf(stderr, _("Failed to allocate memory\n"));
+				goto out;
+			}
+			strcpy(s->keycode, arg);
+			s->ty = SEND_KEYCODE;
+		} else if (strcmp(keyword, "gap") == 0) {
+			op.ty = BATCH_GAP;
+			if (!strtoint(arg, "", &op.gap)) {
+				fprintf(stderr, _("%s:%d: error: cannot parse gap `%s'\n"), fname, lineno, arg);
+				goto out;
+			}
+		} else if (strcmp(keyword, "repeat") == 0) {
+			op.ty = BATCH_REPEAT;
+			if (!strtoint(arg, "", &op.count) || op.count == 0) {
+				fprintf(stderr, _("%s:%d: error: cannot parse repeat count `%s'\n"), fname, lineno, arg);
+				goto out;
+			}
+			if (depth == BATCH_MAX_DEPTH) {
+				fprintf(stderr, _("%s:%d: error: repeat nested more than %d deep\n"), fname, lineno, BATCH_MAX_DEPTH);
+				goto out;
+			}
+			stack[depth++] = batch->nr_ops;
+		} else {
+			fprintf(stderr, _("%s:%d: error: unknown command `%s'\n"), fname, lineno, keyword);
+			goto out;
+		}
+
+		if (s) {
+			s = batch_encode(args, s, fname, lineno);
+			if (!s)
+				goto out;
+			op.ty = BATCH_SEND;
+			op.send = s;
+		}
+
+		if (!batch_add(batch, &op)) {
+			free(s);
+			goto out;
+		}
+	}
+
+	if (depth) {
+		fprintf(stderr, _("%s: error: repeat without end\n"), fname);
+		goto out;
+	}
+
+	rc = 0;
+out:
+	free(line);
+	if (input != stdin)
+		fclose(input);
+	if (rc)
+		free_batch(batch);
+
+	return rc;
+}
+
+static long timespec_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000L +
+	       (a->tv_nsec - b->tv_nsec) / 1000;
+}
+
+static void timespec_add_us(struct timespec *ts, unsigned long us)
+{
+	ts->tv_sec += us / 1000000;
+	ts->tv_nsec += (us % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/*
+ * Send a batch. Every message is scheduled on the monotonic clock relative
+ * to when the previous one was due, not when it was actually sent, so
+ * that timing errors do not accumulate. The difference between when a
+ * message was due and when it was written is reported as jitter.
+ */
+static int lirc_batch(struct arguments *args, int fd, unsigned features,
+		      struct batch *batch)
+{
+	const char *dev = args->device;
+	unsigned counts[BATCH_MAX_DEPTH];
+	unsigned depth = 0, pc = 0;
+	unsigned carrier = UNSET, gap = UNSET;
+	unsigned long messages = 0, late = 0;
+	long jitter, prev_jitter = 0;
+	long jitter_min = 0, jitter_max = 0, interval_max = 0;
+	double jitter_sum = 0;
+	struct timespec due, start, first;
+	int mode = LIRC_MODE_PULSE;
+	ssize_t ret;
+
+	if (!(features & LIRC_CAN_SEND_PULSE)) {
+		fprintf(stderr, _("%s: device cannot send\n"), dev);
+		return EX_UNAVAILABLE;
+	}
+
+	if (ioctl(fd, LIRC_SET_SEND_MODE, &mode)) {
+		fprintf(stderr, _("%s: cannot set send mode\n"), dev);
+		return EX_UNAVAILABLE;
+	}
+
+	while (pc < batch->nr_ops) {
+		struct batch_op *op = &batch->ops[pc++];
+		struct send *s = op->send;
+		unsigned long duration = 0;
+		unsigned i, this_gap;
+
+		switch (op->ty) {
+		case BATCH_REPEAT:
+			counts[depth++] = op->count;
+			continue;
+		case BATCH_END:
+			if (--counts[depth - 1])
+				pc = op->jump + 1;
+			else
+				depth--;
+			continue;
+		case BATCH_GAP:
+			// consecutive gaps add up
+			gap = (gap == UNSET ? 0 : gap) + op->gap;
+			continue;
+		case BATCH_SEND:
+			break;
+		}
+
+		this_gap = gap == UNSET ? args->gap : gap;
+		if (messages) {
+			timespec_add_us(&due, this_gap);
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+					       &due, NULL) == EINTR);
+		}
+		gap = UNSET;
+
+		if (args->carrier == UNSET && s->carrier != UNSET &&
+		    s->carrier != 0 && s->carrier != carrier) {
+			lirc_set_send_carrier(fd, dev, features, s->carrier);
+			carrier = s->carrier;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		ret = TEMP_FAILURE_RETRY(write(fd, s->buf, s->len * sizeof(unsigned)));
+		if (ret < 0) {
+			fprintf(stderr, _("%s: failed to send: %m\n"), dev);
+			return EX_IOERR;
+		}
+
+		if (ret < s->len * sizeof(unsigned)) {
+			fprintf(stderr, _("warning: %s: sent %zd out %u edges\n"),
+				dev, ret / sizeof(unsigned), s->len);
+			return EX_IOERR;
+		}
+
+		if (messages == 0) {
+			first = start;
+			due = start;
+		}
+
+		jitter = timespec_diff_us(&start, &due);
+		if (messages) {
+			long interval = labs(jitter - prev_jitter);
+
+			if (messages == 1 || jitter < jitter_min)
+				jitter_min = jitter;
+			if (messages == 1 || jitter > jitter_max)
+				jitter_max = jitter;
+			if (interval > interval_max)
+				interval_max = interval;
+			jitter_sum += jitter;
+		}
+
+		if (args->verbose)
+			printf("%s:%d: sent %u edges, %ld µs late\n",
+			       batch->fname, op->lineno, s->len, jitter);
+
+		for (i = 0; i < s->len; i++)
+			duration += s->buf[i];
+
+		/*
+		 * If we fell so far behind that most of the gap was eaten up,
+		 * start the schedule over from now.
+		 */
+		if (this_gap && jitter > this_gap / 2) {
+			due = start;
+			late++;
+			jitter = 0;
+		}
+
+		timespec_add_us(&due, duration);
+		prev_jitter = jitter;
+		messages++;
+	}
+
+	if (messages == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	printf(_("Sent %lu messages in %.3f seconds\n"), messages,
+	       timespec_diff_us(&start, &first) / 1e6);
+	if (messages > 1) {
+		printf(_("Jitter: min %ld µs, average %.1f µs, max %ld µs\n"),
+		       jitter_min, jitter_sum / (messages - 1), jitter_max);
+		printf(_("Interval error: max %ld µs\n"), interval_max);
+	}
+	if (late)
+		fprintf(stderr, _("warning: %lu messages sent more than half their gap late, schedule restarted\n"),
+			late);
+
+	return 0;
+}
+
+struct decode_state {
+	struct ir_decoder *dec;
+	struct keymap *keymap;
+	unsigned long samples;
+	unsigned long messages;
+	unsigned long long duration;
+	struct timespec start;
+};
+
+static const char *decoded_keycode(struct keymap *map, const struct ir_decoded *d)
+{
+	for (; map; map = map->next) {
+		const char *proto_str = map->variant ?: map->protocol;
+		struct scancode_entry *se;
+		enum rc_proto proto;
+
+		if (!proto_str)
+			continue;
+
+		// a keymap for e.g. nec or rc6 is for all its variants
+		if ((!protocol_match(proto_str, &proto) || proto != d->protocol) &&
+		    strncasecmp(protocol_name(d->protocol), proto_str, strlen(proto_str)))
+			continue;
+
+		for (se = map->scancode; se; se = se->next) {
+			if (se->scancode == d->scancode)
+				return se->keycode;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Print decoded IR in the send file format, so the output can be sent
+ * again with --send.
+ */
+static void print_decoded(const struct ir_decoded *d, void *priv)
+{
+	struct decode_state *state = priv;
+	const char *keycode = decoded_keycode(state->keymap, d);
+
+	state->messages++;
+
+	printf("scancode %s:0x%x", protocol_name(d->protocol), d->scancode);
+	if (keycode || d->repeat || d->toggle)
+		printf(" #%s%s%s%s", keycode ? " " : "", keycode ?: "",
+		       d->repeat ? " repeat" : "", d->toggle ? " toggle" : "");
+	printf("\n");
+}
+
+static int decode_start(struct arguments *args, struct decode_state *state)
+{
+	memset(state, 0, sizeof(*state));
+
+	state->dec = ir_decoder_new(print_decoded, state);
+	if (!state->dec) {
+		fprintf(stderr, _("Failed to allocate memory\n"));
+		return EX_OSERR;
+	}
+
+	state->keymap = args->keymap;
+	clock_gettime(CLOCK_MONOTONIC, &state->start);
+
+	return 0;
+}
+
+static void decode_sample(struct decode_state *state, bool pulse, unsigned duration)
+{
+	state->samples++;
+	state->duration += duration;
+	ir_decode(state->dec, pulse, duration);
+}
+
+static void decode_stop(struct arguments *args, struct decode_state *state)
+{
+	struct timespec end;
+	double elapsed;
+
+	ir_decoder_free(state->dec);
+
+	if (!args->verbose)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed = (end.tv_sec - state->start.tv_sec) +
+		  (end.tv_nsec - state->start.tv_nsec) / 1e9;
+
+	fprintf(stderr, _("decoded %lu messages from %lu samples, %.3f hours of IR, in %.3f seconds (%.0f samples/s)\n"),
+		state->messages, state->samples, state->duration / 3600e6,
+		elapsed, elapsed > 0 ? state->samples / elapsed : 0.0);
+}
+
+/*
+ * Decode a file in any of the formats --receive produces. Unlike --send,
+ * there is no limit to the length of the file, so long captures can be
+ * decoded in one go.
+ */
+static int decode_file(struct arguments *args, const char *fname)
+{
+	static const char whitespace[] = " \n\r\t";
+	struct decode_state state;
+	bool expect_pulse = true;
+	char *line = NULL;
+	size_t line_size;
+	int lineno = 0;
+	FILE *input;
+	int rc;
+
+	if (strcmp(fname, "-")) {
+		input = fopen(fname, "r");
+		if (!input) {
+			fprintf(stderr, _("%s: could not open: %m\n"), fname);
+			return EX_NOINPUT;
+		}
+	} else {
+		input = stdin;
+	}
+
+	rc = decode_start(args, &state);
+	if (rc)
+		goto out;
+
+	while (getline(&line, &line_size, input) > 0) {
+		char *p, *saveptr, *comment;
+
+		lineno++;
+		comment = strchr(line, '#');
+		if (comment)
+			*comment++ = 0;
+
+		for (p = strtok_r(line, whitespace, &saveptr); p;
+		     p = strtok_r(NULL, whitespace, &saveptr)) {
+			bool pulse = expect_pulse;
+			unsigned duration;
+
+			if (*p == '+' || *p == '-') {
+				pulse = *p++ == '+';
+			} else if (!strcmp(p, "pulse") || !strcmp(p, "space") ||
+				   !strcmp(p, "timeout")) {
+				pulse = *p == 'p';
+				p = strtok_r(NULL, whitespace, &saveptr);
+			} else if (!strcmp(p, "carrier")) {
+				strtok_r(NULL, whitespace, &saveptr);
+				continue;
+			} else if (!strcmp(p, "overflow")) {
+				ir_decoder_reset(state.dec);
+				expect_pulse = true;
+				continue;
+			}
+
+			if (!p || !strtoint(p, "", &duration) || duration == 0) {
+				fprintf(stderr, _("error: %s:%d: invalid pulse or space `%s'\n"), fname, lineno, p ?: "");
+				rc = EX_DATAERR;
+				goto out_stop;
+			}
+
+			decode_sample(&state, pulse, duration);
+			expect_pulse = !pulse;
+		}
+
+		// --receive marks a receiver overflow with a comment
+		for (p = comment ? strtok_r(comment, " ,\n\r\t", &saveptr) : NULL; p;
+		     p = strtok_r(NULL, " ,\n\r\t", &saveptr)) {
+			if (!strcmp(p, "overflow")) {
+				ir_decoder_reset(state.dec);
+				expect_pulse = true;
+			}
+		}
+	}
+
+	// the file may end without the trailing space
+	ir_decode(state.dec, false, IR_DEFAULT_TIMEOUT);
+out_stop:
+	decode_stop(args, &state);
+out:
+	free(line);
+	if (input != stdin)
+		fclose(input);
+
+	return rc;
+}
+
 int lirc_receive(struct arguments *args, int fd, unsigned features)
 {
 	char *dev = args->device;
@@ -1138,6 +1748,14 @@ int lirc_receive(struct arguments *args, int fd, unsigned features)
 	bool keep_reading = true;
 	bool leading_space = true;
 	unsigned carrier = 0;
+	struct decode_state state;
+
+	if (args->decode) {
+		rc = decode_start(args, &state);
+		if (rc)
+			return rc;
+		rc = EX_IOERR;
+	}
 
 	while (keep_reading) {
 		ssize_t ret = TEMP_FAILURE_RETRY(read(fd, buf, sizeof(buf)));
@@ -1166,11 +1784,29 @@ int lirc_receive(struct arguments *args, int fd, unsigned features)
 			if (args->oneshot &&
 				(msg == LIRC_MODE2_TIMEOUT ||
 				(msg == LIRC_MODE2_SPACE && val > 19000))) {
+				if (args->decode)
+					decode_sample(&state, false, val);
 				keep_reading = false;
 				break;
 			}
 
-			if (args->mode2) {
+			if (args->decode) {
+				switch (msg) {
+				case LIRC_MODE2_TIMEOUT:
+					leading_space = true;
+					/* fall through */
+				case LIRC_MODE2_SPACE:
+					decode_sample(&state, false, val);
+					break;
+				case LIRC_MODE2_PULSE:
+					decode_sample(&state, true, val);
+					break;
+				case LIRC_MODE2_OVERFLOW:
+					ir_decoder_reset(state.dec);
+					leading_space = true;
+					break;
+				}
+			} else if (args->mode2) {
 				switch (msg) {
 				case LIRC_MODE2_TIMEOUT:
 					printf("timeout %u\n", val);
@@ -1226,6 +1862,8 @@ int lirc_receive(struct arguments *args, int fd, unsigned features)
 
 	rc = 0;
 err:
+	if (args->decode)
+		decode_stop(args, &state);
 	return rc;
 }
 
@@ -1245,12 +1883,27 @@ int main(int argc, char *argv[])
 
 	argp_parse(&argp, argc, argv, 0, 0, &args);
 
+	if (args.decode_file) {
+		int rc = decode_file(&args, args.decode_file);
+
+		free_keymap(args.keymap);
+		return rc;
+	}
+
 	if (args.device == NULL)
 		args.device = "/dev/lirc0";
 
+	struct batch batch = { };
 	int rc, fd;
 	unsigned features;
 
+	// read and encode the whole batch before touching the device
+	if (args.batch_file) {
+		rc = read_batch(&args, args.batch_file, &batch);
+		if (rc)
+			exit(rc);
+	}
+
 	fd = open_lirc(args.device, &features);
 	if (fd < 0)
 		exit(EX_NOINPUT);
@@ -1292,6 +1945,15 @@ int main(int argc, char *argv[])
 		s = next;
 	}
 
+	if (args.batch_file) {
+		rc = lirc_batch(&args, fd, features, &batch);
+		free_batch(&batch);
+		if (rc) {
+			close(fd);
+			exit(rc);
+		}
+	}
+
 	if (args.receive) {
 		rc = lirc_receive(&args, fd, features);
 		if (rc) {
@@ -0,0 +1 @@
+../common/ir-decode.h
\ No newline at end of file
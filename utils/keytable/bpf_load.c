@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <linux/bpf.h>
@@ -17,6 +18,7 @@
 #include <argp.h>
 #include "keymap.h"
 #include "bpf_load.h"
+#include "bpf_protocols/defaults.h"
 
 #ifdef ENABLE_NLS
 # define _(string) gettext(string)
@@ -41,6 +43,73 @@ struct raw_pattern {
 int max_length;
 int trail_space;
 
+// This should match the struct in the combined BPF decoder
+enum decoder_type {
+	DECODER_NONE,
+	DECODER_PULSE_DISTANCE,
+	DECODER_PULSE_LENGTH,
+	DECODER_MANCHESTER,
+};
+
+struct decoder_param {
+	int type;
+	int rc_protocol;
+	int margin;
+	int header_pulse;
+	int header_space;
+	int repeat_pulse;
+	int repeat_space;
+	int bit_pulse;
+	int bit_space;
+	int bit_0_pulse;
+	int bit_1_pulse;
+	int bit_0_space;
+	int bit_1_space;
+	int trailer_pulse;
+	int bits;
+	int reverse;
+	int header_optional;
+	int zero_pulse;
+	int zero_space;
+	int one_pulse;
+	int one_space;
+	int toggle_bit;
+	int scancode_mask;
+};
+
+struct decoder_default {
+	const char *name;
+	size_t offset;
+	int value;
+};
+
+#define DEFAULT(n, v) { #n, offsetof(struct decoder_param, n), v },
+
+static const struct decoder_default pulse_distance_defaults[] = {
+	PULSE_DISTANCE_DEFAULTS(DEFAULT)
+	{ }
+};
+
+static const struct decoder_default pulse_length_defaults[] = {
+	PULSE_LENGTH_DEFAULTS(DEFAULT)
+	{ }
+};
+
+static const struct decoder_default manchester_defaults[] = {
+	MANCHESTER_DEFAULTS(DEFAULT)
+	{ }
+};
+
+static const struct {
+	const char *name;
+	enum decoder_type type;
+	const struct decoder_default *defaults;
+} combined_decoders[] = {
+	{ "pulse_distance", DECODER_PULSE_DISTANCE, pulse_distance_defaults },
+	{ "pulse_length", DECODER_PULSE_LENGTH, pulse_length_defaults },
+	{ "manchester", DECODER_MANCHESTER, manchester_defaults },
+};
+
 char bpf_log_buf[LOG_BUF_SIZE];
 extern int debug;
 
@@ -58,6 +127,9 @@ struct bpf_file {
 	int strtabidx;
 	Elf_Data *symbols;
 	struct protocol_param *param;
+	struct bpf_combined *combined;
+	int nr_combined;
+	const char *pin_path;
 	char name[128];
 };
 
@@ -85,6 +157,38 @@ static int load_and_attach(int lirc_fd, struct bpf_file *bpf_file, struct bpf_in
 		return -1;
 	}
 
+	// Failing to pin only means the program is loaded again next time
+	if (bpf_file->pin_path) {
+		if (mkdir(BPF_PIN_DIR, 0700) && errno != EEXIST) {
+			if (debug)
+				printf(_("cannot create %s: %m\n"), BPF_PIN_DIR);
+		} else if (bpf_obj_pin(fd, bpf_file->pin_path)) {
+			if (debug)
+				printf(_("cannot pin %s: %m\n"), bpf_file->pin_path);
+		}
+	}
+
+	return 0;
+}
+
+static int attach_pinned(const char *pin_path, int lirc_fd)
+{
+	int fd, err;
+
+	fd = bpf_obj_get(pin_path);
+	if (fd < 0)
+		return -1;
+
+	err = bpf_prog_attach(fd, lirc_fd, BPF_LIRC_MODE2, 0);
+	close(fd);
+	if (err) {
+		printf(_("bpf_prog_attach: err=%m\n"));
+		return -1;
+	}
+
+	if (debug)
+		printf(_("attached pinned program %s\n"), pin_path);
+
 	return 0;
 }
 
@@ -163,6 +267,85 @@ static int build_raw_map(struct bpf_map_data *map, struct raw_entry *raw, int nu
 	return fd;
 }
 
+bool bpf_combinable(const char *name)
+{
+	int i;
+
+	for (i = 0; i < sizeof(combined_decoders) / sizeof(combined_decoders[0]); i++) {
+		if (!strcmp(combined_decoders[i].name, name))
+			return true;
+	}
+
+	return false;
+}
+
+static int build_param_map(struct bpf_map_data *map, struct bpf_combined *combined,
+			   int count, int numa_node)
+{
+	struct decoder_param p;
+	int fd, key, i, value;
+	LIBBPF_OPTS(bpf_map_create_opts, opts,
+		.map_flags = map->def.map_flags,
+		.numa_node = numa_node,
+	);
+
+	if (map->def.value_size != sizeof(p) || count > map->def.max_entries) {
+		printf(_("combined decoder does not match ir-keytable\n"));
+		return -1;
+	}
+
+	fd = bpf_map_create(map->def.type,
+			    map->name,
+			    map->def.key_size,
+			    map->def.value_size,
+			    map->def.max_entries,
+			    &opts);
+	if (fd < 0) {
+		printf(_("failed to create a map: %d %s\n"),
+		       errno, strerror(errno));
+		return -1;
+	}
+
+	for (key = 0; key < count; key++) {
+		const struct decoder_default *d = NULL;
+
+		memset(&p, 0, sizeof(p));
+
+		for (i = 0; i < sizeof(combined_decoders) / sizeof(combined_decoders[0]); i++) {
+			if (!strcmp(combined_decoders[i].name, combined[key].name)) {
+				p.type = combined_decoders[i].type;
+				d = combined_decoders[i].defaults;
+				break;
+			}
+		}
+
+		if (!d) {
+			printf(_("protocol %s cannot be combined\n"), combined[key].name);
+			close(fd);
+			return -1;
+		}
+
+		for (; d->name; d++) {
+			if (bpf_param(combined[key].param, d->name, &value))
+				value = d->value;
+
+			if (debug)
+				printf(_("decoder %d: %s %s=%d\n"), key, combined[key].name, d->name, value);
+
+			*(int*)((unsigned char*)&p + d->offset) = value;
+		}
+
+		if (bpf_map_update_elem(fd, &key, &p, BPF_ANY)) {
+			printf(_("failed to update param map: %d %s\n"),
+			       errno, strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
+	return fd;
+}
+
 static int load_maps(struct bpf_file *bpf_file, struct raw_entry *raw)
 {
 	struct bpf_map_data *maps = bpf_file->map_data;
@@ -189,6 +372,9 @@ static int load_maps(struct bpf_file *bpf_file, struct raw_entry *raw)
 							&opts);
 		} else if (!strcmp(maps[i].name, "raw_map")) {
 			bpf_file->map_fd[i] = build_raw_map(&maps[i], raw, numa_node);
+		} else if (!strcmp(maps[i].name, "param_map")) {
+			bpf_file->map_fd[i] = build_param_map(&maps[i], bpf_file->combined,
+							      bpf_file->nr_combined, numa_node);
 		} else {
 			LIBBPF_OPTS(bpf_map_create_opts, opts,
 				.map_flags = maps[i].def.map_flags,
@@ -442,10 +628,10 @@ static int load_elf_maps_section(struct bpf_file *bpf_file)
 	return nr_maps;
 }
 
-int load_bpf_file(const char *path, int lirc_fd, struct protocol_param *param,
-		  struct raw_entry *raw)
+static int load_bpf(const char *path, int lirc_fd, struct bpf_file *bpf_file_init,
+		    struct raw_entry *raw)
 {
-	struct bpf_file bpf_file = { .param = param };
+	struct bpf_file bpf_file = *bpf_file_init;
 	int fd, i, ret;
 	Elf *elf;
 	GElf_Ehdr ehdr;
@@ -454,6 +640,9 @@ int load_bpf_file(const char *path, int lirc_fd, struct protocol_param *param,
 	char *shname, *shname_prog;
 	int nr_maps = 0;
 
+	if (bpf_file.pin_path && !attach_pinned(bpf_file.pin_path, lirc_fd))
+		return 0;
+
 	if (elf_version(EV_CURRENT) == EV_NONE)
 		return 1;
 
@@ -580,3 +769,26 @@ done:
 	close(fd);
 	return ret;
 }
+
+int load_bpf_file(const char *path, int lirc_fd, const char *pin_path,
+		  struct protocol_param *param, struct raw_entry *raw)
+{
+	struct bpf_file bpf_file = {
+		.param = param,
+		.pin_path = pin_path,
+	};
+
+	return load_bpf(path, lirc_fd, &bpf_file, raw);
+}
+
+int load_bpf_combined(const char *path, int lirc_fd, const char *pin_path,
+		      struct bpf_combined *combined, int count)
+{
+	struct bpf_file bpf_file = {
+		.combined = combined,
+		.nr_combined = count,
+		.pin_path = pin_path,
+	};
+
+	return load_bpf(path, lirc_fd, &bpf_file, NULL);
+}
@@ -5,6 +5,9 @@
 #define MAX_MAPS 32
 #define MAX_PROGS 64
 
+// Loaded programs are pinned here, so they can be reused
+#define BPF_PIN_DIR "/sys/fs/bpf/ir-keytable"
+
 struct bpf_load_map_def {
 	unsigned int type;
 	unsigned int key_size;
@@ -32,10 +35,28 @@ struct bpf_map_data {
  * One ELF file can contain multiple BPF programs which will be loaded
  * and their FDs stored stored in prog_fd array
  *
+ * If pin_path is set and a program is pinned there, that program is
+ * attached instead. Otherwise the loaded program is pinned there.
+ *
  * returns zero on success
  */
-int load_bpf_file(const char *path, int lirc_fd, struct protocol_param *param, struct raw_entry *raw);
+int load_bpf_file(const char *path, int lirc_fd, const char *pin_path, struct protocol_param *param, struct raw_entry *raw);
 
 int bpf_param(struct protocol_param *param, const char *name, int *val);
 
+/*
+ * The pulse_distance, pulse_length and manchester protocols can be loaded as
+ * one BPF program with bpf_protocols/combined.c, with up to MAX_COMBINED
+ * protocols, each with their own parameters.
+ */
+#define MAX_COMBINED 8
+
+struct bpf_combined {
+	const char *name;
+	struct protocol_param *param;
+};
+
+bool bpf_combinable(const char *name);
+int load_bpf_combined(const char *path, int lirc_fd, const char *pin_path, struct bpf_combined *combined, int count);
+
 #endif
@@ -0,0 +1,374 @@
+// SPDX-License-Identifier: GPL-2.0+
+//
+// Combined pulse_distance, pulse_length and manchester decoder. When a lirc
+// device needs more than one of these protocols, ir-keytable loads this
+// decoder once rather than one program per protocol. Every parameter set
+// is a different decoder, and all are run for each sample.
+//
+// The decoders are the same as in pulse_distance.c, pulse_length.c and
+// manchester.c, but the parameters are read from param_map rather than
+// patched into the program, since there is more than one set of them.
+
+#include <linux/lirc.h>
+#include <linux/bpf.h>
+
+#include "bpf_helpers.h"
+
+#define MAX_DECODERS 8
+
+// This should match the struct in bpf_load.c
+enum decoder_type {
+	DECODER_NONE,
+	DECODER_PULSE_DISTANCE,
+	DECODER_PULSE_LENGTH,
+	DECODER_MANCHESTER,
+};
+
+struct decoder_param {
+	int type;
+	int rc_protocol;
+	int margin;
+	int header_pulse;
+	int header_space;
+	int repeat_pulse;
+	int repeat_space;
+	int bit_pulse;
+	int bit_space;
+	int bit_0_pulse;
+	int bit_1_pulse;
+	int bit_0_space;
+	int bit_1_space;
+	int trailer_pulse;
+	int bits;
+	int reverse;
+	int header_optional;
+	int zero_pulse;
+	int zero_space;
+	int one_pulse;
+	int one_space;
+	int toggle_bit;
+	int scancode_mask;
+};
+
+struct decoder_state {
+	unsigned long bits;
+	unsigned int state;
+	unsigned int count;
+};
+
+struct bpf_map_def SEC("lirc_mode2/maps") decoder_state_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(unsigned int),
+	.value_size = sizeof(struct decoder_state),
+	.max_entries = MAX_DECODERS,
+};
+
+// Filled in by the bpf loader from the rc_keymap toml files
+struct bpf_map_def SEC("lirc_mode2/maps") param_map = {
+	.type = BPF_MAP_TYPE_ARRAY,
+	.key_size = sizeof(unsigned int),
+	.value_size = sizeof(struct decoder_param),
+	.max_entries = MAX_DECODERS,
+};
+
+enum state {
+	STATE_INACTIVE,
+	STATE_HEADER_SPACE,
+	STATE_REPEAT_SPACE,
+	STATE_BITS_SPACE,
+	STATE_BITS_PULSE,
+	STATE_TRAILER,
+};
+
+#define STATE_HEADER   1
+#define STATE_START1   2
+#define STATE_MID1     3
+#define STATE_MID0     4
+#define STATE_START0   5
+
+static inline int eq_margin(struct decoder_param *p, unsigned d1, unsigned d2)
+{
+	return ((d1 > (d2 - p->margin)) && (d1 < (d2 + p->margin)));
+}
+
+static inline void pulse_distance(unsigned int *sample, struct decoder_param *p,
+				  struct decoder_state *s, int pulse, int duration)
+{
+	switch (s->state) {
+	case STATE_HEADER_SPACE:
+		if (!pulse && eq_margin(p, p->header_space, duration))
+			s->state = STATE_BITS_PULSE;
+		else
+			s->state = STATE_INACTIVE;
+		break;
+	case STATE_REPEAT_SPACE:
+		if (!pulse && eq_margin(p, p->repeat_space, duration))
+			s->state = STATE_TRAILER;
+		else
+			s->state = STATE_INACTIVE;
+		break;
+	case STATE_INACTIVE:
+		if (pulse && eq_margin(p, p->header_pulse, duration)) {
+			s->bits = 0;
+			s->state = STATE_HEADER_SPACE;
+			s->count = 0;
+			break;
+		}
+		if (pulse && p->repeat_pulse > 0 &&
+		    eq_margin(p, p->repeat_pulse, duration)) {
+			s->state = STATE_REPEAT_SPACE;
+			s->count = 0;
+			break;
+		}
+		if (!p->header_optional)
+			break;
+		/* pass through */
+	case STATE_BITS_PULSE:
+		if (pulse && eq_margin(p, p->bit_pulse, duration))
+			s->state = STATE_BITS_SPACE;
+		else
+			s->state = STATE_INACTIVE;
+		break;
+	case STATE_BITS_SPACE:
+		if (pulse) {
+			s->state = STATE_INACTIVE;
+			break;
+		}
+
+		unsigned long set_bit = 1;
+
+		if (p->reverse)
+			set_bit <<= s->count;
+		else
+			s->bits <<= 1;
+
+		if (eq_margin(p, p->bit_1_space, duration))
+			s->bits |= set_bit;
+		else if (!eq_margin(p, p->bit_0_space, duration)) {
+			s->state = STATE_INACTIVE;
+			break;
+		}
+
+		s->count++;
+		if (s->count == p->bits)
+			s->state = STATE_TRAILER;
+		else
+			s->state = STATE_BITS_PULSE;
+		break;
+	case STATE_TRAILER:
+		if (pulse && eq_margin(p, p->trailer_pulse, duration)) {
+			if (s->count == 0)
+				bpf_rc_repeat(sample);
+			else
+				bpf_rc_keydown(sample, p->rc_protocol, s->bits, 0);
+		}
+
+		s->state = STATE_INACTIVE;
+	}
+}
+
+static inline void pulse_length(unsigned int *sample, struct decoder_param *p,
+				struct decoder_state *s, int pulse, int duration)
+{
+	switch (s->state) {
+	case STATE_HEADER_SPACE:
+		if (!pulse && eq_margin(p, p->header_space, duration))
+			s->state = STATE_BITS_PULSE;
+		else
+			s->state = STATE_INACTIVE;
+		break;
+	case STATE_REPEAT_SPACE:
+		if (!pulse && eq_margin(p, p->repeat_space, duration))
+			s->state = STATE_TRAILER;
+		else
+			s->state = STATE_INACTIVE;
+		break;
+	case STATE_INACTIVE:
+		if (pulse && eq_margin(p, p->header_pulse, duration)) {
+			s->bits = 0;
+			s->state = STATE_HEADER_SPACE;
+			s->count = 0;
+			break;
+		}
+		if (pulse && p->repeat_pulse > 0 &&
+		    eq_margin(p, p->repeat_pulse, duration)) {
+			s->state = STATE_REPEAT_SPACE;
+			s->count = 0;
+			break;
+		}
+		if (!p->header_optional)
+			break;
+		/* pass through */
+	case STATE_BITS_PULSE:
+		if (!pulse)
+			break;
+
+		unsigned long set_bit = 1;
+
+		if (p->reverse)
+			set_bit <<= s->count;
+		else
+			s->bits <<= 1;
+
+		if (eq_margin(p, p->bit_1_pulse, duration))
+			s->bits |= set_bit;
+		else if (!eq_margin(p, p->bit_0_pulse, duration)) {
+			s->state = STATE_INACTIVE;
+			break;
+		}
+
+		s->count++;
+		if (s->count == p->bits) {
+			bpf_rc_keydown(sample, p->rc_protocol, s->bits, 0);
+			s->state = STATE_INACTIVE;
+		} else {
+			s->state = STATE_BITS_SPACE;
+		}
+		break;
+	case STATE_BITS_SPACE:
+		if (!pulse && eq_margin(p, p->bit_space, duration))
+			s->state = STATE_BITS_PULSE;
+		else
+			s->state = STATE_INACTIVE;
+		break;
+	case STATE_TRAILER:
+		if (pulse && eq_margin(p, p->trailer_pulse, duration))
+			bpf_rc_repeat(sample);
+
+		s->state = STATE_INACTIVE;
+	}
+}
+
+static inline int emit_bit(unsigned int *sample, struct decoder_param *p,
+			   struct decoder_state *s, int bit, int state)
+{
+	s->bits <<= 1;
+	s->bits |= bit;
+	s->count++;
+
+	if (s->count == p->bits) {
+		unsigned int toggle = 0;
+		unsigned long mask = p->scancode_mask;
+		if (p->toggle_bit < p->bits) {
+			unsigned int tmask = 1 << p->toggle_bit;
+			if (s->bits & tmask)
+				toggle = 1;
+			mask |= tmask;
+		}
+
+		bpf_rc_keydown(sample, p->rc_protocol, s->bits & ~mask, toggle);
+		state = STATE_INACTIVE;
+	}
+
+	return state;
+}
+
+static inline void manchester(unsigned int *sample, struct decoder_param *p,
+			      struct decoder_state *s, int pulse, int duration)
+{
+	unsigned int new_state = s->state;
+
+	switch (s->state) {
+	case STATE_INACTIVE:
+		if (p->header_pulse) {
+			if (pulse && eq_margin(p, p->header_pulse, duration))
+				new_state = STATE_HEADER;
+			break;
+		}
+		/* pass through */
+	case STATE_HEADER:
+		if (p->header_space) {
+			if (!pulse && eq_margin(p, p->header_space, duration)) {
+				s->bits = 0;
+				s->count = 0;
+				new_state = STATE_MID1;
+			}
+			break;
+		}
+		s->bits = 0;
+		s->count = 0;
+		/* pass through */
+	case STATE_MID1:
+		if (!pulse)
+			break;
+
+		if (eq_margin(p, p->one_pulse, duration))
+			new_state = emit_bit(sample, p, s, 1, STATE_START1);
+		else if (eq_margin(p, p->one_pulse + p->zero_pulse, duration))
+			new_state = emit_bit(sample, p, s, 1, STATE_MID0);
+		break;
+	case STATE_MID0:
+		if (pulse)
+			break;
+
+		if (eq_margin(p, p->zero_space, duration))
+			new_state = emit_bit(sample, p, s, 0, STATE_START0);
+		else if (eq_margin(p, p->zero_space + p->one_space, duration))
+			new_state = emit_bit(sample, p, s, 0, STATE_MID1);
+		else
+			new_state = emit_bit(sample, p, s, 0, STATE_INACTIVE);
+		break;
+	case STATE_START1:
+		if (!pulse && eq_margin(p, p->zero_space, duration))
+			new_state = STATE_MID1;
+		break;
+	case STATE_START0:
+		if (pulse && eq_margin(p, p->one_pulse, duration))
+			new_state = STATE_MID0;
+		break;
+	}
+
+	if (new_state == s->state)
+		s->state = STATE_INACTIVE;
+	else
+		s->state = new_state;
+}
+
+SEC("lirc_mode2/combined")
+int bpf_decoder(unsigned int *sample)
+{
+	unsigned int i;
+
+	switch (*sample & LIRC_MODE2_MASK) {
+	case LIRC_MODE2_SPACE:
+	case LIRC_MODE2_PULSE:
+	case LIRC_MODE2_TIMEOUT:
+		break;
+	default:
+		// not a timing events
+		return 0;
+	}
+
+	int duration = LIRC_VALUE(*sample);
+	int pulse = LIRC_IS_PULSE(*sample);
+
+	// The loop is unrolled since older kernels do not allow loops
+#pragma unroll
+	for (i = 0; i < MAX_DECODERS; i++) {
+		unsigned int key = i;
+		struct decoder_param *p = bpf_map_lookup_elem(&param_map, &key);
+		struct decoder_state *s = bpf_map_lookup_elem(&decoder_state_map, &key);
+
+		if (!p || !s)
+			return 0;
+
+		switch (p->type) {
+		case DECODER_PULSE_DISTANCE:
+			pulse_distance(sample, p, s, pulse, duration);
+			break;
+		case DECODER_PULSE_LENGTH:
+			pulse_length(sample, p, s, pulse, duration);
+			break;
+		case DECODER_MANCHESTER:
+			manchester(sample, p, s, pulse, duration);
+			break;
+		default:
+			// the parameter sets are at the start of the map
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0+
+//
+// Default parameters of the decoders which can be combined. These can be
+// overridden in the rc_keymap toml. The decoders declare them as variables
+// and ir-keytable builds the parameters of the combined decoder from them,
+// so they are only listed here.
+
+#ifndef __BPF_PROTOCOLS_DEFAULTS_H
+#define __BPF_PROTOCOLS_DEFAULTS_H
+
+#define PULSE_DISTANCE_DEFAULTS(param)	\
+	param(margin, 200)		\
+	param(header_pulse, 2125)	\
+	param(header_space, 1875)	\
+	param(repeat_pulse, 0)		\
+	param(repeat_space, 0)		\
+	param(bit_pulse, 625)		\
+	param(bit_0_space, 375)		\
+	param(bit_1_space, 1625)	\
+	param(trailer_pulse, 625)	\
+	param(bits, 4)			\
+	param(reverse, 0)		\
+	param(header_optional, 0)	\
+	param(rc_protocol, 64)
+
+#define PULSE_LENGTH_DEFAULTS(param)	\
+	param(margin, 200)		\
+	param(header_pulse, 2125)	\
+	param(header_space, 1875)	\
+	param(repeat_pulse, 0)		\
+	param(repeat_space, 0)		\
+	param(bit_space, 625)		\
+	param(bit_0_pulse, 375)		\
+	param(bit_1_pulse, 1625)	\
+	param(trailer_pulse, 0)		\
+	param(bits, 4)			\
+	param(reverse, 0)		\
+	param(header_optional, 0)	\
+	param(rc_protocol, 67)
+
+#define MANCHESTER_DEFAULTS(param)	\
+	param(margin, 200)		\
+	param(header_pulse, 0)		\
+	param(header_space, 0)		\
+	param(zero_pulse, 888)		\
+	param(zero_space, 888)		\
+	param(one_pulse, 888)		\
+	param(one_space, 888)		\
+	param(toggle_bit, 100)		\
+	param(bits, 14)			\
+	param(scancode_mask, 0)		\
+	param(rc_protocol, 66)
+
+#endif
@@ -6,6 +6,7 @@
 #include <linux/bpf.h>
 
 #include "bpf_helpers.h"
+#include "defaults.h"
 
 struct decoder_state {
 	unsigned int state;
@@ -29,17 +30,8 @@ struct bpf_map_def SEC("lirc_mode2/maps") decoder_state_map = {
 //
 // See:
 // http://clearwater.com.au/code/rc5
-int margin = 200;
-int header_pulse = 0;
-int header_space = 0;
-int zero_pulse = 888;
-int zero_space = 888;
-int one_pulse = 888;
-int one_space = 888;
-int toggle_bit = 100;
-int bits = 14;
-int scancode_mask = 0;
-int rc_protocol = 66;
+#define DECLARE_PARAM(name, value) int name = value;
+MANCHESTER_DEFAULTS(DECLARE_PARAM)
 
 #define BPF_PARAM(x) (int)(long)(&(x))
 
@@ -107,7 +99,7 @@ int bpf_decoder(unsigned int *sample)
 		if (BPF_PARAM(header_pulse)) {
 			if (pulse &&
 			    eq_margin(BPF_PARAM(header_pulse), duration)) {
-				s->state = STATE_HEADER;
+				newState = STATE_HEADER;
 			}
 			break;
 		}
@@ -116,7 +108,9 @@ int bpf_decoder(unsigned int *sample)
 		if (BPF_PARAM(header_space)) {
 			if (!pulse &&
 			    eq_margin(BPF_PARAM(header_space), duration)) {
-				s->state = STATE_MID1;
+				s->bits = 0;
+				s->count = 0;
+				newState = STATE_MID1;
 			}
 			break;
 		}
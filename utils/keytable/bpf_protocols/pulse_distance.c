@@ -6,6 +6,7 @@
 #include <linux/bpf.h>
 
 #include "bpf_helpers.h"
+#include "defaults.h"
 
 enum state {
 	STATE_INACTIVE,
@@ -35,19 +36,8 @@ struct bpf_map_def SEC("lirc_mode2/maps") decoder_state_map = {
 // an int, so that the compiler emits a mov immediate for the address
 // but uses it as an int. The bpf loader replaces the relocation with the
 // actual value (either overridden or taken from the data segment).
-int margin = 200;
-int header_pulse = 2125;
-int header_space = 1875;
-int repeat_pulse = 0;
-int repeat_space = 0;
-int bit_pulse = 625;
-int bit_0_space = 375;
-int bit_1_space = 1625;
-int trailer_pulse = 625;
-int bits = 4;
-int reverse = 0;
-int header_optional = 0;
-int rc_protocol = 64;
+#define DECLARE_PARAM(name, value) int name = value;
+PULSE_DISTANCE_DEFAULTS(DECLARE_PARAM)
 
 #define BPF_PARAM(x) (int)(long)(&(x))
 
@@ -0,0 +1,579 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+// Compiled keymap database. The keymaps are parsed once when building, and
+// stored in a single file which is mapped into memory, so auto-loading a
+// keymap at boot needs neither the toml parser nor reading the keymap.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <argp.h>
+
+#include "keymap-db.h"
+
+#ifdef ENABLE_NLS
+# define _(string) gettext(string)
+# include "gettext.h"
+# include <locale.h>
+# include <langinfo.h>
+# include <iconv.h>
+#else
+# define _(string) string
+#endif
+
+#define KEYMAP_DB_MAGIC		"RCKEYMAP"
+#define KEYMAP_DB_VERSION	1
+
+/*
+ * The file starts with the header and the hash table of keymap files,
+ * followed by the records. Records and strings are referred to by their
+ * offset in the file, with 0 meaning none. Everything is stored in host
+ * byte order, since the database is built on the machine that uses it.
+ */
+struct keymap_db_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;		/* size of the database file */
+	uint32_t buckets;	/* number of hash table entries after the header */
+	uint32_t files;		/* number of keymap files */
+};
+
+struct keymap_db_file {
+	uint32_t next;		/* next file in the same hash bucket */
+	uint32_t name;		/* file name without directory */
+	uint64_t file_size;	/* size of the keymap file it was compiled from */
+	uint32_t protocols;	/* number of entries in the protocol array */
+	uint32_t protocol;
+};
+
+struct keymap_db_protocol {
+	uint32_t protocol;
+	uint32_t variant;
+	uint32_t name;
+	uint32_t params;	/* number of entries in the param array */
+	uint32_t param;
+	uint32_t scancodes;	/* number of entries in the scancode array */
+	uint32_t scancode;
+	uint32_t raws;		/* number of entries in the raw array */
+	uint32_t raw;
+	uint32_t reserved;
+};
+
+struct keymap_db_param {
+	uint32_t name;
+	uint32_t reserved;
+	int64_t value;
+};
+
+struct keymap_db_scancode {
+	uint64_t scancode;
+	uint32_t keycode;
+	uint32_t reserved;
+};
+
+struct keymap_db_raw {
+	uint32_t keycode;
+	uint32_t raw_length;	/* number of entries in the raw array */
+	uint32_t raw;
+	uint32_t reserved;
+};
+
+struct keymap_db {
+	const char *data;
+	size_t size;
+	struct timespec mtime;
+	char *dir;
+};
+
+static uint32_t hash_name(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*
+ * Compiling
+ */
+
+struct db_buf {
+	char *data;
+	size_t size;
+	size_t alloc;
+};
+
+#define DB_REC(buf, type, off) ((type *)((buf)->data + (off)))
+
+static error_t db_alloc(struct db_buf *buf, size_t len, uint32_t *off)
+{
+	size_t start = (buf->size + 7) & ~(size_t)7;
+
+	if (start + len > UINT32_MAX) {
+		fprintf(stderr, _("keymap database too large\n"));
+		return EINVAL;
+	}
+	if (start + len > buf->alloc) {
+		size_t alloc = buf->alloc ? buf->alloc : 65536;
+		char *data;
+
+		while (start + len > alloc)
+			alloc *= 2;
+		data = realloc(buf->data, alloc);
+		if (!data) {
+			perror("compile_keymap_db");
+			return ENOMEM;
+		}
+		memset(data + buf->alloc, 0, alloc - buf->alloc);
+		buf->data = data;
+		buf->alloc = alloc;
+	}
+	buf->size = start + len;
+	*off = start;
+	return 0;
+}
+
+static error_t db_string(struct db_buf *buf, const char *str, uint32_t *off)
+{
+	error_t rc;
+
+	*off = 0;
+	if (!str)
+		return 0;
+	rc = db_alloc(buf, strlen(str) + 1, off);
+	if (!rc)
+		strcpy(buf->data + *off, str);
+	return rc;
+}
+
+static error_t db_add_protocol(struct db_buf *buf, uint32_t off, struct keymap *map)
+{
+	uint32_t protocol, variant, name, param = 0, scancode = 0, raw = 0;
+	unsigned params = 0, scancodes = 0, raws = 0, i;
+	struct protocol_param *pp;
+	struct scancode_entry *se;
+	struct raw_entry *re;
+	error_t rc;
+
+	for (pp = map->param; pp; pp = pp->next)
+		params++;
+	for (se = map->scancode; se; se = se->next)
+		scancodes++;
+	for (re = map->raw; re; re = re->next)
+		raws++;
+
+	if ((rc = db_string(buf, map->protocol, &protocol)) ||
+	    (rc = db_string(buf, map->variant, &variant)) ||
+	    (rc = db_string(buf, map->name, &name)))
+		return rc;
+	if ((params &&
+	     (rc = db_alloc(buf, params * sizeof(struct keymap_db_param), &param))) ||
+	    (scancodes &&
+	     (rc = db_alloc(buf, scancodes * sizeof(struct keymap_db_scancode), &scancode))) ||
+	    (raws &&
+	     (rc = db_alloc(buf, raws * sizeof(struct keymap_db_raw), &raw))))
+		return rc;
+
+	for (pp = map->param, i = 0; pp; pp = pp->next, i++) {
+		uint32_t off = param + i * sizeof(struct keymap_db_param);
+		uint32_t str;
+
+		rc = db_string(buf, pp->name, &str);
+		if (rc)
+			return rc;
+		DB_REC(buf, struct keymap_db_param, off)->name = str;
+		DB_REC(buf, struct keymap_db_param, off)->value = pp->value;
+	}
+
+	for (se = map->scancode, i = 0; se; se = se->next, i++) {
+		uint32_t off = scancode + i * sizeof(struct keymap_db_scancode);
+		uint32_t str;
+
+		rc = db_string(buf, se->keycode, &str);
+		if (rc)
+			return rc;
+		DB_REC(buf, struct keymap_db_scancode, off)->scancode = se->scancode;
+		DB_REC(buf, struct keymap_db_scancode, off)->keycode = str;
+	}
+
+	for (re = map->raw, i = 0; re; re = re->next, i++) {
+		uint32_t off = raw + i * sizeof(struct keymap_db_raw);
+		uint32_t str, values;
+
+		if ((rc = db_string(buf, re->keycode, &str)) ||
+		    (rc = db_alloc(buf, re->raw_length * sizeof(re->raw[0]), &values)))
+			return rc;
+		memcpy(buf->data + values, re->raw, re->raw_length * sizeof(re->raw[0]));
+		DB_REC(buf, struct keymap_db_raw, off)->keycode = str;
+		DB_REC(buf, struct keymap_db_raw, off)->raw_length = re->raw_length;
+		DB_REC(buf, struct keymap_db_raw, off)->raw = values;
+	}
+
+	DB_REC(buf, struct keymap_db_protocol, off)->protocol = protocol;
+	DB_REC(buf, struct keymap_db_protocol, off)->variant = variant;
+	DB_REC(buf, struct keymap_db_protocol, off)->name = name;
+	DB_REC(buf, struct keymap_db_protocol, off)->params = params;
+	DB_REC(buf, struct keymap_db_protocol, off)->param = param;
+	DB_REC(buf, struct keymap_db_protocol, off)->scancodes = scancodes;
+	DB_REC(buf, struct keymap_db_protocol, off)->scancode = scancode;
+	DB_REC(buf, struct keymap_db_protocol, off)->raws = raws;
+	DB_REC(buf, struct keymap_db_protocol, off)->raw = raw;
+	return 0;
+}
+
+static error_t db_add_file(struct db_buf *buf, const char *name, uint64_t file_size,
+			   struct keymap *map)
+{
+	struct keymap_db_header *header;
+	uint32_t off, str, protocol, *bucket;
+	unsigned protocols = 0, i;
+	struct keymap *m;
+	error_t rc;
+
+	for (m = map; m; m = m->next)
+		protocols++;
+
+	if ((rc = db_alloc(buf, sizeof(struct keymap_db_file), &off)) ||
+	    (rc = db_string(buf, name, &str)) ||
+	    (rc = db_alloc(buf, protocols * sizeof(struct keymap_db_protocol), &protocol)))
+		return rc;
+
+	for (m = map, i = 0; m; m = m->next, i++) {
+		rc = db_add_protocol(buf, protocol + i * sizeof(struct keymap_db_protocol), m);
+		if (rc)
+			return rc;
+	}
+
+	header = DB_REC(buf, struct keymap_db_header, 0);
+	bucket = DB_REC(buf, uint32_t, sizeof(*header)) + hash_name(name) % header->buckets;
+	DB_REC(buf, struct keymap_db_file, off)->next = *bucket;
+	DB_REC(buf, struct keymap_db_file, off)->name = str;
+	DB_REC(buf, struct keymap_db_file, off)->file_size = file_size;
+	DB_REC(buf, struct keymap_db_file, off)->protocols = protocols;
+	DB_REC(buf, struct keymap_db_file, off)->protocol = protocol;
+	*bucket = off;
+	header->files++;
+	return 0;
+}
+
+error_t compile_keymap_db(const char *db_fname, char **fnames, int count, bool verbose)
+{
+	struct keymap_db_header *header;
+	struct db_buf buf = {};
+	uint32_t off;
+	error_t rc;
+	FILE *fout;
+	int i;
+
+	if ((rc = db_alloc(&buf, sizeof(*header), &off)) ||
+	    (rc = db_alloc(&buf, (2 * count + 1) * sizeof(uint32_t), &off)))
+		goto out;
+
+	header = DB_REC(&buf, struct keymap_db_header, 0);
+	memcpy(header->magic, KEYMAP_DB_MAGIC, sizeof(header->magic));
+	header->version = KEYMAP_DB_VERSION;
+	header->buckets = 2 * count + 1;
+
+	for (i = 0; i < count; i++) {
+		const char *name = strrchr(fnames[i], '/');
+		struct keymap *map = NULL;
+		struct stat st;
+
+		if (stat(fnames[i], &st)) {
+			fprintf(stderr, _("%s: error: cannot open: %m\n"), fnames[i]);
+			rc = errno;
+			goto out;
+		}
+		rc = parse_keymap(fnames[i], &map, verbose);
+		if (rc) {
+			fprintf(stderr, _("Can't load %s keymap\n"), fnames[i]);
+			goto out;
+		}
+		rc = db_add_file(&buf, name ? name + 1 : fnames[i], st.st_size, map);
+		free_keymap(map);
+		if (rc)
+			goto out;
+	}
+	DB_REC(&buf, struct keymap_db_header, 0)->size = buf.size;
+
+	fout = fopen(db_fname, "w");
+	if (!fout) {
+		fprintf(stderr, _("%s: error: cannot open: %m\n"), db_fname);
+		rc = errno;
+		goto out;
+	}
+	if (fwrite(buf.data, buf.size, 1, fout) != 1 || fclose(fout)) {
+		fprintf(stderr, _("%s: error: cannot write: %m\n"), db_fname);
+		rc = EIO;
+		goto out;
+	}
+	if (verbose)
+		fprintf(stderr, _("Compiled %d keymaps into %s\n"), count, db_fname);
+out:
+	free(buf.data);
+	return rc;
+}
+
+/*
+ * Loading
+ */
+
+static const void *db_array(const struct keymap_db *db, uint32_t off, uint32_t count, size_t size)
+{
+	if (!off || off > db->size || count > (db->size - off) / size)
+		return NULL;
+	return db->data + off;
+}
+
+/* Return a string of the database, or NULL if it isn't valid */
+static const char *db_str(const struct keymap_db *db, uint32_t off)
+{
+	if (!off || off >= db->size || !memchr(db->data + off, 0, db->size - off))
+		return NULL;
+	return db->data + off;
+}
+
+/* Duplicate an optional string, *valid is cleared if it isn't valid */
+static char *db_strdup(const struct keymap_db *db, uint32_t off, bool *valid)
+{
+	const char *str;
+
+	if (!off)
+		return NULL;
+	str = db_str(db, off);
+	if (!str) {
+		*valid = false;
+		return NULL;
+	}
+	return strdup(str);
+}
+
+struct keymap_db *open_keymap_db(const char *db_fname, bool verbose)
+{
+	const struct keymap_db_header *header;
+	struct keymap_db *db;
+	const char *slash;
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(db_fname, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) || st.st_size < (off_t)sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return NULL;
+
+	header = data;
+	if (memcmp(header->magic, KEYMAP_DB_MAGIC, sizeof(header->magic)) ||
+	    header->version != KEYMAP_DB_VERSION || header->size != st.st_size ||
+	    !header->buckets ||
+	    header->buckets > (st.st_size - sizeof(*header)) / sizeof(uint32_t)) {
+		if (verbose)
+			fprintf(stderr, _("%s: invalid keymap database, ignoring it\n"), db_fname);
+		munmap(data, st.st_size);
+		return NULL;
+	}
+
+	db = calloc(1, sizeof(*db));
+	if (!db) {
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	db->data = data;
+	db->size = st.st_size;
+	db->mtime = st.st_mtim;
+	slash = strrchr(db_fname, '/');
+	db->dir = slash ? strndup(db_fname, slash - db_fname) : strdup(".");
+
+	if (verbose)
+		fprintf(stderr, _("Using keymap database %s with %u keymaps\n"),
+			db_fname, header->files);
+	return db;
+}
+
+void close_keymap_db(struct keymap_db *db)
+{
+	if (!db)
+		return;
+	munmap((void *)db->data, db->size);
+	free(db->dir);
+	free(db);
+}
+
+static error_t db_load_protocol(const struct keymap_db *db, const struct keymap_db_protocol *p,
+				struct keymap **keymap)
+{
+	const struct keymap_db_param *param;
+	const struct keymap_db_scancode *scancode;
+	const struct keymap_db_raw *raw;
+	struct protocol_param **next_param;
+	struct scancode_entry **next_se;
+	struct raw_entry **next_re;
+	struct keymap *map;
+	bool valid = true;
+	unsigned i;
+
+	map = calloc(1, sizeof(*map));
+	if (!map)
+		return ENOMEM;
+	*keymap = map;
+
+	map->protocol = db_strdup(db, p->protocol, &valid);
+	map->variant = db_strdup(db, p->variant, &valid);
+	map->name = db_strdup(db, p->name, &valid);
+
+	param = db_array(db, p->param, p->params, sizeof(*param));
+	scancode = db_array(db, p->scancode, p->scancodes, sizeof(*scancode));
+	raw = db_array(db, p->raw, p->raws, sizeof(*raw));
+	if ((p->params && !param) || (p->scancodes && !scancode) || (p->raws && !raw))
+		return EINVAL;
+
+	next_param = &map->param;
+	for (i = 0; valid && i < p->params; i++) {
+		struct protocol_param *pp = calloc(1, sizeof(*pp));
+
+		if (!pp)
+			return ENOMEM;
+		*next_param = pp;
+		next_param = &pp->next;
+		pp->name = db_strdup(db, param[i].name, &valid);
+		pp->value = param[i].value;
+		if (!pp->name)
+			valid = false;
+	}
+
+	next_se = &map->scancode;
+	for (i = 0; valid && i < p->scancodes; i++) {
+		struct scancode_entry *se = calloc(1, sizeof(*se));
+
+		if (!se)
+			return ENOMEM;
+		*next_se = se;
+		next_se = &se->next;
+		se->scancode = scancode[i].scancode;
+		se->keycode = db_strdup(db, scancode[i].keycode, &valid);
+		if (!se->keycode)
+			valid = false;
+	}
+
+	next_re = &map->raw;
+	for (i = 0; valid && i < p->raws; i++) {
+		const uint32_t *values = db_array(db, raw[i].raw, raw[i].raw_length, sizeof(uint32_t));
+		struct raw_entry *re;
+
+		if (!values)
+			return EINVAL;
+		re = calloc(1, sizeof(*re) + sizeof(re->raw[0]) * raw[i].raw_length);
+		if (!re)
+			return ENOMEM;
+		*next_re = re;
+		next_re = &re->next;
+		re->raw_length = raw[i].raw_length;
+		memcpy(re->raw, values, sizeof(re->raw[0]) * raw[i].raw_length);
+		re->keycode = db_strdup(db, raw[i].keycode, &valid);
+		if (!re->keycode)
+			valid = false;
+	}
+
+	return valid ? 0 : EINVAL;
+}
+
+static error_t db_load_file(const struct keymap_db *db, const struct keymap_db_file *file,
+			    struct keymap **keymap)
+{
+	const struct keymap_db_protocol *protocol;
+	struct keymap *map = NULL, **next = &map;
+	error_t rc = 0;
+	unsigned i;
+
+	protocol = db_array(db, file->protocol, file->protocols, sizeof(*protocol));
+	if (!protocol || !file->protocols)
+		return EINVAL;
+
+	for (i = 0; !rc && i < file->protocols; i++) {
+		rc = db_load_protocol(db, &protocol[i], next);
+		if (*next)
+			next = &(*next)->next;
+	}
+	if (rc) {
+		free_keymap(map);
+		return rc;
+	}
+	*keymap = map;
+	return 0;
+}
+
+/*
+ * Look up the keymap of file fname in the database. Only keymaps in the
+ * directory of the database are looked up, and only if they haven't been
+ * changed since the database was built. Returns ENOENT if the keymap has
+ * to be parsed instead.
+ */
+error_t keymap_db_lookup(struct keymap_db *db, const char *fname, struct keymap **keymap, bool verbose)
+{
+	const struct keymap_db_header *header = (const void *)db->data;
+	const uint32_t *buckets = (const void *)(db->data + sizeof(*header));
+	const char *name = strrchr(fname, '/');
+	struct stat st;
+	uint32_t off, i;
+	error_t rc;
+
+	if (!name || strncmp(fname, db->dir, name - fname) || db->dir[name - fname])
+		return ENOENT;
+	name++;
+
+	if (stat(fname, &st))
+		return ENOENT;
+
+	off = buckets[hash_name(name) % header->buckets];
+	for (i = 0; off && i < header->files; i++) {
+		const struct keymap_db_file *file = db_array(db, off, 1, sizeof(*file));
+		const char *file_name = file ? db_str(db, file->name) : NULL;
+
+		if (!file_name)
+			break;
+		if (strcmp(file_name, name)) {
+			off = file->next;
+			continue;
+		}
+
+		if (file->file_size != (uint64_t)st.st_size ||
+		    st.st_mtim.tv_sec > db->mtime.tv_sec ||
+		    (st.st_mtim.tv_sec == db->mtime.tv_sec &&
+		     st.st_mtim.tv_nsec > db->mtime.tv_nsec)) {
+			if (verbose)
+				fprintf(stderr, _("%s changed after the keymap database was built\n"), fname);
+			return ENOENT;
+		}
+
+		rc = db_load_file(db, file, keymap);
+		if (rc) {
+			fprintf(stderr, _("%s: invalid keymap database entry\n"), fname);
+			return rc;
+		}
+		if (verbose)
+			fprintf(stderr, _("Read %s keycode file from the keymap database\n"), fname);
+		return 0;
+	}
+
+	if (verbose && off)
+		fprintf(stderr, _("Invalid keymap database\n"));
+	return ENOENT;
+}
@@ -0,0 +1,16 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __KEYMAP_DB_H
+#define __KEYMAP_DB_H
+
+#include "keymap.h"
+
+#define KEYMAP_DB_NAME "rc_keymaps.db"
+
+struct keymap_db;
+
+error_t compile_keymap_db(const char *db_fname, char **fnames, int count, bool verbose);
+struct keymap_db *open_keymap_db(const char *db_fname, bool verbose);
+void close_keymap_db(struct keymap_db *db);
+error_t keymap_db_lookup(struct keymap_db *db, const char *fname, struct keymap **keymap, bool verbose);
+
+#endif
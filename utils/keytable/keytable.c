@@ -30,10 +30,13 @@
 #include <argp.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 
 #include "ir-encode.h"
 #include "parse.h"
 #include "keymap.h"
+#include "keymap-db.h"
 
 #ifdef HAVE_BPF
 #include <bpf/bpf.h>
@@ -258,6 +261,8 @@ static const char doc[] = N_(
 	"  PARAMETER - a set of name1=number1[,name2=number2]... for the BPF prototcol\n"
 	"  CFGFILE   - configuration file that associates a driver/table name with\n"
 	"              a keymap file\n"
+	"  DBFILE    - keymap database file, compiled from the KEYMAP files given as\n"
+	"              arguments\n"
 	"\nOptions can be combined together.");
 
 static const struct argp_option options[] = {
@@ -273,13 +278,16 @@ static const struct argp_option options[] = {
 	{"delay",	'D',	N_("DELAY"),	0,	N_("Sets the delay before repeating a keystroke"), 0},
 	{"period",	'P',	N_("PERIOD"),	0,	N_("Sets the period to repeat a keystroke"), 0},
 	{"auto-load",	'a',	N_("CFGFILE"),	0,	N_("Auto-load keymaps, based on a configuration file. Only works with --sysdev."), 0},
+	{"compile-db",	-4,	N_("DBFILE"),	0,	N_("Compile the keymaps given as arguments into a keymap database"), 0},
+	{"list-pinned",	-5,	0,		0,	N_("List the BPF protocols pinned for reuse"), 0},
+	{"clear-pinned", -6,	0,		0,	N_("Remove the BPF protocols pinned for reuse"), 0},
 	{"help",        '?',	0,		0,	N_("Give this help list"), -1},
 	{"usage",	-3,	0,		0,	N_("Give a short usage message")},
 	{"version",	'V',	0,		0,	N_("Print program version"), -1},
 	{ 0, 0, 0, 0, 0, 0 }
 };
 
-static const char args_doc[] = N_("");
+static const char args_doc[] = N_("[KEYMAP...]");
 
 /* Static vars to store the parameters */
 static char *devclass = NULL;
@@ -290,11 +298,18 @@ static int test = 0;
 static int delay = -1;
 static int period = -1;
 static enum sysfs_protocols ch_proto = 0;
+static char *compile_db = NULL;
+static int list_pinned = 0;
+static int clear_pinned = 0;
+static char **db_keymaps = NULL;
+static int db_keymap_count = 0;
 
 struct bpf_protocol {
 	struct bpf_protocol *next;
 	struct protocol_param *param;
 	char *name;
+	char *pin;
+	bool combined;
 };
 
 static struct bpf_protocol *bpf_protocol;
@@ -382,7 +397,7 @@ static int add_keymap(struct keymap *map, const char *fname)
 			if (strcmp(map->protocol, "none")) {
 				struct bpf_protocol *b;
 
-				b = malloc(sizeof(*b));
+				b = calloc(1, sizeof(*b));
 				b->name = strdup(map->protocol);
 				b->param = map->param;
 				/* steal param */
@@ -642,7 +657,7 @@ static error_t parse_opt(int k, char *arg, struct argp_state *state)
 			if (protocol == SYSFS_INVALID) {
 				struct bpf_protocol *b;
 
-				b = malloc(sizeof(*b));
+				b = calloc(1, sizeof(*b));
 				b->name = strdup(p);
 				b->param = NULL;
 				b->next = bpf_protocol;
@@ -707,6 +722,23 @@ static error_t parse_opt(int k, char *arg, struct argp_state *state)
 	case -3:
 		argp_state_help(state, state->out_stream, ARGP_HELP_USAGE);
 		exit(0);
+	case -4:
+		compile_db = arg;
+		break;
+	case -5:
+		list_pinned++;
+		break;
+	case -6:
+		clear_pinned++;
+		break;
+	case ARGP_KEY_ARG:
+		db_keymaps = realloc(db_keymaps, (db_keymap_count + 1) * sizeof(*db_keymaps));
+		if (!db_keymaps) {
+			perror(_("No memory!\n"));
+			return ENOMEM;
+		}
+		db_keymaps[db_keymap_count++] = arg;
+		break;
 	default:
 		return ARGP_ERR_UNKNOWN;
 	}
@@ -967,7 +999,7 @@ static enum sysfs_protocols load_bpf_for_unsupported(enum sysfs_protocols protoc
 		    (supported & pme->sysfs_protocol))
 			continue;
 
-		b = malloc(sizeof(*b));
+		b = calloc(1, sizeof(*b));
 		b->name = strdup(pme->name);
 		b->param = NULL;
 		add_bpf_protocol(b);
@@ -1760,28 +1792,174 @@ static void device_info(int fd, char *prepend)
 // https://github.com/systemd/systemd/blob/master/src/basic/def.h#L60
 #define HIGH_RLIMIT_MEMLOCK (1024ULL*1024ULL*64ULL)
 
-static bool attach_bpf(const char *lirc_name, const char *bpf_prog, struct protocol_param *param)
+static char *find_bpf_file(const char *name);
+
+static uint64_t pin_hash(uint64_t hash, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	// FNV-1a
+	while (len--) {
+		hash ^= *p++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+static uint64_t pin_hash_param(uint64_t hash, struct protocol_param *param)
+{
+	for (; param; param = param->next) {
+		hash = pin_hash(hash, param->name, strlen(param->name) + 1);
+		hash = pin_hash(hash, &param->value, sizeof(param->value));
+	}
+
+	return hash;
+}
+
+/*
+ * The pins of a physical device start with a hash of its sysfs path, so the
+ * pins left over from an earlier keymap for it can be found.
+ */
+static int bpf_pin_device(const char *lirc_name, char *device, uint64_t *hash)
+{
+	const char *lirc = strrchr(lirc_name, '/');
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "/sys/class/lirc/%s/device/device",
+		 lirc ? lirc + 1 : lirc_name);
+	if (!realpath(path, device))
+		return -1;
+
+	*hash = pin_hash(0xcbf29ce484222325ULL, device, strlen(device) + 1);
+
+	return 0;
+}
+
+/*
+ * A loaded BPF program is pinned in bpffs, so that when the same device is
+ * plugged in again the program can be attached again without parsing,
+ * relocating and verifying it. The pin name is a hash of everything the
+ * program is built from. The physical device is part of it too, since the
+ * maps of the program hold the decoder state, which can't be shared.
+ */
+static char *bpf_pin_path(const char *lirc_name, const char *bpf_prog, uint64_t hash)
+{
+	char device[PATH_MAX];
+	struct raw_entry *re;
+	uint64_t dev_hash;
+	struct stat st;
+	char *name, *pin, *p;
+
+	if (stat(bpf_prog, &st))
+		return NULL;
+
+	if (bpf_pin_device(lirc_name, device, &dev_hash))
+		return NULL;
+
+	hash = pin_hash(hash, device, strlen(device) + 1);
+	hash = pin_hash(hash, &st.st_ino, sizeof(st.st_ino));
+	hash = pin_hash(hash, &st.st_size, sizeof(st.st_size));
+	hash = pin_hash(hash, &st.st_mtim, sizeof(st.st_mtim));
+	hash = pin_hash_param(hash, bpf_parameter);
+
+	for (re = rawtable; re; re = re->next) {
+		hash = pin_hash(hash, &re->scancode, sizeof(re->scancode));
+		hash = pin_hash(hash, re->raw, re->raw_length * sizeof(re->raw[0]));
+	}
+
+	// bpffs does not allow dots in names
+	p = strrchr(bpf_prog, '/');
+	name = strdup(p ? p + 1 : bpf_prog);
+	if (!name)
+		return NULL;
+	p = strrchr(name, '.');
+	if (p && !strcmp(p, ".o"))
+		*p = 0;
+	for (p = name; *p; p++) {
+		if (*p == '.')
+			*p = '_';
+	}
+
+	if (asprintf(&pin, BPF_PIN_DIR "/%016llx_%s_%016llx",
+		     (unsigned long long)dev_hash, name,
+		     (unsigned long long)hash) < 0)
+		pin = NULL;
+
+	free(name);
+
+	if (debug && pin)
+		fprintf(stderr, _("BPF pin path %s for %s\n"), pin, device);
+
+	return pin;
+}
+
+/*
+ * Remove the pins of the device that were not used for the current
+ * keymap, so they don't pile up each time the keymap or the BPF
+ * protocols change. A removed program stays loaded while it is attached.
+ */
+static void unpin_stale_bpf(const char *lirc_name)
+{
+	char device[PATH_MAX], prefix[20], path[PATH_MAX];
+	struct bpf_protocol *b;
+	struct dirent *entry;
+	uint64_t dev_hash;
+	DIR *dir;
+
+	if (bpf_pin_device(lirc_name, device, &dev_hash))
+		return;
+
+	snprintf(prefix, sizeof(prefix), "%016llx_", (unsigned long long)dev_hash);
+
+	dir = opendir(BPF_PIN_DIR);
+	if (!dir)
+		return;
+
+	while ((entry = readdir(dir))) {
+		if (strncmp(entry->d_name, prefix, strlen(prefix)))
+			continue;
+
+		snprintf(path, sizeof(path), BPF_PIN_DIR "/%s", entry->d_name);
+
+		for (b = bpf_protocol; b; b = b->next) {
+			if (b->pin && !strcmp(b->pin, path))
+				break;
+		}
+		if (b)
+			continue;
+
+		if (unlink(path))
+			perror(path);
+		else if (debug)
+			fprintf(stderr, _("Removed stale BPF pin %s for %s\n"), path, device);
+	}
+
+	closedir(dir);
+}
+
+static int open_bpf_lirc(const char *lirc_name)
 {
 	unsigned int features;
 	struct rlimit rl;
-	int fd, ret;
+	int fd;
 
 	fd = open(lirc_name, O_RDWR);
 	if (fd == -1) {
 		perror(lirc_name);
-		return false;
+		return -1;
 	}
 
 	if (ioctl(fd, LIRC_GET_FEATURES, &features)) {
 		perror(lirc_name);
 		close(fd);
-		return false;
+		return -1;
 	}
 
 	if (!(features & LIRC_CAN_REC_MODE2)) {
 		fprintf(stderr, _("%s: not a raw IR receiver\n"), lirc_name);
 		close(fd);
-		return false;
+		return -1;
 	}
 
 	// BPF programs are charged against RLIMIT_MEMLOCK. We'll need pages
@@ -1792,12 +1970,99 @@ static bool attach_bpf(const char *lirc_name, const char *bpf_prog, struct proto
 	rl.rlim_cur = rl.rlim_max = HIGH_RLIMIT_MEMLOCK;
 	(void) setrlimit(RLIMIT_MEMLOCK, &rl);
 
-	ret = load_bpf_file(bpf_prog, fd, param, rawtable);
+	return fd;
+}
+
+static bool attach_bpf(const char *lirc_name, const char *bpf_prog, struct bpf_protocol *b)
+{
+	int fd, ret;
+
+	fd = open_bpf_lirc(lirc_name);
+	if (fd == -1)
+		return false;
+
+	b->pin = bpf_pin_path(lirc_name, bpf_prog,
+			      pin_hash_param(0xcbf29ce484222325ULL, b->param));
+	ret = load_bpf_file(bpf_prog, fd, b->pin, b->param, rawtable);
 	close(fd);
 
 	return ret == 0;
 }
 
+/*
+ * Several pulse_distance, pulse_length and manchester protocols are loaded
+ * as a single BPF program, so each IR sample runs one program rather than
+ * one per protocol. Protocols replaced by a user protocol file are loaded
+ * by themselves.
+ */
+static void combine_bpf(const char *lirc_name)
+{
+	struct bpf_combined combined[MAX_COMBINED];
+	struct bpf_protocol *b, *protocols[MAX_COMBINED];
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	char *fname, *pin;
+	struct stat st;
+	int count = 0;
+	int i, fd, ret;
+
+	for (b = bpf_protocol; b && count < MAX_COMBINED; b = b->next) {
+		if (!bpf_combinable(b->name) || !stat(b->name, &st))
+			continue;
+
+		if (asprintf(&fname, IR_PROTOCOLS_USER_DIR "/%s.o", b->name) < 0) {
+			fprintf(stderr, _("asprintf failed: %m\n"));
+			return;
+		}
+		ret = stat(fname, &st);
+		free(fname);
+		if (!ret)
+			continue;
+
+		protocols[count] = b;
+		combined[count].name = b->name;
+		combined[count].param = b->param;
+		count++;
+
+		hash = pin_hash(hash, b->name, strlen(b->name) + 1);
+		hash = pin_hash_param(hash, b->param);
+	}
+
+	if (count < 2)
+		return;
+
+	// combined.o is only installed when built with -Dbpf-combined=true
+	if (stat(IR_PROTOCOLS_USER_DIR "/combined.o", &st) &&
+	    stat(IR_PROTOCOLS_SYSTEM_DIR "/combined.o", &st))
+		return;
+
+	fname = find_bpf_file("combined");
+	if (!fname)
+		return;
+
+	fd = open_bpf_lirc(lirc_name);
+	if (fd == -1) {
+		free(fname);
+		return;
+	}
+
+	pin = bpf_pin_path(lirc_name, fname, hash);
+	ret = load_bpf_combined(fname, fd, pin, combined, count);
+	close(fd);
+	free(fname);
+	if (ret) {
+		free(pin);
+		fprintf(stderr, _("Failed to load combined BPF protocols, loading them separately\n"));
+		return;
+	}
+
+	protocols[0]->pin = pin;
+
+	for (i = 0; i < count; i++) {
+		fprintf(stderr, _("Loaded BPF protocol %s (combined)\n"), protocols[i]->name);
+		protocols[i]->combined = true;
+	}
+}
+
 static void show_bpf(const char *lirc_name)
 {
 	unsigned int prog_ids[MAX_PROGS], count = MAX_PROGS;
@@ -1901,14 +2166,78 @@ static void clear_bpf(const char *lirc_name)
 	if (debug)
 		fprintf(stderr, _("BPF protocols removed\n"));
 }
+
+/*
+ * List the pinned BPF programs, or unpin them. Unpinning does not detach
+ * them from any lirc device they are attached to.
+ */
+static int pinned_bpf(bool unpin)
+{
+	struct dirent *entry;
+	char path[PATH_MAX];
+	int prog_fd, ret = 0;
+	DIR *dir;
+
+	dir = opendir(BPF_PIN_DIR);
+	if (!dir) {
+		if (errno == ENOENT)
+			return 0;
+		perror(BPF_PIN_DIR);
+		return -1;
+	}
+
+	while ((entry = readdir(dir))) {
+		struct bpf_prog_info info = {};
+		__u32 info_len = sizeof(info);
+
+		if (entry->d_name[0] == '.')
+			continue;
+
+		snprintf(path, sizeof(path), BPF_PIN_DIR "/%s", entry->d_name);
+
+		if (unpin) {
+			if (unlink(path)) {
+				perror(path);
+				ret = -1;
+			} else if (debug) {
+				fprintf(stderr, _("Removed %s\n"), path);
+			}
+			continue;
+		}
+
+		prog_fd = bpf_obj_get(path);
+		if (prog_fd == -1) {
+			fprintf(stderr, _("%s: %m\n"), path);
+			ret = -1;
+			continue;
+		}
+
+		if (!bpf_obj_get_info_by_fd(prog_fd, &info, &info_len))
+			printf(_("%s: prog_id %u, %s\n"), entry->d_name, info.id, info.name);
+		else
+			printf(_("%s: %m\n"), entry->d_name);
+		close(prog_fd);
+	}
+
+	closedir(dir);
+
+	return ret;
+}
 #else
-static bool attach_bpf(const char *lirc_name, const char *bpf_prog, struct protocol_param *param)
+static bool attach_bpf(const char *lirc_name, const char *bpf_prog, struct bpf_protocol *b)
 {
 	fprintf(stderr, _("error: ir-keytable was compiled without BPF support\n"));
 	return false;
 }
+static void combine_bpf(const char *lirc_name) {}
+static void unpin_stale_bpf(const char *lirc_name) {}
 static void show_bpf(const char *lirc_name) {}
 static void clear_bpf(const char *lirc_name) {}
+static int pinned_bpf(bool unpin)
+{
+	fprintf(stderr, _("error: ir-keytable was compiled without BPF support\n"));
+	return -1;
+}
 #endif
 
 static int show_sysfs_attribs(struct rc_device *rc_dev, char *name)
@@ -2058,6 +2387,18 @@ int main(int argc, char *argv[])
 
 	argp_parse(&argp, argc, argv, ARGP_NO_HELP, 0, 0);
 
+	if (compile_db)
+		return compile_keymap_db(compile_db, db_keymaps, db_keymap_count, debug) ? -1 : 0;
+	if (db_keymaps) {
+		fprintf(stderr, _("Keymap arguments can only be used with --compile-db\n"));
+		return -1;
+	}
+	if (list_pinned || clear_pinned) {
+		if (list_pinned && pinned_bpf(false))
+			return -1;
+		return clear_pinned ? pinned_bpf(true) : 0;
+	}
+
 	/* Just list all devices */
 	if (!clear && !readtable && !keytable && !ch_proto && !cfg.next && !test && delay < 0 && period < 0 && !bpf_protocol) {
 		if (show_sysfs_attribs(&rc_dev, devclass))
@@ -2088,6 +2429,8 @@ int main(int argc, char *argv[])
 	dev_from_class++;
 
 	if (cfg.next) {
+		struct keymap_db *db = NULL;
+		bool db_opened = false;
 		struct cfgfile *cur;
 		struct keymap *map;
 		char *fname;
@@ -2109,7 +2452,14 @@ int main(int argc, char *argv[])
 			if (!fname)
 				return -1;
 
-			rc = parse_keymap(fname, &map, debug);
+			/* Use the precompiled keymap if there is one */
+			if (!db_opened) {
+				db = open_keymap_db(IR_KEYTABLE_SYSTEM_DIR "/" KEYMAP_DB_NAME, debug);
+				db_opened = true;
+			}
+			rc = db ? keymap_db_lookup(db, fname, &map, debug) : ENOENT;
+			if (rc)
+				rc = parse_keymap(fname, &map, debug);
 			if (rc < 0) {
 				fprintf(stderr, _("Can't load %s keymap\n"), fname);
 				free(fname);
@@ -2121,6 +2471,7 @@ int main(int argc, char *argv[])
 			clear = 1;
 			matches++;
 		}
+		close_keymap_db(db);
 
 		if (!matches) {
 			if (debug)
@@ -2180,15 +2531,26 @@ int main(int argc, char *argv[])
 			fprintf(stderr, _("Error: unable to attach bpf program, lirc device name was not found\n"));
 		}
 
+		if (rc_dev.lirc_name)
+			combine_bpf(rc_dev.lirc_name);
+
 		for (b = bpf_protocol; b && rc_dev.lirc_name; b = b->next) {
-			char *fname = find_bpf_file(b->name);
+			char *fname;
+
+			if (b->combined)
+				continue;
+
+			fname = find_bpf_file(b->name);
 
 			if (fname) {
-				if (attach_bpf(rc_dev.lirc_name, fname, b->param))
+				if (attach_bpf(rc_dev.lirc_name, fname, b))
 					fprintf(stderr, _("Loaded BPF protocol %s\n"), b->name);
 				free(fname);
 			}
 		}
+
+		if (rc_dev.lirc_name)
+			unpin_stale_bpf(rc_dev.lirc_name);
 	}
 
 	/*
@@ -29,6 +29,8 @@
 #include <libv4l2rds.h>
 #include <v4l-getsubopt.h>
 
+#include "rds-ctl.h"
+
 using dev_vec = std::vector<std::string>;
 using dev_map = std::map<std::string, std::string>;
 
@@ -49,6 +51,7 @@ enum Option {
 	OptReadRds = 'R',
 	OptGetTuner = 'T',
 	OptAll = 128,
+	OptDaemon,
 	OptFreqSeek,
 	OptListDevices,
 	OptListFreqBands,
@@ -66,6 +69,8 @@ struct ctl_parameters {
 	bool terminate_decoding;
 	char options[OptLast];
 	char fd_name[80];
+	dev_vec devices;
+	const char *daemon_socket;
 	bool filemode_active;
 	double freq;
 	uint32_t wait_limit;
@@ -79,6 +84,7 @@ static int app_result;
 static struct option long_options[] = {
 	{"all", no_argument, nullptr, OptAll},
 	{"rbds", no_argument, nullptr, OptRBDS},
+	{"daemon", required_argument, nullptr, OptDaemon},
 	{"device", required_argument, nullptr, OptSetDevice},
 	{"file", required_argument, nullptr, OptOpenFile},
 	{"freq-seek", required_argument, nullptr, OptFreqSeek},
@@ -152,6 +158,10 @@ static void usage_rds()
 	       "  --silent           only set the result code, do not print any messages\n"
 	       "  --verbose          turn on verbose mode - every received RDS group\n"
 	       "                     will be printed\n"
+	       "  --daemon <socket>  decode the RDS data of all devices given with -d (which\n"
+	       "                     can be used multiple times), or else of all RDS-capable\n"
+	       "                     devices, and answer queries about the current PI, PS, RT,\n"
+	       "                     AF and TMC state on the Unix socket <socket>\n"
 	       );
 }
 
@@ -575,11 +585,12 @@ static void read_rds(struct v4l2_rds *handle, const int fd, const int wait_limit
 	int byte_cnt = 0;
 	int error_cnt = 0;
 	uint32_t updated_fields = 0x00;
-	struct v4l2_rds_data rds_data; /* read buffer for rds blocks */
+	/* read buffer for rds blocks, reading many blocks at once is much
+	 * faster for RDS stream files */
+	struct v4l2_rds_data rds_data[1024];
 
 	while (!params.terminate_decoding) {
-		memset(&rds_data, 0, sizeof(rds_data));
-		if ((byte_cnt=read(fd, &rds_data, 3)) != 3) {
+		if ((byte_cnt=read(fd, rds_data, sizeof(rds_data))) < 3) {
 			if (byte_cnt == 0) {
 				printf("\nEnd of input file reached \n");
 				break;
@@ -592,14 +603,20 @@ static void read_rds(struct v4l2_rds *handle, const int fd, const int wait_limit
 			/* wait for new data to arrive: transmission of 1
 			 * group takes ~88.7ms */
 			usleep(wait_limit * 1000);
-		}
-		else if (byte_cnt == 3) {
+		} else {
+			unsigned cnt = byte_cnt / 3;
+			unsigned i = 0;
+
 			error_cnt = 0;
-			/* true if a new group was decoded */
-			if ((updated_fields = v4l2_rds_add(handle, &rds_data))) {
-				print_rds_data(handle, updated_fields);
-				if (params.options[OptVerbose])
-					 print_rds_group(v4l2_rds_get_group(handle));
+			/* stop at every new group with updated fields */
+			while (i < cnt && !params.terminate_decoding) {
+				i += v4l2_rds_add_blocks(handle, rds_data + i, cnt - i,
+							 0xffffffff, &updated_fields);
+				if (updated_fields) {
+					print_rds_data(handle, updated_fields);
+					if (params.options[OptVerbose])
+						 print_rds_group(v4l2_rds_get_group(handle));
+				}
 			}
 		}
 	}
@@ -665,6 +682,10 @@ static int parse_cl(int argc, char **argv)
 				snprintf(params.fd_name, sizeof(params.fd_name), "/dev/radio%s", optarg);
 			}
 			params.fd_name[sizeof(params.fd_name) - 1] = '\0';
+			params.devices.push_back(params.fd_name);
+			break;
+		case OptDaemon:
+			params.daemon_socket = optarg;
 			break;
 		case OptSetFreq:
 			params.freq = strtod(optarg, nullptr);
@@ -862,6 +883,20 @@ int main(int argc, char **argv)
 		std::exit(EXIT_SUCCESS);
 	}
 
+	/* Daemon Mode: decode many devices, disables all other features */
+	if (params.options[OptDaemon]) {
+		if (params.devices.empty())
+			params.devices = list_devices();
+		if (params.devices.empty()) {
+			fprintf(stderr, "No RDS-capable device found\n");
+			std::exit(EXIT_FAILURE);
+		}
+		if (rds_daemon(params.devices, params.daemon_socket,
+			       params.options[OptRBDS], params.options[OptVerbose]))
+			std::exit(EXIT_FAILURE);
+		std::exit(EXIT_SUCCESS);
+	}
+
 	/* Device Mode: open the radio device as read-only and non-blocking */
 	if (!params.options[OptSetDevice]) {
 		/* check the system for RDS capable devices */
@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+
+#ifndef _RDS_CTL_H_
+#define _RDS_CTL_H_
+
+#include <string>
+#include <vector>
+
+// rds-daemon.cpp
+int rds_daemon(const std::vector<std::string> &devices, const char *socket_path,
+	       bool is_rbds, bool verbose);
+
+#endif
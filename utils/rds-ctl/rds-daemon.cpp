@@ -0,0 +1,504 @@
+// SPDX-License-Identifier: LGPL-2.1-or-later
+/*
+ * rds-ctl daemon mode: decode the RDS data of many radio devices and
+ * answer queries about the current station state on a Unix socket.
+ *
+ * The protocol is line based. Every command is a single line, every
+ * response ends with an empty line:
+ *
+ *   list                  the monitored devices, one per line
+ *   get [<dev>...]        the state of all or the given devices
+ *   help                  the list of commands
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+#include <libv4l2rds.h>
+
+#include "rds-ctl.h"
+
+/*
+ * The state of a station is kept as text, one string per field. A field
+ * is only encoded again when the decoder reported a change in it since
+ * the last query, so a query costs little more than copying the strings.
+ */
+enum rds_field {
+	FIELD_PI,
+	FIELD_PS,
+	FIELD_RT,
+	FIELD_AF,
+	FIELD_TMC,
+	FIELD_NUM
+};
+
+static const uint32_t field_masks[FIELD_NUM] = {
+	V4L2_RDS_PI,
+	V4L2_RDS_PS,
+	V4L2_RDS_RT,
+	V4L2_RDS_AF,
+	V4L2_RDS_TMC_SG | V4L2_RDS_TMC_MG | V4L2_RDS_TMC_SYS | V4L2_RDS_TMC_TUNING,
+};
+
+struct rds_station {
+	std::string device;
+	int fd;
+	struct v4l2_rds *handle;
+	uint32_t changed;	/* fields updated since they were last encoded */
+	bool tmc_sys;		/* TMC system information was received */
+	unsigned char partial[sizeof(struct v4l2_rds_data)];
+	unsigned partial_len;	/* bytes of an incomplete block in partial */
+	std::string fields[FIELD_NUM];
+};
+
+struct rds_client {
+	std::string in;
+	std::string out;
+	bool eof;		/* the client shut down its side */
+};
+
+/* the longest command line */
+#define CLIENT_IN_MAX	1024
+/* commands are not handled while this much output is waiting to be read */
+#define CLIENT_OUT_MAX	(64 * 1024)
+
+/* the epoll data is the type of fd in the upper and the fd in the lower half */
+enum epoll_type {
+	EPOLL_LISTEN,
+	EPOLL_STATION,
+	EPOLL_CLIENT,
+};
+
+#define EPOLL_DATA(type, v)	((static_cast<__u64>(type) << 32) | static_cast<__u32>(v))
+
+static volatile bool terminate_daemon;
+
+static void signal_handler_terminate(int signum)
+{
+	terminate_daemon = true;
+}
+
+static std::string encode_af(const struct v4l2_rds_af_set &af_set)
+{
+	std::string s = "af:";
+	char buf[32];
+
+	for (int i = 0; i < af_set.size && i < af_set.announced_af; i++) {
+		if (af_set.af[i] >= 87500000)
+			sprintf(buf, " %.1fMHz", af_set.af[i] / 1000000.0);
+		else
+			sprintf(buf, " %.3fkHz", af_set.af[i] / 1000.0);
+		s += buf;
+	}
+	return s + "\n";
+}
+
+static std::string encode_tmc(const struct rds_station &station)
+{
+	const struct v4l2_rds *handle = station.handle;
+	const struct v4l2_rds_tmc &tmc = handle->tmc;
+	std::ostringstream s;
+	char buf[128];
+
+	if (station.tmc_sys) {
+		sprintf(buf, "tmc: ltn %u, sid %u, spn %s\n",
+			tmc.ltn, tmc.sid, tmc.spn);
+		s << buf;
+	}
+	if (handle->valid_fields & (V4L2_RDS_TMC_SG | V4L2_RDS_TMC_MG)) {
+		const struct v4l2_rds_tmc_msg &msg = tmc.tmc_msg;
+
+		sprintf(buf, "tmc-msg: location %04x, event %04x, extent %02x, duration %02x",
+			msg.location, msg.event, msg.extent, msg.dp);
+		s << buf;
+		for (int i = 0; i < msg.additional.size; i++) {
+			sprintf(buf, ", %02u=%04x", msg.additional.fields[i].label,
+				msg.additional.fields[i].data);
+			s << buf;
+		}
+		s << "\n";
+	}
+	if (handle->valid_fields & V4L2_RDS_TMC_TUNING) {
+		for (int i = 0; i < tmc.tuning.station_cnt; i++) {
+			const struct v4l2_tmc_station &st = tmc.tuning.station[i];
+
+			sprintf(buf, "tmc-station: pi %04x, afs", st.pi);
+			s << buf;
+			for (int j = 0; j < st.afi.af_size; j++) {
+				sprintf(buf, " %.1fMHz", st.afi.af[j] / 1000000.0);
+				s << buf;
+			}
+			s << "\n";
+		}
+	}
+	return s.str();
+}
+
+static void encode_field(struct rds_station &station, unsigned field)
+{
+	const struct v4l2_rds *handle = station.handle;
+	char buf[128];
+
+	station.fields[field].clear();
+	if (field != FIELD_TMC && !(handle->valid_fields & field_masks[field]))
+		return;
+
+	switch (field) {
+	case FIELD_PI:
+		sprintf(buf, "pi: %04x\n", handle->pi);
+		station.fields[field] = buf;
+		break;
+	case FIELD_PS:
+		station.fields[field] = std::string("ps: ") +
+			reinterpret_cast<const char *>(handle->ps) + "\n";
+		break;
+	case FIELD_RT:
+		station.fields[field] = std::string("rt: ") +
+			reinterpret_cast<const char *>(handle->rt) + "\n";
+		break;
+	case FIELD_AF:
+		station.fields[field] = encode_af(handle->rds_af);
+		break;
+	case FIELD_TMC:
+		station.fields[field] = encode_tmc(station);
+		break;
+	}
+}
+
+static std::string station_state(struct rds_station &station)
+{
+	std::string s = "device: " + station.device + "\n";
+
+	if (station.fd < 0)
+		s += "disconnected\n";
+	for (unsigned i = 0; i < FIELD_NUM; i++) {
+		if (station.changed & field_masks[i])
+			encode_field(station, i);
+		s += station.fields[i];
+	}
+	station.changed = 0;
+	return s;
+}
+
+static bool station_match(const struct rds_station &station, const std::string &name)
+{
+	if (station.device == name)
+		return true;
+	if (name.length() <= 3 && name[0] >= '0' && name[0] <= '9')
+		return station.device == "/dev/radio" + name;
+	return station.device == "/dev/" + name;
+}
+
+static std::string handle_command(std::vector<struct rds_station> &stations,
+				  const std::string &line)
+{
+	std::istringstream in(line);
+	std::string cmd, arg;
+	std::string s;
+
+	in >> cmd;
+	if (cmd == "list") {
+		for (const auto &station : stations)
+			s += station.device + "\n";
+	} else if (cmd == "get") {
+		std::vector<std::string> names;
+
+		while (in >> arg)
+			names.push_back(arg);
+		for (auto &station : stations) {
+			bool found = names.empty();
+
+			for (const auto &name : names)
+				found |= station_match(station, name);
+			if (found)
+				s += station_state(station);
+		}
+		if (s.empty())
+			s = "error: unknown device\n";
+	} else if (cmd == "help") {
+		s = "list\nget [<dev>...]\nhelp\n";
+	} else if (!cmd.empty()) {
+		s = "error: unknown command '" + cmd + "'\n";
+	}
+	return s + "\n";
+}
+
+static void read_station(int epfd, struct rds_station &station)
+{
+	struct v4l2_rds_data rds_data[256];
+	unsigned char *buf = reinterpret_cast<unsigned char *>(rds_data);
+	size_t len = station.partial_len;
+	ssize_t byte_cnt;
+
+	// a block may be split over two reads
+	memcpy(buf, station.partial, len);
+	while ((byte_cnt = read(station.fd, buf + len, sizeof(rds_data) - len)) > 0) {
+		unsigned blocks = (len + byte_cnt) / sizeof(rds_data[0]);
+		uint32_t updated_fields;
+
+		len += byte_cnt;
+		v4l2_rds_add_blocks(station.handle, rds_data, blocks, 0,
+				    &updated_fields);
+		station.changed |= updated_fields;
+		if (updated_fields & V4L2_RDS_TMC_SYS)
+			station.tmc_sys = true;
+		len -= blocks * sizeof(rds_data[0]);
+		memmove(buf, rds_data + blocks, len);
+	}
+	memcpy(station.partial, buf, len);
+	station.partial_len = len;
+	if (byte_cnt < 0 && errno == EAGAIN)
+		return;
+	fprintf(stderr, "%s: %s\n", station.device.c_str(),
+		byte_cnt ? strerror(errno) : "end of data");
+	epoll_ctl(epfd, EPOLL_CTL_DEL, station.fd, nullptr);
+	close(station.fd);
+	station.fd = -1;
+}
+
+static int open_socket(const char *socket_path)
+{
+	struct sockaddr_un addr = {};
+	struct stat st;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", socket_path);
+		return -1;
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket");
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	// remove a socket left behind by an earlier run, but nothing else
+	if (!stat(socket_path, &st) && S_ISSOCK(st.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		bool in_use = probe >= 0 &&
+			(!connect(probe, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ||
+			 errno != ECONNREFUSED);
+
+		if (probe >= 0)
+			close(probe);
+		if (in_use) {
+			fprintf(stderr, "%s is in use by another daemon\n", socket_path);
+			close(fd);
+			return -1;
+		}
+		unlink(socket_path);
+	}
+	if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) ||
+	    listen(fd, 16)) {
+		fprintf(stderr, "Failed to listen on %s: %s\n", socket_path,
+			strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Handle the complete commands of a client and send the responses.
+ * Returns false if the connection should be closed.
+ */
+static bool client_update(int epfd, int fd, struct rds_client &client,
+			  std::vector<struct rds_station> &stations)
+{
+	struct epoll_event ev = {};
+	size_t pos;
+
+	while (true) {
+		while (client.out.size() < CLIENT_OUT_MAX &&
+		       (pos = client.in.find('\n')) != std::string::npos) {
+			std::string line = client.in.substr(0, pos);
+
+			client.in.erase(0, pos + 1);
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			client.out += handle_command(stations, line);
+		}
+		if (client.out.empty())
+			break;
+
+		ssize_t n = write(fd, client.out.data(), client.out.size());
+
+		if (n < 0 && errno == EAGAIN)
+			break;
+		if (n < 0)
+			return false;
+		client.out.erase(0, n);
+	}
+	// a client that shut down its side is done once it has all responses
+	if (client.eof && client.out.empty())
+		return false;
+	// a client that never sends a newline can't make us grow without bound
+	if (client.in.size() > CLIENT_IN_MAX &&
+	    client.in.find('\n') == std::string::npos)
+		return false;
+	/*
+	 * Only read more commands while the responses are read by the client,
+	 * and only wait for the client to become writable while output is
+	 * pending.
+	 */
+	if (!client.eof && client.out.size() < CLIENT_OUT_MAX)
+		ev.events |= EPOLLIN;
+	if (!client.out.empty())
+		ev.events |= EPOLLOUT;
+	ev.data.u64 = EPOLL_DATA(EPOLL_CLIENT, fd);
+	epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+	return true;
+}
+
+static bool client_read(int fd, struct rds_client &client)
+{
+	char buf[CLIENT_IN_MAX];
+	ssize_t n = read(fd, buf, sizeof(buf));
+
+	if (n > 0) {
+		client.in.append(buf, n);
+		return true;
+	}
+	if (n < 0)
+		return errno == EAGAIN || errno == EINTR;
+	/*
+	 * The commands sent before the shutdown are still answered, including
+	 * a last one without a newline.
+	 */
+	client.eof = true;
+	if (!client.in.empty() && client.in.back() != '\n')
+		client.in += '\n';
+	return true;
+}
+
+int rds_daemon(const std::vector<std::string> &devices, const char *socket_path,
+	       bool is_rbds, bool verbose)
+{
+	std::vector<struct rds_station> stations(devices.size());
+	std::map<int, struct rds_client> clients;
+	struct epoll_event ev = {};
+	struct epoll_event events[32];
+	int listen_fd;
+	int epfd;
+
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		return -1;
+	}
+	for (unsigned i = 0; i < devices.size(); i++) {
+		struct rds_station &station = stations[i];
+
+		station.device = devices[i];
+		station.fd = open(station.device.c_str(), O_RDONLY | O_NONBLOCK);
+		if (station.fd < 0) {
+			fprintf(stderr, "Failed to open %s: %s\n", station.device.c_str(),
+				strerror(errno));
+			return -1;
+		}
+		station.handle = v4l2_rds_create(is_rbds);
+		station.changed = ~0U;
+		ev.events = EPOLLIN;
+		ev.data.u64 = EPOLL_DATA(EPOLL_STATION, i);
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, station.fd, &ev)) {
+			fprintf(stderr, "Failed to poll %s: %s\n", station.device.c_str(),
+				strerror(errno));
+			return -1;
+		}
+		if (verbose)
+			printf("Monitoring %s\n", station.device.c_str());
+	}
+
+	listen_fd = open_socket(socket_path);
+	if (listen_fd < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.u64 = EPOLL_DATA(EPOLL_LISTEN, listen_fd);
+	epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	signal(SIGINT, signal_handler_terminate);
+	signal(SIGTERM, signal_handler_terminate);
+	signal(SIGPIPE, SIG_IGN);
+	if (verbose)
+		printf("Listening on %s\n", socket_path);
+	fflush(stdout);
+
+	while (!terminate_daemon) {
+		int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("epoll_wait");
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			unsigned type = events[i].data.u64 >> 32;
+			int v = static_cast<__u32>(events[i].data.u64);
+
+			switch (type) {
+			case EPOLL_LISTEN: {
+				int fd;
+
+				while ((fd = accept4(listen_fd, nullptr, nullptr,
+						     SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+					ev.events = EPOLLIN;
+					ev.data.u64 = EPOLL_DATA(EPOLL_CLIENT, fd);
+					epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+					clients[fd];
+				}
+				break;
+			}
+			case EPOLL_STATION:
+				if (stations[v].fd >= 0)
+					read_station(epfd, stations[v]);
+				break;
+			case EPOLL_CLIENT: {
+				auto it = clients.find(v);
+				bool ok;
+
+				if (it == clients.end())
+					break;
+				ok = !(events[i].events & EPOLLERR);
+				if (ok && (events[i].events & EPOLLIN))
+					ok = client_read(v, it->second);
+				if (ok)
+					ok = client_update(epfd, v, it->second, stations);
+				if (!ok) {
+					close(v);
+					clients.erase(it);
+				}
+				break;
+			}
+			}
+		}
+	}
+
+	for (auto &client : clients)
+		close(client.first);
+	close(listen_fd);
+	unlink(socket_path);
+	for (auto &station : stations) {
+		if (station.fd >= 0)
+			close(station.fd);
+		v4l2_rds_destroy(station.handle);
+	}
+	close(epfd);
+	return 0;
+}
@@ -50,6 +50,7 @@ enum Option {
 	OptExitOnFail = 'E',
 	OptStreamAllFormats = 'f',
 	OptHelp = 'h',
+	OptJobs = 'j',
 	OptSetMediaDevice = 'm',
 	OptSetMediaDeviceOnly = 'M',
 	OptNoWarnings = 'n',
@@ -67,6 +68,8 @@ enum Option {
 	OptMediaBusInfo = 'z',
 	OptStreamFrom = 128,
 	OptStreamFromHdr,
+	OptBenchmark,
+	OptStress,
 	OptVersion,
 	OptLast = 256
 };
@@ -89,11 +92,17 @@ bool is_uvcvideo;
 int media_fd = -1;
 unsigned warnings;
 bool has_mmu = true;
+unsigned max_jobs = 1;
 
 static unsigned color_component;
 static unsigned color_skip;
 static unsigned color_perc = 90;
 
+static unsigned stress_seconds = 60;
+static unsigned stress_seed;
+static bool stress_has_seed;
+static unsigned stress_stall_ms = 2000;
+
 struct dev_state {
 	struct node *node;
 	std::vector<v4l2_ext_control> control_vec;
@@ -127,6 +136,7 @@ static struct option long_options[] = {
 	{"media-device", required_argument, nullptr, OptSetMediaDevice},
 	{"media-device-only", required_argument, nullptr, OptSetMediaDeviceOnly},
 	{"media-bus-info", required_argument, nullptr, OptMediaBusInfo},
+	{"jobs", required_argument, nullptr, OptJobs},
 	{"help", no_argument, nullptr, OptHelp},
 	{"verbose", no_argument, nullptr, OptVerbose},
 	{"color", required_argument, nullptr, OptColor},
@@ -144,6 +154,8 @@ static struct option long_options[] = {
 	{"stream-all-formats", optional_argument, nullptr, OptStreamAllFormats},
 	{"stream-all-io", no_argument, nullptr, OptStreamAllIO},
 	{"stream-all-color", required_argument, nullptr, OptStreamAllColorTest},
+	{"benchmark", optional_argument, nullptr, OptBenchmark},
+	{"stress", optional_argument, nullptr, OptStress},
 	{"version", no_argument, nullptr, OptVersion},
 	{nullptr, 0, nullptr, 0}
 };
@@ -216,6 +228,11 @@ static void usage()
 	printf("                     If <dev> starts with a digit, then /dev/media<dev> is used.\n");
 	printf("                     If <dev> doesn't exist, then attempt to find a media device with a\n");
 	printf("                     bus info string equal to <dev>.\n");
+	printf("  -j, --jobs <jobs>  Test up to <jobs> interfaces of the media device given with -m\n");
+	printf("                     at the same time, each in its own process. If <jobs> is 0,\n");
+	printf("                     then all interfaces are tested at the same time. Combined\n");
+	printf("                     with -s this streams on all video devices simultaneously.\n");
+	printf("                     The output is shown per interface, in the usual order.\n");
 	printf("  -M, --media-device-only <dev>\n");
 	printf("                     Use device <dev> as the media controller device. Only test this\n");
 	printf("                     device, don't walk over all the interfaces.\n");
@@ -253,6 +270,23 @@ static void usage()
 	printf("                     signal is present on the input(s). If <skip> is not specified,\n");
 	printf("                     then just capture the first frame. If <perc> is not specified,\n");
 	printf("                     then this defaults to 90%%.\n");
+	printf("  --benchmark [frames=<count>,csv=<file>]\n");
+	printf("                     For all formats and memory types stream <count> frames\n");
+	printf("                     (default 300) as fast as possible and report the frame rate,\n");
+	printf("                     the VIDIOC_QBUF and VIDIOC_DQBUF latency, the CPU time per\n");
+	printf("                     frame and the time it takes to set up the buffers.\n");
+	printf("                     Only discrete frame sizes or the default frame size are used,\n");
+	printf("                     at the highest frame rate. Each result is also written as a\n");
+	printf("                     line to the CSV <file> if given, to compare kernel versions.\n");
+	printf("                     For DMABUF --expbuf-device needs to be set as well.\n");
+	printf("  --stress [time=<secs>,seed=<seed>,stall=<ms>]\n");
+	printf("                     Stream with the current format for <secs> seconds (default 60)\n");
+	printf("                     in cycles with a random memory type and number of buffers.\n");
+	printf("                     Streaming is restarted a random number of times per cycle,\n");
+	printf("                     and buffers are dequeued and requeued by separate threads,\n");
+	printf("                     in random order and after a random delay. It fails if the\n");
+	printf("                     driver holds all buffers for <ms> milliseconds (default 2000).\n");
+	printf("                     The random choices depend on <seed>, which is shown if not set.\n");
 	printf("  -E, --exit-on-fail Exit on the first fail.\n");
 	printf("  -h, --help         Display this help message.\n");
 	printf("  -C, --color <when> Highlight OK/warn/fail/FAIL strings with colors\n");
@@ -290,6 +324,24 @@ const char *ok(int res)
 	return buf;
 }
 
+void getTestResults(test_results &res)
+{
+	res.total = grand_total;
+	res.ok = grand_ok;
+	res.warnings = grand_warnings;
+	res.result = app_result;
+}
+
+/* Add the results of device nodes tested in another process. */
+void addTestResults(const test_results &res)
+{
+	grand_total += res.total;
+	grand_ok += res.ok;
+	grand_warnings += res.warnings;
+	if (res.result)
+		app_result = res.result;
+}
+
 int check_string(const char *s, size_t len)
 {
 	size_t sz = strnlen(s, len);
@@ -970,7 +1022,8 @@ err:
 }
 
 void testNode(struct node &node, struct node &node_m2m_cap, struct node &expbuf_node, media_type type,
-	      unsigned frame_count, unsigned all_fmt_frame_count, int parent_media_fd)
+	      unsigned frame_count, unsigned all_fmt_frame_count, unsigned benchmark_frame_count,
+	      int parent_media_fd)
 {
 	struct node node2;
 	struct v4l2_capability vcap = {};
@@ -1514,7 +1567,8 @@ void testNode(struct node &node, struct node &node_m2m_cap, struct node &expbuf_
 			break;
 
 		if (options[OptStreaming] || (node.is_video && options[OptStreamAllFormats]) ||
-		    (node.is_video && node.can_capture && options[OptStreamAllColorTest]))
+		    (node.is_video && node.can_capture && options[OptStreamAllColorTest]) ||
+		    (node.is_video && (options[OptBenchmark] || options[OptStress])))
 			printf("Test %s %d:\n\n",
 				node.can_capture ? "input" : "output", io);
 
@@ -1606,6 +1660,25 @@ void testNode(struct node &node, struct node &node_m2m_cap, struct node &expbuf_
 						     color_skip, color_perc);
 			}
 		}
+
+		if (node.is_video && options[OptBenchmark]) {
+			printf("Benchmark using all formats:\n");
+
+			if (!node.is_m2m)
+				streamingSetup(&node);
+			benchmarkAllFormats(&node, &expbuf_node, benchmark_frame_count);
+			printf("\n");
+		}
+
+		if (node.is_video && options[OptStress]) {
+			printf("Stress test:\n");
+
+			if (!node.is_m2m)
+				streamingSetup(&node);
+			stressTest(&node, &expbuf_node, stress_seconds, stress_seed,
+				   stress_stall_ms);
+			printf("\n");
+		}
 	}
 
 	/*
@@ -1639,7 +1712,7 @@ show_total:
 
 	if (node.is_media() && options[OptSetMediaDevice]) {
 		walkTopology(node, expbuf_node,
-			     frame_count, all_fmt_frame_count);
+			     frame_count, all_fmt_frame_count, benchmark_frame_count);
 		/* Final test report */
 		printf("\nGrand Total for %s device %s: %d, Succeeded: %d, Failed: %d, Warnings: %d\n",
 		       driver.c_str(), node.device,
@@ -1666,6 +1739,8 @@ int main(int argc, char **argv)
 	std::string expbuf_device;	/* --expbuf-device device */
 	unsigned frame_count = 60;
 	unsigned all_fmt_frame_count = 0;
+	unsigned benchmark_frame_count = 300;
+	const char *benchmark_csv_file = nullptr;
 	char short_options[26 * 2 * 3 + 1];
 	char *value, *subs;
 	int idx = 0;
@@ -1741,6 +1816,9 @@ int main(int argc, char **argv)
 			device = make_devname(optarg, "media", optarg, true);
 			type = MEDIA_TYPE_MEDIA;
 			break;
+		case OptJobs:
+			max_jobs = strtoul(optarg, nullptr, 0);
+			break;
 		case OptMediaBusInfo:
 			media_bus_info = optarg;
 			break;
@@ -1811,6 +1889,59 @@ int main(int argc, char **argv)
 				}
 			}
 			break;
+		case OptBenchmark:
+			subs = optarg;
+			while (subs && *subs != '\0') {
+				static constexpr const char *subopts[] = {
+					"frames",
+					"csv",
+					nullptr
+				};
+
+				switch (parse_subopt(&subs, subopts, &value)) {
+				case 0:
+					benchmark_frame_count = strtoul(value, nullptr, 0);
+					if (!benchmark_frame_count)
+						benchmark_frame_count = 300;
+					break;
+				case 1:
+					benchmark_csv_file = value;
+					break;
+				default:
+					usage();
+					std::exit(EXIT_FAILURE);
+				}
+			}
+			break;
+		case OptStress:
+			subs = optarg;
+			while (subs && *subs != '\0') {
+				static constexpr const char *subopts[] = {
+					"time",
+					"seed",
+					"stall",
+					nullptr
+				};
+
+				switch (parse_subopt(&subs, subopts, &value)) {
+				case 0:
+					stress_seconds = strtoul(value, nullptr, 0);
+					break;
+				case 1:
+					stress_seed = strtoul(value, nullptr, 0);
+					stress_has_seed = true;
+					break;
+				case 2:
+					stress_stall_ms = strtoul(value, nullptr, 0);
+					if (!stress_stall_ms)
+						stress_stall_ms = 2000;
+					break;
+				default:
+					usage();
+					std::exit(EXIT_FAILURE);
+				}
+			}
+			break;
 		case OptColor:
 			if (!strcmp(optarg, "always"))
 				show_colors = true;
@@ -1866,6 +1997,9 @@ int main(int argc, char **argv)
 	print_sha();
 	printf("\n");
 
+	if (!stress_has_seed)
+		stress_seed = time(nullptr) ^ getpid();
+
 	bool direct = !options[OptUseWrapper];
 	int fd;
 
@@ -1915,8 +2049,26 @@ int main(int argc, char **argv)
 		}
 	}
 
-	testNode(node, node, expbuf_node, type, frame_count, all_fmt_frame_count);
+	if (benchmark_csv_file) {
+		benchmark_csv = fopen(benchmark_csv_file, "w");
+		if (!benchmark_csv) {
+			fprintf(stderr, "Failed to open %s: %s\n", benchmark_csv_file,
+				strerror(errno));
+			std::exit(EXIT_FAILURE);
+		}
+		fprintf(benchmark_csv, "driver,device,output_format,capture_format,width,height,field,"
+			"memory,buffers,frames,fps,reqbufs_us,create_bufs_us,map_us,"
+			"qbuf_median_us,qbuf_p99_us,qbuf_max_us,"
+			"dqbuf_median_us,dqbuf_p99_us,dqbuf_max_us,cpu_us_per_frame\n");
+		// Write it out now, or every forked child would write it again
+		fflush(benchmark_csv);
+	}
+
+	testNode(node, node, expbuf_node, type, frame_count, all_fmt_frame_count,
+		 benchmark_frame_count);
 
+	if (benchmark_csv)
+		fclose(benchmark_csv);
 	if (!expbuf_device.empty())
 		expbuf_node.close();
 	if (media_fd >= 0)
@@ -54,6 +54,8 @@ extern int kernel_version;
 extern int media_fd;
 extern unsigned warnings;
 extern bool has_mmu;
+extern FILE *benchmark_csv;
+extern unsigned max_jobs; // Number of device nodes of a media device to test at the same time
 
 enum poll_mode {
 	POLL_MODE_NONE,
@@ -318,8 +320,19 @@ int check_string(const char *s, size_t len);
 int check_ustring(const __u8 *s, int len);
 int check_0(const void *p, int len);
 int restoreFormat(struct node *node);
+
+struct test_results {
+	int total;
+	int ok;
+	int warnings;
+	int result;
+};
+
+void getTestResults(test_results &res);
+void addTestResults(const test_results &res);
 void testNode(struct node &node, struct node &node_m2m_cap, struct node &expbuf_node, media_type type,
-	      unsigned frame_count, unsigned all_fmt_frame_count, int parent_media_fd = -1);
+	      unsigned frame_count, unsigned all_fmt_frame_count, unsigned benchmark_frame_count,
+	      int parent_media_fd = -1);
 std::string stream_from(const std::string &pixelformat, bool &use_hdr);
 
 // Media Controller ioctl tests
@@ -328,7 +341,8 @@ int testMediaTopology(struct node *node);
 int testMediaEnum(struct node *node);
 int testMediaSetupLink(struct node *node);
 void walkTopology(struct node &node, struct node &expbuf_node,
-		  unsigned frame_count, unsigned all_fmt_frame_count);
+		  unsigned frame_count, unsigned all_fmt_frame_count,
+		  unsigned benchmark_frame_count);
 
 // Debug ioctl tests
 int testRegister(struct node *node);
@@ -422,6 +436,11 @@ int testRequests(struct node *node, bool test_streaming);
 void streamAllFormats(struct node *node, unsigned frame_count);
 void streamM2MAllFormats(struct node *node, unsigned frame_count);
 
+// Benchmark
+void benchmarkAllFormats(struct node *node, struct node *expbuf_node, unsigned frame_count);
+void stressTest(struct node *node, struct node *expbuf_node, unsigned seconds,
+		unsigned seed, unsigned stall_ms);
+
 // Color tests
 int testColorsAllFormats(struct node *node, unsigned component,
 			 unsigned skip, unsigned perc);
@@ -0,0 +1,785 @@
+/*
+    V4L2 API compliance streaming benchmark and stress test.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+ */
+
+#include <algorithm>
+#include <vector>
+
+#include <poll.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+#include "v4l2-compliance.h"
+
+FILE *benchmark_csv;
+
+/* Number of buffers allocated with VIDIOC_REQBUFS, one more is added with VIDIOC_CREATE_BUFS */
+static constexpr unsigned bench_buffers = 3;
+
+struct bench_result {
+	unsigned buffers;
+	unsigned frames;
+	__u64 elapsed;		/* ns from STREAMON until the last frame was dequeued */
+	__u64 cpu;		/* ns of user and system time used while streaming */
+	__u64 reqbufs;		/* ns in VIDIOC_REQBUFS, including VIDIOC_QUERYBUF */
+	__u64 create_bufs;	/* ns in VIDIOC_CREATE_BUFS, 0 if not supported */
+	__u64 map;		/* ns to mmap, allocate or export the buffers */
+	std::vector<__u64> qbuf;	/* ns in each VIDIOC_QBUF */
+	std::vector<__u64> dqbuf;	/* ns in each successful VIDIOC_DQBUF */
+};
+
+static __u64 bench_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __u64 bench_cpu_ns()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000000ULL +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1000ULL;
+}
+
+static const char *bench_memory2s(unsigned memory)
+{
+	switch (memory) {
+	case V4L2_MEMORY_MMAP:
+		return "MMAP";
+	case V4L2_MEMORY_USERPTR:
+		return "USERPTR";
+	default:
+		return "DMABUF";
+	}
+}
+
+/* Return the p-th percentile of the sorted durations in microseconds. */
+static double bench_percentile_us(const std::vector<__u64> &sorted, unsigned p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[(sorted.size() - 1) * p / 100] / 1000.0;
+}
+
+static void bench_prepare_buf(const cv4l_queue &q, cv4l_buffer &buf, unsigned &field)
+{
+	buf.update(q, buf.g_index());
+	if (!v4l_type_is_output(q.g_type()))
+		return;
+
+	/* The contents of output buffers don't matter, only the time it takes to process them. */
+	for (unsigned p = 0; p < q.g_num_planes(); p++) {
+		buf.s_bytesused(q.g_length(p), p);
+		buf.s_data_offset(0, p);
+	}
+	buf.s_field(field);
+	if (field == V4L2_FIELD_TOP)
+		field = V4L2_FIELD_BOTTOM;
+	else if (field == V4L2_FIELD_BOTTOM)
+		field = V4L2_FIELD_TOP;
+}
+
+static int bench_qbuf(struct node *node, cv4l_buffer &buf, bench_result &res)
+{
+	__u64 start = bench_ns();
+	int ret = node->qbuf(buf);
+
+	res.qbuf.push_back(bench_ns() - start);
+	return ret;
+}
+
+static unsigned bench_expbuf_type(struct node *expbuf_node)
+{
+	if (expbuf_node->g_caps() & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
+		return V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (expbuf_node->g_caps() & V4L2_CAP_VIDEO_CAPTURE)
+		return V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	if (expbuf_node->g_caps() & V4L2_CAP_VIDEO_OUTPUT_MPLANE)
+		return V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+	return V4L2_BUF_TYPE_VIDEO_OUTPUT;
+}
+
+/*
+ * Allocate reqbufs_count buffers with VIDIOC_REQBUFS and create_count more
+ * with VIDIOC_CREATE_BUFS, if supported.
+ */
+static int benchmarkSetupQueue(struct node *node, struct node *expbuf_node,
+			       cv4l_queue &q, cv4l_queue &exp_q, bench_result &res,
+			       unsigned reqbufs_count, unsigned create_count)
+{
+	cv4l_fmt fmt;
+	__u64 start;
+	int ret;
+
+	fail_on_test(node->g_fmt(fmt, q.g_type()));
+
+	start = bench_ns();
+	fail_on_test(q.reqbufs(node, reqbufs_count));
+	res.reqbufs += bench_ns() - start;
+	fail_on_test(q.g_buffers() == 0);
+
+	if (create_count) {
+		start = bench_ns();
+		ret = q.create_bufs(node, create_count, &fmt);
+		fail_on_test_val(ret && ret != ENOTTY, ret);
+		if (!ret)
+			res.create_bufs += bench_ns() - start;
+	}
+
+	start = bench_ns();
+	switch (q.g_memory()) {
+	case V4L2_MEMORY_MMAP:
+		fail_on_test(q.mmap_bufs(node));
+		break;
+	case V4L2_MEMORY_USERPTR:
+		fail_on_test(q.alloc_bufs(node));
+		break;
+	case V4L2_MEMORY_DMABUF: {
+		cv4l_fmt exp_fmt;
+
+		/*
+		 * VIDIOC_CREATE_BUFS accepts a larger sizeimage than the format needs,
+		 * so the exported buffers fit whatever format is benchmarked.
+		 */
+		fail_on_test(expbuf_node->g_fmt(exp_fmt, exp_q.g_type()));
+		if (exp_fmt.g_num_planes() < q.g_num_planes())
+			return ENOTTY;
+		for (unsigned p = 0; p < q.g_num_planes(); p++)
+			exp_fmt.s_sizeimage(std::max(exp_fmt.g_sizeimage(p), q.g_length(p)), p);
+		fail_on_test(exp_q.create_bufs(expbuf_node, q.g_buffers(), &exp_fmt));
+		fail_on_test(exp_q.g_buffers() < q.g_buffers());
+		fail_on_test(exp_q.export_bufs(expbuf_node, exp_q.g_type()));
+		for (unsigned i = 0; i < q.g_buffers(); i++)
+			for (unsigned p = 0; p < q.g_num_planes(); p++)
+				q.s_fd(i, p, exp_q.g_fd(i, p));
+		break;
+	}
+	}
+	res.map += bench_ns() - start;
+	res.buffers += q.g_buffers();
+	return 0;
+}
+
+/*
+ * Stream frame_count frames through queues[0], and through queues[1] as well for
+ * m2m devices, requeueing every buffer as soon as it is dequeued.
+ */
+static int benchmarkStream(struct node *node, cv4l_queue **queues, unsigned num_queues,
+			   unsigned frame_count, bench_result &res)
+{
+	cv4l_fmt fmt;
+	unsigned field;
+	short events = 0;
+
+	/* Only the output queue needs the field, that is the last queue. */
+	node->g_fmt(fmt, queues[num_queues - 1]->g_type());
+	field = fmt.g_field() == V4L2_FIELD_ALTERNATE ? V4L2_FIELD_TOP : fmt.g_field();
+
+	for (unsigned i = 0; i < num_queues; i++) {
+		cv4l_queue &q = *queues[i];
+
+		for (unsigned b = 0; b < q.g_buffers(); b++) {
+			cv4l_buffer buf(q, b);
+
+			bench_prepare_buf(q, buf, field);
+			fail_on_test(bench_qbuf(node, buf, res));
+		}
+		events |= v4l_type_is_output(q.g_type()) ? POLLOUT : POLLIN;
+	}
+
+	fcntl(node->g_fd(), F_SETFL, fcntl(node->g_fd(), F_GETFL) | O_NONBLOCK);
+
+	__u64 start = bench_ns();
+	__u64 cpu_start = bench_cpu_ns();
+
+	/* The m2m output queue is started first, the counted queue last. */
+	for (unsigned i = num_queues; i; i--)
+		fail_on_test(node->streamon(queues[i - 1]->g_type()));
+
+	while (res.frames < frame_count) {
+		struct pollfd pfd = { node->g_fd(), events, 0 };
+		int ret = poll(&pfd, 1, 2000);
+
+		fail_on_test(ret == 0);
+		fail_on_test_val(ret < 0, errno);
+		fail_on_test(pfd.revents & POLLERR);
+
+		for (unsigned i = 0; i < num_queues; i++) {
+			cv4l_queue &q = *queues[i];
+			cv4l_buffer buf(q);
+
+			if (!(pfd.revents & (v4l_type_is_output(q.g_type()) ? POLLOUT : POLLIN)))
+				continue;
+
+			__u64 dq_start = bench_ns();
+
+			ret = node->dqbuf(buf);
+			if (ret == EAGAIN)
+				continue;
+			res.dqbuf.push_back(bench_ns() - dq_start);
+			fail_on_test_val(ret, ret);
+			if (i == 0 && ++res.frames == frame_count)
+				break;
+			bench_prepare_buf(q, buf, field);
+			fail_on_test(bench_qbuf(node, buf, res));
+		}
+	}
+	res.elapsed = bench_ns() - start;
+	res.cpu = bench_cpu_ns() - cpu_start;
+	return 0;
+}
+
+static int benchmarkRun(struct node *node, struct node *expbuf_node, unsigned memory,
+			unsigned frame_count, bench_result &res)
+{
+	unsigned type = node->g_type();
+	cv4l_queue q(type, memory);
+	cv4l_queue m2m_q(v4l_type_invert(type), memory);
+	cv4l_queue *queues[2] = { &q, &m2m_q };
+	unsigned num_queues = node->is_m2m ? 2 : 1;
+	cv4l_queue exp_q(bench_expbuf_type(expbuf_node), V4L2_MEMORY_MMAP);
+	int fd_flags = fcntl(node->g_fd(), F_GETFL);
+	int ret = 0;
+
+	for (unsigned i = 0; !ret && i < num_queues; i++)
+		ret = benchmarkSetupQueue(node, expbuf_node, *queues[i], exp_q, res,
+					  bench_buffers, 1);
+	if (!ret)
+		ret = benchmarkStream(node, queues, num_queues, frame_count, res);
+
+	fcntl(node->g_fd(), F_SETFL, fd_flags);
+	for (unsigned i = 0; i < num_queues; i++)
+		queues[i]->free(node);
+	if (memory == V4L2_MEMORY_DMABUF)
+		exp_q.free(expbuf_node);
+	return ret;
+}
+
+static void benchmarkMemory(struct node *node, struct node *expbuf_node,
+			    unsigned memory, unsigned frame_count)
+{
+	cv4l_fmt cap_fmt, out_fmt;
+	v4l2_capability vcap;
+	bench_result res = {};
+	const char *map_op;
+	bool is_output = !node->is_m2m && v4l_type_is_output(node->g_type());
+	int ret;
+
+	node->g_fmt(cap_fmt);
+	if (node->is_m2m) {
+		node->g_fmt(out_fmt, v4l_type_invert(node->g_type()));
+		printf("\ttest %s for Format %s -> %s, Frame Size %ux%u:\n",
+		       bench_memory2s(memory),
+		       fcc2s(out_fmt.g_pixelformat()).c_str(),
+		       fcc2s(cap_fmt.g_pixelformat()).c_str(),
+		       cap_fmt.g_width(), cap_fmt.g_frame_height());
+	} else {
+		printf("\ttest %s for Format %s, Frame Size %ux%u:\n",
+		       bench_memory2s(memory),
+		       fcc2s(cap_fmt.g_pixelformat()).c_str(),
+		       cap_fmt.g_width(), cap_fmt.g_frame_height());
+	}
+
+	ret = benchmarkRun(node, expbuf_node, memory, frame_count, res);
+
+	std::sort(res.qbuf.begin(), res.qbuf.end());
+	std::sort(res.dqbuf.begin(), res.dqbuf.end());
+	double fps = res.elapsed ? res.frames * 1000000000.0 / res.elapsed : 0;
+	double cpu_per_frame = res.frames ? res.cpu / 1000.0 / res.frames : 0;
+
+	switch (memory) {
+	case V4L2_MEMORY_MMAP:
+		map_op = "mmap";
+		break;
+	case V4L2_MEMORY_USERPTR:
+		map_op = "malloc";
+		break;
+	default:
+		map_op = "VIDIOC_EXPBUF";
+		break;
+	}
+
+	if (!ret) {
+		printf("\t\tVIDIOC_REQBUFS %.1f us, VIDIOC_CREATE_BUFS %.1f us, %s %.1f us for %u buffers\n",
+		       res.reqbufs / 1000.0, res.create_bufs / 1000.0, map_op,
+		       res.map / 1000.0, res.buffers);
+		printf("\t\tVIDIOC_QBUF median %.1f us, p99 %.1f us, max %.1f us\n",
+		       bench_percentile_us(res.qbuf, 50), bench_percentile_us(res.qbuf, 99),
+		       bench_percentile_us(res.qbuf, 100));
+		printf("\t\tVIDIOC_DQBUF median %.1f us, p99 %.1f us, max %.1f us\n",
+		       bench_percentile_us(res.dqbuf, 50), bench_percentile_us(res.dqbuf, 99),
+		       bench_percentile_us(res.dqbuf, 100));
+		printf("\t\tCPU time %.1f us per frame\n", cpu_per_frame);
+	}
+	printf("\t\t%u frames, %.2f fps: %s\n", res.frames, fps, ok(ret));
+
+	if (!benchmark_csv || ret)
+		return;
+
+	node->querycap(vcap);
+	fprintf(benchmark_csv, "%s,%s,%s,%s,%u,%u,%s,%s,%u,%u,%.2f,%.1f,%.1f,%.1f,"
+		"%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+		reinterpret_cast<const char *>(vcap.driver), node->device,
+		node->is_m2m || is_output ?
+			fcc2s((node->is_m2m ? out_fmt : cap_fmt).g_pixelformat()).c_str() : "",
+		is_output ? "" : fcc2s(cap_fmt.g_pixelformat()).c_str(),
+		cap_fmt.g_width(), cap_fmt.g_frame_height(),
+		field2s(cap_fmt.g_field()).c_str(), bench_memory2s(memory),
+		res.buffers, res.frames, fps,
+		res.reqbufs / 1000.0, res.create_bufs / 1000.0, res.map / 1000.0,
+		bench_percentile_us(res.qbuf, 50), bench_percentile_us(res.qbuf, 99),
+		bench_percentile_us(res.qbuf, 100),
+		bench_percentile_us(res.dqbuf, 50), bench_percentile_us(res.dqbuf, 99),
+		bench_percentile_us(res.dqbuf, 100), cpu_per_frame);
+	fflush(benchmark_csv);
+}
+
+static constexpr unsigned bench_memories[] = {
+	V4L2_MEMORY_MMAP,
+	V4L2_MEMORY_USERPTR,
+	V4L2_MEMORY_DMABUF,
+};
+
+static bool bench_can_use_memory(struct node *node, struct node *expbuf_node, unsigned memory)
+{
+	if (!(node->valid_memorytype & (1 << memory)))
+		return false;
+	/* The m2m queues would need two exporting devices. */
+	return memory != V4L2_MEMORY_DMABUF ||
+	       (!node->is_m2m && expbuf_node->g_fd() >= 0);
+}
+
+static void benchmarkAllMemory(struct node *node, struct node *expbuf_node,
+			       unsigned frame_count)
+{
+	for (auto memory : bench_memories)
+		if (bench_can_use_memory(node, expbuf_node, memory))
+			benchmarkMemory(node, expbuf_node, memory, frame_count);
+}
+
+static void benchmarkFmt(struct node *node, struct node *expbuf_node,
+			 __u32 pixelformat, __u32 w, __u32 h, unsigned frame_count)
+{
+	v4l2_fract min_period = { 1, 1000 };
+	cv4l_fmt fmt;
+
+	node->g_fmt(fmt);
+	fmt.s_pixelformat(pixelformat);
+	fmt.s_width(w);
+	fmt.s_field(V4L2_FIELD_ANY);
+	fmt.s_height(h);
+	node->try_fmt(fmt);
+	fmt.s_frame_height(h);
+	node->s_fmt(fmt);
+	/* Measure the highest frame rate the driver supports for this format. */
+	if (node->can_capture)
+		node->set_interval(min_period);
+	benchmarkAllMemory(node, expbuf_node, frame_count);
+}
+
+static void benchmarkM2MFmt(struct node *node, struct node *expbuf_node,
+			    __u32 pixelformat, unsigned frame_count)
+{
+	unsigned cap_type = node->g_type();
+	v4l2_fmtdesc fmtdesc;
+	cv4l_fmt out_fmt;
+
+	node->g_fmt(out_fmt, v4l_type_invert(cap_type));
+	out_fmt.s_pixelformat(pixelformat);
+	if (node->s_fmt(out_fmt))
+		return;
+
+	if (node->enum_fmt(fmtdesc, true, 0))
+		return;
+	do {
+		cv4l_fmt fmt;
+
+		if (node->g_fmt(fmt))
+			continue;
+		fmt.s_pixelformat(fmtdesc.pixelformat);
+		fmt.s_width(out_fmt.g_width());
+		fmt.s_height(out_fmt.g_height());
+		if (node->s_fmt(fmt))
+			continue;
+		benchmarkAllMemory(node, expbuf_node, frame_count);
+	} while (!node->enum_fmt(fmtdesc));
+}
+
+/*
+ * Measure the streaming performance for each format and memory type. Contrary to
+ * streamAllFormats() only the discrete frame sizes or the default frame size are
+ * used, at the highest frame rate.
+ */
+void benchmarkAllFormats(struct node *node, struct node *expbuf_node, unsigned frame_count)
+{
+	v4l2_fmtdesc fmtdesc;
+	unsigned out_type = v4l_type_invert(node->g_type());
+
+	if (!(node->g_caps() & V4L2_CAP_STREAMING)) {
+		printf("\tNot supported without streaming I/O\n");
+		return;
+	}
+
+	if (node->is_m2m) {
+		/* The decoders need a valid bitstream. */
+		if (IS_DECODER(node)) {
+			printf("\tNot supported for decoder devices\n");
+			return;
+		}
+		if (node->enum_fmt(fmtdesc, true, 0, out_type))
+			return;
+		do {
+			benchmarkM2MFmt(node, expbuf_node, fmtdesc.pixelformat, frame_count);
+		} while (!node->enum_fmt(fmtdesc));
+		return;
+	}
+
+	if (node->enum_fmt(fmtdesc, true))
+		return;
+	do {
+		v4l2_frmsizeenum frmsize;
+		cv4l_fmt fmt;
+
+		restoreFormat(node);
+		if (!node->enum_framesizes(frmsize, fmtdesc.pixelformat) &&
+		    frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE) {
+			do {
+				benchmarkFmt(node, expbuf_node, fmtdesc.pixelformat,
+					     frmsize.discrete.width, frmsize.discrete.height,
+					     frame_count);
+			} while (!node->enum_framesizes(frmsize));
+			continue;
+		}
+		node->g_fmt(fmt);
+		benchmarkFmt(node, expbuf_node, fmtdesc.pixelformat,
+			     fmt.g_width(), fmt.g_frame_height(), frame_count);
+	} while (!node->enum_fmt(fmtdesc));
+	restoreFormat(node);
+}
+
+/*
+ * The stress test streams in cycles with a random memory type and number of
+ * buffers. Each cycle restarts streaming a random number of times, while one
+ * thread dequeues the buffers and another thread requeues them in random order
+ * after a random delay.
+ */
+struct stress_buf {
+	unsigned queue;
+	unsigned index;
+};
+
+struct stress_state {
+	struct node *node;
+	cv4l_queue **queues;
+	unsigned num_queues;
+	unsigned field;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	std::vector<stress_buf> dequeued;	/* buffers waiting to be requeued */
+	bool requeueing;			/* the QBUF thread holds a buffer */
+	bool stop;
+	const char *err_ioctl;			/* the ioctl that failed, if any */
+	int err;
+	unsigned qbuf_seed;
+	unsigned frames;			/* frames dequeued from queues[0] */
+	__u64 last_dqbuf;			/* ns */
+	__u64 max_gap;				/* longest time between two dequeued buffers in ns */
+};
+
+struct stress_stats {
+	unsigned cycles;
+	unsigned restarts;
+	__u64 frames;
+	__u64 max_gap;
+};
+
+static void *stressDqbufThread(void *arg)
+{
+	auto st = static_cast<stress_state *>(arg);
+	short events = 0;
+
+	for (unsigned i = 0; i < st->num_queues; i++)
+		events |= v4l_type_is_output(st->queues[i]->g_type()) ? POLLOUT : POLLIN;
+
+	pthread_mutex_lock(&st->lock);
+	while (!st->stop && !st->err_ioctl) {
+		struct pollfd pfd = { st->node->g_fd(), events, 0 };
+
+		pthread_mutex_unlock(&st->lock);
+		int ret = poll(&pfd, 1, 100);
+		pthread_mutex_lock(&st->lock);
+
+		if (ret < 0 && errno != EINTR) {
+			st->err_ioctl = "poll";
+			st->err = errno;
+			break;
+		}
+		if (ret <= 0)
+			continue;
+		/* vb2 signals POLLERR while no buffers are queued, wait for the QBUF thread. */
+		if (!(pfd.revents & events)) {
+			pthread_mutex_unlock(&st->lock);
+			usleep(1000);
+			pthread_mutex_lock(&st->lock);
+			continue;
+		}
+
+		for (unsigned i = 0; i < st->num_queues && !st->err_ioctl; i++) {
+			cv4l_queue &q = *st->queues[i];
+			cv4l_buffer buf(q);
+
+			if (!(pfd.revents & (v4l_type_is_output(q.g_type()) ? POLLOUT : POLLIN)))
+				continue;
+
+			pthread_mutex_unlock(&st->lock);
+			ret = st->node->dqbuf(buf);
+			__u64 now = bench_ns();
+			pthread_mutex_lock(&st->lock);
+
+			if (ret == EAGAIN)
+				continue;
+			if (ret) {
+				st->err_ioctl = "VIDIOC_DQBUF";
+				st->err = ret;
+				break;
+			}
+			st->max_gap = std::max(st->max_gap, now - st->last_dqbuf);
+			st->last_dqbuf = now;
+			if (i == 0)
+				st->frames++;
+			st->dequeued.push_back({ i, buf.g_index() });
+			pthread_cond_broadcast(&st->cond);
+		}
+	}
+	pthread_cond_broadcast(&st->cond);
+	pthread_mutex_unlock(&st->lock);
+	return nullptr;
+}
+
+static void *stressQbufThread(void *arg)
+{
+	auto st = static_cast<stress_state *>(arg);
+
+	pthread_mutex_lock(&st->lock);
+	while (!st->stop && !st->err_ioctl) {
+		if (st->dequeued.empty()) {
+			pthread_cond_wait(&st->cond, &st->lock);
+			continue;
+		}
+
+		unsigned i = rand_r(&st->qbuf_seed) % st->dequeued.size();
+		stress_buf b = st->dequeued[i];
+		/* Requeue three out of four buffers right away, hold on to the others for up to 5 ms. */
+		unsigned delay = rand_r(&st->qbuf_seed) % 4 ? 0 : rand_r(&st->qbuf_seed) % 5000;
+
+		st->dequeued.erase(st->dequeued.begin() + i);
+		st->requeueing = true;
+		pthread_mutex_unlock(&st->lock);
+
+		if (delay)
+			usleep(delay);
+
+		cv4l_queue &q = *st->queues[b.queue];
+		cv4l_buffer buf(q, b.index);
+
+		bench_prepare_buf(q, buf, st->field);
+		int ret = st->node->qbuf(buf);
+
+		pthread_mutex_lock(&st->lock);
+		st->requeueing = false;
+		if (ret) {
+			st->err_ioctl = "VIDIOC_QBUF";
+			st->err = ret;
+		}
+	}
+	pthread_mutex_unlock(&st->lock);
+	return nullptr;
+}
+
+/* Stream until frame_count frames are dequeued or the deadline has passed. */
+static int stressStream(stress_state &st, unsigned frame_count, __u64 deadline,
+			unsigned stall_ms)
+{
+	struct node *node = st.node;
+	pthread_t dqbuf_thread, qbuf_thread;
+	bool stalled = false;
+	int ret = 0;
+
+	for (unsigned i = 0; i < st.num_queues; i++) {
+		cv4l_queue &q = *st.queues[i];
+
+		for (unsigned b = 0; b < q.g_buffers(); b++) {
+			cv4l_buffer buf(q, b);
+
+			bench_prepare_buf(q, buf, st.field);
+			fail_on_test(node->qbuf(buf));
+		}
+	}
+	for (unsigned i = st.num_queues; i; i--)
+		fail_on_test(node->streamon(st.queues[i - 1]->g_type()));
+
+	st.dequeued.clear();
+	st.stop = false;
+	st.frames = 0;
+	st.last_dqbuf = bench_ns();
+	fail_on_test(pthread_create(&dqbuf_thread, nullptr, stressDqbufThread, &st));
+	if (pthread_create(&qbuf_thread, nullptr, stressQbufThread, &st)) {
+		pthread_mutex_lock(&st.lock);
+		st.stop = true;
+		pthread_mutex_unlock(&st.lock);
+		pthread_join(dqbuf_thread, nullptr);
+		return fail("pthread_create failed\n");
+	}
+
+	pthread_mutex_lock(&st.lock);
+	while (!st.err_ioctl && st.frames < frame_count && bench_ns() < deadline) {
+		/* The driver holds all buffers, but doesn't return any. */
+		if (st.dequeued.empty() && !st.requeueing &&
+		    bench_ns() - st.last_dqbuf > stall_ms * 1000000ULL) {
+			stalled = true;
+			break;
+		}
+		pthread_mutex_unlock(&st.lock);
+		usleep(10000);
+		pthread_mutex_lock(&st.lock);
+	}
+	st.stop = true;
+	pthread_cond_broadcast(&st.cond);
+	pthread_mutex_unlock(&st.lock);
+	pthread_join(qbuf_thread, nullptr);
+	pthread_join(dqbuf_thread, nullptr);
+
+	if (stalled)
+		ret = fail("stall: no buffer was dequeued for %u ms after %u frames\n",
+			   stall_ms, st.frames);
+	else if (st.err_ioctl)
+		ret = fail("%s returned %d after %u frames\n", st.err_ioctl, st.err, st.frames);
+
+	/* STREAMOFF returns all buffers, they are all queued again on the next restart. */
+	for (unsigned i = 0; i < st.num_queues; i++)
+		fail_on_test(node->streamoff(st.queues[i]->g_type()));
+	return ret;
+}
+
+static int stressCycle(struct node *node, struct node *expbuf_node, unsigned memory,
+		       unsigned &seed, __u64 deadline, unsigned stall_ms, stress_stats &stats)
+{
+	unsigned type = node->g_type();
+	cv4l_queue q(type, memory);
+	cv4l_queue m2m_q(v4l_type_invert(type), memory);
+	cv4l_queue *queues[2] = { &q, &m2m_q };
+	cv4l_queue exp_q(bench_expbuf_type(expbuf_node), V4L2_MEMORY_MMAP);
+	int fd_flags = fcntl(node->g_fd(), F_GETFL);
+	unsigned restarts = 1 + rand_r(&seed) % 3;
+	bench_result res = {};
+	stress_state st = {};
+	cv4l_fmt fmt;
+	int ret = 0;
+
+	st.node = node;
+	st.queues = queues;
+	st.num_queues = node->is_m2m ? 2 : 1;
+	st.qbuf_seed = rand_r(&seed);
+	pthread_mutex_init(&st.lock, nullptr);
+	pthread_cond_init(&st.cond, nullptr);
+
+	/* Only the output queue needs the field, that is the last queue. */
+	node->g_fmt(fmt, queues[st.num_queues - 1]->g_type());
+	st.field = fmt.g_field() == V4L2_FIELD_ALTERNATE ? V4L2_FIELD_TOP : fmt.g_field();
+
+	for (unsigned i = 0; !ret && i < st.num_queues; i++)
+		ret = benchmarkSetupQueue(node, expbuf_node, *queues[i], exp_q, res,
+					  1 + rand_r(&seed) % 8, rand_r(&seed) % 3);
+
+	fcntl(node->g_fd(), F_SETFL, fd_flags | O_NONBLOCK);
+	for (unsigned r = 0; !ret && r < restarts && bench_ns() < deadline; r++) {
+		ret = stressStream(st, 1 + rand_r(&seed) % 200, deadline, stall_ms);
+		stats.frames += st.frames;
+		stats.max_gap = std::max(stats.max_gap, st.max_gap);
+		stats.restarts++;
+	}
+
+	fcntl(node->g_fd(), F_SETFL, fd_flags);
+	for (unsigned i = 0; i < st.num_queues; i++)
+		queues[i]->free(node);
+	if (memory == V4L2_MEMORY_DMABUF)
+		exp_q.free(expbuf_node);
+	pthread_cond_destroy(&st.cond);
+	pthread_mutex_destroy(&st.lock);
+	return ret;
+}
+
+static int stressRun(struct node *node, struct node *expbuf_node, unsigned seconds,
+		     unsigned seed, unsigned stall_ms, stress_stats &stats)
+{
+	std::vector<unsigned> memories;
+	__u64 deadline = bench_ns() + seconds * 1000000000ULL;
+
+	for (auto memory : bench_memories)
+		if (bench_can_use_memory(node, expbuf_node, memory))
+			memories.push_back(memory);
+	if (memories.empty())
+		return ENOTTY;
+
+	while (bench_ns() < deadline) {
+		unsigned memory = memories[rand_r(&seed) % memories.size()];
+		int ret = stressCycle(node, expbuf_node, memory, seed, deadline, stall_ms, stats);
+
+		stats.cycles++;
+		if (!no_progress)
+			printf("\r\t\tCycle %u, %s, %llu frames   ", stats.cycles,
+			       bench_memory2s(memory), stats.frames);
+		fflush(stdout);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Stream with the current format for the given number of seconds in a way that
+ * is much less well-behaved than the streaming tests, to qualify a driver for
+ * continuous operation.
+ */
+void stressTest(struct node *node, struct node *expbuf_node, unsigned seconds,
+		unsigned seed, unsigned stall_ms)
+{
+	stress_stats stats = {};
+	__u64 start = bench_ns();
+	int ret;
+
+	if (!(node->g_caps() & V4L2_CAP_STREAMING)) {
+		printf("\tNot supported without streaming I/O\n");
+		return;
+	}
+	if (node->is_m2m && IS_DECODER(node)) {
+		printf("\tNot supported for decoder devices\n");
+		return;
+	}
+
+	printf("\ttest for %u seconds with seed %u:\n", seconds, seed);
+	ret = stressRun(node, expbuf_node, seconds, seed, stall_ms, stats);
+	if (!no_progress)
+		printf("\r\t\t                                                            \r");
+
+	double elapsed = (bench_ns() - start) / 1000000000.0;
+
+	printf("\t\t%u cycles, %u restarts, %llu frames in %.1f s (%.2f fps), longest gap %.1f ms: %s\n",
+	       stats.cycles, stats.restarts, stats.frames, elapsed,
+	       elapsed > 0 ? stats.frames / elapsed : 0, stats.max_gap / 1000000.0, ok(ret));
+}
@@ -20,10 +20,13 @@
 
 #include <map>
 #include <set>
+#include <vector>
 
 #include <dirent.h>
+#include <sys/mman.h>
 #include <sys/sysmacros.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 #include "v4l2-compliance.h"
 
@@ -535,10 +538,223 @@ int testMediaSetupLink(struct node *node)
 	return 0;
 }
 
+static void walkNode(struct node &node, struct node &expbuf_node, const std::string &dev,
+		     unsigned frame_count, unsigned all_fmt_frame_count,
+		     unsigned benchmark_frame_count)
+{
+	printf("--------------------------------------------------------------------------------\n");
+
+	media_type type = mi_media_detect_type(dev.c_str());
+	if (type == MEDIA_TYPE_CANT_STAT) {
+		fprintf(stderr, "\nCannot open device %s, skipping.\n\n",
+			dev.c_str());
+		return;
+	}
+
+	switch (type) {
+	// For now we can only handle V4L2 devices
+	case MEDIA_TYPE_VIDEO:
+	case MEDIA_TYPE_VBI:
+	case MEDIA_TYPE_RADIO:
+	case MEDIA_TYPE_SDR:
+	case MEDIA_TYPE_TOUCH:
+	case MEDIA_TYPE_SUBDEV:
+		break;
+	case MEDIA_TYPE_DVB_FRONTEND:
+	case MEDIA_TYPE_DVB_DEMUX:
+	case MEDIA_TYPE_DVB_DVR:
+	case MEDIA_TYPE_DVB_NET:
+	case MEDIA_TYPE_DTV_CA:
+		fprintf(stderr, "\nUnsupported device %s, skipping.\n\n",
+			dev.c_str());
+		return;
+	default:
+		type = MEDIA_TYPE_UNKNOWN;
+		break;
+	}
+
+	if (type == MEDIA_TYPE_UNKNOWN) {
+		fprintf(stderr, "\nUnable to detect what device %s is, skipping.\n\n",
+			dev.c_str());
+		return;
+	}
+
+	struct node test_node;
+	int fd = -1;
+
+	test_node.device = dev.c_str();
+	test_node.s_trace(node.g_trace());
+	switch (type) {
+	case MEDIA_TYPE_MEDIA:
+		test_node.s_direct(true);
+		fd = test_node.media_open(dev.c_str(), false);
+		break;
+	case MEDIA_TYPE_SUBDEV:
+		test_node.s_direct(true);
+		fd = test_node.subdev_open(dev.c_str(), false);
+		break;
+	default:
+		test_node.s_direct(node.g_direct());
+		fd = test_node.open(dev.c_str(), false);
+		break;
+	}
+	if (fd < 0) {
+		fprintf(stderr, "\nFailed to open device %s, skipping\n\n",
+			dev.c_str());
+		return;
+	}
+
+	testNode(test_node, test_node, expbuf_node, type,
+		 frame_count, all_fmt_frame_count, benchmark_frame_count,
+		 node.g_fd());
+	test_node.close();
+}
+
+/*
+ * Test each device node in a worker process with its output captured in a
+ * temporary file, so the output of the nodes isn't interleaved.
+ */
+struct walk_worker {
+	pid_t pid;
+	FILE *out;
+	bool done;
+};
+
+static void startWalkWorker(struct node &node, struct node &expbuf_node, const std::string &dev,
+			    unsigned frame_count, unsigned all_fmt_frame_count,
+			    unsigned benchmark_frame_count, walk_worker &worker,
+			    test_results *results)
+{
+	worker.out = tmpfile();
+	if (!worker.out) {
+		fprintf(stderr, "\nCannot create a temporary file, testing %s in sequence.\n\n",
+			dev.c_str());
+		walkNode(node, expbuf_node, dev, frame_count, all_fmt_frame_count,
+			 benchmark_frame_count);
+		worker.done = true;
+		return;
+	}
+
+	// The worker must not write out what the parent had buffered
+	fflush(nullptr);
+	worker.pid = fork();
+	if (worker.pid) {
+		if (worker.pid < 0) {
+			fprintf(worker.out, "\nCannot fork to test %s: %s\n\n",
+				dev.c_str(), strerror(errno));
+			results->total = 1;
+			results->result = 1;
+			worker.done = true;
+		}
+		return;
+	}
+
+	test_results before;
+
+	dup2(fileno(worker.out), STDOUT_FILENO);
+	dup2(fileno(worker.out), STDERR_FILENO);
+	/* Don't share the file description and its buffers with the other workers. */
+	if (expbuf_node.g_fd() >= 0)
+		expbuf_node.reopen();
+	getTestResults(before);
+	walkNode(node, expbuf_node, dev, frame_count, all_fmt_frame_count,
+		 benchmark_frame_count);
+	getTestResults(*results);
+	results->total -= before.total;
+	results->ok -= before.ok;
+	results->warnings -= before.warnings;
+	fflush(stdout);
+	fflush(stderr);
+	_exit(0);
+}
+
+static void walkNodesParallel(struct node &node, struct node &expbuf_node,
+			      const std::vector<std::string> &devs,
+			      unsigned frame_count, unsigned all_fmt_frame_count,
+			      unsigned benchmark_frame_count)
+{
+	unsigned num = devs.size();
+	unsigned jobs = max_jobs ? max_jobs : num;
+	std::vector<walk_worker> workers(num);
+	unsigned next_start = 0, next_show = 0, running = 0;
+	size_t results_size = num * sizeof(test_results);
+	/* Shared with the workers, each fills in the results of its device node. */
+	auto results = static_cast<test_results *>(mmap(nullptr, results_size,
+							PROT_READ | PROT_WRITE,
+							MAP_SHARED | MAP_ANONYMOUS, -1, 0));
+
+	if (results == MAP_FAILED) {
+		fprintf(stderr, "\nCannot map the shared results, testing in sequence.\n\n");
+		for (const auto &dev : devs)
+			walkNode(node, expbuf_node, dev, frame_count, all_fmt_frame_count,
+				 benchmark_frame_count);
+		return;
+	}
+	memset(results, 0, results_size);
+
+	while (next_show < num) {
+		while (running < jobs && next_start < num) {
+			walk_worker &worker = workers[next_start];
+
+			startWalkWorker(node, expbuf_node, devs[next_start],
+					frame_count, all_fmt_frame_count, benchmark_frame_count,
+					worker, &results[next_start]);
+			if (!worker.done)
+				running++;
+			next_start++;
+		}
+
+		if (running) {
+			int wstatus;
+			pid_t pid = waitpid(-1, &wstatus, 0);
+
+			if (pid < 0 && errno != EINTR)
+				break;
+			for (unsigned i = 0; pid > 0 && i < next_start; i++) {
+				walk_worker &worker = workers[i];
+
+				if (worker.done || worker.pid != pid)
+					continue;
+				worker.done = true;
+				running--;
+				if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus)) {
+					fprintf(worker.out, "\nTesting %s was aborted (status 0x%x)\n\n",
+						devs[i].c_str(), wstatus);
+					results[i].total++;
+					results[i].result = 1;
+				}
+			}
+		}
+
+		/* Show the output in the order of the topology, not in the order of completion. */
+		while (next_show < num && workers[next_show].done) {
+			walk_worker &worker = workers[next_show];
+
+			if (worker.out) {
+				char buf[4096];
+				size_t sz;
+
+				fflush(worker.out);
+				rewind(worker.out);
+				while ((sz = fread(buf, 1, sizeof(buf), worker.out)))
+					fwrite(buf, 1, sz, stdout);
+				fclose(worker.out);
+				worker.out = nullptr;
+			}
+			fflush(stdout);
+			addTestResults(results[next_show]);
+			next_show++;
+		}
+	}
+	munmap(results, results_size);
+}
+
 void walkTopology(struct node &node, struct node &expbuf_node,
-		  unsigned frame_count, unsigned all_fmt_frame_count)
+		  unsigned frame_count, unsigned all_fmt_frame_count,
+		  unsigned benchmark_frame_count)
 {
 	media_v2_topology topology;
+	std::vector<std::string> devs;
 
 	memset(&topology, 0, sizeof(topology));
 	if (ioctl(node.g_fd(), MEDIA_IOC_G_TOPOLOGY, &topology))
@@ -554,73 +770,16 @@ void walkTopology(struct node &node, struct node &expbuf_node,
 		media_v2_interface &iface = v2_ifaces[i];
 		std::string dev = mi_media_get_device(iface.devnode.major,
 						      iface.devnode.minor);
-		if (dev.empty())
-			continue;
-
-		printf("--------------------------------------------------------------------------------\n");
-
-		media_type type = mi_media_detect_type(dev.c_str());
-		if (type == MEDIA_TYPE_CANT_STAT) {
-			fprintf(stderr, "\nCannot open device %s, skipping.\n\n",
-				dev.c_str());
-			continue;
-		}
-
-		switch (type) {
-		// For now we can only handle V4L2 devices
-		case MEDIA_TYPE_VIDEO:
-		case MEDIA_TYPE_VBI:
-		case MEDIA_TYPE_RADIO:
-		case MEDIA_TYPE_SDR:
-		case MEDIA_TYPE_TOUCH:
-		case MEDIA_TYPE_SUBDEV:
-			break;
-		case MEDIA_TYPE_DVB_FRONTEND:
-		case MEDIA_TYPE_DVB_DEMUX:
-		case MEDIA_TYPE_DVB_DVR:
-		case MEDIA_TYPE_DVB_NET:
-		case MEDIA_TYPE_DTV_CA:
-			fprintf(stderr, "\nUnsupported device %s, skipping.\n\n",
-				dev.c_str());
-			continue;
-		default:
-			type = MEDIA_TYPE_UNKNOWN;
-			break;
-		}
-
-		if (type == MEDIA_TYPE_UNKNOWN) {
-			fprintf(stderr, "\nUnable to detect what device %s is, skipping.\n\n",
-				dev.c_str());
-			continue;
-		}
-
-		struct node test_node;
-		int fd = -1;
-
-		test_node.device = dev.c_str();
-		test_node.s_trace(node.g_trace());
-		switch (type) {
-		case MEDIA_TYPE_MEDIA:
-			test_node.s_direct(true);
-			fd = test_node.media_open(dev.c_str(), false);
-			break;
-		case MEDIA_TYPE_SUBDEV:
-			test_node.s_direct(true);
-			fd = test_node.subdev_open(dev.c_str(), false);
-			break;
-		default:
-			test_node.s_direct(node.g_direct());
-			fd = test_node.open(dev.c_str(), false);
-			break;
-		}
-		if (fd < 0) {
-			fprintf(stderr, "\nFailed to open device %s, skipping\n\n",
-				dev.c_str());
-			continue;
-		}
+		if (!dev.empty())
+			devs.push_back(dev);
+	}
 
-		testNode(test_node, test_node, expbuf_node, type,
-			 frame_count, all_fmt_frame_count, node.g_fd());
-		test_node.close();
+	if (max_jobs == 1 || devs.size() <= 1) {
+		for (const auto &dev : devs)
+			walkNode(node, expbuf_node, dev, frame_count, all_fmt_frame_count,
+				 benchmark_frame_count);
+		return;
 	}
+	walkNodesParallel(node, expbuf_node, devs, frame_count, all_fmt_frame_count,
+			  benchmark_frame_count);
 }
@@ -1,11 +1,13 @@
 #include <algorithm>
 #include <cctype>
 #include <cstring>
+#include <fstream>
 #include <list>
 #include <map>
 #include <vector>
 
 #include <dirent.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 
@@ -13,6 +15,8 @@
 
 #include "v4l2-ctl.h"
 
+#include <media-info.h>
+
 #ifdef HAVE_SYS_KLOG_H
 #include <sys/klog.h>
 #endif
@@ -48,6 +52,8 @@ static enum v4l2_priority prio = V4L2_PRIORITY_UNSET;
 
 static bool have_query_ext_ctrl;
 
+static std::string ctrl_batch_file;
+
 void common_usage()
 {
 	printf("\nGeneral/Common options:\n"
@@ -59,6 +65,14 @@ void common_usage()
 	       "                     get the value of the controls [VIDIOC_G_EXT_CTRLS]\n"
 	       "  -c, --set-ctrl <ctrl>=<val>[,<ctrl>=<val>...]\n"
 	       "                     set the value of the controls [VIDIOC_S_EXT_CTRLS]\n"
+	       "  --set-ctrl-batch <file>\n"
+	       "                     set the controls of one or more devices in batches as\n"
+	       "                     read from <file>, and report how long each batch took.\n"
+	       "                     Each line is either '<dev> <ctrl>=<val>[,<ctrl>=<val>...]'\n"
+	       "                     or 'sync <dev>' to apply each following batch right after\n"
+	       "                     a frame sync event of <dev>. An empty line ends a batch.\n"
+	       "                     The controls of a device in a batch are set with a single\n"
+	       "                     VIDIOC_S_EXT_CTRLS call.\n"
 	       "  -D, --info         show driver info [VIDIOC_QUERYCAP]\n"
 	       "  -d, --device <dev> use device <dev> instead of /dev/video0\n"
 	       "                     if <dev> starts with a digit, then /dev/video<dev> is used\n"
@@ -818,7 +832,8 @@ static void print_qctrl(int fd, const v4l2_query_ext_ctrl &qc,
 	}
 }
 
-static int print_control(int fd, struct v4l2_query_ext_ctrl &qctrl, bool show_menus)
+static int print_control(int fd, struct v4l2_query_ext_ctrl &qctrl, bool show_menus,
+			 const struct v4l2_ext_control *value = nullptr)
 {
 	struct v4l2_control ctrl;
 	struct v4l2_ext_control ext_ctrl;
@@ -839,6 +854,10 @@ static int print_control(int fd, struct v4l2_query_ext_ctrl &qctrl, bool show_me
 		print_qctrl(fd, qctrl, ext_ctrl, show_menus);
 		return 1;
 	}
+	if (value && value->id) {
+		print_qctrl(fd, qctrl, *value, show_menus);
+		return 1;
+	}
 	ctrls.which = V4L2_CTRL_ID2WHICH(qctrl.id);
 	ctrls.count = 1;
 	ctrls.controls = &ext_ctrl;
@@ -919,20 +938,71 @@ static int query_ext_ctrl_ioctl(int fd, struct v4l2_query_ext_ctrl &qctrl)
 	return rc;
 }
 
+/*
+ * Read the current values of all controls without a payload with a single
+ * VIDIOC_G_EXT_CTRLS call instead of one call per control. The value of
+ * qctrls[i] is stored in values[i], controls that have to be read
+ * separately get a zero id. Returns false if the values could not be read
+ * in one go.
+ */
+static bool get_control_values(int fd, const std::vector<v4l2_query_ext_ctrl> &qctrls,
+			       std::vector<v4l2_ext_control> &values)
+{
+	std::vector<v4l2_ext_control> batch;
+	struct v4l2_ext_controls ctrls = {};
+
+	values.assign(qctrls.size(), v4l2_ext_control());
+	for (const auto &qctrl : qctrls) {
+		v4l2_ext_control ctrl = {};
+
+		if (qctrl.type == V4L2_CTRL_TYPE_CTRL_CLASS ||
+		    qctrl.type == V4L2_CTRL_TYPE_BUTTON ||
+		    qctrl.type >= V4L2_CTRL_COMPOUND_TYPES ||
+		    qctrl.nr_of_dims ||
+		    (qctrl.flags & (V4L2_CTRL_FLAG_DISABLED |
+				    V4L2_CTRL_FLAG_WRITE_ONLY |
+				    V4L2_CTRL_FLAG_HAS_PAYLOAD)))
+			continue;
+		ctrl.id = qctrl.id;
+		batch.push_back(ctrl);
+	}
+	if (batch.size() < 2)
+		return false;
+
+	ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+	ctrls.count = batch.size();
+	ctrls.controls = batch.data();
+	if (test_ioctl(fd, VIDIOC_G_EXT_CTRLS, &ctrls))
+		return false;
+
+	for (unsigned i = 0, j = 0; i < qctrls.size() && j < batch.size(); i++)
+		if (qctrls[i].id == batch[j].id)
+			values[i] = batch[j++];
+	return true;
+}
+
 static void list_controls(int fd, bool show_menus)
 {
 	const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
 	struct v4l2_query_ext_ctrl qctrl;
+	std::vector<v4l2_query_ext_ctrl> qctrls;
+	std::vector<v4l2_ext_control> values;
 	int id;
 
 	memset(&qctrl, 0, sizeof(qctrl));
 	qctrl.id = next_fl;
 	while (query_ext_ctrl_ioctl(fd, qctrl) == 0) {
-		print_control(fd, qctrl, show_menus);
+		qctrls.push_back(qctrl);
 		qctrl.id |= next_fl;
 	}
-	if (qctrl.id != next_fl)
+	if (qctrl.id != next_fl) {
+		/* Fall back to reading each value separately if this fails */
+		bool batched = get_control_values(fd, qctrls, values);
+
+		for (unsigned i = 0; i < qctrls.size(); i++)
+			print_control(fd, qctrls[i], show_menus, batched ? &values[i] : nullptr);
 		return;
+	}
 	for (id = V4L2_CID_USER_BASE; id < V4L2_CID_LASTP1; id++) {
 		qctrl.id = id;
 		if (query_ext_ctrl_ioctl(fd, qctrl) == 0)
@@ -944,11 +1014,10 @@ static void list_controls(int fd, bool show_menus)
 	}
 }
 
-static void find_controls(cv4l_fd &_fd)
+static void find_controls(int fd, ctrl_qmap &str2q, ctrl_idmap &id2str)
 {
 	const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
 	struct v4l2_query_ext_ctrl qctrl;
-	int fd = _fd.g_fd();
 	int id;
 
 	memset(&qctrl, 0, sizeof(qctrl));
@@ -956,8 +1025,8 @@ static void find_controls(cv4l_fd &_fd)
 	while (query_ext_ctrl_ioctl(fd, qctrl) == 0) {
 		if (qctrl.type != V4L2_CTRL_TYPE_CTRL_CLASS &&
 		    !(qctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
-			ctrl_str2q[name2var(qctrl.name)] = qctrl;
-			ctrl_id2str[qctrl.id] = name2var(qctrl.name);
+			str2q[name2var(qctrl.name)] = qctrl;
+			id2str[qctrl.id] = name2var(qctrl.name);
 		}
 		qctrl.id |= next_fl;
 	}
@@ -967,15 +1036,15 @@ static void find_controls(cv4l_fd &_fd)
 		qctrl.id = id;
 		if (query_ext_ctrl_ioctl(fd, qctrl) == 0 &&
 		    !(qctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
-			ctrl_str2q[name2var(qctrl.name)] = qctrl;
-			ctrl_id2str[qctrl.id] = name2var(qctrl.name);
+			str2q[name2var(qctrl.name)] = qctrl;
+			id2str[qctrl.id] = name2var(qctrl.name);
 		}
 	}
 	for (qctrl.id = V4L2_CID_PRIVATE_BASE;
 			query_ext_ctrl_ioctl(fd, qctrl) == 0; qctrl.id++) {
 		if (!(qctrl.flags & V4L2_CTRL_FLAG_DISABLED)) {
-			ctrl_str2q[name2var(qctrl.name)] = qctrl;
-			ctrl_id2str[qctrl.id] = name2var(qctrl.name);
+			str2q[name2var(qctrl.name)] = qctrl;
+			id2str[qctrl.id] = name2var(qctrl.name);
 		}
 	}
 }
@@ -997,7 +1066,7 @@ void common_process_controls(cv4l_fd &fd)
 	rc = test_ioctl(fd.g_fd(), VIDIOC_QUERY_EXT_CTRL, &qc);
 	have_query_ext_ctrl = rc == 0;
 
-	find_controls(fd);
+	find_controls(fd.g_fd(), ctrl_str2q, ctrl_id2str);
 	for (const auto &get_ctrl : get_ctrls) {
 		std::string s = get_ctrl;
 		if (is_valid_number(s)) {
@@ -1164,6 +1233,9 @@ void common_cmd(int ch, char *optarg)
 			}
 		}
 		break;
+	case OptSetCtrlBatch:
+		ctrl_batch_file = optarg;
+		break;
 	case OptSubset:
 		if (parse_subset(optarg)) {
 			common_usage();
@@ -1463,6 +1535,293 @@ bool common_list_devices(const std::string &media_bus_info, cv4l_fd &fd)
 	return false;
 }
 
+struct batch_device {
+	std::string name;
+	cv4l_fd fd;
+	ctrl_qmap str2q;
+	ctrl_idmap id2str;
+};
+
+struct batch_entry {
+	batch_device *dev;
+	std::vector<v4l2_ext_control> ctrls;
+};
+
+using batch_vec = std::vector<batch_entry>;
+using batch_dev_map = std::map<std::string, batch_device>;
+
+static batch_device *batch_open(batch_dev_map &devs, const std::string &name)
+{
+	auto it = devs.find(name);
+
+	if (it != devs.end())
+		return &it->second;
+
+	batch_device &dev = devs[name];
+	int fd;
+
+	dev.name = name;
+	if (mi_media_detect_type(name.c_str()) == MEDIA_TYPE_SUBDEV) {
+		fd = dev.fd.subdev_open(name.c_str());
+	} else {
+		dev.fd.s_direct(!options[OptUseWrapper]);
+		fd = dev.fd.open(name.c_str());
+	}
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", name.c_str(), strerror(errno));
+		devs.erase(name);
+		return nullptr;
+	}
+	find_controls(fd, dev.str2q, dev.id2str);
+	return &dev;
+}
+
+static bool batch_parse_ctrls(batch_entry &entry, char *subs)
+{
+	batch_device &dev = *entry.dev;
+	char *value;
+
+	while (*subs != '\0') {
+		if (parse_next_subopt(&subs, &value))
+			return false;
+
+		const char *equal = std::strchr(value, '=');
+
+		if (!equal) {
+			fprintf(stderr, "control '%s' without '='\n", value);
+			return false;
+		}
+
+		std::string name(value, equal - value);
+
+		if (is_valid_number(name)) {
+			__u32 id = strtoul(name.c_str(), nullptr, 0);
+
+			if (dev.id2str.find(id) != dev.id2str.end())
+				name = dev.id2str[id];
+		}
+		if (dev.str2q.find(name) == dev.str2q.end()) {
+			fprintf(stderr, "%s: unknown control '%s'\n",
+				dev.name.c_str(), name.c_str());
+			return false;
+		}
+
+		const struct v4l2_query_ext_ctrl &qc = dev.str2q[name];
+		struct v4l2_ext_control ctrl = {};
+
+		ctrl.id = qc.id;
+		if (qc.type == V4L2_CTRL_TYPE_STRING) {
+			ctrl.size = qc.elems * qc.elem_size;
+			ctrl.string = static_cast<char *>(calloc(1, ctrl.size));
+			strncpy(ctrl.string, equal + 1, qc.maximum);
+		} else if (qc.flags & V4L2_CTRL_FLAG_HAS_PAYLOAD) {
+			fprintf(stderr, "%s: %s: unsupported payload type\n",
+				dev.name.c_str(), qc.name);
+			return false;
+		} else if (qc.type == V4L2_CTRL_TYPE_INTEGER64) {
+			ctrl.value64 = strtoll(equal + 1, nullptr, 0);
+		} else {
+			ctrl.value = strtol(equal + 1, nullptr, 0);
+		}
+		entry.ctrls.push_back(ctrl);
+	}
+	return true;
+}
+
+static bool batch_parse_file(const std::string &filename, batch_dev_map &devs,
+			     std::vector<batch_vec> &batches, batch_device *&sync_dev)
+{
+	std::ifstream file(filename.c_str());
+	std::string line;
+	batch_vec batch;
+	unsigned linenr = 0;
+
+	if (!file) {
+		fprintf(stderr, "Failed to open %s: %s\n", filename.c_str(), strerror(errno));
+		return false;
+	}
+	while (std::getline(file, line)) {
+		linenr++;
+
+		size_t start = line.find_first_not_of(" \t");
+
+		if (start == std::string::npos) {
+			if (!batch.empty())
+				batches.push_back(batch);
+			batch.clear();
+			continue;
+		}
+		if (line[start] == '#')
+			continue;
+
+		size_t end = line.find_first_of(" \t", start);
+		std::string dev_name = line.substr(start, end - start);
+		size_t arg = end == std::string::npos ? end : line.find_first_not_of(" \t", end);
+		std::string args = arg == std::string::npos ? "" : line.substr(arg);
+
+		args.erase(args.find_last_not_of(" \t\r") + 1);
+		if (args.empty()) {
+			fprintf(stderr, "%s:%u: missing arguments\n", filename.c_str(), linenr);
+			return false;
+		}
+		if (dev_name == "sync") {
+			sync_dev = batch_open(devs, args);
+			if (!sync_dev)
+				return false;
+			continue;
+		}
+
+		batch_device *dev = batch_open(devs, dev_name);
+
+		if (!dev)
+			return false;
+
+		batch_entry *entry = nullptr;
+
+		for (auto &e : batch)
+			if (e.dev == dev)
+				entry = &e;
+		if (!entry) {
+			batch.push_back({ dev });
+			entry = &batch.back();
+		}
+		if (!batch_parse_ctrls(*entry, &args[0])) {
+			fprintf(stderr, "%s:%u: invalid controls\n", filename.c_str(), linenr);
+			return false;
+		}
+	}
+	if (!batch.empty())
+		batches.push_back(batch);
+	return true;
+}
+
+/*
+ * Wait for the start of the next frame. Events of frames that already
+ * started are discarded.
+ */
+static bool batch_wait_frame_sync(int fd, __u32 &sequence)
+{
+	struct pollfd pfd = { fd, POLLPRI };
+	struct v4l2_event ev;
+
+	while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLPRI))
+		if (test_ioctl(fd, VIDIOC_DQEVENT, &ev))
+			break;
+	if (poll(&pfd, 1, 1000) <= 0 || !(pfd.revents & POLLPRI) ||
+	    test_ioctl(fd, VIDIOC_DQEVENT, &ev))
+		return false;
+	sequence = ev.u.frame_sync.frame_sequence;
+	return true;
+}
+
+/* Return true if a new frame started, and its sequence number. */
+static bool batch_frame_started(int fd, __u32 &sequence)
+{
+	struct pollfd pfd = { fd, POLLPRI };
+	struct v4l2_event ev;
+
+	if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLPRI) ||
+	    test_ioctl(fd, VIDIOC_DQEVENT, &ev))
+		return false;
+	sequence = ev.u.frame_sync.frame_sequence;
+	return true;
+}
+
+static __u64 batch_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int common_set_ctrl_batch()
+{
+	std::vector<batch_vec> batches;
+	batch_device *sync_dev = nullptr;
+	batch_dev_map devs;
+	int result = 0;
+
+	/* Fall back to VIDIOC_QUERYCTRL per device if needed */
+	have_query_ext_ctrl = true;
+	if (!batch_parse_file(ctrl_batch_file, devs, batches, sync_dev))
+		return EXIT_FAILURE;
+
+	if (sync_dev) {
+		struct v4l2_event_subscription sub = {};
+
+		sub.type = V4L2_EVENT_FRAME_SYNC;
+		if (doioctl(sync_dev->fd.g_fd(), VIDIOC_SUBSCRIBE_EVENT, &sub))
+			return EXIT_FAILURE;
+	}
+
+	for (unsigned b = 0; b < batches.size(); b++) {
+		batch_vec &batch = batches[b];
+		std::vector<int> errors(batch.size());
+		std::vector<__u32> error_idx(batch.size());
+		__u32 frame = 0, next_frame;
+		unsigned count = 0;
+
+		if (sync_dev && !batch_wait_frame_sync(sync_dev->fd.g_fd(), frame)) {
+			fprintf(stderr, "%s: no frame sync event\n", sync_dev->name.c_str());
+			return EXIT_FAILURE;
+		}
+
+		__u64 start = batch_ns();
+
+		for (unsigned i = 0; i < batch.size(); i++) {
+			struct v4l2_ext_controls ctrls = {};
+
+			ctrls.which = V4L2_CTRL_WHICH_CUR_VAL;
+			ctrls.count = batch[i].ctrls.size();
+			ctrls.controls = batch[i].ctrls.data();
+			if (test_ioctl(batch[i].dev->fd.g_fd(), VIDIOC_S_EXT_CTRLS, &ctrls)) {
+				errors[i] = errno;
+				error_idx[i] = ctrls.error_idx;
+			}
+		}
+
+		__u64 end = batch_ns();
+		bool late = sync_dev && batch_frame_started(sync_dev->fd.g_fd(), next_frame);
+
+		for (unsigned i = 0; i < batch.size(); i++) {
+			batch_device &dev = *batch[i].dev;
+
+			count += batch[i].ctrls.size();
+			if (!errors[i])
+				continue;
+			result = EXIT_FAILURE;
+			if (error_idx[i] >= batch[i].ctrls.size())
+				stderr_info("%s: Error setting controls: %s\n",
+					    dev.name.c_str(), strerror(errors[i]));
+			else
+				stderr_info("%s: %s: %s\n", dev.name.c_str(),
+					    dev.id2str[batch[i].ctrls[error_idx[i]].id].c_str(),
+					    strerror(errors[i]));
+		}
+		if (options[OptSilent])
+			continue;
+		printf("batch %u: %zu device%s, %u control%s, %llu us",
+		       b + 1, batch.size(), batch.size() == 1 ? "" : "s",
+		       count, count == 1 ? "" : "s", (end - start) / 1000);
+		if (sync_dev) {
+			printf(", started at frame %u", frame);
+			if (late)
+				printf(", frame %u started before the batch was done", next_frame);
+		}
+		printf("\n");
+	}
+
+	for (auto &batch : batches)
+		for (auto &entry : batch)
+			for (auto &ctrl : entry.ctrls)
+				if (ctrl.size)
+					free(ctrl.string);
+	for (auto &dev : devs)
+		dev.second.fd.close();
+	return result;
+}
+
 void common_list(cv4l_fd &fd)
 {
 	if (options[OptListCtrls] || options[OptListCtrlsMenus]) {
@@ -1,6 +1,16 @@
+#include <algorithm>
 #include <cstring>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include <netdb.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 
 #include <linux/media.h>
@@ -34,12 +44,15 @@ static u8 stream_out_alpha;
 static bool stream_out_alpha_red_only;
 static bool stream_out_rgb_lim_range;
 static unsigned stream_out_perc_fill = 100;
+static unsigned stream_out_threads = 1;
 static v4l2_std_id stream_out_std;
 static bool stream_out_refresh;
 static tpg_move_mode stream_out_hor_mode = TPG_MOVE_NONE;
 static tpg_move_mode stream_out_vert_mode = TPG_MOVE_NONE;
 static unsigned reqbufs_count_cap = 0;
 static unsigned reqbufs_count_out = 0;
+static bool stream_latency;
+static char *stream_latency_csv;
 static char *file_to;
 static bool to_with_hdr;
 static char *host_to;
@@ -49,6 +62,36 @@ static unsigned bpl_cap[VIDEO_MAX_PLANES];
 #endif
 static bool host_lossless;
 static int host_fd_to = -1;
+static bool host_serve;
+static int serve_fd = -1;
+#ifndef NO_STREAM_TO
+static unsigned host_port_serve = V4L_STREAM_PORT;
+static unsigned serve_min_clients = 1;
+static unsigned serve_queue_depth = 8;
+
+/*
+ * An encoded v4l-stream packet. Frame packets are encoded once and
+ * shared between the send queues of all connected receivers.
+ */
+struct stream_packet {
+	std::vector<__u8> data;
+	bool keyframe;
+};
+
+struct stream_client {
+	int fd;
+	std::string name;
+	std::deque<std::shared_ptr<stream_packet>> queue;
+	unsigned offset;	// bytes of the front packet that were already sent
+	bool wait_keyframe;
+	bool watched;		// registered with the streaming event loop
+	unsigned sent;
+	unsigned dropped;
+};
+
+static std::list<stream_client> serve_clients;
+static std::shared_ptr<stream_packet> serve_hdr;
+#endif
 static unsigned comp_perc;
 static unsigned comp_perc_count;
 static char *file_from;
@@ -82,6 +125,17 @@ struct request_fwht {
 
 static request_fwht fwht_reqs[VIDEO_MAX_FRAME];
 
+/* An m2m device that is appended to the capture device with --stream-pipeline */
+struct pipeline_opt {
+	std::string devname;
+	unsigned set_fmts;
+	__u32 width;
+	__u32 height;
+	__u32 pixelformat;
+};
+
+static std::vector<pipeline_opt> pipeline_opts;
+
 #define TS_WINDOW 241
 #define FILE_HDR_ID			v4l2_fourcc('V', 'h', 'd', 'r')
 
@@ -133,6 +187,78 @@ public:
 	unsigned dropped();
 };
 
+/*
+ * The event loop shared by all streaming modes: video devices, media
+ * requests, timers and sockets are all watched with one (level-triggered)
+ * epoll instance. wait() collects the ready events, revents() returns
+ * them per file descriptor.
+ */
+class event_loop {
+private:
+	int epoll_fd;
+	std::map<int, unsigned> watched;
+	std::map<int, unsigned> ready;
+	std::vector<int> timers;
+
+public:
+	event_loop()
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	}
+	~event_loop();
+
+	int watch(int fd, unsigned events);
+	int add_timer(unsigned ms);
+	bool timer_expired(int fd);
+	int wait(int timeout_ms);
+	unsigned revents(int fd);
+	void clear_revents(int fd) { ready.erase(fd); }
+};
+
+/*
+ * Latency histogram of a fixed size, so long runs don't need more memory.
+ * Values below 64 ns each have a bucket, larger values have 32 buckets per
+ * power of two, so a bucket is at most 1/32 of its values wide.
+ */
+class latency_hist {
+private:
+	static constexpr unsigned sub_bits = 5;
+	static constexpr unsigned buckets = (64 - sub_bits + 1) << sub_bits;
+	__u64 hist[buckets];
+	__u64 cnt, sum, min, max;
+
+	static unsigned bucket(__u64 v);
+	static __u64 bucket_min(unsigned b);
+
+public:
+	void add(__u64 v);
+	void print(const char *name);
+	bool empty() const { return !cnt; }
+};
+
+/*
+ * Per-buffer latency measurement for --stream-latency.
+ */
+class latency_stats {
+private:
+	latency_hist lat, e2e;
+	FILE *csv;
+	__u32 memory;
+	unsigned buffers;
+	__u64 out_qbuf[VIDEO_MAX_FRAME];
+	/* QBUF time of the output buffers, indexed by timestamp and by sequence */
+	std::map<__u64, __u64> qbuf_by_ts;
+	std::map<unsigned, __u64> qbuf_by_seq;
+
+public:
+	void out_queued(cv4l_buffer &buf);
+	void out_dequeued(cv4l_buffer &buf);
+	void cap_dequeued(cv4l_queue &q, cv4l_buffer &buf);
+	void report();
+};
+
+static latency_stats latency;
+
 static bool need_sleep(unsigned count)
 {
 	if (stream_sleep_count <= 0)
@@ -177,6 +303,144 @@ static void do_sleep()
 	nanosleep(&t, NULL);
 }
 
+/*
+ * Fills the test pattern using several threads, each filling its own
+ * range of lines. The calling thread fills the first range.
+ */
+class tpg_fill_workers {
+public:
+	tpg_fill_workers()
+	{
+		pthread_mutex_init(&lock, nullptr);
+		pthread_cond_init(&start_cond, nullptr);
+		pthread_cond_init(&done_cond, nullptr);
+	}
+
+	void start(unsigned count);
+	void stop();
+	void fill(unsigned p, u8 *vbuf);
+
+private:
+	static void *worker(void *arg);
+	void fill_range(unsigned idx);
+
+	pthread_mutex_t lock;
+	pthread_cond_t start_cond;
+	pthread_cond_t done_cond;
+	std::vector<pthread_t> threads;
+	unsigned generation = 0;
+	unsigned pending = 0;
+	bool quit = false;
+	unsigned plane = 0;
+	u8 *buf = nullptr;
+};
+
+struct tpg_fill_worker_arg {
+	tpg_fill_workers *workers;
+	unsigned idx;
+};
+
+static tpg_fill_workers fill_workers;
+
+void tpg_fill_workers::start(unsigned count)
+{
+	quit = false;
+	for (unsigned i = 1; i < count; i++) {
+		auto arg = new tpg_fill_worker_arg{ this, i };
+		pthread_t thread;
+
+		if (pthread_create(&thread, nullptr, worker, arg)) {
+			delete arg;
+			break;
+		}
+		threads.push_back(thread);
+	}
+}
+
+void tpg_fill_workers::stop()
+{
+	pthread_mutex_lock(&lock);
+	quit = true;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&lock);
+	for (auto thread : threads)
+		pthread_join(thread, nullptr);
+	threads.clear();
+}
+
+void tpg_fill_workers::fill_range(unsigned idx)
+{
+	unsigned height = tpg.compose.height;
+	unsigned cnt = threads.size() + 1;
+
+	tpg_fill_plane_lines(&tpg, stream_out_std, plane, buf,
+			     height * idx / cnt, height * (idx + 1) / cnt);
+}
+
+void *tpg_fill_workers::worker(void *arg)
+{
+	auto a = static_cast<tpg_fill_worker_arg *>(arg);
+	tpg_fill_workers *w = a->workers;
+	unsigned idx = a->idx;
+	unsigned seen = 0;
+
+	delete a;
+	for (;;) {
+		pthread_mutex_lock(&w->lock);
+		while (!w->quit && w->generation == seen)
+			pthread_cond_wait(&w->start_cond, &w->lock);
+		seen = w->generation;
+		pthread_mutex_unlock(&w->lock);
+		if (w->quit)
+			return nullptr;
+
+		w->fill_range(idx);
+
+		pthread_mutex_lock(&w->lock);
+		if (!--w->pending)
+			pthread_cond_signal(&w->done_cond);
+		pthread_mutex_unlock(&w->lock);
+	}
+}
+
+void tpg_fill_workers::fill(unsigned p, u8 *vbuf)
+{
+	pthread_mutex_lock(&lock);
+	plane = p;
+	buf = vbuf;
+	pending = threads.size();
+	generation++;
+	pthread_cond_broadcast(&start_cond);
+	pthread_mutex_unlock(&lock);
+
+	fill_range(0);
+
+	pthread_mutex_lock(&lock);
+	while (pending)
+		pthread_cond_wait(&done_cond, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+static void fill_tpg_buffer(unsigned p, u8 *vbuf)
+{
+	unsigned offset = 0;
+
+	if (stream_out_threads <= 1) {
+		tpg_fillbuffer(&tpg, stream_out_std, p, vbuf);
+		return;
+	}
+
+	tpg_prepare_fill(&tpg);
+	if (tpg.buffers > 1) {
+		fill_workers.fill(p, vbuf);
+		return;
+	}
+	for (unsigned i = 0; i < tpg_g_planes(&tpg); i++) {
+		fill_workers.fill(i, vbuf + offset);
+		offset += tpg_calc_plane_size(&tpg, i);
+	}
+}
+
 void fps_timestamps::determine_field(int fd, unsigned type)
 {
 	struct v4l2_format fmt = { };
@@ -292,6 +556,272 @@ double fps_timestamps::fps()
 	return fps;
 };
 
+event_loop::~event_loop()
+{
+	for (auto fd : timers)
+		close(fd);
+	if (epoll_fd >= 0)
+		close(epoll_fd);
+}
+
+/*
+ * Start, change or (if events is 0) stop watching fd. The fd may have
+ * been closed and reused since it was last watched, so fall back to
+ * adding or modifying it if the epoll instance disagrees.
+ */
+int event_loop::watch(int fd, unsigned events)
+{
+	struct epoll_event ev = {};
+	auto iter = watched.find(fd);
+	int ret;
+
+	if (iter != watched.end() && iter->second == events)
+		return 0;
+	ev.events = events;
+	ev.data.fd = fd;
+	if (!events) {
+		if (iter != watched.end())
+			watched.erase(iter);
+		ready.erase(fd);
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, &ev);
+		return 0;
+	}
+	ret = epoll_ctl(epoll_fd, iter == watched.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+			fd, &ev);
+	if (ret && errno == EEXIST)
+		ret = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+	else if (ret && errno == ENOENT)
+		ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+	if (ret) {
+		stderr_info("epoll_ctl error: %s\n", strerror(errno));
+		return ret;
+	}
+	watched[fd] = events;
+	return 0;
+}
+
+int event_loop::add_timer(unsigned ms)
+{
+	struct itimerspec its = {};
+	int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (fd < 0)
+		return fd;
+	its.it_value.tv_sec = its.it_interval.tv_sec = ms / 1000;
+	its.it_value.tv_nsec = its.it_interval.tv_nsec = (ms % 1000) * 1000000;
+	if (timerfd_settime(fd, 0, &its, nullptr) || watch(fd, EPOLLIN)) {
+		close(fd);
+		return -1;
+	}
+	timers.push_back(fd);
+	return fd;
+}
+
+bool event_loop::timer_expired(int fd)
+{
+	__u64 expirations;
+
+	if (!(revents(fd) & EPOLLIN))
+		return false;
+	ready.erase(fd);
+	return read(fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
+
+/*
+ * Returns the number of ready file descriptors, 0 on timeout or -1 on
+ * error (with errno set).
+ */
+int event_loop::wait(int timeout_ms)
+{
+	struct epoll_event events[16];
+	int n;
+
+	ready.clear();
+	n = epoll_wait(epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+	for (int i = 0; i < n; i++)
+		ready[events[i].data.fd] |= events[i].events;
+	return n;
+}
+
+unsigned event_loop::revents(int fd)
+{
+	auto iter = ready.find(fd);
+
+	if (iter == ready.end())
+		return 0;
+
+	unsigned events = iter->second;
+
+	// Like select(), report errors as readable/writable
+	if (events & (EPOLLERR | EPOLLHUP))
+		events |= watched[fd] & (EPOLLIN | EPOLLOUT);
+	return events;
+}
+
+static __u64 monotonic_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latency_stats::out_queued(cv4l_buffer &buf)
+{
+	__u64 now = monotonic_ns();
+
+	out_qbuf[buf.g_index()] = now;
+	if ((buf.g_flags() & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_COPY) {
+		// Limit the size in case the driver drops frames
+		if (qbuf_by_ts.size() >= 4 * VIDEO_MAX_FRAME)
+			qbuf_by_ts.erase(qbuf_by_ts.begin());
+		qbuf_by_ts[buf.g_timestamp_ns()] = now;
+	}
+}
+
+void latency_stats::out_dequeued(cv4l_buffer &buf)
+{
+	if ((buf.g_flags() & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_COPY)
+		return;
+	if (qbuf_by_seq.size() >= 4 * VIDEO_MAX_FRAME)
+		qbuf_by_seq.erase(qbuf_by_seq.begin());
+	qbuf_by_seq[buf.g_sequence()] = out_qbuf[buf.g_index()];
+}
+
+void latency_stats::cap_dequeued(cv4l_queue &q, cv4l_buffer &buf)
+{
+	__u64 ts = buf.g_timestamp_ns();
+	__u64 dqbuf = monotonic_ns();
+	__s64 latency = -1;
+	__s64 e2e_latency = -1;
+
+	memory = q.g_memory();
+	buffers = q.g_buffers();
+	if ((buf.g_flags() & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC &&
+	    dqbuf >= ts) {
+		latency = dqbuf - ts;
+		lat.add(latency);
+	}
+
+	auto ts_iter = qbuf_by_ts.find(ts);
+
+	if (ts_iter != qbuf_by_ts.end()) {
+		e2e_latency = dqbuf - ts_iter->second;
+		qbuf_by_ts.erase(ts_iter);
+	} else {
+		auto seq_iter = qbuf_by_seq.find(buf.g_sequence());
+
+		if (seq_iter != qbuf_by_seq.end()) {
+			e2e_latency = dqbuf - seq_iter->second;
+			qbuf_by_seq.erase(seq_iter);
+		}
+	}
+	if (e2e_latency >= 0)
+		e2e.add(e2e_latency);
+
+	if (!stream_latency_csv)
+		return;
+	if (!csv) {
+		csv = fopen(stream_latency_csv, "w");
+		if (!csv) {
+			fprintf(stderr, "could not open %s for writing\n", stream_latency_csv);
+			stream_latency_csv = nullptr;
+			return;
+		}
+		fprintf(csv, "sequence,timestamp_ns,dqbuf_ns,latency_ns,e2e_ns\n");
+	}
+	fprintf(csv, "%u,%llu,%llu,%lld,%lld\n", buf.g_sequence(), ts, dqbuf,
+		latency, e2e_latency);
+}
+
+unsigned latency_hist::bucket(__u64 v)
+{
+	if (v < (2U << sub_bits))
+		return v;
+
+	unsigned shift = 63 - __builtin_clzll(v) - sub_bits;
+
+	return (shift << sub_bits) + (v >> shift);
+}
+
+__u64 latency_hist::bucket_min(unsigned b)
+{
+	if (b < (2U << sub_bits))
+		return b;
+
+	unsigned shift = (b >> sub_bits) - 1;
+
+	return static_cast<__u64>(b - (shift << sub_bits)) << shift;
+}
+
+void latency_hist::add(__u64 v)
+{
+	if (!cnt || v < min)
+		min = v;
+	if (!cnt || v > max)
+		max = v;
+	sum += v;
+	cnt++;
+	hist[bucket(v)]++;
+}
+
+void latency_hist::print(const char *name)
+{
+	static constexpr unsigned print_buckets = 10;
+	__u64 print_hist[print_buckets] = {};
+	__u64 max_cnt = 0;
+	__u64 p99_rank = (cnt * 99 - 1) / 100 + 1;
+	__u64 p99 = max;
+	__u64 seen = 0;
+
+	if (!cnt)
+		return;
+
+	__u64 width = (max - min) / print_buckets + 1;
+
+	for (unsigned b = bucket(min); b <= bucket(max); b++) {
+		if (!hist[b])
+			continue;
+
+		// all values of a bucket count as the smallest one
+		__u64 v = std::min(std::max(bucket_min(b), min), max);
+		unsigned pb = (v - min) / width;
+
+		if (seen < p99_rank && seen + hist[b] >= p99_rank)
+			p99 = v;
+		seen += hist[b];
+		print_hist[pb] += hist[b];
+		if (print_hist[pb] > max_cnt)
+			max_cnt = print_hist[pb];
+	}
+
+	stderr_info("%s latency (%llu buffers): min %.03f ms, avg %.03f ms, p99 %.03f ms, max %.03f ms\n",
+		    name, cnt, min / 1000000.0, sum / cnt / 1000000.0,
+		    p99 / 1000000.0, max / 1000000.0);
+	for (unsigned b = 0; b < print_buckets; b++)
+		stderr_info("\t%8.03f - %8.03f ms: %6llu %s\n",
+			    (min + b * width) / 1000000.0, (min + (b + 1) * width) / 1000000.0,
+			    print_hist[b],
+			    std::string((print_hist[b] * 50 + max_cnt - 1) / max_cnt, '#').c_str());
+}
+
+void latency_stats::report()
+{
+	if (buffers)
+		stderr_info("\nLatency with %u %s buffers:\n", buffers,
+			    memory == V4L2_MEMORY_MMAP ? "mmap" :
+			    memory == V4L2_MEMORY_USERPTR ? "userptr" : "dmabuf");
+	else
+		stderr_info("\nLatency:\n");
+	if (lat.empty() && e2e.empty())
+		stderr_info("\tno buffers with a monotonic timestamp or matching output buffer\n");
+	lat.print("Driver");
+	e2e.print("End-to-end");
+	if (csv)
+		fclose(csv);
+	csv = nullptr;
+}
+
 void streaming_usage()
 {
 	printf("\nVideo Streaming options:\n"
@@ -321,14 +851,33 @@ void streaming_usage()
 	       "                     frame is prefixed by a header. Use for compressed data.\n"
 	       "  --stream-to-host <hostname[:port]>\n"
                "                     stream to this host. The default port is %d.\n"
+	       "  --stream-to-server [port=<port>,clients=<count>,queue=<frames>]\n"
+	       "                     act as a server and stream to every receiver that connects\n"
+	       "                     to <port>. The default port is %d. Streaming starts once\n"
+	       "                     <count> receivers (default 1) are connected, others can join\n"
+	       "                     later. Each frame is compressed once and queued for every\n"
+	       "                     receiver. If more than <frames> (default 8) frames are pending\n"
+	       "                     for a receiver, then its pending frames are dropped and it\n"
+	       "                     resumes at the next key frame.\n"
 	       "  --stream-lossless  always use lossless video compression.\n"
 #endif
-	       "  --stream-poll      use non-blocking mode and select() to stream.\n"
+	       "  --stream-poll      use non-blocking mode and epoll() to stream.\n"
 	       "  --stream-buf-caps  show capture buffer capabilities\n"
 	       "  --stream-show-delta-now\n"
 	       "                     output the difference between the buffer timestamp and current\n"
 	       "                     clock, if the buffer timestamp source is the monotonic clock.\n"
 	       "                     Requires --verbose as well.\n"
+	       "  --stream-latency [csv=<file>]\n"
+	       "                     measure the latency of each captured buffer and show the\n"
+	       "                     min/avg/p99/max and a histogram when streaming stops.\n"
+	       "                     The driver latency is the time between the buffer timestamp\n"
+	       "                     and VIDIOC_DQBUF, if the timestamp uses the monotonic clock.\n"
+	       "                     For a memory-to-memory device the end-to-end latency is the\n"
+	       "                     time between VIDIOC_QBUF of the output buffer and VIDIOC_DQBUF\n"
+	       "                     of the capture buffer. Output and capture buffers are matched\n"
+	       "                     by timestamp if it is copied, otherwise by sequence number.\n"
+	       "                     It is not measured with --out-device. All samples are written\n"
+	       "                     to <file> in CSV format if given.\n"
 	       "  --stream-mmap <count>\n"
 	       "                     capture video using mmap() [VIDIOC_(D)QBUF]\n"
 	       "                     count: the number of buffers to allocate. The default is 3.\n"
@@ -337,6 +886,17 @@ void streaming_usage()
 	       "                     count: the number of buffers to allocate. The default is 3.\n"
 	       "  --stream-dmabuf    capture video using dmabuf [VIDIOC_(D)QBUF]\n"
 	       "                     Requires a corresponding --stream-out-mmap option.\n"
+	       "  --stream-pipeline dev=<dev>[,width=<w>,height=<h>,pixelformat=<pf>]\n"
+	       "                     pass the frames captured with --stream-mmap through the\n"
+	       "                     memory-to-memory device <dev>. This option can be repeated to\n"
+	       "                     build a chain of devices. The capture buffers of each stage\n"
+	       "                     are exported and imported as dmabuf by the next stage, the\n"
+	       "                     output of the last stage is handled as set by --stream-to.\n"
+	       "                     If <dev> starts with a digit, then /dev/video<dev> is used.\n"
+	       "                     The output format of each stage is copied from the capture\n"
+	       "                     format of the previous stage, the capture format can be\n"
+	       "                     changed with width, height and pixelformat.\n"
+	       "                     Per-stage throughput and latency are reported every second.\n"
 	       "  --stream-from <file>\n"
 	       "                     stream from this file. The default is to generate a pattern.\n"
 	       "                     If <file> is '-', then the data is read from stdin.\n"
@@ -376,6 +936,9 @@ void streaming_usage()
 	       "                     and the range is [-3...3].\n"
 	       "  --stream-out-perc-fill <percentage>\n"
 	       "                     percentage of the frame to actually fill. The default is 100%%.\n"
+	       "  --stream-out-threads <count>\n"
+	       "                     use <count> threads to generate the test pattern, each filling\n"
+	       "                     a range of lines. The default is 1.\n"
 	       "  --stream-out-buf-caps\n"
 	       "                     show output buffer capabilities\n"
 	       "  --stream-out-mmap <count>\n"
@@ -404,7 +967,7 @@ void streaming_usage()
 	       "  --list-buffers-meta\n"
 	       "                     list all Meta RX buffers [VIDIOC_QUERYBUF]\n",
 #ifndef NO_STREAM_TO
-		V4L_STREAM_PORT,
+		V4L_STREAM_PORT, V4L_STREAM_PORT,
 #endif
 	       	V4L_STREAM_PORT);
 }
@@ -814,6 +1377,32 @@ void streaming_cmd(int ch, char *optarg)
 		else
 			stream_out_vert_mode = static_cast<tpg_move_mode>(speed + 3);
 		break;
+	case OptStreamLatency:
+		stream_latency = true;
+		subs = optarg;
+		while (subs && *subs != '\0') {
+			static constexpr const char *subopts[] = {
+				"csv",
+				nullptr
+			};
+
+			switch (parse_subopt(&subs, subopts, &value)) {
+			case 0:
+				stream_latency_csv = value;
+				break;
+			default:
+				streaming_usage();
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		break;
+	case OptStreamOutThreads:
+		stream_out_threads = strtoul(optarg, nullptr, 0);
+		if (stream_out_threads < 1)
+			stream_out_threads = 1;
+		if (stream_out_threads > 64)
+			stream_out_threads = 64;
+		break;
 	case OptStreamOutPercFill:
 		stream_out_perc_fill = strtoul(optarg, nullptr, 0);
 		if (stream_out_perc_fill > 100)
@@ -836,6 +1425,37 @@ void streaming_cmd(int ch, char *optarg)
 	case OptStreamToHost:
 		host_to = optarg;
 		break;
+#ifndef NO_STREAM_TO
+	case OptStreamToServer:
+		host_serve = true;
+		subs = optarg;
+		while (subs && *subs != '\0') {
+			static constexpr const char *subopts[] = {
+				"port",
+				"clients",
+				"queue",
+				nullptr
+			};
+
+			switch (parse_subopt(&subs, subopts, &value)) {
+			case 0:
+				host_port_serve = strtoul(value, nullptr, 0);
+				break;
+			case 1:
+				serve_min_clients = strtoul(value, nullptr, 0);
+				break;
+			case 2:
+				serve_queue_depth = strtoul(value, nullptr, 0);
+				if (serve_queue_depth)
+					break;
+				fallthrough;
+			default:
+				streaming_usage();
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		break;
+#endif
 	case OptStreamLossless:
 		host_lossless = true;
 		break;
@@ -860,6 +1480,55 @@ void streaming_cmd(int ch, char *optarg)
 	case OptStreamDmaBuf:
 		memory = V4L2_MEMORY_DMABUF;
 		break;
+	case OptStreamPipeline: {
+		pipeline_opt opt = {};
+
+		subs = optarg;
+		while (*subs != '\0') {
+			static constexpr const char *subopts[] = {
+				"dev",
+				"width",
+				"height",
+				"pixelformat",
+				nullptr
+			};
+
+			switch (parse_subopt(&subs, subopts, &value)) {
+			case 0:
+				if (isdigit(value[0]) && strlen(value) <= 3)
+					opt.devname = std::string("/dev/video") + value;
+				else
+					opt.devname = value;
+				break;
+			case 1:
+				opt.width = strtoul(value, nullptr, 0);
+				opt.set_fmts |= FmtWidth;
+				break;
+			case 2:
+				opt.height = strtoul(value, nullptr, 0);
+				opt.set_fmts |= FmtHeight;
+				break;
+			case 3:
+				if (strlen(value) != 4) {
+					fprintf(stderr, "The pixelformat '%s' is invalid\n", value);
+					std::exit(EXIT_FAILURE);
+				}
+				opt.pixelformat = v4l2_fourcc(value[0], value[1],
+							      value[2], value[3]);
+				opt.set_fmts |= FmtPixelFormat;
+				break;
+			default:
+				streaming_usage();
+				std::exit(EXIT_FAILURE);
+			}
+		}
+		if (opt.devname.empty()) {
+			streaming_usage();
+			std::exit(EXIT_FAILURE);
+		}
+		pipeline_opts.push_back(opt);
+		break;
+	}
 	case OptStreamOutUser:
 		out_memory = V4L2_MEMORY_USERPTR;
 		fallthrough;
@@ -1333,7 +2002,7 @@ static int do_setup_out_buffers(cv4l_fd &fd, cv4l_queue &q, FILE *fin, bool qbuf
 
 			if (can_fill) {
 				for (unsigned j = 0; j < q.g_num_planes(); j++)
-					tpg_fillbuffer(&tpg, stream_out_std, j, static_cast<u8 *>(q.g_dataptr(i, j)));
+					fill_tpg_buffer(j, static_cast<u8 *>(q.g_dataptr(i, j)));
 			}
 		}
 		if (is_meta)
@@ -1370,6 +2039,8 @@ static int do_setup_out_buffers(cv4l_fd &fd, cv4l_queue &q, FILE *fin, bool qbuf
 			set_time_stamp(buf);
 			if (fd.qbuf(buf))
 				return QUEUE_ERROR;
+			if (stream_latency)
+				latency.out_queued(buf);
 			tpg_update_mv_count(&tpg, V4L2_FIELD_HAS_T_OR_B(field));
 			if (!verbose)
 				stderr_info(">");
@@ -1394,42 +2065,358 @@ static int do_setup_out_buffers(cv4l_fd &fd, cv4l_queue &q, FILE *fin, bool qbuf
 	return 0;
 }
 
+#ifndef NO_STREAM_TO
+static void put_u32(std::vector<__u8> &v, __u32 val)
+{
+	__u8 *p = reinterpret_cast<__u8 *>(&val);
+
+	val = htonl(val);
+	v.insert(v.end(), p, p + sizeof(val));
+}
+
+static void encode_frame_packet(cv4l_queue &q, cv4l_buffer &buf, stream_packet &pkt)
+{
+	std::vector<__u8> &v = pkt.data;
+	unsigned tot_comp_size = 0;
+	unsigned tot_used = 0;
+	__u32 size;
+
+	v.clear();
+	pkt.keyframe = true;
+	put_u32(v, ctx ? V4L_STREAM_PACKET_FRAME_VIDEO_FWHT :
+		V4L_STREAM_PACKET_FRAME_VIDEO_RLE);
+	put_u32(v, 0); // packet size, filled in below
+	put_u32(v, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_HDR);
+	put_u32(v, buf.g_field());
+	put_u32(v, buf.g_flags());
+
+	/*
+	 * Compress and append each plane in turn: fwht_compress() always
+	 * returns the same buffer, so the result must be copied before
+	 * the next plane is compressed.
+	 */
+	for (unsigned j = 0; j < buf.g_num_planes(); j++) {
+		__u32 used = buf.g_bytesused(j);
+		unsigned offset = buf.g_data_offset(j);
+		u8 *p;
+		__u8 *comp_ptr;
+		unsigned comp_size;
+
+		if (offset > used) {
+			// Should never happen
+			fprintf(stderr, "offset %d > used %d!\n",
+				offset, used);
+			offset = 0;
+		}
+		used -= offset;
+		p = static_cast<u8 *>(q.g_dataptr(buf.g_index(), j)) + offset;
+
+		if (ctx) {
+			comp_ptr = fwht_compress(ctx, p, used, &comp_size);
+			auto hdr = reinterpret_cast<fwht_cframe_hdr *>(comp_ptr);
+
+			if (!(ntohl(hdr->flags) & V4L2_FWHT_FL_I_FRAME))
+				pkt.keyframe = false;
+		} else {
+			comp_ptr = p;
+			comp_size = rle_compress(p, used, bpl_cap[j]);
+		}
+		put_u32(v, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_PLANE_HDR);
+		put_u32(v, used);
+		put_u32(v, comp_size);
+		v.insert(v.end(), comp_ptr, comp_ptr + comp_size);
+		tot_comp_size += comp_size;
+		tot_used += used;
+	}
+	size = htonl(V4L_STREAM_PACKET_FRAME_VIDEO_SIZE(buf.g_num_planes()) + tot_comp_size);
+	memcpy(&v[4], &size, sizeof(size));
+	comp_perc += (tot_comp_size * 100 / tot_used);
+	comp_perc_count++;
+}
+
+static void encode_fmt_packet(cv4l_fd &fd, std::vector<__u8> &v)
+{
+	struct v4l2_fract aspect;
+	unsigned width, height;
+	cv4l_fmt cfmt;
+
+	fd.g_fmt(cfmt);
+	aspect = fd.g_pixel_aspect(width, height);
+
+	put_u32(v, V4L_STREAM_ID);
+	put_u32(v, V4L_STREAM_VERSION);
+	put_u32(v, V4L_STREAM_PACKET_FMT_VIDEO);
+	put_u32(v, V4L_STREAM_PACKET_FMT_VIDEO_SIZE(cfmt.g_num_planes()));
+	put_u32(v, V4L_STREAM_PACKET_FMT_VIDEO_SIZE_FMT);
+	put_u32(v, cfmt.g_num_planes());
+	put_u32(v, cfmt.g_pixelformat());
+	put_u32(v, cfmt.g_width());
+	put_u32(v, cfmt.g_height());
+	put_u32(v, cfmt.g_field());
+	put_u32(v, cfmt.g_colorspace());
+	put_u32(v, cfmt.g_ycbcr_enc());
+	put_u32(v, cfmt.g_quantization());
+	put_u32(v, cfmt.g_xfer_func());
+	put_u32(v, cfmt.g_flags());
+	put_u32(v, aspect.numerator);
+	put_u32(v, aspect.denominator);
+	for (unsigned i = 0; i < cfmt.g_num_planes(); i++) {
+		put_u32(v, V4L_STREAM_PACKET_FMT_VIDEO_SIZE_FMT_PLANE);
+		put_u32(v, cfmt.g_sizeimage(i));
+		put_u32(v, cfmt.g_bytesperline(i));
+		bpl_cap[i] = rle_calc_bpl(cfmt.g_bytesperline(i), cfmt.g_pixelformat());
+	}
+	if (!host_lossless) {
+		unsigned visible_width = support_cap_compose ? composed_width : cfmt.g_width();
+		unsigned visible_height = support_cap_compose ? composed_height : cfmt.g_height();
+
+		ctx = fwht_alloc(cfmt.g_pixelformat(), visible_width, visible_height,
+				 cfmt.g_width(), cfmt.g_height(),
+				 cfmt.g_field(), cfmt.g_colorspace(), cfmt.g_xfer_func(),
+				 cfmt.g_ycbcr_enc(), cfmt.g_quantization());
+	}
+}
+
+/*
+ * Send as much of the pending packets of this receiver as the socket
+ * accepts without blocking. Returns false if the receiver is gone.
+ */
+static bool serve_flush(stream_client &c, bool block = false)
+{
+	while (!c.queue.empty()) {
+		const std::vector<__u8> &v = c.queue.front()->data;
+		ssize_t n = send(c.fd, v.data() + c.offset, v.size() - c.offset,
+				 MSG_NOSIGNAL | (block ? 0 : MSG_DONTWAIT));
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		c.offset += n;
+		if (c.offset < v.size())
+			continue;
+		if (c.queue.front() != serve_hdr)
+			c.sent++;
+		c.queue.pop_front();
+		c.offset = 0;
+	}
+	return true;
+}
+
+static void serve_disconnect(std::list<stream_client>::iterator &iter)
+{
+	stderr_info("\nreceiver %s disconnected: %u frames sent, %u dropped\n",
+		    iter->name.c_str(), iter->sent, iter->dropped);
+	close(iter->fd);
+	iter = serve_clients.erase(iter);
+}
+
+static bool serve_accept(bool block)
+{
+	struct sockaddr_in cli_addr;
+	socklen_t clilen = sizeof(cli_addr);
+	char name[INET_ADDRSTRLEN];
+	int fd;
+
+	fd = accept4(serve_fd, reinterpret_cast<struct sockaddr *>(&cli_addr), &clilen,
+		     block ? 0 : SOCK_NONBLOCK);
+	if (fd < 0)
+		return false;
+	if (block)
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	inet_ntop(AF_INET, &cli_addr.sin_addr, name, sizeof(name));
+
+	stream_client c = {};
+
+	c.fd = fd;
+	c.name = std::string(name) + ":" + std::to_string(ntohs(cli_addr.sin_port));
+	// A FWHT stream can only be decoded starting with an I-frame
+	c.wait_keyframe = ctx != nullptr;
+	c.queue.push_back(serve_hdr);
+	serve_clients.push_back(c);
+	stderr_info("\nreceiver %s connected (%zu total)\n",
+		    c.name.c_str(), serve_clients.size());
+	if (!serve_flush(serve_clients.back())) {
+		auto iter = std::prev(serve_clients.end());
+
+		serve_disconnect(iter);
+	}
+	return true;
+}
+
+static void serve_frame(const std::shared_ptr<stream_packet> &pkt)
+{
+	while (serve_accept(false)) ;
+
+	for (auto iter = serve_clients.begin(); iter != serve_clients.end(); ) {
+		stream_client &c = *iter;
+		unsigned keep = !c.queue.empty() &&
+				(c.offset || c.queue.front() == serve_hdr);
+
+		if (c.queue.size() > keep + serve_queue_depth - 1) {
+			/*
+			 * This receiver can't keep up: drop all pending frames
+			 * except the one that is partially sent (that one must
+			 * be completed to keep the stream in sync).
+			 */
+			c.dropped += c.queue.size() - keep;
+			c.queue.erase(c.queue.begin() + keep, c.queue.end());
+			c.wait_keyframe = ctx != nullptr;
+		}
+		if (c.wait_keyframe && !pkt->keyframe) {
+			c.dropped++;
+		} else {
+			c.wait_keyframe = false;
+			c.queue.push_back(pkt);
+		}
+		if (serve_flush(c))
+			iter++;
+		else
+			serve_disconnect(iter);
+	}
+}
+
+static void open_server(cv4l_fd &fd)
+{
+	struct sockaddr_in serv_addr = {};
+	int val = 1;
+
+	serve_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (serve_fd < 0) {
+		fprintf(stderr, "could not open socket\n");
+		std::exit(EXIT_FAILURE);
+	}
+	setsockopt(serve_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_addr.s_addr = INADDR_ANY;
+	serv_addr.sin_port = htons(host_port_serve);
+	if (bind(serve_fd, reinterpret_cast<struct sockaddr *>(&serv_addr), sizeof(serv_addr)) < 0) {
+		fprintf(stderr, "could not bind\n");
+		std::exit(EXIT_FAILURE);
+	}
+	listen(serve_fd, 16);
+
+	serve_hdr = std::make_shared<stream_packet>();
+	serve_hdr->keyframe = true;
+	encode_fmt_packet(fd, serve_hdr->data);
+
+	stderr_info("waiting for %u receiver%s on port %u\n", serve_min_clients,
+		    serve_min_clients == 1 ? "" : "s", host_port_serve);
+	while (serve_clients.size() < serve_min_clients) {
+		if (!serve_accept(true) && errno != EINTR) {
+			fprintf(stderr, "could not accept\n");
+			std::exit(EXIT_FAILURE);
+		}
+	}
+	fcntl(serve_fd, F_SETFL, fcntl(serve_fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void close_server()
+{
+	if (serve_fd < 0)
+		return;
+
+	auto end = std::make_shared<stream_packet>();
+
+	put_u32(end->data, V4L_STREAM_PACKET_END);
+	end->keyframe = true;
+	for (auto &c : serve_clients) {
+		c.queue.push_back(end);
+		fcntl(c.fd, F_SETFL, fcntl(c.fd, F_GETFL) & ~O_NONBLOCK);
+		serve_flush(c, true);
+		stderr_info("receiver %s: %u frames sent, %u dropped\n",
+			    c.name.c_str(), c.sent, c.dropped);
+		close(c.fd);
+	}
+	serve_clients.clear();
+	serve_hdr.reset();
+	close(serve_fd);
+	serve_fd = -1;
+}
+
+/*
+ * Watch the listening socket for new receivers and the receivers with
+ * pending data for writability, so they are served while waiting for
+ * the next frame.
+ */
+static void serve_watch(event_loop &loop)
+{
+	if (serve_fd < 0)
+		return;
+
+	loop.watch(serve_fd, EPOLLIN);
+	for (auto &c : serve_clients) {
+		/*
+		 * The fd of a new receiver may be a reused fd of a receiver
+		 * that disconnected, so drop any stale state first.
+		 */
+		if (!c.watched) {
+			loop.watch(c.fd, 0);
+			c.watched = true;
+		}
+		loop.watch(c.fd, c.queue.empty() ? 0 : EPOLLOUT);
+	}
+}
+
+static void serve_handle(event_loop &loop)
+{
+	if (serve_fd < 0)
+		return;
+
+	if (loop.revents(serve_fd) & EPOLLIN)
+		while (serve_accept(false)) ;
+	for (auto iter = serve_clients.begin(); iter != serve_clients.end(); ) {
+		if (!(loop.revents(iter->fd) & EPOLLOUT) || serve_flush(*iter)) {
+			iter++;
+		} else {
+			loop.watch(iter->fd, 0);
+			serve_disconnect(iter);
+		}
+	}
+}
+#endif
+
+/*
+ * Wait for events on the loop and handle the output sockets.
+ * Returns the result of event_loop::wait().
+ */
+static int stream_wait(event_loop &loop, int timeout_ms)
+{
+	int r;
+
+#ifndef NO_STREAM_TO
+	serve_watch(loop);
+#endif
+	r = loop.wait(timeout_ms);
+#ifndef NO_STREAM_TO
+	if (r > 0)
+		serve_handle(loop);
+#endif
+	return r;
+}
+
 static void write_buffer_to_file(cv4l_fd &fd, cv4l_queue &q, cv4l_buffer &buf,
 				 cv4l_fmt &fmt, FILE *fout)
 {
 #ifndef NO_STREAM_TO
-	unsigned comp_size[VIDEO_MAX_PLANES];
-	__u8 *comp_ptr[VIDEO_MAX_PLANES];
+	if (serve_fd >= 0) {
+		auto pkt = std::make_shared<stream_packet>();
 
+		encode_frame_packet(q, buf, *pkt);
+		serve_frame(pkt);
+		return;
+	}
 	if (host_fd_to >= 0) {
-		unsigned tot_comp_size = 0;
-		unsigned tot_used = 0;
-
-		for (unsigned j = 0; j < buf.g_num_planes(); j++) {
-			__u32 used = buf.g_bytesused(j);
-			unsigned offset = buf.g_data_offset(j);
-			u8 *p = static_cast<u8 *>(q.g_dataptr(buf.g_index(), j)) + offset;
+		static stream_packet pkt;
 
-			if (ctx) {
-				comp_ptr[j] = fwht_compress(ctx, p,
-							    used - offset, &comp_size[j]);
-			} else {
-				comp_ptr[j] = p;
-				comp_size[j] = rle_compress(p, used - offset,
-							    bpl_cap[j]);
-			}
-			tot_comp_size += comp_size[j];
-			tot_used += used - offset;
-		}
-		write_u32(fout, ctx ? V4L_STREAM_PACKET_FRAME_VIDEO_FWHT :
-				V4L_STREAM_PACKET_FRAME_VIDEO_RLE);
-		write_u32(fout, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE(buf.g_num_planes()) + tot_comp_size);
-		write_u32(fout, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_HDR);
-		write_u32(fout, buf.g_field());
-		write_u32(fout, buf.g_flags());
-		comp_perc += (tot_comp_size * 100 / tot_used);
-		comp_perc_count++;
+		encode_frame_packet(q, buf, pkt);
+		if (fwrite(pkt.data.data(), 1, pkt.data.size(), fout) != pkt.data.size())
+			fprintf(stderr, "could not write %zu bytes\n", pkt.data.size());
+		fflush(fout);
+		return;
 	}
+
 	if (to_with_hdr)
 		write_u32(fout, FILE_HDR_ID);
 	for (unsigned j = 0; j < buf.g_num_planes(); j++) {
@@ -1444,18 +2431,10 @@ static void write_buffer_to_file(cv4l_fd &fd, cv4l_queue &q, cv4l_buffer &buf,
 			offset = 0;
 		}
 		used -= offset;
-		if (host_fd_to >= 0) {
-			write_u32(fout, V4L_STREAM_PACKET_FRAME_VIDEO_SIZE_PLANE_HDR);
+		if (to_with_hdr)
 			write_u32(fout, used);
-			write_u32(fout, comp_size[j]);
-			used = comp_size[j];
-		} else if (to_with_hdr) {
-			write_u32(fout, used);
-		}
-		if (host_fd_to >= 0)
-			sz = fwrite(comp_ptr[j] + offset, 1, used, fout);
-		else if (codec_type != NOT_CODEC && support_cap_compose &&
-			 v4l2_fwht_find_pixfmt(fmt.g_pixelformat()))
+		if (codec_type != NOT_CODEC && support_cap_compose &&
+		    v4l2_fwht_find_pixfmt(fmt.g_pixelformat()))
 			read_write_padded_frame(fmt, static_cast<u8 *>(q.g_dataptr(buf.g_index(), j)) + offset,
 						fout, sz, used, used, false);
 		else
@@ -1464,8 +2443,6 @@ static void write_buffer_to_file(cv4l_fd &fd, cv4l_queue &q, cv4l_buffer &buf,
 		if (sz != used)
 			fprintf(stderr, "%u != %u\n", sz, used);
 	}
-	if (host_fd_to >= 0)
-		fflush(fout);
 #endif
 }
 
@@ -1502,10 +2479,13 @@ static int do_handle_cap(cv4l_fd &fd, cv4l_queue &q, FILE *fout, int *index,
 	bool is_empty_frame = !buf.g_bytesused(0);
 	bool is_error_frame = buf.g_flags() & V4L2_BUF_FLAG_ERROR;
 
+	if (stream_latency && !is_empty_frame && !is_error_frame)
+		latency.cap_dequeued(q, buf);
+
 	double ts_secs = buf.g_timestamp().tv_sec + buf.g_timestamp().tv_usec / 1000000.0;
 	fps_ts.add_ts(ts_secs, buf.g_sequence(), buf.g_field());
 
-	if (fout && (!stream_skip || ignore_count_skip) &&
+	if ((fout || serve_fd >= 0) && (!stream_skip || ignore_count_skip) &&
 	    !is_empty_frame && !is_error_frame)
 		write_buffer_to_file(fd, q, buf, fmt, fout);
 
@@ -1517,7 +2497,7 @@ static int do_handle_cap(cv4l_fd &fd, cv4l_queue &q, FILE *fout, int *index,
 		ch = 'B';
 	if (verbose) {
 		print_concise_buffer(stderr, buf, fmt, q, fps_ts,
-				     host_fd_to >= 0 ? 100 - comp_perc / comp_perc_count : -1);
+				     comp_perc_count ? 100 - comp_perc / comp_perc_count : -1);
 		comp_perc_count = comp_perc = 0;
 	}
 	if (!last_buffer && index == nullptr) {
@@ -1545,8 +2525,13 @@ static int do_handle_cap(cv4l_fd &fd, cv4l_queue &q, FILE *fout, int *index,
 			stderr_info(" %.02f fps", fps_ts.fps());
 			if (dropped)
 				stderr_info(", dropped buffers: %u", dropped);
-			if (host_fd_to >= 0)
+			if (comp_perc_count)
 				stderr_info(" %d%% compression", 100 - comp_perc / comp_perc_count);
+#ifndef NO_STREAM_TO
+			if (serve_fd >= 0)
+				stderr_info(" %zu receiver%s", serve_clients.size(),
+					    serve_clients.size() == 1 ? "" : "s");
+#endif
 			comp_perc_count = comp_perc = 0;
 			stderr_info("\n");
 		}
@@ -1620,6 +2605,8 @@ static int do_handle_out(cv4l_fd &fd, cv4l_queue &q, FILE *fin, cv4l_buffer *cap
 		ret = fd.dqbuf(buf);
 		if (ret == EAGAIN)
 			return 0;
+		if (!ret && stream_latency)
+			latency.out_dequeued(buf);
 
 		double ts_secs = buf.g_timestamp().tv_sec + buf.g_timestamp().tv_usec / 1000000.0;
 		fps_ts.add_ts(ts_secs, buf.g_sequence(), buf.g_field());
@@ -1658,8 +2645,7 @@ static int do_handle_out(cv4l_fd &fd, cv4l_queue &q, FILE *fin, cv4l_buffer *cap
 
 	if (!fin && stream_out_refresh) {
 		for (unsigned j = 0; j < buf.g_num_planes(); j++)
-			tpg_fillbuffer(&tpg, stream_out_std, j,
-				       static_cast<u8 *>(q.g_dataptr(buf.g_index(), j)));
+			fill_tpg_buffer(j, static_cast<u8 *>(q.g_dataptr(buf.g_index(), j)));
 	}
 	if (is_meta)
 		meta_fillbuffer(buf, fmt, q);
@@ -1685,6 +2671,10 @@ static int do_handle_out(cv4l_fd &fd, cv4l_queue &q, FILE *fin, cv4l_buffer *cap
 		fprintf(stderr, "%s: failed: %s\n", "VIDIOC_QBUF", strerror(errno));
 		return QUEUE_ERROR;
 	}
+	// Output buffers filled from another device's capture buffers have no
+	// end-to-end latency: their sequence numbers are those of another device
+	if (stream_latency && !cap)
+		latency.out_queued(buf);
 	if (fmt.g_pixelformat() == V4L2_PIX_FMT_FWHT_STATELESS) {
 		if (!set_fwht_req_by_fd(&last_fwht_hdr, buf.g_request_fd(), last_fwht_bf_ts,
 					buf.g_timestamp_ns())) {
@@ -1767,19 +2757,19 @@ static FILE *open_output_file(cv4l_fd &fd)
 			fprintf(stderr, "could not open %s for writing\n", file_to);
 		return fout;
 	}
+	if (host_serve) {
+		if (serve_fd < 0)
+			open_server(fd);
+		return nullptr;
+	}
 	if (!host_to)
 		return nullptr;
 
 	char *p = std::strchr(host_to, ':');
 	struct sockaddr_in serv_addr;
 	struct hostent *server;
-	struct v4l2_fract aspect;
-	unsigned width, height;
-	cv4l_fmt cfmt;
-
-	fd.g_fmt(cfmt);
+	std::vector<__u8> hdr;
 
-	aspect = fd.g_pixel_aspect(width, height);
 	if (p) {
 		host_port_to = strtoul(p + 1, nullptr, 0);
 		*p = '\0';
@@ -1805,38 +2795,8 @@ static FILE *open_output_file(cv4l_fd &fd)
 		std::exit(EXIT_SUCCESS);
 	}
 	fout = fdopen(host_fd_to, "a");
-	write_u32(fout, V4L_STREAM_ID);
-	write_u32(fout, V4L_STREAM_VERSION);
-	write_u32(fout, V4L_STREAM_PACKET_FMT_VIDEO);
-	write_u32(fout, V4L_STREAM_PACKET_FMT_VIDEO_SIZE(cfmt.g_num_planes()));
-	write_u32(fout, V4L_STREAM_PACKET_FMT_VIDEO_SIZE_FMT);
-	write_u32(fout, cfmt.g_num_planes());
-	write_u32(fout, cfmt.g_pixelformat());
-	write_u32(fout, cfmt.g_width());
-	write_u32(fout, cfmt.g_height());
-	write_u32(fout, cfmt.g_field());
-	write_u32(fout, cfmt.g_colorspace());
-	write_u32(fout, cfmt.g_ycbcr_enc());
-	write_u32(fout, cfmt.g_quantization());
-	write_u32(fout, cfmt.g_xfer_func());
-	write_u32(fout, cfmt.g_flags());
-	write_u32(fout, aspect.numerator);
-	write_u32(fout, aspect.denominator);
-	for (unsigned i = 0; i < cfmt.g_num_planes(); i++) {
-		write_u32(fout, V4L_STREAM_PACKET_FMT_VIDEO_SIZE_FMT_PLANE);
-		write_u32(fout, cfmt.g_sizeimage(i));
-		write_u32(fout, cfmt.g_bytesperline(i));
-		bpl_cap[i] = rle_calc_bpl(cfmt.g_bytesperline(i), cfmt.g_pixelformat());
-	}
-	if (!host_lossless) {
-		unsigned visible_width = support_cap_compose ? composed_width : cfmt.g_width();
-		unsigned visible_height = support_cap_compose ? composed_height : cfmt.g_height();
-
-		ctx = fwht_alloc(cfmt.g_pixelformat(), visible_width, visible_height,
-				 cfmt.g_width(), cfmt.g_height(),
-				 cfmt.g_field(), cfmt.g_colorspace(), cfmt.g_xfer_func(),
-				 cfmt.g_ycbcr_enc(), cfmt.g_quantization());
-	}
+	encode_fmt_packet(fd, hdr);
+	fwrite(hdr.data(), 1, hdr.size(), fout);
 	fflush(fout);
 #endif
 	return fout;
@@ -1849,6 +2809,7 @@ static void streaming_set_cap(cv4l_fd &fd, cv4l_fd &exp_fd)
 	cv4l_queue exp_q(exp_fd.g_type(), V4L2_MEMORY_MMAP);
 	fps_timestamps fps_ts;
 	bool use_poll = options[OptStreamPoll];
+	event_loop loop;
 	unsigned count;
 	bool eos;
 	bool source_change;
@@ -1871,8 +2832,8 @@ static void streaming_set_cap(cv4l_fd &fd, cv4l_fd &exp_fd)
 	case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
 		break;
 	default:
-		if (host_to) {
-			fprintf(stderr, "--stream-to-host is not supported for non-video streams\n");
+		if (host_to || host_serve) {
+			fprintf(stderr, "--stream-to-host and --stream-to-server are not supported for non-video streams\n");
 			return;
 		}
 		break;
@@ -1948,31 +2909,28 @@ restart:
 	if (use_poll)
 		fcntl(fd.g_fd(), F_SETFL, fd_flags | O_NONBLOCK);
 
-	while (!eos && !source_change) {
-		fd_set read_fds;
-		fd_set exception_fds;
-		struct timeval tv = { use_poll ? 2 : 0, 0 };
-		int r;
+	/*
+	 * Without --stream-poll only check for pending events and then
+	 * block in VIDIOC_DQBUF.
+	 */
+	loop.watch(fd.g_fd(), EPOLLPRI | (use_poll ? EPOLLIN : 0));
 
-		FD_ZERO(&exception_fds);
-		FD_SET(fd.g_fd(), &exception_fds);
-		FD_ZERO(&read_fds);
-		FD_SET(fd.g_fd(), &read_fds);
-		r = select(fd.g_fd() + 1, use_poll ? &read_fds : nullptr, nullptr, &exception_fds, &tv);
+	while (!eos && !source_change) {
+		int r = stream_wait(loop, use_poll ? 2000 : 0);
 
 		if (r == -1) {
 			if (EINTR == errno)
 				continue;
-			stderr_info("select error: %s\n",
+			stderr_info("poll error: %s\n",
 					strerror(errno));
 			goto done;
 		}
 		if (use_poll && r == 0) {
-			stderr_info("select timeout\n");
+			stderr_info("poll timeout\n");
 			goto done;
 		}
 
-		if (FD_ISSET(fd.g_fd(), &exception_fds)) {
+		if (loop.revents(fd.g_fd()) & EPOLLPRI) {
 			struct v4l2_event ev;
 
 			while (!fd.dqevent(ev)) {
@@ -1994,7 +2952,7 @@ restart:
 			}
 		}
 
-		if (FD_ISSET(fd.g_fd(), &read_fds)) {
+		if (!use_poll || (loop.revents(fd.g_fd()) & EPOLLIN)) {
 			r = do_handle_cap(fd, q, fout, nullptr,
 					  count, fps_ts, fmt, false);
 			if (r == QUEUE_OFF_ON) {
@@ -2026,6 +2984,9 @@ done:
 			write_u32(fout, V4L_STREAM_PACKET_END);
 		fclose(fout);
 	}
+#ifndef NO_STREAM_TO
+	close_server();
+#endif
 }
 
 static FILE *open_input_file(cv4l_fd &fd, __u32 type)
@@ -2161,6 +3122,7 @@ static void streaming_set_out(cv4l_fd &fd, cv4l_fd &exp_fd)
 	cv4l_queue exp_q(exp_fd.g_type(), V4L2_MEMORY_MMAP);
 	int fd_flags = fcntl(fd.g_fd(), F_GETFL);
 	bool use_poll = options[OptStreamPoll];
+	event_loop loop;
 	fps_timestamps fps_ts;
 	unsigned count = 0;
 	bool stopped = false;
@@ -2229,37 +3191,31 @@ restart:
 	if (stream_sleep_count == 0)
 		do_sleep();
 
-	if (use_poll)
+	if (use_poll) {
 		fcntl(fd.g_fd(), F_SETFL, fd_flags | O_NONBLOCK);
+		loop.watch(fd.g_fd(), EPOLLOUT);
+	}
 
 	for (;;) {
 		int r;
 
 		if (use_poll) {
-			fd_set fds;
-			struct timeval tv;
-
-			FD_ZERO(&fds);
-			FD_SET(fd.g_fd(), &fds);
-
-			/* Timeout. */
-			tv.tv_sec = 2;
-			tv.tv_usec = 0;
-
-			r = select(fd.g_fd() + 1, nullptr, &fds, nullptr, &tv);
+			r = stream_wait(loop, 2000);
 
 			if (r == -1) {
 				if (EINTR == errno)
 					continue;
-				stderr_info("select error: %s\n",
+				stderr_info("poll error: %s\n",
 					strerror(errno));
 				goto done;
 			}
 
 			if (r == 0) {
-				stderr_info("select timeout\n");
+				stderr_info("poll timeout\n");
 				goto done;
 			}
+			if (!(loop.revents(fd.g_fd()) & EPOLLOUT))
+				continue;
 		}
 		r = do_handle_out(fd, q, fin, nullptr,
 				  count, fps_ts, fmt, stopped, false);
@@ -2355,10 +3311,9 @@ static void stateful_m2m(cv4l_fd &fd, cv4l_queue &in, cv4l_queue &out,
 	int fd_flags = fcntl(fd.g_fd(), F_GETFL);
 	fps_timestamps fps_ts[2];
 	unsigned count[2] = { 0, 0 };
-	fd_set fds[3];
-	fd_set *rd_fds = &fds[0]; /* for capture */
-	fd_set *ex_fds = &fds[1]; /* for capture */
-	fd_set *wr_fds = &fds[2]; /* for output */
+	event_loop loop;
+	/* EPOLLIN/EPOLLPRI for capture, EPOLLOUT for output */
+	unsigned events = EPOLLIN | EPOLLPRI | EPOLLOUT;
 	bool cap_streaming = false;
 	static struct v4l2_encoder_cmd enc_stop = {
 		.cmd = V4L2_ENC_CMD_STOP,
@@ -2423,49 +3378,35 @@ static void stateful_m2m(cv4l_fd &fd, cv4l_queue &in, cv4l_queue &out,
 			fd.decoder_cmd(dec_stop);
 	}
 
-	while (rd_fds || wr_fds || ex_fds) {
-		struct timeval tv = { 2, 0 };
-		struct timeval stopped_tv = { 0, 500000 };
+	while (events) {
 		int r = 0;
 
-		if (rd_fds) {
-			FD_ZERO(rd_fds);
-			FD_SET(fd.g_fd(), rd_fds);
-		}
-
-		if (ex_fds) {
-			FD_ZERO(ex_fds);
-			FD_SET(fd.g_fd(), ex_fds);
-		}
-
-		if (wr_fds) {
-			FD_ZERO(wr_fds);
-			FD_SET(fd.g_fd(), wr_fds);
-		}
-
-		r = select(fd.g_fd() + 1, rd_fds, wr_fds, ex_fds,
-			   stopped ? &stopped_tv : &tv);
+		loop.watch(fd.g_fd(), events);
+		r = stream_wait(loop, stopped ? 500 : 2000);
 
 		if (r == -1) {
 			if (EINTR == errno)
 				continue;
-			stderr_info("select error: %s\n",
+			stderr_info("poll error: %s\n",
 					strerror(errno));
 			return;
 		}
 		if (r == 0) {
 			if (!stopped)
-				stderr_info("select timeout");
+				stderr_info("poll timeout");
 			stderr_info("\n");
 			return;
 		}
 
-		if (ex_fds && FD_ISSET(fd.g_fd(), ex_fds)) {
+		unsigned revents = loop.revents(fd.g_fd());
+
+		if (revents & EPOLLPRI) {
 			struct v4l2_event ev;
 
 			while (!fd.dqevent(ev)) {
 				if (ev.type == V4L2_EVENT_EOS) {
-					wr_fds = nullptr;
+					events &= ~EPOLLOUT;
+					revents &= ~EPOLLOUT;
 					if (!verbose)
 						stderr_info("\n");
 					stderr_info("EOS EVENT\n");
@@ -2487,22 +3428,22 @@ static void stateful_m2m(cv4l_fd &fd, cv4l_queue &in, cv4l_queue &out,
 			}
 		}
 
-		if (rd_fds && FD_ISSET(fd.g_fd(), rd_fds)) {
+		if (revents & EPOLLIN) {
 			r = do_handle_cap(fd, in, fin, nullptr,
 					  count[CAP], fps_ts[CAP], fmt_in,
 					  ignore_count_skip);
 			if (r == QUEUE_STOPPED)
 				break;
 			if (r < 0) {
-				rd_fds = nullptr;
+				events &= ~EPOLLIN;
 				if (!have_eos) {
-					ex_fds = nullptr;
+					events &= ~EPOLLPRI;
 					break;
 				}
 			}
 		}
 
-		if (wr_fds && FD_ISSET(fd.g_fd(), wr_fds)) {
+		if (revents & EPOLLOUT) {
 			r = do_handle_out(fd, out, fout, nullptr,
 					  count[OUT], fps_ts[OUT], fmt_out, stopped,
 					  !ignore_count_skip);
@@ -2603,34 +3544,59 @@ static void stateless_m2m(cv4l_fd &fd, cv4l_queue &in, cv4l_queue &out,
 		fprintf(stderr, "%s: streamon for in failed\n", __func__);
 		return;
 	}
-	int index = 0;
 	bool queue_lst_buf = false;
+	bool watched[VIDEO_MAX_FRAME] = {};
 	cv4l_buffer last_in_buf;
+	event_loop loop;
 
 	fcntl(fd.g_fd(), F_SETFL, fd_flags | O_NONBLOCK);
 
 	while (true) {
-		fd_set except_fds;
-		int req_fd = fwht_reqs[index].fd;
-		struct timeval tv = { 2, 0 };
+		unsigned active = 0;
+		int index = -1;
 
-		if (req_fd < 0)
+		/*
+		 * Watch all queued requests and handle whichever completes.
+		 * A handled request is unwatched until it is queued again,
+		 * since a completed request stays ready until it is reinitialized.
+		 */
+		for (unsigned i = 0; i < out.g_buffers(); i++) {
+			if (fwht_reqs[i].fd < 0)
+				continue;
+			active++;
+			if (!watched[i]) {
+				loop.watch(fwht_reqs[i].fd, EPOLLPRI);
+				watched[i] = true;
+			}
+			if (index < 0 && loop.revents(fwht_reqs[i].fd))
+				index = i;
+		}
+		if (!active)
 			break;
+		if (index < 0) {
+			int rc = stream_wait(loop, 2000);
 
-		FD_ZERO(&except_fds);
-		FD_SET(req_fd, &except_fds);
+			if (rc == 0) {
+				fprintf(stderr, "Timeout when waiting for media request\n");
+				return;
+			}
+			if (rc < 0 && errno != EINTR) {
+				fprintf(stderr, "Unable to poll media request: %s\n",
+					strerror(errno));
+				return;
+			}
+			continue;
+		}
 
-		int rc = select(req_fd + 1, nullptr, nullptr, &except_fds, &tv);
+		int req_fd = fwht_reqs[index].fd;
 
-		if (rc == 0) {
-			fprintf(stderr, "Timeout when waiting for media request\n");
-			return;
-		}
-		if (rc < 0) {
-			fprintf(stderr, "Unable to select media request: %s\n",
-				strerror(errno));
+		if ((loop.revents(req_fd) & (EPOLLPRI | EPOLLERR)) != EPOLLPRI) {
+			fprintf(stderr, "Error when waiting for media request\n");
 			return;
 		}
+		loop.watch(req_fd, 0);
+		watched[index] = false;
+
 		/*
 		 * it is safe to queue back last cap buffer only after
 		 * the following request is done so that the buffer
@@ -2647,8 +3613,8 @@ static void stateless_m2m(cv4l_fd &fd, cv4l_queue &in, cv4l_queue &out,
 		 * fin is not sent to do_handle_cap since the capture buf is
 		 * written to the file in current function
 		 */
-		rc = do_handle_cap(fd, in, nullptr, &buf_idx, count[CAP],
-				   fps_ts[CAP], fmt_in, false);
+		int rc = do_handle_cap(fd, in, nullptr, &buf_idx, count[CAP],
+				       fps_ts[CAP], fmt_in, false);
 		if (rc && rc != QUEUE_STOPPED) {
 			stderr_info("%s: do_handle_cap err\n", __func__);
 			return;
@@ -2663,12 +3629,12 @@ static void stateless_m2m(cv4l_fd &fd, cv4l_queue &in, cv4l_queue &out,
 			stderr_info("%s: frame returned with error\n", __func__);
 			last_fwht_bf_ts	= 0;
 		} else {
-			cv4l_buffer cap_buf(in, index);
+			cv4l_buffer cap_buf(in, buf_idx);
 			if (fd.querybuf(cap_buf))
 				return;
 			last_in_buf = cap_buf;
 			queue_lst_buf = true;
-			if (fin && cap_buf.g_bytesused(0) &&
+			if ((fin || serve_fd >= 0) && cap_buf.g_bytesused(0) &&
 			    !(cap_buf.g_flags() & V4L2_BUF_FLAG_ERROR)) {
 				int idx = get_fwht_req_by_ts(cap_buf.g_timestamp_ns());
 
@@ -2693,11 +3659,13 @@ static void stateless_m2m(cv4l_fd &fd, cv4l_queue &in, cv4l_queue &out,
 				stopped = true;
 				if (rc != QUEUE_STOPPED)
 					stderr_info("%s: output stream ended\n", __func__);
-				close(req_fd);
-				fwht_reqs[index].fd = -1;
 			}
 		}
-		index = (index + 1) % out.g_buffers();
+		// Once the output stream stopped, wait only for the requests still queued
+		if (stopped) {
+			close(req_fd);
+			fwht_reqs[index].fd = -1;
+		}
 	}
 
 	fcntl(fd.g_fd(), F_SETFL, fd_flags);
@@ -2761,6 +3729,9 @@ done:
 
 	if (file[CAP] && file[CAP] != stdout)
 		fclose(file[CAP]);
+#ifndef NO_STREAM_TO
+	close_server();
+#endif
 
 	if (file[OUT] && file[OUT] != stdin)
 		fclose(file[OUT]);
@@ -2778,7 +3749,7 @@ static void streaming_set_cap2out(cv4l_fd &fd, cv4l_fd &out_fd)
 	fps_timestamps fps_ts[2];
 	unsigned count[2] = { 0, 0 };
 	FILE *file[2] = {nullptr, nullptr};
-	fd_set fds;
+	event_loop loop;
 	unsigned cnt = 0;
 	cv4l_fmt fmt[2];
 
@@ -2884,32 +3855,30 @@ static void streaming_set_cap2out(cv4l_fd &fd, cv4l_fd &out_fd)
 	if (stream_sleep_count == 0)
 		do_sleep();
 
-	if (use_poll)
+	if (use_poll) {
 		fcntl(fd.g_fd(), F_SETFL, fd_flags | O_NONBLOCK);
+		loop.watch(fd.g_fd(), EPOLLIN);
+	}
 
 	while (true) {
-		struct timeval tv = { use_poll ? 2 : 0, 0 };
 		int r = 0;
 
-		FD_ZERO(&fds);
-		FD_SET(fd.g_fd(), &fds);
-
 		if (use_poll)
-			r = select(fd.g_fd() + 1, &fds, nullptr, nullptr, &tv);
+			r = stream_wait(loop, 2000);
 
 		if (r == -1) {
 			if (EINTR == errno)
 				continue;
-			stderr_info("select error: %s\n",
+			stderr_info("poll error: %s\n",
 					strerror(errno));
 			goto done;
 		}
 		if (use_poll && r == 0) {
-			stderr_info("select timeout\n");
+			stderr_info("poll timeout\n");
 			goto done;
 		}
 
-		if (FD_ISSET(fd.g_fd(), &fds)) {
+		if (!use_poll || (loop.revents(fd.g_fd()) & EPOLLIN)) {
 			int index = -1;
 
 			r = do_handle_cap(fd, in, file[CAP], &index,
@@ -2959,6 +3928,442 @@ done:
 		fclose(file[OUT]);
 }
 
+struct pipeline_stats {
+	unsigned frames;
+	__u64 bytes;
+	unsigned lat_cnt;
+	__u64 lat_sum;
+	__u64 lat_min;
+	__u64 lat_max;
+
+	void add_latency(__u64 ns)
+	{
+		if (!lat_cnt || ns < lat_min)
+			lat_min = ns;
+		if (ns > lat_max)
+			lat_max = ns;
+		lat_sum += ns;
+		lat_cnt++;
+	}
+
+	void add(const pipeline_stats &s)
+	{
+		frames += s.frames;
+		bytes += s.bytes;
+		if (s.lat_cnt && (!lat_cnt || s.lat_min < lat_min))
+			lat_min = s.lat_min;
+		if (s.lat_max > lat_max)
+			lat_max = s.lat_max;
+		lat_sum += s.lat_sum;
+		lat_cnt += s.lat_cnt;
+	}
+};
+
+/*
+ * A pipeline stage. Stage 0 is the capture device, all other stages are
+ * m2m devices whose output queue imports the capture buffers of the
+ * previous stage as dmabuf, using the same buffer index.
+ */
+struct pipeline_stage {
+	std::string name;
+	cv4l_fd dev;
+	cv4l_fd *fd = nullptr;
+	cv4l_queue cap;
+	cv4l_queue out;
+	cv4l_fmt fmt;
+	unsigned cap_queued = 0;
+	unsigned out_queued = 0;
+	/*
+	 * The time each output buffer was queued, indexed by its timestamp
+	 * which the m2m device copies to the resulting capture buffer.
+	 */
+	std::map<__u64, __u64> pending;
+	pipeline_stats interval = {};
+	pipeline_stats total = {};
+};
+
+static __u64 pipeline_ts(cv4l_buffer &buf)
+{
+	return buf.g_timestamp().tv_sec * 1000000ULL + buf.g_timestamp().tv_usec;
+}
+
+static void pipeline_print_stats(const pipeline_stage &s, const pipeline_stats &st,
+				 __u64 elapsed)
+{
+	double secs = elapsed / 1000000000.0;
+
+	stderr_info("%s: %u frames, %.02f fps, %.02f MB/s", s.name.c_str(),
+		    st.frames, st.frames / secs, st.bytes / secs / 1000000.0);
+	if (st.lat_cnt)
+		stderr_info(", latency min/avg/max %.02f/%.02f/%.02f ms",
+			    st.lat_min / 1000000.0,
+			    st.lat_sum / st.lat_cnt / 1000000.0,
+			    st.lat_max / 1000000.0);
+	stderr_info("\n");
+}
+
+static int pipeline_watch(event_loop &loop, std::vector<pipeline_stage> &pipe, unsigned idx)
+{
+	pipeline_stage &s = pipe[idx];
+	unsigned events = idx ? EPOLLIN | EPOLLOUT : EPOLLIN;
+
+	/*
+	 * vb2 reports EPOLLERR if no buffers are queued, so only
+	 * watch a stage while it owns buffers.
+	 */
+	if (!s.cap_queued && !s.out_queued)
+		events = 0;
+	return loop.watch(s.fd->g_fd(), events) ? QUEUE_ERROR : 0;
+}
+
+static int pipeline_handle_cap(std::vector<pipeline_stage> &pipe, unsigned idx,
+			       FILE *fout, unsigned &count, bool &ts_monotonic,
+			       pipeline_stats &e2e)
+{
+	pipeline_stage &s = pipe[idx];
+	bool is_last = idx + 1 == pipe.size();
+
+	for (;;) {
+		cv4l_buffer buf(s.cap);
+		int ret = s.fd->dqbuf(buf);
+
+		if (ret == EAGAIN)
+			return 0;
+		if (ret == EPIPE)
+			return QUEUE_STOPPED;
+		if (ret) {
+			fprintf(stderr, "%s: VIDIOC_DQBUF failed: %s\n",
+				s.name.c_str(), strerror(errno));
+			return QUEUE_ERROR;
+		}
+		s.cap_queued--;
+
+		__u64 now = monotonic_ns();
+		__u64 ts = pipeline_ts(buf);
+		bool is_last_buf = buf.g_flags() & V4L2_BUF_FLAG_LAST;
+
+		if (is_last_buf && !buf.g_bytesused(0))
+			return QUEUE_STOPPED;
+		if ((buf.g_flags() & V4L2_BUF_FLAG_ERROR) || !buf.g_bytesused(0)) {
+			if (s.fd->qbuf(buf))
+				return QUEUE_ERROR;
+			s.cap_queued++;
+			continue;
+		}
+
+		if (idx == 0) {
+			ts_monotonic = (buf.g_flags() & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+				V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+			if (ts_monotonic && now > ts * 1000)
+				s.interval.add_latency(now - ts * 1000);
+		} else {
+			auto it = s.pending.find(ts);
+
+			if (it != s.pending.end()) {
+				s.interval.add_latency(now - it->second);
+				s.pending.erase(it);
+			}
+		}
+		s.interval.frames++;
+		for (unsigned p = 0; p < s.cap.g_num_planes(); p++)
+			s.interval.bytes += buf.g_bytesused(p);
+
+		if (!is_last) {
+			pipeline_stage &next = pipe[idx + 1];
+			cv4l_buffer out_buf(next.out, buf.g_index());
+
+			for (unsigned p = 0; p < s.cap.g_num_planes(); p++)
+				out_buf.s_bytesused(buf.g_bytesused(p), p);
+			out_buf.s_field(buf.g_field());
+			out_buf.s_timestamp(buf.g_timestamp());
+			// Drop stale entries for frames the device never returned
+			if (next.pending.size() > 2 * VIDEO_MAX_FRAME)
+				next.pending.erase(next.pending.begin());
+			next.pending[ts] = monotonic_ns();
+			if (next.fd->qbuf(out_buf)) {
+				fprintf(stderr, "%s: VIDIOC_QBUF failed: %s\n",
+					next.name.c_str(), strerror(errno));
+				return QUEUE_ERROR;
+			}
+			next.out_queued++;
+		} else {
+			if (ts_monotonic && now > ts * 1000)
+				e2e.add_latency(now - ts * 1000);
+			e2e.frames++;
+			if (fout || serve_fd >= 0)
+				write_buffer_to_file(*s.fd, s.cap, buf, s.fmt, fout);
+			if (!is_last_buf) {
+				if (s.fd->qbuf(buf))
+					return QUEUE_ERROR;
+				s.cap_queued++;
+			}
+			count++;
+			if (stream_count && count >= stream_count)
+				return QUEUE_STOPPED;
+		}
+		if (is_last_buf)
+			return QUEUE_STOPPED;
+	}
+}
+
+static int pipeline_handle_out(std::vector<pipeline_stage> &pipe, unsigned idx)
+{
+	pipeline_stage &s = pipe[idx];
+	pipeline_stage &prev = pipe[idx - 1];
+
+	for (;;) {
+		cv4l_buffer buf(s.out);
+		int ret = s.fd->dqbuf(buf);
+
+		if (ret == EAGAIN)
+			return 0;
+		if (ret) {
+			fprintf(stderr, "%s: VIDIOC_DQBUF failed: %s\n",
+				s.name.c_str(), strerror(errno));
+			return QUEUE_ERROR;
+		}
+		s.out_queued--;
+
+		// The dmabuf is released, give it back to the previous stage
+		cv4l_buffer cap_buf(prev.cap, buf.g_index());
+
+		if (prev.fd->qbuf(cap_buf)) {
+			fprintf(stderr, "%s: VIDIOC_QBUF failed: %s\n",
+				prev.name.c_str(), strerror(errno));
+			return QUEUE_ERROR;
+		}
+		prev.cap_queued++;
+	}
+}
+
+static int pipeline_setup_fmt(pipeline_stage &prev, pipeline_stage &s,
+			      const pipeline_opt &opt)
+{
+	cv4l_fmt fmt;
+
+	s.fd->g_fmt(fmt, s.out.g_type());
+	fmt.s_pixelformat(prev.fmt.g_pixelformat());
+	fmt.s_width(prev.fmt.g_width());
+	fmt.s_height(prev.fmt.g_height());
+	fmt.s_field(prev.fmt.g_field());
+	fmt.s_colorspace(prev.fmt.g_colorspace());
+	fmt.s_xfer_func(prev.fmt.g_xfer_func());
+	fmt.s_ycbcr_enc(prev.fmt.g_ycbcr_enc());
+	fmt.s_quantization(prev.fmt.g_quantization());
+	if (fmt.g_num_planes() == prev.fmt.g_num_planes()) {
+		for (unsigned p = 0; p < fmt.g_num_planes(); p++) {
+			fmt.s_bytesperline(prev.fmt.g_bytesperline(p), p);
+			fmt.s_sizeimage(prev.fmt.g_sizeimage(p), p);
+		}
+	}
+	if (s.fd->s_fmt(fmt, false) ||
+	    fmt.g_pixelformat() != prev.fmt.g_pixelformat() ||
+	    fmt.g_width() != prev.fmt.g_width() ||
+	    fmt.g_height() != prev.fmt.g_height()) {
+		fprintf(stderr, "%s: cannot import the %s %ux%u frames of %s\n",
+			s.name.c_str(), fcc2s(prev.fmt.g_pixelformat()).c_str(),
+			prev.fmt.g_width(), prev.fmt.g_height(), prev.name.c_str());
+		return QUEUE_ERROR;
+	}
+
+	s.fd->g_fmt(fmt, s.cap.g_type());
+	if (opt.set_fmts & FmtWidth)
+		fmt.s_width(opt.width);
+	if (opt.set_fmts & FmtHeight)
+		fmt.s_height(opt.height);
+	if (opt.set_fmts & FmtPixelFormat)
+		fmt.s_pixelformat(opt.pixelformat);
+	if (opt.set_fmts && s.fd->s_fmt(fmt)) {
+		fprintf(stderr, "%s: cannot set the capture format\n", s.name.c_str());
+		return QUEUE_ERROR;
+	}
+	return s.fd->g_fmt(s.fmt, s.cap.g_type()) ? QUEUE_ERROR : 0;
+}
+
+static int pipeline_setup_bufs(std::vector<pipeline_stage> &pipe)
+{
+	for (unsigned i = 0; i < pipe.size(); i++) {
+		pipeline_stage &s = pipe[i];
+
+		if (i) {
+			pipeline_stage &prev = pipe[i - 1];
+
+			if (s.out.reqbufs(s.fd, prev.cap.g_buffers()))
+				return QUEUE_ERROR;
+			if (s.out.g_buffers() < prev.cap.g_buffers() ||
+			    s.out.g_num_planes() != prev.cap.g_num_planes()) {
+				fprintf(stderr, "%s: cannot import the buffers of %s\n",
+					s.name.c_str(), prev.name.c_str());
+				return QUEUE_ERROR;
+			}
+			for (unsigned b = 0; b < prev.cap.g_buffers(); b++)
+				for (unsigned p = 0; p < prev.cap.g_num_planes(); p++)
+					s.out.s_fd(b, p, prev.cap.g_fd(b, p));
+		}
+		if (s.cap.reqbufs(s.fd, reqbufs_count_cap))
+			return QUEUE_ERROR;
+		// Only the frames of the last stage are accessed by the CPU
+		if (i + 1 < pipe.size()) {
+			if (s.cap.export_bufs(s.fd, s.cap.g_type()))
+				return QUEUE_ERROR;
+		} else if (s.cap.obtain_bufs(s.fd)) {
+			return QUEUE_ERROR;
+		}
+		if (s.cap.queue_all(s.fd))
+			return QUEUE_ERROR;
+		s.cap_queued = s.cap.g_buffers();
+	}
+	return 0;
+}
+
+static void streaming_set_pipeline(cv4l_fd &fd)
+{
+	int fd_flags = fcntl(fd.g_fd(), F_GETFL);
+	std::vector<pipeline_stage> pipe(pipeline_opts.size() + 1);
+	event_loop loop;
+	int timer_fd;
+	unsigned idle_secs = 0;
+	unsigned count = 0;
+	bool ts_monotonic = false;
+	pipeline_stats e2e = {};
+	__u64 start, last;
+	FILE *fout = nullptr;
+	int r = 0;
+
+	if (!options[OptStreamMmap] || fd.has_vid_m2m() ||
+	    !(capabilities & (V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_VIDEO_CAPTURE_MPLANE))) {
+		fprintf(stderr, "--stream-pipeline requires a video capture device and --stream-mmap\n");
+		return;
+	}
+
+	pipe[0].name = fd.g_v4l_fd()->devname;
+	pipe[0].fd = &fd;
+	pipe[0].cap.init(fd.g_type(), V4L2_MEMORY_MMAP);
+	fd.g_fmt(pipe[0].fmt, pipe[0].cap.g_type());
+
+	for (unsigned i = 1; i < pipe.size(); i++) {
+		pipeline_stage &s = pipe[i];
+
+		s.name = pipeline_opts[i - 1].devname;
+		s.dev.s_direct(!options[OptUseWrapper]);
+		if (s.dev.open(s.name.c_str(), true) < 0) {
+			fprintf(stderr, "Failed to open %s: %s\n", s.name.c_str(),
+				strerror(errno));
+			goto done;
+		}
+		s.fd = &s.dev;
+		s.dev.s_trace(options[OptSilent] ? 0 : (verbose ? 2 : 1));
+		if (!s.dev.has_vid_m2m()) {
+			fprintf(stderr, "%s: not a memory-to-memory device\n", s.name.c_str());
+			goto done;
+		}
+		s.cap.init(s.dev.g_type(), V4L2_MEMORY_MMAP);
+		s.out.init(v4l_type_invert(s.dev.g_type()), V4L2_MEMORY_DMABUF);
+		if (pipeline_setup_fmt(pipe[i - 1], s, pipeline_opts[i - 1]))
+			goto done;
+	}
+
+	if (pipeline_setup_bufs(pipe))
+		goto done;
+
+	for (unsigned i = pipe.size(); i-- > 0;) {
+		if (pipe[i].fd->streamon(pipe[i].cap.g_type()) ||
+		    (i && pipe[i].fd->streamon(pipe[i].out.g_type())))
+			goto done;
+		pipe[i].fd->s_trace(0);
+	}
+
+	fout = open_output_file(*pipe.back().fd);
+
+	fcntl(fd.g_fd(), F_SETFL, fd_flags | O_NONBLOCK);
+	timer_fd = loop.add_timer(1000);
+	if (timer_fd < 0) {
+		fprintf(stderr, "could not create the statistics timer\n");
+		goto done;
+	}
+
+	start = last = monotonic_ns();
+	while (!r) {
+		for (unsigned i = 0; !r && i < pipe.size(); i++)
+			r = pipeline_watch(loop, pipe, i);
+		if (r)
+			break;
+
+		int n = stream_wait(loop, 2000);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			stderr_info("poll error: %s\n", strerror(errno));
+			break;
+		}
+		for (unsigned i = 0; !r && i < pipe.size(); i++) {
+			unsigned revents = loop.revents(pipe[i].fd->g_fd());
+
+			if (i && (revents & EPOLLOUT))
+				r = pipeline_handle_out(pipe, i);
+			if (!r && (revents & EPOLLIN))
+				r = pipeline_handle_cap(pipe, i, fout, count,
+							ts_monotonic, e2e);
+		}
+
+		if (loop.timer_expired(timer_fd) || r) {
+			__u64 now = monotonic_ns();
+			unsigned frames = 0;
+
+			for (auto &s : pipe)
+				frames += s.interval.frames;
+			// The timer keeps waking up the loop, so detect stalls here
+			idle_secs = frames ? 0 : idle_secs + 1;
+			if (idle_secs >= 2) {
+				stderr_info("poll timeout\n");
+				r = QUEUE_ERROR;
+			}
+			for (auto &s : pipe) {
+				pipeline_print_stats(s, s.interval, now - last);
+				s.total.add(s.interval);
+				s.interval = {};
+			}
+			last = now;
+		}
+	}
+
+	stderr_info("\nTotal:\n");
+	for (const auto &s : pipe)
+		pipeline_print_stats(s, s.total, last - start);
+	if (e2e.lat_cnt)
+		stderr_info("end-to-end latency min/avg/max %.02f/%.02f/%.02f ms\n",
+			    e2e.lat_min / 1000000.0,
+			    e2e.lat_sum / e2e.lat_cnt / 1000000.0,
+			    e2e.lat_max / 1000000.0);
+
+done:
+	fcntl(fd.g_fd(), F_SETFL, fd_flags);
+
+	/*
+	 * Release the importing output queue of a stage before the
+	 * capture queue of the previous stage closes the exported fds.
+	 */
+	for (unsigned i = pipe.size(); i-- > 0;) {
+		pipeline_stage &s = pipe[i];
+
+		if (!s.fd)
+			continue;
+		s.fd->s_trace(0);
+		if (i)
+			s.out.free(s.fd);
+		s.cap.free(s.fd);
+		if (i)
+			s.dev.close();
+	}
+
+	if (fout && fout != stdout)
+		fclose(fout);
+#ifndef NO_STREAM_TO
+	close_server();
+#endif
+}
+
 void streaming_set(cv4l_fd &fd, cv4l_fd &out_fd, cv4l_fd &exp_fd)
 {
 	int do_cap = options[OptStreamMmap] + options[OptStreamUser] + options[OptStreamDmaBuf];
@@ -3009,7 +4414,12 @@ void streaming_set(cv4l_fd &fd, cv4l_fd &out_fd, cv4l_fd &exp_fd)
 			reqbufs_count_out = 4;
 	}
 
-	if (do_cap && do_out && out_fd.g_fd() < 0)
+	if (do_out && stream_out_threads > 1)
+		fill_workers.start(stream_out_threads);
+
+	if (do_cap && !pipeline_opts.empty())
+		streaming_set_pipeline(fd);
+	else if (do_cap && do_out && out_fd.g_fd() < 0)
 		streaming_set_m2m(fd, exp_fd);
 	else if (do_cap && do_out)
 		streaming_set_cap2out(fd, out_fd);
@@ -3018,6 +4428,11 @@ void streaming_set(cv4l_fd &fd, cv4l_fd &out_fd, cv4l_fd &exp_fd)
 	else if (do_out)
 		streaming_set_out(fd, exp_fd);
 
+	fill_workers.stop();
+
+	if (stream_latency && do_cap)
+		latency.report();
+
 	fd.s_trace(old_trace_fd);
 	out_fd.s_trace(old_trace_out_fd);
 	exp_fd.s_trace(old_trace_exp_fd);
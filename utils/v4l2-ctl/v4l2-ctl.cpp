@@ -133,6 +133,7 @@ static struct option long_options[] = {
 	{"list-ctrls", no_argument, nullptr, OptListCtrls},
 	{"list-ctrls-menus", no_argument, nullptr, OptListCtrlsMenus},
 	{"set-ctrl", required_argument, nullptr, OptSetCtrl},
+	{"set-ctrl-batch", required_argument, nullptr, OptSetCtrlBatch},
 	{"get-ctrl", required_argument, nullptr, OptGetCtrl},
 	{"get-tuner", no_argument, nullptr, OptGetTuner},
 	{"set-tuner", required_argument, nullptr, OptSetTuner},
@@ -247,12 +248,15 @@ static struct option long_options[] = {
 	{"stream-to-hdr", required_argument, nullptr, OptStreamToHdr},
 	{"stream-lossless", no_argument, nullptr, OptStreamLossless},
 	{"stream-to-host", required_argument, nullptr, OptStreamToHost},
+	{"stream-to-server", optional_argument, nullptr, OptStreamToServer},
 #endif
 	{"stream-buf-caps", no_argument, nullptr, OptStreamBufCaps},
 	{"stream-show-delta-now", no_argument, nullptr, OptStreamShowDeltaNow},
+	{"stream-latency", optional_argument, nullptr, OptStreamLatency},
 	{"stream-mmap", optional_argument, nullptr, OptStreamMmap},
 	{"stream-user", optional_argument, nullptr, OptStreamUser},
 	{"stream-dmabuf", no_argument, nullptr, OptStreamDmaBuf},
+	{"stream-pipeline", required_argument, nullptr, OptStreamPipeline},
 	{"stream-from", required_argument, nullptr, OptStreamFrom},
 	{"stream-from-hdr", required_argument, nullptr, OptStreamFromHdr},
 	{"stream-from-host", required_argument, nullptr, OptStreamFromHost},
@@ -269,6 +273,7 @@ static struct option long_options[] = {
 	{"stream-out-hor-speed", required_argument, nullptr, OptStreamOutHorSpeed},
 	{"stream-out-vert-speed", required_argument, nullptr, OptStreamOutVertSpeed},
 	{"stream-out-perc-fill", required_argument, nullptr, OptStreamOutPercFill},
+	{"stream-out-threads", required_argument, nullptr, OptStreamOutThreads},
 	{"stream-out-buf-caps", no_argument, nullptr, OptStreamOutBufCaps},
 	{"stream-out-mmap", optional_argument, nullptr, OptStreamOutMmap},
 	{"stream-out-user", optional_argument, nullptr, OptStreamOutUser},
@@ -1317,6 +1322,9 @@ int main(int argc, char **argv)
 	if (common_list_devices(media_bus_info, c_fd))
 		return 0;
 
+	if (options[OptSetCtrlBatch])
+		return common_set_ctrl_batch();
+
 	media_type type = mi_media_detect_type(device);
 	if (type == MEDIA_TYPE_CANT_STAT) {
 		fprintf(stderr, "Cannot open device %s, exiting.\n",
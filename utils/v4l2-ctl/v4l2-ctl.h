@@ -176,6 +176,7 @@ enum Option {
 	OptListFreqBands,
 	OptListDevicesInput,
 	OptListDevicesOutput,
+	OptSetCtrlBatch,
 	OptGetOutputParm,
 	OptSetOutputParm,
 	OptQueryStandard,
@@ -223,12 +224,15 @@ enum Option {
 	OptStreamTo,
 	OptStreamToHdr,
 	OptStreamToHost,
+	OptStreamToServer,
 	OptStreamLossless,
 	OptStreamShowDeltaNow,
+	OptStreamLatency,
 	OptStreamBufCaps,
 	OptStreamMmap,
 	OptStreamUser,
 	OptStreamDmaBuf,
+	OptStreamPipeline,
 	OptStreamFrom,
 	OptStreamFromHdr,
 	OptStreamFromHost,
@@ -240,6 +244,7 @@ enum Option {
 	OptStreamOutHorSpeed,
 	OptStreamOutVertSpeed,
 	OptStreamOutPercFill,
+	OptStreamOutThreads,
 	OptStreamOutAlphaComponent,
 	OptStreamOutAlphaRedOnly,
 	OptStreamOutRGBLimitedRange,
@@ -364,6 +369,7 @@ void common_list(cv4l_fd &fd);
 void common_process_controls(cv4l_fd &fd);
 void common_control_event(int fd, const struct v4l2_event *ev);
 int common_find_ctrl_id(const char *name);
+int common_set_ctrl_batch(void);
 
 // v4l2-ctl-tuner.cpp
 void tuner_usage(void);
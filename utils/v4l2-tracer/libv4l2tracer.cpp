@@ -9,6 +9,45 @@
 
 extern struct trace_context ctx_trace;
 
+/*
+ * Serializes the access of traced threads to ctx_trace and the json trace file.
+ * Binary records committed while it is held are only queued to the ring of the
+ * thread once it is released. Binary records that don't depend on ctx_trace
+ * are committed without taking it.
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Set while a thread runs tracer code, calls made by the tracer itself aren't traced. */
+static thread_local bool in_tracer;
+
+struct trace_lock_guard {
+	trace_lock_guard()
+	{
+		pthread_mutex_lock(&trace_lock);
+		in_tracer = true;
+		if (trace_binary_enabled())
+			trace_binary_stage();
+	}
+	~trace_lock_guard()
+	{
+		pthread_mutex_unlock(&trace_lock);
+		/* Queueing may open the trace file, which must not be traced. */
+		if (trace_binary_enabled())
+			trace_binary_unstage();
+		in_tracer = false;
+	}
+};
+
+/* Marks tracer code that doesn't need the trace lock. */
+struct tracer_guard {
+	tracer_guard() { in_tracer = true; }
+	~tracer_guard() { in_tracer = false; }
+};
+
+static bool skip_trace(void)
+{
+	return in_tracer || getenv("V4L2_TRACER_PAUSE_TRACE") != nullptr;
+}
+
 const std::list<unsigned long> ioctls = {
 	VIDIOC_QUERYCAP,
 	VIDIOC_STREAMON,
@@ -71,14 +110,18 @@ int open(const char *path, int oflag, ...)
 		va_end(argp);
 	}
 
-	int (*original_open)(const char *path, int oflag, ...) = nullptr;
-	original_open = (int (*)(const char*, int, ...)) dlsym(RTLD_NEXT, "open");
+	static int (*original_open)(const char *path, int oflag, ...) =
+		(int (*)(const char*, int, ...)) dlsym(RTLD_NEXT, "open");
+
+	if (skip_trace())
+		return (*original_open)(path, oflag, mode);
+
+	start_call_trace();
 	int fd = (*original_open)(path, oflag, mode);
+	end_call_trace();
 	debug_line_info("\n\tfd: %d, path: %s", fd, path);
 
-	if (getenv("V4L2_TRACER_PAUSE_TRACE") != nullptr)
-		return fd;
-
+	trace_lock_guard guard;
 	if (is_video_or_media_device(path)) {
 		trace_open(fd, path, oflag, mode, false);
 		add_device(fd, path);
@@ -90,20 +133,30 @@ int open(const char *path, int oflag, ...)
 
 ssize_t write(int fd, const void *buf, size_t count)
 {
-	ssize_t (*original_write)(int fd, const void *buf, size_t count) = nullptr;
-	original_write = (ssize_t (*)(int, const void *, size_t)) dlsym(RTLD_NEXT, "write");
+	static ssize_t (*original_write)(int fd, const void *buf, size_t count) =
+		(ssize_t (*)(int, const void *, size_t)) dlsym(RTLD_NEXT, "write");
+
+	if (in_tracer)
+		return (*original_write)(fd, buf, count);
+
+	start_call_trace();
 	ssize_t ret = (*original_write)(fd, buf, count);
+	end_call_trace();
 
 	/*
 	 * If the write message starts with "v4l2-tracer", then assume it came from the
 	 * v4l2_tracer_info macro and trace it.
 	 */
 	std::string buf_string(static_cast<const char*>(buf), count);
-	if (buf_string.find("v4l2-tracer") == 0) {
-		json_object *write_obj = json_object_new_object();
-		json_object_object_add(write_obj, "write", json_object_new_string((const char*)buf));
-		write_json_object_to_json_file(write_obj);
-		json_object_put(write_obj);
+	if (buf_string.find("v4l2-tracer") != 0)
+		return ret;
+
+	if (trace_binary_enabled()) {
+		tracer_guard guard;
+		trace_write(buf, count);
+	} else {
+		trace_lock_guard guard;
+		trace_write(buf, count);
 	}
 
 	return ret;
@@ -121,14 +174,18 @@ int open64(const char *path, int oflag, ...)
 		va_end(argp);
 	}
 
-	int (*original_open64)(const char *path, int oflag, ...) = nullptr;
-	original_open64 = (int (*)(const char*, int, ...)) dlsym(RTLD_NEXT, "open64");
+	static int (*original_open64)(const char *path, int oflag, ...) =
+		(int (*)(const char*, int, ...)) dlsym(RTLD_NEXT, "open64");
+
+	if (skip_trace())
+		return (*original_open64)(path, oflag, mode);
+
+	start_call_trace();
 	int fd = (*original_open64)(path, oflag, mode);
+	end_call_trace();
 	debug_line_info("\n\tfd: %d, path: %s", fd, path);
 
-	if (getenv("V4L2_TRACER_PAUSE_TRACE") != nullptr)
-		return fd;
-
+	trace_lock_guard guard;
 	if (is_video_or_media_device(path)) {
 		add_device(fd, path);
 		trace_open(fd, path, oflag, mode, true);
@@ -142,29 +199,29 @@ int open64(const char *path, int oflag, ...)
 int close(int fd)
 {
 	errno = 0;
-	int (*original_close)(int fd) = nullptr;
-	original_close = (int (*)(int)) dlsym(RTLD_NEXT, "close");
+	static int (*original_close)(int fd) =
+		(int (*)(int)) dlsym(RTLD_NEXT, "close");
 
-	if (getenv("V4L2_TRACER_PAUSE_TRACE") != nullptr)
+	if (skip_trace())
 		return (*original_close)(fd);
 
-	std::string path = get_device(fd);
-	debug_line_info("\n\tfd: %d, path: %s", fd, path.c_str());
-
-	/* Only trace the close if a corresponding open was also traced. */
-	if (!path.empty()) {
-		json_object *close_obj = json_object_new_object();
-		json_object_object_add(close_obj, "fd", json_object_new_int(fd));
-		json_object_object_add(close_obj, "close", json_object_new_string(path.c_str()));
-		write_json_object_to_json_file(close_obj);
-		json_object_put(close_obj);
-		ctx_trace.devices.erase(fd);
-
-		/* If we removed the last device, close the json trace file. */
-		if (!ctx_trace.devices.size())
-			close_json_file();
+	start_call_trace();
+	{
+		trace_lock_guard guard;
+		std::string path = get_device(fd);
+		debug_line_info("\n\tfd: %d, path: %s", fd, path.c_str());
+
+		/* Only trace the close if a corresponding open was also traced. */
+		if (!path.empty()) {
+			trace_close(fd, path);
+			ctx_trace.devices.erase(fd);
+
+			/* If we removed the last device, close the json trace file. */
+			if (!ctx_trace.devices.size())
+				close_json_file();
+		}
+		print_devices();
 	}
-	print_devices();
 
 	return (*original_close)(fd);
 }
@@ -172,10 +229,18 @@ int close(int fd)
 void *mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
 {
 	errno = 0;
-	void *(*original_mmap)(void *addr, size_t len, int prot, int flags, int fildes, off_t off) = nullptr;
-	original_mmap = (void*(*)(void*, size_t, int, int, int, off_t)) dlsym(RTLD_NEXT, "mmap");
+	static void *(*original_mmap)(void *addr, size_t len, int prot, int flags, int fildes, off_t off) =
+		(void*(*)(void*, size_t, int, int, int, off_t)) dlsym(RTLD_NEXT, "mmap");
+
+	/* Anonymous mappings can't be buffers. */
+	if (in_tracer || fildes < 0)
+		return (*original_mmap)(addr, len, prot, flags, fildes, off);
+
+	start_call_trace();
 	void *buf_address_pointer = (*original_mmap)(addr, len, prot, flags, fildes, off);
+	end_call_trace();
 
+	trace_lock_guard guard;
 	set_buffer_address_trace(fildes, off, (unsigned long) buf_address_pointer);
 
 	if (buffer_in_trace_context(fildes, off))
@@ -188,10 +253,18 @@ void *mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
 void *mmap64(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
 {
 	errno = 0;
-	void *(*original_mmap64)(void *addr, size_t len, int prot, int flags, int fildes, off_t off) = nullptr;
-	original_mmap64 = (void*(*)(void*, size_t, int, int, int, off_t)) dlsym(RTLD_NEXT, "mmap64");
+	static void *(*original_mmap64)(void *addr, size_t len, int prot, int flags, int fildes, off_t off) =
+		(void*(*)(void*, size_t, int, int, int, off_t)) dlsym(RTLD_NEXT, "mmap64");
+
+	/* Anonymous mappings can't be buffers. */
+	if (in_tracer || fildes < 0)
+		return (*original_mmap64)(addr, len, prot, flags, fildes, off);
+
+	start_call_trace();
 	void *buf_address_pointer = (*original_mmap64)(addr, len, prot, flags, fildes, off);
+	end_call_trace();
 
+	trace_lock_guard guard;
 	set_buffer_address_trace(fildes, off, (unsigned long) buf_address_pointer);
 
 	if (buffer_in_trace_context(fildes, off))
@@ -204,26 +277,22 @@ void *mmap64(void *addr, size_t len, int prot, int flags, int fildes, off_t off)
 int munmap(void *start, size_t length)
 {
 	errno = 0;
-	int(*original_munmap)(void *start, size_t length) = nullptr;
-	original_munmap = (int(*)(void *, size_t)) dlsym(RTLD_NEXT, "munmap");
+	static int(*original_munmap)(void *start, size_t length) =
+		(int(*)(void *, size_t)) dlsym(RTLD_NEXT, "munmap");
+
+	if (in_tracer)
+		return (*original_munmap)(start, length);
+
+	start_call_trace();
 	int ret = (*original_munmap)(start, length);
+	end_call_trace();
 
 	/* Only trace the unmapping if the original mapping was traced. */
+	trace_lock_guard guard;
 	if (!buffer_is_mapped((unsigned long) start))
 		return ret;
 
-	json_object *munmap_obj = json_object_new_object();
-
-	if (errno)
-		json_object_object_add(munmap_obj, "errno", json_object_new_string(STRERR(errno)));
-
-	json_object *munmap_args = json_object_new_object();
-	json_object_object_add(munmap_args, "start", json_object_new_int64((int64_t)start));
-	json_object_object_add(munmap_args, "length", json_object_new_uint64(length));
-	json_object_object_add(munmap_obj, "munmap", munmap_args);
-
-	write_json_object_to_json_file(munmap_obj);
-	json_object_put(munmap_obj);
+	trace_munmap(start, length);
 
 	return ret;
 }
@@ -236,24 +305,37 @@ int ioctl(int fd, unsigned long cmd, ...)
 	void *arg = va_arg(argp, void *);
 	va_end(argp);
 
-	int (*original_ioctl)(int fd, unsigned long cmd, ...) = nullptr;
-	original_ioctl = (int (*)(int, long unsigned int, ...)) dlsym(RTLD_NEXT, "ioctl");
+	static int (*original_ioctl)(int fd, unsigned long cmd, ...) =
+		(int (*)(int, long unsigned int, ...)) dlsym(RTLD_NEXT, "ioctl");
 
-	if (getenv("V4L2_TRACER_PAUSE_TRACE") != nullptr)
+	if (skip_trace())
 		return (*original_ioctl)(fd, cmd, arg);
 
 	/* Don't trace ioctls that are not in the specified ioctls list. */
 	if (find(ioctls.begin(), ioctls.end(), cmd) == ioctls.end())
 		return (*original_ioctl)(fd, cmd, arg);
 
-	json_object *ioctl_obj = json_object_new_object();
-	json_object_object_add(ioctl_obj, "fd", json_object_new_int(fd));
-	json_object_object_add(ioctl_obj, "ioctl",
-	                       json_object_new_string(val2s(cmd, ioctl_val_def).c_str()));
+	bool binary = trace_binary_enabled();
+	json_object *ioctl_obj = nullptr;
+
+	if (!binary) {
+		ioctl_obj = json_object_new_object();
+		json_object_object_add(ioctl_obj, "fd", json_object_new_int(fd));
+		json_object_object_add(ioctl_obj, "ioctl",
+		                       json_object_new_string(val2s(cmd, ioctl_val_def).c_str()));
+	}
 
 	/* Don't attempt to trace a nullptr. */
 	if (arg == nullptr) {
+		start_call_trace();
 		int ret = (*original_ioctl)(fd, cmd, arg);
+		end_call_trace();
+		if (binary) {
+			tracer_guard guard;
+			trace_ioctl_binary(fd, cmd, errno, nullptr, nullptr);
+			return ret;
+		}
+		trace_lock_guard guard;
 		if (errno)
 			json_object_object_add(ioctl_obj, "errno",
 			                       json_object_new_string(STRERR(errno)));
@@ -262,47 +344,70 @@ int ioctl(int fd, unsigned long cmd, ...)
 		return ret;
 	}
 
-	/* Get info needed for writing the decoded video data to a yuv file. */
-	if (cmd == VIDIOC_S_EXT_CTRLS)
-		s_ext_ctrls_setup(static_cast<struct v4l2_ext_controls*>(arg));
-	if (cmd == VIDIOC_QBUF)
-		qbuf_setup(static_cast<struct v4l2_buffer*>(arg));
-	if (cmd == VIDIOC_STREAMOFF)
-		streamoff_cleanup(*(static_cast<v4l2_buf_type*>(arg)));
-
 	/*
 	 * To avoid cluttering the trace file, only trace userspace arguments when necessary
 	 * or if the option to trace them is selected.
 	 */
-	if (((cmd & IOC_INOUT) == IOC_IN) ||
-		(getenv("V4L2_TRACER_OPTION_TRACE_USERSPACE_ARG") != nullptr) ||
-		(cmd == VIDIOC_QBUF)) {
-		json_object *ioctl_args_userspace = trace_ioctl_args(cmd, arg);
-		/* Some ioctls won't have arguments to trace e.g. MEDIA_REQUEST_IOC_QUEUE. */
-		if (json_object_object_length(ioctl_args_userspace))
-			json_object_object_add(ioctl_obj, "from_userspace", ioctl_args_userspace);
-		else
-			json_object_put(ioctl_args_userspace);
+	static thread_local std::vector<unsigned char> arg_userspace;
+	bool trace_userspace = ((cmd & IOC_INOUT) == IOC_IN) ||
+		get_options_trace().trace_userspace_arg ||
+		(cmd == VIDIOC_QBUF);
+
+	/* The lock isn't held during the ioctl, DQBUF may block until another thread calls QBUF. */
+	{
+		trace_lock_guard guard;
+
+		/* Get info needed for writing the decoded video data to a yuv file. */
+		if (cmd == VIDIOC_S_EXT_CTRLS)
+			s_ext_ctrls_setup(static_cast<struct v4l2_ext_controls*>(arg));
+		if (cmd == VIDIOC_QBUF)
+			qbuf_setup(static_cast<struct v4l2_buffer*>(arg));
+		if (cmd == VIDIOC_STREAMOFF)
+			streamoff_cleanup(*(static_cast<v4l2_buf_type*>(arg)));
+
+		if (trace_userspace && binary) {
+			/* Take a copy, the driver may modify the argument. */
+			arg_userspace.resize(trace_binary_arg_size(cmd, arg));
+			trace_binary_arg_flatten(cmd, arg, arg_userspace.data());
+		} else if (trace_userspace) {
+			json_object *ioctl_args_userspace = trace_ioctl_args(cmd, arg);
+			/* Some ioctls won't have arguments to trace e.g. MEDIA_REQUEST_IOC_QUEUE. */
+			if (json_object_object_length(ioctl_args_userspace))
+				json_object_object_add(ioctl_obj, "from_userspace", ioctl_args_userspace);
+			else
+				json_object_put(ioctl_args_userspace);
+		}
 	}
 
 	/* Make the original ioctl call. */
+	start_call_trace();
 	int ret = (*original_ioctl)(fd, cmd, arg);
+	end_call_trace();
 
-	if (errno)
-		json_object_object_add(ioctl_obj, "errno", json_object_new_string(STRERR(errno)));
-
-	/* Trace driver arguments if userspace will be reading them i.e. _IOR or _IOWR ioctls */
-	if ((cmd & IOC_OUT) != 0U) {
-		json_object *ioctl_args_driver = trace_ioctl_args(cmd, arg);
-		/* Some ioctls won't have arguments to trace e.g. MEDIA_REQUEST_IOC_QUEUE. */
-		if (json_object_object_length(ioctl_args_driver))
-			json_object_object_add(ioctl_obj, "from_driver", ioctl_args_driver);
-		else
-			json_object_put(ioctl_args_driver);
+	if (binary) {
+		tracer_guard guard;
+		trace_ioctl_binary(fd, cmd, errno, trace_userspace ? &arg_userspace : nullptr,
+		                   (cmd & IOC_OUT) ? arg : nullptr);
 	}
 
-	write_json_object_to_json_file(ioctl_obj);
-	json_object_put(ioctl_obj);
+	trace_lock_guard guard;
+	if (!binary) {
+		if (errno)
+			json_object_object_add(ioctl_obj, "errno", json_object_new_string(STRERR(errno)));
+
+		/* Trace driver arguments if userspace will be reading them i.e. _IOR or _IOWR ioctls */
+		if ((cmd & IOC_OUT) != 0U) {
+			json_object *ioctl_args_driver = trace_ioctl_args(cmd, arg);
+			/* Some ioctls won't have arguments to trace e.g. MEDIA_REQUEST_IOC_QUEUE. */
+			if (json_object_object_length(ioctl_args_driver))
+				json_object_object_add(ioctl_obj, "from_driver", ioctl_args_driver);
+			else
+				json_object_put(ioctl_args_driver);
+		}
+
+		write_json_object_to_json_file(ioctl_obj);
+		json_object_put(ioctl_obj);
+	}
 
 	/* Get additional info from driver for writing the decoded video data to a yuv file. */
 	if (cmd == VIDIOC_G_FMT)
@@ -322,3 +427,35 @@ int ioctl(int fd, unsigned long cmd, ...)
 
 	return ret;
 }
+
+/* Don't fork while another thread holds the trace lock, the child couldn't take it. */
+static void libv4l2tracer_atfork_prepare(void)
+{
+	pthread_mutex_lock(&trace_lock);
+}
+
+static void libv4l2tracer_atfork_parent(void)
+{
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static void libv4l2tracer_atfork_child(void)
+{
+	pthread_mutex_init(&trace_lock, nullptr);
+	in_tracer = true;
+	fork_child_trace();
+	in_tracer = false;
+}
+
+__attribute__((constructor)) static void libv4l2tracer_init(void)
+{
+	pthread_atfork(libv4l2tracer_atfork_prepare, libv4l2tracer_atfork_parent,
+	               libv4l2tracer_atfork_child);
+}
+
+/* Write out the records still queued for the binary trace when the application exits. */
+__attribute__((destructor)) static void libv4l2tracer_fini(void)
+{
+	if (trace_binary_enabled())
+		trace_binary_flush();
+}
@@ -4,31 +4,30 @@
  */
 
 #include "retrace.h"
+#include <climits>
+#include <ctype.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 struct retrace_context ctx_retrace = {};
 
+static inline __u64 buffer_key(__u32 hi, __u32 lo)
+{
+	return ((__u64) hi << 32) | lo;
+}
+
 bool buffer_in_retrace_context(int fd, __u32 offset)
 {
-	bool buffer_in_retrace_context = false;
-	for (auto &b : ctx_retrace.buffers) {
-		if ((b.fd == fd) && (b.offset == offset)) {
-			buffer_in_retrace_context = true;
-			break;
-		}
-	}
-	return buffer_in_retrace_context;
+	return ctx_retrace.buffer_offsets.count(buffer_key(fd, offset)) != 0;
 }
 
 int get_buffer_fd_retrace(__u32 type, __u32 index)
 {
-	int fd = -1;
-	for (auto &b : ctx_retrace.buffers) {
-		if ((b.type == type) && (b.index == index)) {
-			fd = b.fd;
-			break;
-		}
-	}
-	return fd;
+	auto it = ctx_retrace.buffers.find(buffer_key(type, index));
+	if (it == ctx_retrace.buffers.end())
+		return -1;
+	return it->second.fd;
 }
 
 void add_buffer_retrace(int fd, __u32 type, __u32 index, __u32 offset)
@@ -38,45 +37,152 @@ void add_buffer_retrace(int fd, __u32 type, __u32 index, __u32 offset)
 	buf.type = type;
 	buf.index = index;
 	buf.offset = offset;
-	ctx_retrace.buffers.push_front(buf);
+
+	remove_buffer_retrace(type, index);
+	ctx_retrace.buffers[buffer_key(type, index)] = buf;
+	ctx_retrace.buffer_offsets[buffer_key(fd, offset)] = buffer_key(type, index);
 }
 
 void remove_buffer_retrace(__u32 type, __u32 index)
 {
-	for (auto it = ctx_retrace.buffers.begin(); it != ctx_retrace.buffers.end(); ++it) {
-		if ((it->type == type) && (it->index == index)) {
-			ctx_retrace.buffers.erase(it);
-			break;
-		}
-	}
+	auto it = ctx_retrace.buffers.find(buffer_key(type, index));
+	if (it == ctx_retrace.buffers.end())
+		return;
+
+	struct buffer_retrace &b = it->second;
+	auto offset_it = ctx_retrace.buffer_offsets.find(buffer_key(b.fd, b.offset));
+	if (offset_it != ctx_retrace.buffer_offsets.end() && offset_it->second == it->first)
+		ctx_retrace.buffer_offsets.erase(offset_it);
+	if (b.address_trace)
+		ctx_retrace.buffer_addresses.erase(b.address_trace);
+	ctx_retrace.buffers.erase(it);
 }
 
 void set_buffer_address_retrace(int fd, __u32 offset, long address_trace, long address_retrace)
 {
-	for (auto &b : ctx_retrace.buffers) {
-		if ((b.fd == fd) && (b.offset == offset)) {
-			b.address_trace = address_trace;
-			b.address_retrace = address_retrace;
-			break;
-		}
-	}
+	auto offset_it = ctx_retrace.buffer_offsets.find(buffer_key(fd, offset));
+	if (offset_it == ctx_retrace.buffer_offsets.end())
+		return;
+
+	struct buffer_retrace &b = ctx_retrace.buffers[offset_it->second];
+	if (b.address_trace)
+		ctx_retrace.buffer_addresses.erase(b.address_trace);
+	b.address_trace = address_trace;
+	b.address_retrace = address_retrace;
+	ctx_retrace.buffer_addresses[address_trace] = address_retrace;
 }
 
 long get_retrace_address_from_trace_address(long address_trace)
 {
-	long address_retrace = 0;
-	for (auto &b : ctx_retrace.buffers) {
-		if (b.address_trace == address_trace) {
-			address_retrace = b.address_retrace;
+	auto it = ctx_retrace.buffer_addresses.find(address_trace);
+	if (it == ctx_retrace.buffer_addresses.end())
+		return 0;
+	return it->second;
+}
+
+/*
+ * Read a JSON trace file one object at a time, so that memory use doesn't grow with the
+ * length of the trace, and pass each object to func. Stops early if func returns false.
+ */
+int read_json_objects(FILE *file, const std::function<bool(json_object *)> &func)
+{
+	json_tokener *tok = json_tokener_new();
+	char buf[65536];
+	size_t len = 0;
+	size_t pos = 0;
+	bool in_object = false;
+	unsigned long count = 0;
+	int ret = 0;
+
+	for (;;) {
+		if (pos == len) {
+			len = fread(buf, sizeof(char), sizeof(buf), file);
+			pos = 0;
+			if (len == 0)
+				break;
+		}
+
+		/* Skip the brackets of the json array and the separators between its objects. */
+		if (!in_object && (buf[pos] == '[' || buf[pos] == ']' || buf[pos] == ',' ||
+		                   isspace(buf[pos]))) {
+			pos++;
+			continue;
+		}
+
+		json_object *jobj = json_tokener_parse_ex(tok, buf + pos, len - pos);
+		enum json_tokener_error jerr = json_tokener_get_error(tok);
+		if (jerr == json_tokener_continue) {
+			in_object = true;
+			pos = len;
+			continue;
+		}
+		if (jobj == nullptr) {
+			line_info("\n\t%s after %lu JSON-objects", json_tokener_error_desc(jerr), count);
+			ret = 1;
 			break;
 		}
+		pos += json_tokener_get_parse_end(tok);
+		json_tokener_reset(tok);
+		in_object = false;
+		count++;
+
+		bool more = func(jobj);
+		json_object_put(jobj);
+		if (!more)
+			break;
+	}
+
+	if (in_object)
+		line_info("\n\tWarning: trace file ends in the middle of a JSON-object.");
+
+	json_tokener_free(tok);
+	return ret;
+}
+
+static bool get_range_end(const char *str, char **end, unsigned long *value, bool *time)
+{
+	if (!isdigit(*str))
+		return false;
+
+	double secs = strtod(str, end);
+	*time = **end == 's';
+	if (*time) {
+		(*end)++;
+		*value = secs * 1000000000.0;
+		return true;
 	}
-	return address_retrace;
+	*value = strtoul(str, end, 10);
+	return true;
+}
+
+/*
+ * Parse a range given as <first>[-[<last>]]. Both ends are included, without <last> the
+ * range ends with the trace. The ends are indexes of JSON-objects in the trace file, or
+ * times in seconds after the first traced call if they are followed by 's'.
+ */
+bool get_range_retrace(const char *str, struct retrace_range *range)
+{
+	char *end;
+	bool time;
+
+	if (!get_range_end(str, &end, &range->first, &range->time))
+		return false;
+	range->last = ULONG_MAX;
+	if (*end == '\0')
+		return true;
+	if (*end++ != '-')
+		return false;
+	if (*end == '\0')
+		return true;
+	if (!get_range_end(end, &end, &range->last, &time))
+		return false;
+	return *end == '\0' && time == range->time && range->last >= range->first;
 }
 
 void print_buffers_retrace(void)
 {
-	for (auto &b : ctx_retrace.buffers) {
+	for (auto &it : ctx_retrace.buffers) {
+		struct buffer_retrace &b = it.second;
 		fprintf(stderr, "fd: %d, offset: %d, address_trace:%ld, address_retrace:%ld\n",
 		        b.fd, b.offset, b.address_trace, b.address_retrace);
 	}
@@ -106,6 +212,24 @@ void print_fds(void)
 		fprintf(stderr, "fd_trace: %d, fd_retrace: %d\n", retrace_fd.first, retrace_fd.second);
 }
 
+/*
+ * Pause tracing the retracer's own calls. Returns false if tracing was already paused,
+ * in which case resume_trace() leaves the pause in place.
+ */
+static bool pause_trace(void)
+{
+	if (getenv("V4L2_TRACER_PAUSE_TRACE") != nullptr)
+		return false;
+	setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
+	return true;
+}
+
+static void resume_trace(bool paused)
+{
+	if (paused)
+		unsetenv("V4L2_TRACER_PAUSE_TRACE");
+}
+
 std::string get_path_retrace_from_path_trace(std::string path_trace, json_object *open_obj)
 {
 	bool is_media = path_trace.find("media") != std::string::npos;
@@ -134,7 +258,10 @@ std::string get_path_retrace_from_path_trace(std::string path_trace, json_object
 	if (driver.empty())
 		return "";
 
+	/* Don't trace looking for the media device. */
+	bool paused = pause_trace();
 	path_media = get_path_media(driver);
+	resume_trace(paused);
 	if (path_media.empty()) {
 		line_info("\n\tWarning: driver: \'%s\' not found.", driver.c_str());
 		return "";
@@ -157,27 +284,77 @@ std::string get_path_retrace_from_path_trace(std::string path_trace, json_object
 		if (linked_entities.size() == 0)
 			return "";
 
-		setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
+		paused = pause_trace();
 		int media_fd = open(path_media.c_str(), O_RDONLY);
-		unsetenv("V4L2_TRACER_PAUSE_TRACE");
+		resume_trace(paused);
 
 		std::string path_video = get_path_video(media_fd, linked_entities);
-		setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
+		paused = pause_trace();
 		close(media_fd);
-		unsetenv("V4L2_TRACER_PAUSE_TRACE");
+		resume_trace(paused);
 		return path_video;
 	}
 
 	return "";
 }
 
+static int read_mem_file(unsigned char *buffer_pointer, int bytesused, std::string mem_file)
+{
+	std::string path = ctx_retrace.trace_dir + mem_file;
+	int bytesread;
+
+#ifdef HAVE_ZLIB
+	/* gzread() reads uncompressed files as well. */
+	gzFile gz = gzopen(path.c_str(), "rb");
+	if (gz == nullptr) {
+		line_info("\n\tCan't open '%s'", path.c_str());
+		return 0;
+	}
+	bytesread = gzread(gz, buffer_pointer, bytesused);
+	gzclose(gz);
+#else
+	if (mem_file.length() > 3 && mem_file.compare(mem_file.length() - 3, 3, ".gz") == 0) {
+		line_info("\n\tBuilt without zlib, can't read '%s'", path.c_str());
+		return 0;
+	}
+	FILE *fp = fopen(path.c_str(), "r");
+	if (fp == nullptr) {
+		line_info("\n\tCan't open '%s'", path.c_str());
+		return 0;
+	}
+	bytesread = fread(buffer_pointer, 1, bytesused, fp);
+	fclose(fp);
+#endif
+	return bytesread < 0 ? 0 : bytesread;
+}
+
 void write_to_output_buffer(unsigned char *buffer_pointer, int bytesused, json_object *mem_obj)
 {
 	int byteswritten = 0;
-	const int hex_base = 16;
 	json_object *line_obj;
 	size_t number_of_lines;
-	std::string compressed_video_data;
+
+	json_object *mem_file_obj;
+	if (json_object_object_get_ex(mem_obj, "mem_file", &mem_file_obj)) {
+		byteswritten = read_mem_file(buffer_pointer, bytesused,
+		                             json_object_get_string(mem_file_obj));
+		debug_line_info("\n\tbytesused: %d, byteswritten: %d", bytesused, byteswritten);
+		return;
+	}
+
+	/* Map each hex digit character to its value, anything else to -1. */
+	static signed char hex_values[256];
+	static bool hex_values_init;
+	if (!hex_values_init) {
+		memset(hex_values, -1, sizeof(hex_values));
+		for (int i = 0; i < 10; i++)
+			hex_values['0' + i] = i;
+		for (int i = 0; i < 6; i++) {
+			hex_values['a' + i] = 10 + i;
+			hex_values['A' + i] = 10 + i;
+		}
+		hex_values_init = true;
+	}
 
 	json_object *mem_array_obj;
 	json_object_object_get_ex(mem_obj, "mem_array", &mem_array_obj);
@@ -185,25 +362,28 @@ void write_to_output_buffer(unsigned char *buffer_pointer, int bytesused, json_o
 
 	for (long unsigned int i = 0; i < number_of_lines; i++) {
 		line_obj = json_object_array_get_idx(mem_array_obj, i);
-		if (json_object_get_string(line_obj) != nullptr)
-			compressed_video_data = json_object_get_string(line_obj);
+		const char *compressed_video_data = json_object_get_string(line_obj);
+		if (compressed_video_data == nullptr)
+			continue;
 
-		for (long unsigned i = 0; i < compressed_video_data.length(); i++) {
-			if (std::isspace(compressed_video_data[i]) != 0)
+		for (const char *p = compressed_video_data; *p; p++) {
+			if (std::isspace(*p) != 0)
 				continue;
-			try {
-				/* Two values from the string e.g. "D9" are needed to write one byte. */
-				*buffer_pointer = (char) std::stoi(compressed_video_data.substr(i,2), nullptr, hex_base);
-				buffer_pointer++;
-				i++;
+			/* Two values from the string e.g. "D9" are needed to write one byte. */
+			int hi = hex_values[(unsigned char)p[0]];
+			int lo = p[1] ? hex_values[(unsigned char)p[1]] : -1;
+			if (hi < 0 || lo < 0) {
+				line_info("\n\t'%.2s' is an invalid argument.\n", p);
+				if (!p[1])
+					break;
+				p++;
+				continue;
+			}
+			if (byteswritten < bytesused) {
+				*buffer_pointer++ = (hi << 4) | lo;
 				byteswritten++;
-			} catch (std::invalid_argument& ia) {
-				line_info("\n\t\'%s\' is an invalid argument.\n",
-				          compressed_video_data.substr(i,2).c_str());
-			} catch (std::out_of_range& oor) {
-				line_info("\n\t\'%s\' is out of range.\n",
-				          compressed_video_data.substr(i,2).c_str());
 			}
+			p++;
 		}
 	}
 	debug_line_info("\n\tbytesused: %d, byteswritten: %d", bytesused, byteswritten);
@@ -0,0 +1,131 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright 2022 Collabora Ltd.
+ */
+
+#include "retrace.h"
+#include <map>
+
+/* Durations in ns of the successful calls of one ioctl. */
+struct ioctl_durations {
+	std::vector<__u64> trace;
+	std::vector<__u64> retrace;
+};
+
+struct report_file {
+	unsigned long calls;	/* calls with a duration */
+	__u64 ts_first;		/* start of the first call */
+	__u64 ts_last;		/* end of the last call */
+};
+
+static int read_durations(std::string filename, std::map<std::string, ioctl_durations> &ioctls,
+                          bool is_retrace, struct report_file &file_info)
+{
+	FILE *file = fopen(filename.c_str(), "r");
+	if (file == nullptr) {
+		line_info("\n\tCan't open \'%s\'", filename.c_str());
+		return 1;
+	}
+
+	file_info = {};
+	int ret = read_json_objects(file, [&](json_object *jobj) {
+		json_object *ts_obj;
+		json_object *duration_obj;
+		if (!json_object_object_get_ex(jobj, "ts", &ts_obj) ||
+		    !json_object_object_get_ex(jobj, "duration", &duration_obj))
+			return true;
+
+		__u64 ts = json_object_get_int64(ts_obj);
+		__u64 duration = json_object_get_int64(duration_obj);
+		if (!file_info.ts_first || ts < file_info.ts_first)
+			file_info.ts_first = ts;
+		if (ts + duration > file_info.ts_last)
+			file_info.ts_last = ts + duration;
+		file_info.calls++;
+
+		/* Failed ioctls aren't retraced. */
+		json_object *ioctl_obj;
+		json_object *errno_obj;
+		if (!json_object_object_get_ex(jobj, "ioctl", &ioctl_obj) ||
+		    json_object_object_get_ex(jobj, "errno", &errno_obj) ||
+		    json_object_get_string(ioctl_obj) == nullptr)
+			return true;
+
+		struct ioctl_durations &durations = ioctls[json_object_get_string(ioctl_obj)];
+		if (is_retrace)
+			durations.retrace.push_back(duration);
+		else
+			durations.trace.push_back(duration);
+		return true;
+	});
+	fclose(file);
+
+	return ret;
+}
+
+/* Return the p-th percentile of the sorted durations in microseconds. */
+static double percentile_us(const std::vector<__u64> &sorted, unsigned p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[(sorted.size() - 1) * p / 100] / 1000.0;
+}
+
+static void print_change(double before, double after)
+{
+	if (before > 0 && after > 0)
+		printf(" %+7.1f%%", (after - before) * 100.0 / before);
+	else
+		printf(" %8s", "-");
+}
+
+/*
+ * Compare the time each ioctl took in a trace with the time it took when retraced,
+ * to find performance regressions of a driver by retracing a trace recorded earlier.
+ */
+int report(std::string trace_filename, std::string retrace_filename)
+{
+	std::map<std::string, ioctl_durations> ioctls;
+	struct report_file trace_info;
+	struct report_file retrace_info;
+
+	if (read_durations(trace_filename, ioctls, false, trace_info) ||
+	    read_durations(retrace_filename, ioctls, true, retrace_info))
+		return 1;
+
+	if (!trace_info.calls || !retrace_info.calls) {
+		line_info("\n\t\'%s\' has no call durations, it must be traced with a newer v4l2-tracer.",
+		          (!trace_info.calls ? trace_filename : retrace_filename).c_str());
+		return 1;
+	}
+
+	printf("Trace:   %s\n", trace_filename.c_str());
+	printf("Retrace: %s\n\n", retrace_filename.c_str());
+	printf("%-32s %26s   %26s %8s\n", "", "trace", "retrace", "change");
+	printf("%-32s %6s %9s %9s   %6s %9s %9s %8s\n", "ioctl",
+	       "calls", "median", "p95", "calls", "median", "p95", "median");
+
+	for (auto &it : ioctls) {
+		std::vector<__u64> &trace = it.second.trace;
+		std::vector<__u64> &retrace = it.second.retrace;
+
+		std::sort(trace.begin(), trace.end());
+		std::sort(retrace.begin(), retrace.end());
+
+		double trace_median = percentile_us(trace, 50);
+		double retrace_median = percentile_us(retrace, 50);
+		printf("%-32s %6zu %7.1fus %7.1fus   %6zu %7.1fus %7.1fus", it.first.c_str(),
+		       trace.size(), trace_median, percentile_us(trace, 95),
+		       retrace.size(), retrace_median, percentile_us(retrace, 95));
+		print_change(trace_median, retrace_median);
+		printf("\n");
+	}
+
+	double trace_secs = (trace_info.ts_last - trace_info.ts_first) / 1000000000.0;
+	double retrace_secs = (retrace_info.ts_last - retrace_info.ts_first) / 1000000000.0;
+	printf("\nElapsed: trace %.3fs, retrace %.3fs", trace_secs, retrace_secs);
+	print_change(trace_secs, retrace_secs);
+	printf("\n");
+
+	return 0;
+}
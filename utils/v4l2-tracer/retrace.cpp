@@ -4,6 +4,9 @@
  */
 
 #include "retrace.h"
+#include <climits>
+#include <ctype.h>
+#include <time.h>
 
 extern struct retrace_context ctx_retrace;
 
@@ -1520,19 +1523,108 @@ void retrace_object(json_object *jobj)
 	line_info("\n\tWarning: unexpected JSON object in trace file.");
 }
 
-void retrace_array(json_object *root_array_obj)
+/* Objects that queue or dequeue a buffer, or belong to a request that does. */
+static bool is_frame_object(json_object *jobj)
 {
-	json_object *jobj;
-	struct array_list *array_list_pointer = json_object_get_array(root_array_obj);
-	size_t json_objects_in_file = array_list_length(array_list_pointer);
+	json_object *temp_obj;
+	if (json_object_object_get_ex(jobj, "mem_dump", &temp_obj))
+		return true;
+	if (!json_object_object_get_ex(jobj, "ioctl", &temp_obj))
+		return false;
 
-	if (json_objects_in_file < 3)
-		line_info("\n\tWarning: trace file may be empty.");
+	switch (s2val(json_object_get_string(temp_obj), ioctl_val_def)) {
+	case VIDIOC_QBUF:
+	case VIDIOC_DQBUF:
+	case VIDIOC_PREPARE_BUF:
+	case VIDIOC_DQEVENT:
+	case MEDIA_REQUEST_IOC_QUEUE:
+	case MEDIA_REQUEST_IOC_REINIT:
+		return true;
+	case VIDIOC_G_EXT_CTRLS:
+	case VIDIOC_TRY_EXT_CTRLS:
+	case VIDIOC_S_EXT_CTRLS: {
+		json_object *ioctl_args;
+		if (json_object_object_get_ex(jobj, "from_userspace", &ioctl_args) == false)
+			json_object_object_get_ex(jobj, "from_driver", &ioctl_args);
+		json_object *v4l2_ext_controls_obj;
+		json_object *which_obj;
+		if (json_object_object_get_ex(ioctl_args, "v4l2_ext_controls", &v4l2_ext_controls_obj) &&
+		    json_object_object_get_ex(v4l2_ext_controls_obj, "which", &which_obj))
+			return s2val(json_object_get_string(which_obj), which_val_def) ==
+			       V4L2_CTRL_WHICH_REQUEST_VAL;
+		return false;
+	}
+	default:
+		return false;
+	}
+}
+
+static __u64 get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until_ns(__u64 time_ns)
+{
+	struct timespec ts = { (time_t)(time_ns / 1000000000ULL), (long)(time_ns % 1000000000ULL) };
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+		;
+}
+
+static int retrace_file(FILE *trace_file, const struct retrace_range &range, double timing)
+{
+	unsigned long index = 0;
+	unsigned long pos_in_range = 0;
+	__u64 ts_first = 0;
+	__u64 ts_timed = 0;	/* time of the first call retraced with its original timing */
+	__u64 start_timed = 0;
+
+	int ret = read_json_objects(trace_file, [&](json_object *jobj) {
+		__u64 ts = 0;
+		json_object *ts_obj;
+		if (json_object_object_get_ex(jobj, "ts", &ts_obj))
+			ts = json_object_get_int64(ts_obj);
+		if (ts && !ts_first)
+			ts_first = ts;
+
+		/* Objects without a timestamp, like the header, keep the time of the preceding call. */
+		if (!range.time)
+			pos_in_range = index;
+		else if (ts)
+			pos_in_range = ts - ts_first;
+
+		/* Before the range, only set up the devices. Stop after the range. */
+		if (pos_in_range > range.last)
+			return false;
+		index++;
+		if (pos_in_range < range.first) {
+			if (!is_frame_object(jobj))
+				retrace_object(jobj);
+			return true;
+		}
+
+		/* Keep the time between the calls of the trace, scaled by timing. */
+		if (timing > 0 && ts) {
+			if (!ts_timed) {
+				ts_timed = ts;
+				start_timed = get_time_ns();
+			}
+			if (ts > ts_timed)
+				sleep_until_ns(start_timed + (__u64)((ts - ts_timed) * timing));
+		}
 
-	for (size_t i = 0; i < json_objects_in_file; i++) {
-		jobj = (json_object *) array_list_get_idx(array_list_pointer, i);
 		retrace_object(jobj);
-	}
+		return true;
+	});
+
+	if (index < 3)
+		line_info("\n\tWarning: trace file may be empty.");
+
+	return ret;
 }
 
 int retrace(std::string trace_filename)
@@ -1543,19 +1635,31 @@ int retrace(std::string trace_filename)
 		return -EINVAL;
 	}
 
-	fprintf(stderr, "Retracing: %s\n", trace_filename.c_str());
+	double timing = 0;
+	if (getenv("V4L2_TRACER_OPTION_TIMING") != nullptr)
+		timing = strtod(getenv("V4L2_TRACER_OPTION_TIMING"), nullptr);
 
-	json_object *root_array_obj = json_object_from_file(trace_filename.c_str());
+	struct retrace_range range = { false, 0, ULONG_MAX };
+	if (getenv("V4L2_TRACER_OPTION_RANGE") != nullptr &&
+	    !get_range_retrace(getenv("V4L2_TRACER_OPTION_RANGE"), &range)) {
+		line_info("\n\tBad range: \'%s\'", getenv("V4L2_TRACER_OPTION_RANGE"));
+		return -EINVAL;
+	}
 
-	if (root_array_obj == nullptr) {
-		line_info("\n\t%s\tCan't get JSON-object from file: %s",
-			  json_util_get_last_err(),
-			  trace_filename.c_str());
+	FILE *trace_file = fopen(trace_filename.c_str(), "r");
+	if (trace_file == nullptr) {
+		line_info("\n\tCan't open \'%s\'", trace_filename.c_str());
 		return 1;
 	}
 
-	retrace_array(root_array_obj);
-	json_object_put(root_array_obj);
+	fprintf(stderr, "Retracing: %s\n", trace_filename.c_str());
+
+	size_t pos = trace_filename.find_last_of('/');
+	if (pos != std::string::npos)
+		ctx_retrace.trace_dir = trace_filename.substr(0, pos + 1);
+
+	int ret = retrace_file(trace_file, range, timing);
+	fclose(trace_file);
 
-	return 0;
+	return ret;
 }
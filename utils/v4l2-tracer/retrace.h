@@ -8,6 +8,7 @@
 
 #include "v4l2-tracer-common.h"
 #include "retrace-gen.h"
+#include <functional>
 
 struct buffer_retrace {
 	int fd;
@@ -18,14 +19,30 @@ struct buffer_retrace {
 	long address_retrace;
 };
 
+/* Part of the trace to retrace, see --range. */
+struct retrace_range {
+	bool time;		/* first and last are ns after the first call, not indexes */
+	unsigned long first;
+	unsigned long last;
+};
+
 struct retrace_context {
 	/* Key is a file descriptor from the trace, value is the corresponding fd in the retrace. */
 	std::unordered_map<int, int> retrace_fds;
-	/* List of output and capture buffers being retraced. */
-	std::list<struct buffer_retrace> buffers;
+	/* Output and capture buffers being retraced, the key is the buffer type and index. */
+	std::unordered_map<__u64, struct buffer_retrace> buffers;
+	/* Key is the fd and mmap offset of a buffer, value is its key in buffers. */
+	std::unordered_map<__u64, __u64> buffer_offsets;
+	/* Key is a buffer address from the trace, value is the corresponding address in the retrace. */
+	std::unordered_map<long, long> buffer_addresses;
+	/* Directory of the trace file, buffer files are looked up relative to it. */
+	std::string trace_dir;
 };
 
 int retrace(std::string trace_filename);
+int report(std::string trace_filename, std::string retrace_filename);
+int read_json_objects(FILE *file, const std::function<bool(json_object *)> &func);
+bool get_range_retrace(const char *str, struct retrace_range *range);
 
 bool buffer_in_retrace_context(int fd, __u32 offset = 0);
 int get_buffer_fd_retrace(__u32 type, __u32 index);
@@ -0,0 +1,536 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright 2022 Collabora Ltd.
+ */
+
+#include "trace.h"
+#include <atomic>
+
+/* Flattened sub-arguments are aligned to 8 bytes to allow accessing them in place. */
+static size_t align8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+static bool is_buffer_ioctl(unsigned long cmd)
+{
+	return cmd == VIDIOC_QUERYBUF || cmd == VIDIOC_QBUF ||
+	       cmd == VIDIOC_DQBUF || cmd == VIDIOC_PREPARE_BUF;
+}
+
+static bool is_ext_ctrls_ioctl(unsigned long cmd)
+{
+	return cmd == VIDIOC_G_EXT_CTRLS || cmd == VIDIOC_S_EXT_CTRLS ||
+	       cmd == VIDIOC_TRY_EXT_CTRLS;
+}
+
+static __u32 buffer_planes(struct v4l2_buffer *buf)
+{
+	if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE &&
+	    buf->type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return 0;
+	if (buf->m.planes == nullptr)
+		return 0;
+	return std::min(buf->length, (__u32)VIDEO_MAX_PLANES);
+}
+
+static __u32 ext_ctrls_count(struct v4l2_ext_controls *ext_controls)
+{
+	if (ext_controls->controls == nullptr)
+		return 0;
+	return std::min(ext_controls->count, (__u32)V4L2_CID_MAX_CTRLS);
+}
+
+/*
+ * Return the size of the ioctl argument including the arrays and control
+ * payloads it points to, as stored by trace_binary_arg_flatten().
+ */
+size_t trace_binary_arg_size(unsigned long cmd, void *arg)
+{
+	size_t size = align8(_IOC_SIZE(cmd));
+
+	if (is_buffer_ioctl(cmd)) {
+		struct v4l2_buffer *buf = static_cast<struct v4l2_buffer*>(arg);
+		size += align8(buffer_planes(buf) * sizeof(struct v4l2_plane));
+	}
+
+	if (is_ext_ctrls_ioctl(cmd)) {
+		struct v4l2_ext_controls *ext_controls = static_cast<struct v4l2_ext_controls*>(arg);
+		__u32 count = ext_ctrls_count(ext_controls);
+
+		size += align8(count * sizeof(struct v4l2_ext_control));
+		for (__u32 i = 0; i < count; i++) {
+			struct v4l2_ext_control *p = &ext_controls->controls[i];
+			if (p->size && p->ptr != nullptr)
+				size += align8(p->size);
+		}
+	}
+
+	return size;
+}
+
+/* Copy the ioctl argument and everything it points to into dst. */
+void trace_binary_arg_flatten(unsigned long cmd, void *arg, unsigned char *dst)
+{
+	size_t pos = align8(_IOC_SIZE(cmd));
+
+	memcpy(dst, arg, _IOC_SIZE(cmd));
+
+	if (is_buffer_ioctl(cmd)) {
+		struct v4l2_buffer *buf = static_cast<struct v4l2_buffer*>(arg);
+		size_t len = buffer_planes(buf) * sizeof(struct v4l2_plane);
+
+		memcpy(dst + pos, buf->m.planes, len);
+		pos += align8(len);
+	}
+
+	if (is_ext_ctrls_ioctl(cmd)) {
+		struct v4l2_ext_controls *ext_controls = static_cast<struct v4l2_ext_controls*>(arg);
+		__u32 count = ext_ctrls_count(ext_controls);
+		size_t len = count * sizeof(struct v4l2_ext_control);
+
+		memcpy(dst + pos, ext_controls->controls, len);
+		pos += align8(len);
+		for (__u32 i = 0; i < count; i++) {
+			struct v4l2_ext_control *p = &ext_controls->controls[i];
+			if (!p->size || p->ptr == nullptr)
+				continue;
+			memcpy(dst + pos, p->ptr, p->size);
+			pos += align8(p->size);
+		}
+	}
+}
+
+/*
+ * Point the pointers in a flattened ioctl argument to the copies that follow it.
+ * Return nullptr if the argument doesn't fit in size bytes.
+ */
+void *trace_binary_arg_unflatten(unsigned long cmd, unsigned char *src, size_t size)
+{
+	size_t pos = align8(_IOC_SIZE(cmd));
+
+	if (pos > size)
+		return nullptr;
+
+	if (is_buffer_ioctl(cmd)) {
+		struct v4l2_buffer *buf = reinterpret_cast<struct v4l2_buffer*>(src);
+		size_t len = buffer_planes(buf) * sizeof(struct v4l2_plane);
+
+		if (pos + len > size)
+			return nullptr;
+		if (len)
+			buf->m.planes = reinterpret_cast<struct v4l2_plane*>(src + pos);
+		pos += align8(len);
+	}
+
+	if (is_ext_ctrls_ioctl(cmd)) {
+		struct v4l2_ext_controls *ext_controls = reinterpret_cast<struct v4l2_ext_controls*>(src);
+		__u32 count = ext_ctrls_count(ext_controls);
+		size_t len = count * sizeof(struct v4l2_ext_control);
+
+		if (pos + len > size)
+			return nullptr;
+		if (len)
+			ext_controls->controls = reinterpret_cast<struct v4l2_ext_control*>(src + pos);
+		pos += align8(len);
+		for (__u32 i = 0; i < count; i++) {
+			struct v4l2_ext_control *p = &ext_controls->controls[i];
+			if (!p->size || p->ptr == nullptr)
+				continue;
+			if (pos + p->size > size)
+				return nullptr;
+			p->ptr = src + pos;
+			pos += align8(p->size);
+		}
+	}
+
+	return src;
+}
+
+/* Write all of iov, continuing where a short writev() left off. */
+static int writev_full(int fd, struct iovec *iov, int iovcnt)
+{
+	while (iovcnt) {
+		ssize_t ret = writev(fd, iov, iovcnt);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (iovcnt && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = static_cast<unsigned char*>(iov->iov_base) + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+int trace_binary_write_header(int fd)
+{
+	struct trace_binary_header header = {};
+	struct iovec iov = { &header, sizeof(header) };
+
+	memcpy(header.magic, TRACE_BINARY_MAGIC, sizeof(header.magic));
+	header.version = TRACE_BINARY_VERSION;
+	header.pointer_size = sizeof(void *);
+
+	return writev_full(fd, &iov, 1);
+}
+
+/*
+ * Write a complete record, with a single writev() call unless it is cut short,
+ * so records written by different processes appending to the same file don't
+ * get interleaved.
+ */
+static int write_record(int fd, struct trace_binary_record *rec,
+			const struct iovec *iov, int iovcnt)
+{
+	struct iovec vec[TRACE_BINARY_MAX_IOV + 1];
+
+	if (iovcnt > TRACE_BINARY_MAX_IOV) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	vec[0].iov_base = rec;
+	vec[0].iov_len = sizeof(*rec);
+	for (int i = 0; i < iovcnt; i++)
+		vec[i + 1] = iov[i];
+
+	return writev_full(fd, vec, iovcnt + 1);
+}
+
+static void init_record(struct trace_binary_record *rec, __u32 type, int dev_fd, int err,
+			const struct iovec *iov, int iovcnt)
+{
+	const struct trace_call &call = get_call_trace();
+
+	*rec = { type, sizeof(*rec), dev_fd, err, call.tid, 0, call.ts, call.duration };
+	for (int i = 0; i < iovcnt; i++)
+		rec->size += iov[i].iov_len;
+}
+
+int trace_binary_write_record(int fd, __u32 type, int dev_fd, int err,
+			      const struct iovec *iov, int iovcnt)
+{
+	struct trace_binary_record rec;
+
+	init_record(&rec, type, dev_fd, err, iov, iovcnt);
+	return write_record(fd, &rec, iov, iovcnt);
+}
+
+/*
+ * Records are queued by the traced threads in per-thread ring buffers and
+ * written to the trace file by a background writer thread, so the traced
+ * application only pays for a memcpy per traced call. Each ring has a single
+ * producer (the thread owning it) and a single consumer (the writer thread),
+ * so head and tail are the only shared state and no locking is needed.
+ */
+
+#define TRACE_RING_SIZE (1 << 20)
+
+struct trace_ring {
+	std::atomic<size_t> head{0};	/* bytes queued by the owning thread */
+	std::atomic<size_t> tail{0};	/* bytes written to the trace file */
+	std::atomic<bool> in_use{true};
+	struct trace_ring *next = nullptr;
+	unsigned char data[TRACE_RING_SIZE];
+};
+
+/* Give the ring back when the thread exits, so a new thread can reuse it. */
+struct trace_ring_owner {
+	struct trace_ring *ring = nullptr;
+	~trace_ring_owner()
+	{
+		if (ring != nullptr)
+			ring->in_use.store(false, std::memory_order_release);
+	}
+};
+
+static std::atomic<struct trace_ring *> rings{nullptr};
+static thread_local struct trace_ring_owner ring_owner;
+
+/* Serializes starting and stopping the writer thread. */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes writes to the trace file. */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::atomic<bool> writer_running{false};
+/* Set if the writer thread couldn't be started, records are then written directly. */
+static std::atomic<bool> write_direct{false};
+static std::atomic<bool> writer_stop{false};
+static pthread_t writer_thread;
+static int trace_fd = -1;
+
+bool trace_binary_enabled(void)
+{
+	static bool enabled = getenv("V4L2_TRACER_OPTION_BINARY") != nullptr;
+
+	return enabled;
+}
+
+static struct trace_ring *get_ring(void)
+{
+	struct trace_ring *ring = ring_owner.ring;
+
+	if (ring != nullptr)
+		return ring;
+
+	for (ring = rings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next) {
+		bool in_use = false;
+		if (ring->in_use.compare_exchange_strong(in_use, true)) {
+			ring_owner.ring = ring;
+			return ring;
+		}
+	}
+
+	ring = new trace_ring;
+	ring->next = rings.load(std::memory_order_relaxed);
+	while (!rings.compare_exchange_weak(ring->next, ring, std::memory_order_release))
+		;
+	ring_owner.ring = ring;
+	return ring;
+}
+
+/* Write out everything queued in the rings, return the number of bytes written. */
+static size_t drain_rings(void)
+{
+	size_t written = 0;
+
+	for (struct trace_ring *ring = rings.load(std::memory_order_acquire);
+	     ring != nullptr; ring = ring->next) {
+		size_t head = ring->head.load(std::memory_order_acquire);
+		size_t tail = ring->tail.load(std::memory_order_relaxed);
+
+		if (head == tail)
+			continue;
+
+		/* The queued data may wrap around the end of the ring. */
+		size_t start = tail % TRACE_RING_SIZE;
+		size_t len = head - tail;
+		struct iovec iov[2];
+		int iovcnt = 1;
+
+		iov[0].iov_base = ring->data + start;
+		iov[0].iov_len = std::min(len, (size_t)TRACE_RING_SIZE - start);
+		if (iov[0].iov_len < len) {
+			iov[1].iov_base = ring->data;
+			iov[1].iov_len = len - iov[0].iov_len;
+			iovcnt = 2;
+		}
+		if (writev_full(trace_fd, iov, iovcnt))
+			line_info("\n\tCan't write binary trace: %s", strerror(errno));
+
+		ring->tail.store(head, std::memory_order_release);
+		written += len;
+	}
+
+	return written;
+}
+
+static void *trace_binary_writer(void *arg)
+{
+	for (;;) {
+		bool stop = writer_stop.load(std::memory_order_acquire);
+
+		pthread_mutex_lock(&writer_lock);
+		size_t written = drain_rings();
+		pthread_mutex_unlock(&writer_lock);
+
+		if (stop)
+			break;
+		if (!written)
+			usleep(1000);
+	}
+	return nullptr;
+}
+
+void trace_binary_fork_child(void)
+{
+	/*
+	 * The writer thread doesn't exist in the child, and whatever the parent
+	 * had queued will be written by the parent. The child writes to its own
+	 * trace file.
+	 */
+	pthread_mutex_init(&state_lock, nullptr);
+	pthread_mutex_init(&writer_lock, nullptr);
+	writer_running.store(false);
+	write_direct.store(false);
+	for (struct trace_ring *ring = rings.load(); ring != nullptr; ring = ring->next)
+		ring->tail.store(ring->head.load());
+	if (trace_fd >= 0) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+static void start_writer(void)
+{
+	if (writer_running.load(std::memory_order_acquire) ||
+	    write_direct.load(std::memory_order_acquire))
+		return;
+
+	pthread_mutex_lock(&state_lock);
+	if (!writer_running.load(std::memory_order_relaxed) &&
+	    !write_direct.load(std::memory_order_relaxed)) {
+		std::string filename = get_stream_id_trace() + ".bin";
+
+		trace_fd = open(filename.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (trace_fd < 0)
+			line_info("\n\tCan't open \'%s\': %s", filename.c_str(), strerror(errno));
+
+		/* v4l2-tracer writes the header for the tracee, but not for its children. */
+		struct stat sb;
+		if (trace_fd >= 0 && fstat(trace_fd, &sb) == 0 && sb.st_size == 0)
+			trace_binary_write_header(trace_fd);
+
+		writer_stop.store(false);
+		if (pthread_create(&writer_thread, nullptr, trace_binary_writer, nullptr) == 0) {
+			writer_running.store(true, std::memory_order_release);
+		} else {
+			line_info("\n\tCan't start the binary trace writer, writing records directly");
+			write_direct.store(true, std::memory_order_release);
+		}
+	}
+	pthread_mutex_unlock(&state_lock);
+}
+
+static void ring_copy(struct trace_ring *ring, size_t pos, const void *src, size_t len)
+{
+	size_t start = pos % TRACE_RING_SIZE;
+	size_t first = std::min(len, (size_t)TRACE_RING_SIZE - start);
+
+	memcpy(ring->data + start, src, first);
+	memcpy(ring->data, static_cast<const unsigned char*>(src) + first, len - first);
+}
+
+/* Queue a record to the ring of this thread, or write it directly. */
+static void queue_record(struct trace_binary_record *rec, const struct iovec *iov, int iovcnt)
+{
+	start_writer();
+
+	struct trace_ring *ring = get_ring();
+	size_t head = ring->head.load(std::memory_order_relaxed);
+
+	if (write_direct.load(std::memory_order_acquire) || rec->size > TRACE_RING_SIZE / 2) {
+		/*
+		 * Large records (typically dumps of decoded frames) are written
+		 * directly, once everything this thread queued before is out.
+		 */
+		while (ring->tail.load(std::memory_order_acquire) != head)
+			usleep(100);
+		pthread_mutex_lock(&writer_lock);
+		if (write_record(trace_fd, rec, iov, iovcnt))
+			line_info("\n\tCan't write binary trace: %s", strerror(errno));
+		pthread_mutex_unlock(&writer_lock);
+		return;
+	}
+
+	/* Wait for the writer if the ring is full. */
+	while (head + rec->size - ring->tail.load(std::memory_order_acquire) > TRACE_RING_SIZE)
+		usleep(100);
+
+	ring_copy(ring, head, rec, sizeof(*rec));
+	head += sizeof(*rec);
+	for (int i = 0; i < iovcnt; i++) {
+		ring_copy(ring, head, iov[i].iov_base, iov[i].iov_len);
+		head += iov[i].iov_len;
+	}
+	ring->head.store(head, std::memory_order_release);
+}
+
+/*
+ * While a thread holds the trace lock of libv4l2tracer, its records are only
+ * staged. They are queued once the lock is released, so that no thread waits
+ * for the writer while the other traced threads wait for the lock.
+ */
+static thread_local std::vector<unsigned char> staged;
+static thread_local bool staging;
+
+static void queue_staged(void)
+{
+	size_t pos = 0;
+
+	while (pos < staged.size()) {
+		struct trace_binary_record rec;
+
+		memcpy(&rec, staged.data() + pos, sizeof(rec));
+		struct iovec iov = { staged.data() + pos + sizeof(rec), rec.size - sizeof(rec) };
+		queue_record(&rec, &iov, 1);
+		pos += rec.size;
+	}
+	staged.clear();
+}
+
+void trace_binary_stage(void)
+{
+	staging = true;
+}
+
+void trace_binary_unstage(void)
+{
+	int saved_errno = errno;
+
+	staging = false;
+	queue_staged();
+	errno = saved_errno;
+}
+
+void trace_binary_commit(__u32 type, int fd, int err, const struct iovec *iov, int iovcnt)
+{
+	int saved_errno = errno;
+	struct trace_binary_record rec;
+
+	init_record(&rec, type, fd, err, iov, iovcnt);
+
+	if (staging) {
+		staged.insert(staged.end(), reinterpret_cast<unsigned char *>(&rec),
+		              reinterpret_cast<unsigned char *>(&rec) + sizeof(rec));
+		for (int i = 0; i < iovcnt; i++)
+			staged.insert(staged.end(), static_cast<unsigned char *>(iov[i].iov_base),
+			              static_cast<unsigned char *>(iov[i].iov_base) + iov[i].iov_len);
+	} else {
+		queue_record(&rec, iov, iovcnt);
+	}
+	errno = saved_errno;
+}
+
+/* Stop the writer thread once everything queued is written and close the trace file. */
+void trace_binary_flush(void)
+{
+	int saved_errno = errno;
+
+	/* This is called with the trace lock held when the last device is closed. */
+	queue_staged();
+
+	if (!writer_running.load(std::memory_order_acquire) &&
+	    !write_direct.load(std::memory_order_acquire)) {
+		errno = saved_errno;
+		return;
+	}
+
+	pthread_mutex_lock(&state_lock);
+	if (writer_running.load(std::memory_order_relaxed)) {
+		writer_stop.store(true, std::memory_order_release);
+		pthread_join(writer_thread, nullptr);
+		pthread_mutex_lock(&writer_lock);
+		drain_rings();
+		close(trace_fd);
+		trace_fd = -1;
+		pthread_mutex_unlock(&writer_lock);
+		writer_running.store(false, std::memory_order_release);
+	} else if (write_direct.load(std::memory_order_relaxed)) {
+		pthread_mutex_lock(&writer_lock);
+		close(trace_fd);
+		trace_fd = -1;
+		pthread_mutex_unlock(&writer_lock);
+		write_direct.store(false, std::memory_order_release);
+	}
+	pthread_mutex_unlock(&state_lock);
+	errno = saved_errno;
+}
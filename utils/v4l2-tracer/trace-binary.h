@@ -0,0 +1,126 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright 2022 Collabora Ltd.
+ */
+
+#ifndef TRACE_BINARY_H
+#define TRACE_BINARY_H
+
+#include "v4l2-tracer-common.h"
+#include <sys/uio.h>
+
+/*
+ * Binary trace format
+ *
+ * A binary trace starts with a struct trace_binary_header followed by
+ * records. Every record starts with a struct trace_binary_record giving
+ * its type and total size, followed by a type specific payload:
+ *
+ * TRACE_BINARY_JSON:	a JSON object, already serialized.
+ * TRACE_BINARY_OPEN(64): struct trace_binary_open followed by the path,
+ *			driver, bus_info and linked entity names as
+ *			consecutive NUL terminated strings.
+ * TRACE_BINARY_CLOSE:	the path of the device as a NUL terminated string.
+ * TRACE_BINARY_MMAP(64): struct trace_binary_mmap.
+ * TRACE_BINARY_MUNMAP:	struct trace_binary_munmap.
+ * TRACE_BINARY_IOCTL:	struct trace_binary_ioctl followed by the ioctl
+ *			argument as passed by userspace and as returned by
+ *			the driver, each flattened with trace_binary_arg_flatten().
+ * TRACE_BINARY_MEM:	struct trace_binary_mem followed by the contents of
+ *			the buffer if they were dumped.
+ * TRACE_BINARY_WRITE:	the traced message, not NUL terminated.
+ *
+ * Argument structs are stored in host layout, so a binary trace can only be
+ * converted on a machine with the same ABI as the traced application.
+ */
+
+#define TRACE_BINARY_MAGIC	"V4L2TRCB"
+#define TRACE_BINARY_VERSION	1
+
+struct trace_binary_header {
+	char magic[8];
+	__u32 version;
+	__u32 pointer_size;
+};
+
+enum trace_binary_record_type {
+	TRACE_BINARY_JSON = 1,
+	TRACE_BINARY_OPEN,
+	TRACE_BINARY_OPEN64,
+	TRACE_BINARY_CLOSE,
+	TRACE_BINARY_MMAP,
+	TRACE_BINARY_MMAP64,
+	TRACE_BINARY_MUNMAP,
+	TRACE_BINARY_IOCTL,
+	TRACE_BINARY_MEM,
+	TRACE_BINARY_WRITE,
+};
+
+struct trace_binary_record {
+	__u32 type;
+	__u32 size;	/* size of the record including this header */
+	__s32 fd;
+	__s32 err;	/* errno after the call */
+	__s32 tid;	/* thread that made the call, 0 if not a call */
+	__u32 reserved;
+	__u64 ts;	/* CLOCK_MONOTONIC time of the call in ns */
+	__u64 duration;	/* ns the call took, 0 if not known */
+};
+
+struct trace_binary_open {
+	__s32 oflag;
+	__u32 mode;
+};
+
+struct trace_binary_mmap {
+	__u64 addr;
+	__u64 len;
+	__s32 prot;
+	__s32 flags;
+	__s64 off;
+	__u64 buffer_address;
+};
+
+struct trace_binary_munmap {
+	__u64 start;
+	__u64 length;
+};
+
+struct trace_binary_ioctl {
+	__u64 cmd;
+	__u32 userspace_size;	/* 0 if the userspace argument wasn't traced */
+	__u32 driver_size;	/* 0 if the driver argument wasn't traced */
+};
+
+struct trace_binary_mem {
+	__u32 type;
+	__u32 offset;
+	__s32 index;
+	__u32 bytesused;
+	__u64 address;
+	__u32 dumped;		/* number of bytes of buffer data following */
+	__u32 reserved;
+};
+
+/* The maximum number of iovecs that make up the payload of a record. */
+#define TRACE_BINARY_MAX_IOV	4
+
+size_t trace_binary_arg_size(unsigned long cmd, void *arg);
+void trace_binary_arg_flatten(unsigned long cmd, void *arg, unsigned char *dst);
+void *trace_binary_arg_unflatten(unsigned long cmd, unsigned char *src, size_t size);
+int trace_binary_write_header(int fd);
+int trace_binary_write_record(int fd, __u32 type, int dev_fd, int err,
+			      const struct iovec *iov, int iovcnt);
+
+/* Only used by libv4l2tracer. */
+bool trace_binary_enabled(void);
+void trace_binary_stage(void);
+void trace_binary_unstage(void);
+void trace_binary_commit(__u32 type, int fd, int err, const struct iovec *iov, int iovcnt);
+void trace_binary_flush(void);
+void trace_binary_fork_child(void);
+
+/* Only used by v4l2-tracer. */
+int convert(std::string trace_filename);
+
+#endif
@@ -0,0 +1,256 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Copyright 2022 Collabora Ltd.
+ */
+
+#include "trace.h"
+
+extern struct trace_context ctx_trace;
+
+static std::string next_string(const std::vector<unsigned char> &payload, size_t &pos)
+{
+	std::string str;
+
+	while (pos < payload.size() && payload[pos])
+		str += payload[pos++];
+	pos++;
+	return str;
+}
+
+static void *get_arg(unsigned long cmd, std::vector<unsigned char> &payload, size_t pos,
+                     size_t size, std::vector<unsigned char> &arg)
+{
+	/* Copy the argument to get it aligned. */
+	arg.assign(payload.begin() + pos, payload.begin() + pos + size);
+	return trace_binary_arg_unflatten(cmd, arg.data(), arg.size());
+}
+
+static int convert_ioctl(int fd, int err, std::vector<unsigned char> &payload)
+{
+	struct trace_binary_ioctl ioctl_args;
+	std::vector<unsigned char> arg;
+
+	if (payload.size() < sizeof(ioctl_args))
+		return -1;
+	memcpy(&ioctl_args, payload.data(), sizeof(ioctl_args));
+	if (sizeof(ioctl_args) + ioctl_args.userspace_size + ioctl_args.driver_size > payload.size())
+		return -1;
+
+	unsigned long cmd = ioctl_args.cmd;
+	json_object *ioctl_obj = json_object_new_object();
+	json_object_object_add(ioctl_obj, "fd", json_object_new_int(fd));
+	json_object_object_add(ioctl_obj, "ioctl",
+	                       json_object_new_string(val2s(cmd, ioctl_val_def).c_str()));
+
+	if (ioctl_args.userspace_size) {
+		void *ptr = get_arg(cmd, payload, sizeof(ioctl_args), ioctl_args.userspace_size, arg);
+		if (ptr == nullptr) {
+			json_object_put(ioctl_obj);
+			return -1;
+		}
+		errno = 0;
+		json_object *ioctl_args_userspace = trace_ioctl_args(cmd, ptr);
+		if (json_object_object_length(ioctl_args_userspace))
+			json_object_object_add(ioctl_obj, "from_userspace", ioctl_args_userspace);
+		else
+			json_object_put(ioctl_args_userspace);
+	}
+
+	if (err)
+		json_object_object_add(ioctl_obj, "errno", json_object_new_string(STRERR(err)));
+
+	void *ptr = nullptr;
+	if (ioctl_args.driver_size) {
+		ptr = get_arg(cmd, payload, sizeof(ioctl_args) + ioctl_args.userspace_size,
+		              ioctl_args.driver_size, arg);
+		if (ptr == nullptr) {
+			json_object_put(ioctl_obj);
+			return -1;
+		}
+		errno = err;
+		json_object *ioctl_args_driver = trace_ioctl_args(cmd, ptr);
+		if (json_object_object_length(ioctl_args_driver))
+			json_object_object_add(ioctl_obj, "from_driver", ioctl_args_driver);
+		else
+			json_object_put(ioctl_args_driver);
+	}
+
+	write_json_object_to_json_file(ioctl_obj);
+	json_object_put(ioctl_obj);
+
+	/* Tracing the HEVC entry point offsets needs the number of elements. */
+	if (cmd == VIDIOC_QUERY_EXT_CTRL && ptr != nullptr)
+		query_ext_ctrl_setup(fd, static_cast<struct v4l2_query_ext_ctrl*>(ptr));
+
+	return 0;
+}
+
+static int convert_record(struct trace_binary_record &rec, std::vector<unsigned char> &payload)
+{
+	switch (rec.type) {
+	case TRACE_BINARY_JSON: {
+		size_t pos = 0;
+		std::string json_str = next_string(payload, pos);
+		fwrite(json_str.c_str(), sizeof(char), json_str.length(), ctx_trace.trace_file);
+		fputs(",\n", ctx_trace.trace_file);
+		break;
+	}
+	case TRACE_BINARY_OPEN:
+	case TRACE_BINARY_OPEN64: {
+		struct trace_binary_open open_args;
+		if (payload.size() < sizeof(open_args))
+			return -1;
+		memcpy(&open_args, payload.data(), sizeof(open_args));
+
+		size_t pos = sizeof(open_args);
+		std::string path = next_string(payload, pos);
+		std::string driver = next_string(payload, pos);
+		std::string bus_info = next_string(payload, pos);
+		std::list<std::string> linked_entities;
+		while (pos < payload.size())
+			linked_entities.push_back(next_string(payload, pos));
+
+		write_open(rec.fd, path.c_str(), open_args.oflag, open_args.mode,
+		           rec.type == TRACE_BINARY_OPEN64, driver.c_str(), bus_info.c_str(),
+		           linked_entities);
+		break;
+	}
+	case TRACE_BINARY_CLOSE: {
+		size_t pos = 0;
+		trace_close(rec.fd, next_string(payload, pos));
+		break;
+	}
+	case TRACE_BINARY_MMAP:
+	case TRACE_BINARY_MMAP64: {
+		struct trace_binary_mmap mmap_args;
+		if (payload.size() < sizeof(mmap_args))
+			return -1;
+		memcpy(&mmap_args, payload.data(), sizeof(mmap_args));
+		errno = rec.err;
+		trace_mmap((void *)mmap_args.addr, mmap_args.len, mmap_args.prot, mmap_args.flags,
+		           rec.fd, mmap_args.off, mmap_args.buffer_address,
+		           rec.type == TRACE_BINARY_MMAP64);
+		break;
+	}
+	case TRACE_BINARY_MUNMAP: {
+		struct trace_binary_munmap munmap_args;
+		if (payload.size() < sizeof(munmap_args))
+			return -1;
+		memcpy(&munmap_args, payload.data(), sizeof(munmap_args));
+		errno = rec.err;
+		trace_munmap((void *)munmap_args.start, munmap_args.length);
+		break;
+	}
+	case TRACE_BINARY_IOCTL:
+		return convert_ioctl(rec.fd, rec.err, payload);
+	case TRACE_BINARY_MEM: {
+		struct trace_binary_mem mem_args;
+		if (payload.size() < sizeof(mem_args))
+			return -1;
+		memcpy(&mem_args, payload.data(), sizeof(mem_args));
+		if (sizeof(mem_args) + mem_args.dumped > payload.size() ||
+		    (mem_args.dumped && mem_args.dumped != mem_args.bytesused))
+			return -1;
+		write_mem(rec.fd, mem_args.offset, mem_args.type, mem_args.index, mem_args.bytesused,
+		          mem_args.address, mem_args.dumped ? &payload[sizeof(mem_args)] : nullptr);
+		break;
+	}
+	case TRACE_BINARY_WRITE: {
+		std::string message(payload.begin(), payload.end());
+		trace_write(message.c_str(), message.length());
+		break;
+	}
+	default:
+		line_info("\n\tSkipping unknown record type %u", rec.type);
+		break;
+	}
+	return 0;
+}
+
+/* Convert a binary trace to the same JSON trace v4l2-tracer writes without --binary. */
+int convert(std::string trace_filename)
+{
+	if (trace_filename.length() < 4 ||
+	    trace_filename.compare(trace_filename.length() - 4, 4, ".bin")) {
+		line_info("\n\tTrace file \'%s\' must have .bin file extension", trace_filename.c_str());
+		return 1;
+	}
+
+	/* The JSON trace is written by the same functions that trace, not as binary again. */
+	unsetenv("V4L2_TRACER_OPTION_BINARY");
+
+	FILE *trace_file = fopen(trace_filename.c_str(), "r");
+	if (trace_file == nullptr) {
+		line_info("\n\tCan't open \'%s\'", trace_filename.c_str());
+		return 1;
+	}
+
+	struct trace_binary_header header;
+	if (fread(&header, sizeof(header), 1, trace_file) != 1 ||
+	    memcmp(header.magic, TRACE_BINARY_MAGIC, sizeof(header.magic))) {
+		line_info("\n\t\'%s\' is not a binary v4l2-tracer trace", trace_filename.c_str());
+		fclose(trace_file);
+		return 1;
+	}
+	if (header.version != TRACE_BINARY_VERSION ||
+	    header.pointer_size != sizeof(void *)) {
+		line_info("\n\tCan't convert version %u trace with %u byte pointers",
+		          header.version, header.pointer_size);
+		fclose(trace_file);
+		return 1;
+	}
+
+	/* Buffer files written with --mem-files are stored next to the JSON trace file. */
+	std::string trace_id = trace_filename.substr(0, trace_filename.length() - 4);
+	setenv("TRACE_ID", trace_id.c_str(), 1);
+
+	std::string json_filename = trace_id + ".json";
+	ctx_trace.trace_filename = json_filename;
+	ctx_trace.trace_file = fopen(json_filename.c_str(), "w");
+	if (ctx_trace.trace_file == nullptr) {
+		line_info("\n\tCan't open \'%s\'", json_filename.c_str());
+		fclose(trace_file);
+		return 1;
+	}
+
+	fprintf(stderr, "Converting: %s\n", trace_filename.c_str());
+
+	/* Open the json array.*/
+	fputs("[\n", ctx_trace.trace_file);
+
+	struct trace_binary_record rec = {};
+	std::vector<unsigned char> payload;
+	unsigned long count = 0;
+	int ret = 0;
+
+	while (fread(&rec, sizeof(rec), 1, trace_file) == 1) {
+		if (rec.size < sizeof(rec)) {
+			ret = 1;
+			break;
+		}
+		payload.resize(rec.size - sizeof(rec));
+		if (payload.size() && fread(payload.data(), payload.size(), 1, trace_file) != 1) {
+			ret = 1;
+			break;
+		}
+		set_call_trace(rec.tid, rec.ts, rec.duration);
+		if (convert_record(rec, payload)) {
+			ret = 1;
+			break;
+		}
+		count++;
+	}
+	if (ret)
+		line_info("\n\tCorrupt record after %lu records, stopping", count);
+
+	/* Close the json-array. */
+	fflush(ctx_trace.trace_file);
+	fseek(ctx_trace.trace_file, -2L, SEEK_END);
+	fputs("\n]\n", ctx_trace.trace_file);
+	fclose(ctx_trace.trace_file);
+	ctx_trace.trace_file = nullptr;
+	fclose(trace_file);
+
+	fprintf(stderr, "Converted %lu records: %s\n", count, json_filename.c_str());
+	return ret;
+}
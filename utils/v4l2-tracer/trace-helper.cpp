@@ -5,9 +5,92 @@
 
 #include "trace.h"
 #include <math.h>
+#include <sys/syscall.h>
+#include <time.h>
 
 struct trace_context ctx_trace = {};
 
+static thread_local struct trace_call call_trace;
+static thread_local pid_t thread_id;
+
+const struct trace_options &get_options_trace(void)
+{
+	static const struct trace_options options = {
+		getenv("V4L2_TRACER_OPTION_COMPACT_PRINT") != nullptr,
+		getenv("V4L2_TRACER_OPTION_TRACE_USERSPACE_ARG") != nullptr,
+		getenv("V4L2_TRACER_OPTION_WRITE_DECODED_TO_JSON_FILE") != nullptr,
+		getenv("V4L2_TRACER_OPTION_WRITE_DECODED_TO_YUV_FILE") != nullptr,
+		getenv("V4L2_TRACER_OPTION_MEM_FILES") != nullptr,
+		getenv("V4L2_TRACER_OPTION_COMPRESS") != nullptr,
+		getenv("TRACE_ID") != nullptr ? getenv("TRACE_ID") : "",
+		getenv("V4L2_TRACER_TRACEE_PID") != nullptr ?
+			(pid_t) atoi(getenv("V4L2_TRACER_TRACEE_PID")) : 0,
+	};
+
+	return options;
+}
+
+/*
+ * The tracee is traced to <TRACE_ID>.json. Children it forks, and the programs they
+ * execute, are traced to <TRACE_ID>_<pid>.json so that each file is one stream of calls.
+ */
+std::string get_stream_id_trace(void)
+{
+	std::string stream_id = get_options_trace().trace_id;
+	pid_t tracee_pid = get_options_trace().tracee_pid;
+
+	if (tracee_pid && getpid() != tracee_pid)
+		stream_id += "_" + std::to_string(getpid());
+	return stream_id;
+}
+
+static __u64 get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Note the thread and time of a call right before it is made. */
+void start_call_trace(void)
+{
+	if (!thread_id)
+		thread_id = syscall(SYS_gettid);
+	call_trace.tid = thread_id;
+	call_trace.duration = 0;
+	call_trace.ts = get_time_ns();
+}
+
+/* Note how long the call took, right after it returns. */
+void end_call_trace(void)
+{
+	call_trace.duration = get_time_ns() - call_trace.ts;
+}
+
+void set_call_trace(pid_t tid, __u64 ts, __u64 duration)
+{
+	call_trace.tid = tid;
+	call_trace.ts = ts;
+	call_trace.duration = duration;
+}
+
+const struct trace_call &get_call_trace(void)
+{
+	return call_trace;
+}
+
+/* Called in a forked child, switch to a new trace stream for the child. */
+void fork_child_trace(void)
+{
+	thread_id = 0;
+	if (ctx_trace.trace_file != nullptr) {
+		fclose(ctx_trace.trace_file);
+		ctx_trace.trace_file = nullptr;
+	}
+	trace_binary_fork_child();
+}
+
 bool is_video_or_media_device(const char *path)
 {
 	std::string dev_path_video = "/dev/video";
@@ -376,7 +459,7 @@ void dqbuf_setup(struct v4l2_buffer *buf)
 void streamoff_cleanup(v4l2_buf_type buf_type)
 {
 	debug_line_info();
-	if (is_verbose() || (getenv("V4L2_TRACER_OPTION_WRITE_DECODED_TO_YUV_FILE") != nullptr)) {
+	if (is_verbose() || get_options_trace().write_decoded_to_yuv) {
 		fprintf(stderr, "VIDIOC_STREAMOFF: %s\n", val2s(buf_type, v4l2_buf_type_val_def).c_str());
 		fprintf(stderr, "%s, %s %s, width: %d, height: %d\n",
 		        val2s(ctx_trace.compression_format, v4l2_pix_fmt_val_def).c_str(),
@@ -467,19 +550,29 @@ void query_ext_ctrl_setup(int fd, struct v4l2_query_ext_ctrl *ptr)
 
 void write_json_object_to_json_file(json_object *jobj)
 {
+	const struct trace_call &call = get_call_trace();
+	if (call.tid) {
+		json_object_object_add(jobj, "tid", json_object_new_int(call.tid));
+		json_object_object_add(jobj, "ts", json_object_new_int64(call.ts));
+		if (call.duration)
+			json_object_object_add(jobj, "duration",
+			                       json_object_new_int64(call.duration));
+	}
+
 	std::string json_str;
-	if (getenv("V4L2_TRACER_OPTION_COMPACT_PRINT") != nullptr)
+	if (get_options_trace().compact_print)
 		json_str = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PLAIN);
 	else
 		json_str = json_object_to_json_string_ext(jobj, JSON_C_TO_STRING_PRETTY);
 
 	if (ctx_trace.trace_file == nullptr) {
-		std::string filename;
-		if (getenv("TRACE_ID") != nullptr)
-			filename = getenv("TRACE_ID");
-		ctx_trace.trace_filename = filename;
-		ctx_trace.trace_filename += ".json";
+		ctx_trace.trace_filename = get_stream_id_trace() + ".json";
 		ctx_trace.trace_file = fopen(ctx_trace.trace_filename.c_str(), "a");
+
+		/* v4l2-tracer opens the json array of the tracee, but not those of its children. */
+		struct stat sb;
+		if (fstat(fileno(ctx_trace.trace_file), &sb) == 0 && sb.st_size == 0)
+			fputs("[\n", ctx_trace.trace_file);
 	}
 
 	fwrite(json_str.c_str(), sizeof(char), json_str.length(), ctx_trace.trace_file);
@@ -489,6 +582,11 @@ void write_json_object_to_json_file(json_object *jobj)
 
 void close_json_file(void)
 {
+	if (trace_binary_enabled()) {
+		trace_binary_flush();
+		return;
+	}
+
 	if (ctx_trace.trace_file != nullptr) {
 		fclose(ctx_trace.trace_file);
 		ctx_trace.trace_file = 0;
@@ -4,10 +4,16 @@
  */
 
 #include "trace.h"
+#include <sys/syscall.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 extern struct trace_context ctx_trace;
 
-void trace_open(int fd, const char *path, int oflag, mode_t mode, bool is_open64)
+void write_open(int fd, const char *path, int oflag, mode_t mode, bool is_open64,
+                const char *driver, const char *bus_info,
+                const std::list<std::string> &linked_entities)
 {
 	json_object *open_obj = json_object_new_object();
 	json_object_object_add(open_obj, "fd", json_object_new_int(fd));
@@ -22,6 +28,23 @@ void trace_open(int fd, const char *path, int oflag, mode_t mode, bool is_open64
 	else
 		json_object_object_add(open_obj, "open", open_args);
 
+	json_object_object_add(open_obj, "driver", json_object_new_string(driver));
+	json_object_object_add(open_obj, "bus_info", json_object_new_string(bus_info));
+
+	std::string path_str = path;
+	if (path_str.find("video") != std::string::npos) {
+		json_object *linked_entities_obj = json_object_new_array();
+		for (auto &name : linked_entities)
+			json_object_array_add(linked_entities_obj, json_object_new_string(name.c_str()));
+		json_object_object_add(open_obj, "linked_entities", linked_entities_obj);
+	}
+
+	write_json_object_to_json_file(open_obj);
+	json_object_put(open_obj);
+}
+
+void trace_open(int fd, const char *path, int oflag, mode_t mode, bool is_open64)
+{
 	/* Add additional topology information about device. */
 	std::string path_str = path;
 	bool is_media = path_str.find("media") != std::string::npos;
@@ -34,40 +57,110 @@ void trace_open(int fd, const char *path, int oflag, mode_t mode, bool is_open64
 	std::string driver;
 	if (is_video) {
 		struct v4l2_capability cap = {};
-		setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
 		ioctl(fd, VIDIOC_QUERYCAP, &cap);
-		unsetenv("V4L2_TRACER_PAUSE_TRACE");
 
 		std::string path_media = get_path_media(reinterpret_cast<const char *>(cap.driver));
-
-		setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
 		media_fd = open(path_media.c_str(), O_RDONLY);
-		unsetenv("V4L2_TRACER_PAUSE_TRACE");
 	}
 
 	struct media_device_info info = {};
 	ioctl(media_fd, MEDIA_IOC_DEVICE_INFO, &info);
 
-	json_object_object_add(open_obj, "driver", json_object_new_string(info.driver));
-	json_object_object_add(open_obj, "bus_info", json_object_new_string(info.bus_info));
-
+	std::list<std::string> linked_entities;
 	if (is_video) {
-		std::list<std::string> linked_entities = get_linked_entities(media_fd, path_str);
-		json_object *linked_entities_obj = json_object_new_array();
-		for (auto &name : linked_entities)
-			json_object_array_add(linked_entities_obj, json_object_new_string(name.c_str()));
-		json_object_object_add(open_obj, "linked_entities", linked_entities_obj);
-		setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
+		linked_entities = get_linked_entities(media_fd, path_str);
 		close(media_fd);
-		unsetenv("V4L2_TRACER_PAUSE_TRACE");
 	}
 
-	write_json_object_to_json_file(open_obj);
-	json_object_put(open_obj);
+	if (!trace_binary_enabled()) {
+		write_open(fd, path, oflag, mode, is_open64, info.driver, info.bus_info, linked_entities);
+		return;
+	}
+
+	/* The strings are stored one after the other, each NUL terminated. */
+	struct trace_binary_open open_args = { oflag, (__u32)mode };
+	std::string strings;
+	strings.append(path, strlen(path) + 1);
+	strings.append(info.driver, strnlen(info.driver, sizeof(info.driver)));
+	strings += '\0';
+	strings.append(info.bus_info, strnlen(info.bus_info, sizeof(info.bus_info)));
+	strings += '\0';
+	for (auto &name : linked_entities) {
+		strings += name;
+		strings += '\0';
+	}
+
+	struct iovec iov[2] = {
+		{ &open_args, sizeof(open_args) },
+		{ (void *)strings.data(), strings.length() },
+	};
+	trace_binary_commit(is_open64 ? TRACE_BINARY_OPEN64 : TRACE_BINARY_OPEN, fd, 0, iov, 2);
+}
+
+void trace_close(int fd, std::string path)
+{
+	if (trace_binary_enabled()) {
+		struct iovec iov = { (void *)path.c_str(), path.length() + 1 };
+		trace_binary_commit(TRACE_BINARY_CLOSE, fd, 0, &iov, 1);
+		return;
+	}
+
+	json_object *close_obj = json_object_new_object();
+	json_object_object_add(close_obj, "fd", json_object_new_int(fd));
+	json_object_object_add(close_obj, "close", json_object_new_string(path.c_str()));
+	write_json_object_to_json_file(close_obj);
+	json_object_put(close_obj);
+}
+
+void trace_write(const void *buf, size_t count)
+{
+	if (trace_binary_enabled()) {
+		struct iovec iov = { (void *)buf, count };
+		trace_binary_commit(TRACE_BINARY_WRITE, -1, 0, &iov, 1);
+		return;
+	}
+
+	json_object *write_obj = json_object_new_object();
+	json_object_object_add(write_obj, "write", json_object_new_string((const char*)buf));
+	write_json_object_to_json_file(write_obj);
+	json_object_put(write_obj);
+}
+
+void trace_munmap(void *start, size_t length)
+{
+	if (trace_binary_enabled()) {
+		struct trace_binary_munmap munmap_args = { (__u64)start, length };
+		struct iovec iov = { &munmap_args, sizeof(munmap_args) };
+		trace_binary_commit(TRACE_BINARY_MUNMAP, -1, errno, &iov, 1);
+		return;
+	}
+
+	json_object *munmap_obj = json_object_new_object();
+
+	if (errno)
+		json_object_object_add(munmap_obj, "errno", json_object_new_string(STRERR(errno)));
+
+	json_object *munmap_args = json_object_new_object();
+	json_object_object_add(munmap_args, "start", json_object_new_int64((int64_t)start));
+	json_object_object_add(munmap_args, "length", json_object_new_uint64(length));
+	json_object_object_add(munmap_obj, "munmap", munmap_args);
+
+	write_json_object_to_json_file(munmap_obj);
+	json_object_put(munmap_obj);
 }
 
 void trace_mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off, unsigned long buf_address, bool is_mmap64)
 {
+	if (trace_binary_enabled()) {
+		struct trace_binary_mmap mmap_args = {
+			(__u64)addr, len, prot, flags, off, buf_address
+		};
+		struct iovec iov = { &mmap_args, sizeof(mmap_args) };
+		trace_binary_commit(is_mmap64 ? TRACE_BINARY_MMAP64 : TRACE_BINARY_MMAP,
+		                    fildes, errno, &iov, 1);
+		return;
+	}
+
 	json_object *mmap_obj = json_object_new_object();
 
 	if (errno)
@@ -94,39 +187,182 @@ void trace_mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t o
 
 json_object *trace_buffer(unsigned char *buffer_pointer, __u32 bytesused)
 {
-	const int BUF_SIZE = 5;
+	static const char hex_digits[] = "0123456789abcdef";
 	const int MAX_BYTES_PER_LINE = 32;
-	char buf[BUF_SIZE];
-	std::string str;
+	/* Each byte e.g. D9 is written as two characters "D9" plus a space. */
+	char line[MAX_BYTES_PER_LINE * 3];
+	bool compact = get_options_trace().compact_print;
 	int byte_count_per_line = 0;
+	int len = 0;
 	json_object *mem_array_obj = json_object_new_array();
 
 	for (__u32 i = 0; i < bytesused; i++) {
-		memset(buf, 0, BUF_SIZE);
-		/* Each byte e.g. D9 will write a string of two characters "D9". */
-		sprintf(buf, "%02x", buffer_pointer[i]);
-		str += buf;
+		line[len++] = hex_digits[buffer_pointer[i] >> 4];
+		line[len++] = hex_digits[buffer_pointer[i] & 0xf];
 		byte_count_per_line++;
 
 		/*  Add a newline every 32 bytes. */
 		if (byte_count_per_line == MAX_BYTES_PER_LINE) {
 			byte_count_per_line = 0;
-			json_object_array_add(mem_array_obj, json_object_new_string(str.c_str()));
-			str.clear();
-		} else if (getenv("V4L2_TRACER_OPTION_COMPACT_PRINT") == nullptr) {
+			json_object_array_add(mem_array_obj, json_object_new_string_len(line, len));
+			len = 0;
+		} else if (!compact) {
 			/* Add a space every byte e.g. "01 2A 40 01" */
-			str += " ";
+			line[len++] = ' ';
 		}
 	}
 
 	/* Trace the last line if it was less than a full line. */
 	if (byte_count_per_line)
-		json_object_array_add(mem_array_obj, json_object_new_string(str.c_str()));
+		json_object_array_add(mem_array_obj, json_object_new_string_len(line, len));
 
 	return mem_array_obj;
 }
 
-void trace_mem(int fd, __u32 offset, __u32 type, int index, __u32 bytesused, unsigned long start)
+static __u64 hash_buffer(const unsigned char *data, __u32 size)
+{
+	const __u64 k1 = 0x87c37b91114253d5ULL;
+	const __u64 k2 = 0x4cf5ad432745937fULL;
+	__u64 hash = size;
+	__u32 i = 0;
+
+	for (; i + sizeof(__u64) <= size; i += sizeof(__u64)) {
+		__u64 word;
+		memcpy(&word, data + i, sizeof(word));
+		hash ^= word * k1;
+		hash = ((hash << 31) | (hash >> 33)) * k2;
+	}
+	for (; i < size; i++) {
+		hash ^= data[i] * k1;
+		hash = ((hash << 31) | (hash >> 33)) * k2;
+	}
+
+	/* Mix the bits of the final value. */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+static bool write_mem_file(const std::string &path, unsigned char *data, __u32 bytesused)
+{
+	/*
+	 * Write to a temporary file first, so a partially written file is never used.
+	 * Other threads may write a file with the same name at the same time.
+	 */
+	std::string tmp_path = path + "." + std::to_string(getpid()) + "." +
+	                       std::to_string(syscall(SYS_gettid));
+
+#ifdef HAVE_ZLIB
+	if (get_options_trace().compress) {
+		gzFile gz = gzopen(tmp_path.c_str(), "wb1");
+		if (gz == nullptr)
+			return false;
+		bool ok = gzwrite(gz, data, bytesused) == (int)bytesused;
+		if (gzclose(gz) != Z_OK || !ok) {
+			unlink(tmp_path.c_str());
+			return false;
+		}
+		return rename(tmp_path.c_str(), path.c_str()) == 0;
+	}
+#endif
+
+	FILE *fp = fopen(tmp_path.c_str(), "w");
+	if (fp == nullptr)
+		return false;
+	bool ok = fwrite(data, 1, bytesused, fp) == bytesused;
+	if (fclose(fp) || !ok) {
+		unlink(tmp_path.c_str());
+		return false;
+	}
+	return rename(tmp_path.c_str(), path.c_str()) == 0;
+}
+
+/* Return true if the buffer file at path has exactly the given contents. */
+static bool same_mem_file(const std::string &path, const unsigned char *data, __u32 bytesused)
+{
+	unsigned char buf[65536];
+	__u32 pos = 0;
+	int len;
+
+#ifdef HAVE_ZLIB
+	/* gzread() reads uncompressed files as well. */
+	gzFile gz = gzopen(path.c_str(), "rb");
+	if (gz == nullptr)
+		return false;
+	while ((len = gzread(gz, buf, sizeof(buf))) > 0) {
+		if ((__u32)len > bytesused - pos || memcmp(buf, data + pos, len))
+			break;
+		pos += len;
+	}
+	gzclose(gz);
+#else
+	FILE *fp = fopen(path.c_str(), "r");
+	if (fp == nullptr)
+		return false;
+	while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+		if ((__u32)len > bytesused - pos || memcmp(buf, data + pos, len))
+			break;
+		pos += len;
+	}
+	fclose(fp);
+#endif
+	return len == 0 && pos == bytesused;
+}
+
+/*
+ * Store the buffer contents in a file next to the trace file instead of in the
+ * trace itself. The file is named after a hash of the contents, so buffers with
+ * identical contents e.g. repeated frames are stored only once. An existing file
+ * is only used if its contents match, buffers with different contents but the
+ * same hash get a numbered name. Return the path of the file relative to the
+ * trace file, or an empty string on failure.
+ */
+static std::string trace_mem_file(unsigned char *data, __u32 bytesused)
+{
+	const std::string &trace_id = get_options_trace().trace_id;
+	std::string dir = trace_id + "_mem";
+	unsigned long long hash = hash_buffer(data, bytesused);
+	std::string file;
+	char name[48];
+
+	for (unsigned n = 0; ; n++) {
+		if (n)
+			snprintf(name, sizeof(name), "%016llx-%u.raw", hash, n);
+		else
+			snprintf(name, sizeof(name), "%016llx.raw", hash);
+		file = name;
+#ifdef HAVE_ZLIB
+		if (get_options_trace().compress)
+			file += ".gz";
+#endif
+
+		struct stat sb;
+		std::string path = dir + "/" + file;
+		if (stat(path.c_str(), &sb) == 0) {
+			if (same_mem_file(path, data, bytesused))
+				break;
+			continue;
+		}
+		mkdir(dir.c_str(), 0755);
+		if (!write_mem_file(path, data, bytesused)) {
+			line_info("\n\tCan't write '%s': %s", path.c_str(), strerror(errno));
+			return "";
+		}
+		break;
+	}
+
+	/* The trace file is in the same directory as the directory with the buffer files. */
+	size_t pos = trace_id.find_last_of('/');
+	if (pos != std::string::npos)
+		return trace_id.substr(pos + 1) + "_mem/" + file;
+	return trace_id + "_mem/" + file;
+}
+
+void write_mem(int fd, __u32 offset, __u32 type, int index, __u32 bytesused, unsigned long start,
+               unsigned char *data)
 {
 	json_object *mem_obj = json_object_new_object();
 	json_object_object_add(mem_obj, "mem_dump",
@@ -137,9 +373,14 @@ void trace_mem(int fd, __u32 offset, __u32 type, int index, __u32 bytesused, uns
 	json_object_object_add(mem_obj, "bytesused", json_object_new_uint64(bytesused));
 	json_object_object_add(mem_obj, "address", json_object_new_uint64(start));
 
-	if ((type == V4L2_BUF_TYPE_VIDEO_OUTPUT || type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ||
-	    (getenv("V4L2_TRACER_OPTION_WRITE_DECODED_TO_JSON_FILE") != nullptr)) {
-		json_object *mem_array_obj = trace_buffer((unsigned char*) start, bytesused);
+	std::string mem_file;
+	if (data != nullptr && get_options_trace().mem_files)
+		mem_file = trace_mem_file(data, bytesused);
+
+	if (!mem_file.empty()) {
+		json_object_object_add(mem_obj, "mem_file", json_object_new_string(mem_file.c_str()));
+	} else if (data != nullptr) {
+		json_object *mem_array_obj = trace_buffer(data, bytesused);
 		json_object_object_add(mem_obj, "mem_array", mem_array_obj);
 	}
 
@@ -148,6 +389,26 @@ void trace_mem(int fd, __u32 offset, __u32 type, int index, __u32 bytesused, uns
 	json_object_put(mem_obj);
 }
 
+void trace_mem(int fd, __u32 offset, __u32 type, int index, __u32 bytesused, unsigned long start)
+{
+	bool dump = (type == V4L2_BUF_TYPE_VIDEO_OUTPUT || type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) ||
+	            get_options_trace().write_decoded_to_json;
+
+	if (!trace_binary_enabled()) {
+		write_mem(fd, offset, type, index, bytesused, start, dump ? (unsigned char *)start : nullptr);
+		return;
+	}
+
+	struct trace_binary_mem mem_args = {
+		type, offset, index, bytesused, start, dump ? bytesused : 0, 0
+	};
+	struct iovec iov[2] = {
+		{ &mem_args, sizeof(mem_args) },
+		{ (void *)start, mem_args.dumped },
+	};
+	trace_binary_commit(TRACE_BINARY_MEM, fd, 0, iov, 2);
+}
+
 void trace_mem_encoded(int fd, __u32 offset)
 {
 	unsigned long start = get_buffer_address_trace(fd, offset);
@@ -185,15 +446,10 @@ void trace_mem_decoded(void)
 					val2s(it->type, v4l2_buf_type_val_def).c_str(), it->index);
 			displayed_count++;
 
-			if (getenv("V4L2_TRACER_OPTION_WRITE_DECODED_TO_YUV_FILE") != nullptr) {
-				std::string filename;
-				if (getenv("TRACE_ID") != nullptr)
-					filename = getenv("TRACE_ID");
-				filename +=  ".yuv";
+			if (get_options_trace().write_decoded_to_yuv) {
+				std::string filename = get_options_trace().trace_id + ".yuv";
 				FILE *fp = fopen(filename.c_str(), "a");
-				unsigned char *buffer_pointer = (unsigned char*) it->address;
-				for (__u32 i = 0; i < expected_length; i++)
-					fwrite(&buffer_pointer[i], sizeof(unsigned char), 1, fp);
+				fwrite((unsigned char*) it->address, sizeof(unsigned char), expected_length, fp);
 				fclose(fp);
 			}
 			trace_mem(it->fd, it->offset, it->type, it->index, it->bytesused, it->address);
@@ -633,3 +889,31 @@ json_object *trace_ioctl_args(unsigned long cmd, void *arg)
 
 	return ioctl_args;
 }
+
+void trace_ioctl_binary(int fd, unsigned long cmd, int err,
+                        const std::vector<unsigned char> *arg_userspace, void *arg_driver)
+{
+	static thread_local std::vector<unsigned char> flat_driver;
+	struct trace_binary_ioctl ioctl_args = { cmd, 0, 0 };
+	struct iovec iov[3] = {
+		{ &ioctl_args, sizeof(ioctl_args) },
+		{ nullptr, 0 },
+		{ nullptr, 0 },
+	};
+
+	if (arg_userspace != nullptr) {
+		ioctl_args.userspace_size = arg_userspace->size();
+		iov[1].iov_base = (void *)arg_userspace->data();
+		iov[1].iov_len = arg_userspace->size();
+	}
+
+	if (arg_driver != nullptr) {
+		flat_driver.resize(trace_binary_arg_size(cmd, arg_driver));
+		trace_binary_arg_flatten(cmd, arg_driver, flat_driver.data());
+		ioctl_args.driver_size = flat_driver.size();
+		iov[2].iov_base = flat_driver.data();
+		iov[2].iov_len = flat_driver.size();
+	}
+
+	trace_binary_commit(TRACE_BINARY_IOCTL, fd, err, iov, 3);
+}
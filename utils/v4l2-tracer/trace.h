@@ -8,6 +8,7 @@
 
 #include "v4l2-tracer-common.h"
 #include "trace-gen.h"
+#include "trace-binary.h"
 
 struct buffer_trace {
 	int fd;
@@ -24,6 +25,25 @@ struct h264_info {
 	int max_pic_order_cnt_lsb;
 };
 
+/* Options set by v4l2-tracer, they are looked up once when tracing starts. */
+struct trace_options {
+	bool compact_print;
+	bool trace_userspace_arg;
+	bool write_decoded_to_json;
+	bool write_decoded_to_yuv;
+	bool mem_files;
+	bool compress;
+	std::string trace_id;
+	pid_t tracee_pid;
+};
+
+/* The thread that made the call being traced and when it made it. */
+struct trace_call {
+	pid_t tid;
+	__u64 ts;	/* CLOCK_MONOTONIC in ns */
+	__u64 duration;	/* ns the call took, 0 if it isn't known yet */
+};
+
 struct trace_context {
 	__u32 elems;
 	__u32 width;
@@ -41,13 +61,30 @@ struct trace_context {
 	std::unordered_map<int, std::string> devices; /* key:fd, value: path of the device */
 };
 
+void write_open(int fd, const char *path, int oflag, mode_t mode, bool is_open64,
+                const char *driver, const char *bus_info,
+                const std::list<std::string> &linked_entities);
 void trace_open(int fd, const char *path, int oflag, mode_t mode, bool is_open64);
+void trace_close(int fd, std::string path);
+void trace_write(const void *buf, size_t count);
 void trace_mmap(void *addr, size_t len, int prot, int flags, int fildes, off_t off, unsigned long buf_address, bool is_mmap64);
+void trace_munmap(void *start, size_t length);
+void write_mem(int fd, __u32 offset, __u32 type, int index, __u32 bytesused, unsigned long start,
+               unsigned char *data);
 void trace_mem(int fd, __u32 offset, __u32 type, int index, __u32 bytesused, unsigned long start);
 void trace_mem_encoded(int fd, __u32 offset);
 void trace_mem_decoded(void);
 json_object *trace_ioctl_args(unsigned long cmd, void *arg);
+void trace_ioctl_binary(int fd, unsigned long cmd, int err,
+                        const std::vector<unsigned char> *arg_userspace, void *arg_driver);
 
+const struct trace_options &get_options_trace(void);
+std::string get_stream_id_trace(void);
+void start_call_trace(void);
+void end_call_trace(void);
+void set_call_trace(pid_t tid, __u64 ts, __u64 duration);
+const struct trace_call &get_call_trace(void);
+void fork_child_trace(void);
 bool is_video_or_media_device(const char *path);
 void add_device(int fd, std::string path);
 std::string get_device(int fd);
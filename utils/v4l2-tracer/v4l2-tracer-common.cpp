@@ -30,16 +30,21 @@ void print_usage(void)
 	print_v4l2_tracer_info();
 	fprintf(stderr, "Usage:\n\tv4l2-tracer [options] trace <tracee>\n"
 	        "\tv4l2-tracer [options] retrace <trace_file>.json\n"
-	        "\tv4l2-tracer clean <trace_file>.json\n\n"
+	        "\tv4l2-tracer clean <trace_file>.json\n"
+	        "\tv4l2-tracer [options] convert <trace_file>.bin\n"
+	        "\tv4l2-tracer report <trace_file>.json <retrace_file>.json\n\n"
 
 	        "\tCommon options:\n"
+	        "\t\t-b, --binary      Write a binary trace, convert it to JSON afterwards.\n"
 	        "\t\t-c, --compact     Write minimal whitespace in JSON file.\n"
+	        "\t\t-f, --mem-files   Write buffer contents to files instead of the JSON file.\n"
 	        "\t\t-g, --debug       Turn on verbose reporting plus additional debug info.\n"
 	        "\t\t-h, --help        Display this message.\n"
 	        "\t\t-r  --raw         Write decoded video frame data to JSON file.\n"
 	        "\t\t-u  --userspace   Trace userspace arguments.\n"
 	        "\t\t-v, --verbose     Turn on verbose reporting.\n"
-	        "\t\t-y, --yuv         Write decoded video frame data to yuv file.\n\n"
+	        "\t\t-y, --yuv         Write decoded video frame data to yuv file.\n"
+	        "\t\t-z, --compress    Like --mem-files, but compress the files.\n\n"
 
 	        "\tRetrace options:\n"
 	        "\t\t-d, --video_device <dev>   Retrace with a specific video device.\n"
@@ -47,7 +52,16 @@ void print_usage(void)
 	        "\t\t                           /dev/video<dev> \n\n"
 	        "\t\t-m, --media_device <dev>   Retrace with a specific media device.\n"
 	        "\t\t                           <dev> must be a digit corresponding to\n"
-	        "\t\t                           /dev/media<dev> \n\n");
+	        "\t\t                           /dev/media<dev> \n\n"
+	        "\t\t-R, --range <first>[-<last>]\n"
+	        "\t\t                           Only retrace the JSON-objects <first> to <last>\n"
+	        "\t\t                           of the trace file, counting from 0, or the calls\n"
+	        "\t\t                           made <first>s to <last>s seconds after the first\n"
+	        "\t\t                           call. Earlier objects are retraced to set up the\n"
+	        "\t\t                           devices, except for those that queue buffers.\n\n"
+	        "\t\t-t, --timing <scale>       Keep the time between the calls of the trace,\n"
+	        "\t\t                           multiplied by <scale>, and compare the time the\n"
+	        "\t\t                           ioctls take with the trace afterwards.\n\n");
 }
 
 void add_separator(std::string &str)
@@ -359,23 +373,17 @@ std::string get_path_media(std::string driver)
 			continue;
 
 		std::string media_devname = std::string("/dev/") + name;
-		setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
 		int media_fd = open(media_devname.c_str(), O_RDONLY);
-		unsetenv("V4L2_TRACER_PAUSE_TRACE");
 		if (media_fd < 0)
 			continue;
 
 		struct media_device_info info = {};
 		if (ioctl(media_fd, MEDIA_IOC_DEVICE_INFO, &info) || info.driver != driver) {
-			setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
 			close(media_fd);
-			unsetenv("V4L2_TRACER_PAUSE_TRACE");
 			continue;
 		}
 		path_media = media_devname;
-		setenv("V4L2_TRACER_PAUSE_TRACE", "true", 0);
 		close(media_fd);
-		unsetenv("V4L2_TRACER_PAUSE_TRACE");
 	}
 	closedir(directory_pointer);
 	return path_media;
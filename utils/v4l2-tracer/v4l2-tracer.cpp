@@ -4,6 +4,7 @@
  */
 
 #include "retrace.h"
+#include "trace-binary.h"
 #include <climits>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -25,40 +26,55 @@ void v4l2_tracer_sig_handler(int signum)
 }
 
 enum Options {
+	V4l2TracerOptBinary = 'b',
 	V4l2TracerOptCompactPrint = 'c',
 	V4l2TracerOptSetVideoDevice = 'd',
+	V4l2TracerOptMemFiles = 'f',
 	V4l2TracerOptDebug = 'g',
 	V4l2TracerOptHelp = 'h',
 	V4l2TracerOptSetMediaDevice = 'm',
+	V4l2TracerOptRange = 'R',
 	V4l2TracerOptWriteDecodedToJson = 'r',
+	V4l2TracerOptTiming = 't',
 	V4l2TracerOptTraceUserspaceArg = 'u',
 	V4l2TracerOptVerbose = 'v',
 	V4l2TracerOptWriteDecodedToYUVFile = 'y',
+	V4l2TracerOptCompress = 'z',
 };
 
 const static struct option long_options[] = {
+	{ "binary", no_argument, nullptr, V4l2TracerOptBinary },
 	{ "compact", no_argument, nullptr, V4l2TracerOptCompactPrint },
 	{ "video_device", required_argument, nullptr, V4l2TracerOptSetVideoDevice },
+	{ "mem-files", no_argument, nullptr, V4l2TracerOptMemFiles },
 	{ "debug", no_argument, nullptr, V4l2TracerOptDebug },
 	{ "help", no_argument, nullptr, V4l2TracerOptHelp },
 	{ "media_device", required_argument, nullptr, V4l2TracerOptSetMediaDevice },
+	{ "range", required_argument, nullptr, V4l2TracerOptRange },
 	{ "raw", no_argument, nullptr, V4l2TracerOptWriteDecodedToJson },
+	{ "timing", required_argument, nullptr, V4l2TracerOptTiming },
 	{ "userspace", no_argument, nullptr, V4l2TracerOptTraceUserspaceArg},
 	{ "verbose", no_argument, nullptr, V4l2TracerOptVerbose },
 	{ "yuv", no_argument, nullptr, V4l2TracerOptWriteDecodedToYUVFile },
+	{ "compress", no_argument, nullptr, V4l2TracerOptCompress },
 	{ nullptr, 0, nullptr, 0 }
 };
 
 const char short_options[] = {
+	V4l2TracerOptBinary,
 	V4l2TracerOptCompactPrint,
 	V4l2TracerOptSetVideoDevice, ':',
+	V4l2TracerOptMemFiles,
 	V4l2TracerOptDebug,
 	V4l2TracerOptHelp,
 	V4l2TracerOptSetMediaDevice, ':',
+	V4l2TracerOptRange, ':',
 	V4l2TracerOptWriteDecodedToJson,
+	V4l2TracerOptTiming, ':',
 	V4l2TracerOptTraceUserspaceArg,
 	V4l2TracerOptVerbose,
-	V4l2TracerOptWriteDecodedToYUVFile
+	V4l2TracerOptWriteDecodedToYUVFile,
+	V4l2TracerOptCompress
 };
 
 int get_options(int argc, char *argv[])
@@ -78,6 +94,9 @@ int get_options(int argc, char *argv[])
 
 		option = getopt_long(argc, argv, short_options, long_options, NULL);
 		switch (option) {
+		case V4l2TracerOptBinary:
+			setenv("V4L2_TRACER_OPTION_BINARY", "true", 0);
+			break;
 		case V4l2TracerOptCompactPrint: {
 			setenv("V4L2_TRACER_OPTION_COMPACT_PRINT", "true", 0);
 			break;
@@ -100,6 +119,9 @@ int get_options(int argc, char *argv[])
 			}
 			break;
 		}
+		case V4l2TracerOptMemFiles:
+			setenv("V4L2_TRACER_OPTION_MEM_FILES", "true", 0);
+			break;
 		case V4l2TracerOptDebug:
 			setenv("V4L2_TRACER_OPTION_VERBOSE", "true", 0);
 			setenv("V4L2_TRACER_OPTION_DEBUG", "true", 0);
@@ -125,9 +147,28 @@ int get_options(int argc, char *argv[])
 			}
 			break;
 		}
+		case V4l2TracerOptRange: {
+			struct retrace_range range;
+			if (!get_range_retrace(optarg, &range)) {
+				line_info("\n\tCan't use range \'%s\'", optarg);
+				return -1;
+			}
+			setenv("V4L2_TRACER_OPTION_RANGE", optarg, 0);
+			break;
+		}
 		case V4l2TracerOptWriteDecodedToJson:
 			setenv("V4L2_TRACER_OPTION_WRITE_DECODED_TO_JSON_FILE", "true", 0);
 			break;
+		case V4l2TracerOptTiming: {
+			char *end;
+			double scale = strtod(optarg, &end);
+			if (*end != '\0' || !(scale > 0)) {
+				line_info("\n\tCan't use timing scale \'%s\'", optarg);
+				return -1;
+			}
+			setenv("V4L2_TRACER_OPTION_TIMING", optarg, 0);
+			break;
+		}
 		case V4l2TracerOptTraceUserspaceArg:
 			setenv("V4L2_TRACER_OPTION_TRACE_USERSPACE_ARG", "true", 0);
 			break;
@@ -137,6 +178,13 @@ int get_options(int argc, char *argv[])
 		case V4l2TracerOptWriteDecodedToYUVFile:
 			setenv("V4L2_TRACER_OPTION_WRITE_DECODED_TO_YUV_FILE", "true", 0);
 			break;
+		case V4l2TracerOptCompress:
+#ifndef HAVE_ZLIB
+			line_info("\n\tBuilt without zlib, buffer files are not compressed.");
+#endif
+			setenv("V4L2_TRACER_OPTION_MEM_FILES", "true", 0);
+			setenv("V4L2_TRACER_OPTION_COMPRESS", "true", 0);
+			break;
 		default:
 			break;
 		}
@@ -197,6 +245,18 @@ int clean(std::string trace_filename)
 			count_lines_removed++;
 			continue;
 		}
+		if (line.find("\"tid\"") != std::string::npos) {
+			count_lines_removed++;
+			continue;
+		}
+		if (line.find("\"ts\"") != std::string::npos) {
+			count_lines_removed++;
+			continue;
+		}
+		if (line.find("\"duration\"") != std::string::npos) {
+			count_lines_removed++;
+			continue;
+		}
 
 		fputs(buf, clean_file);
 	}
@@ -209,6 +269,70 @@ int clean(std::string trace_filename)
 	return 0;
 }
 
+static void close_json_array(std::string trace_filename)
+{
+	FILE *trace_file = fopen(trace_filename.c_str(), "r+");
+	if (trace_file == nullptr) {
+		line_info("\n\tCan't open \'%s\'", trace_filename.c_str());
+		return;
+	}
+	fseek(trace_file, -2L, SEEK_END);
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+}
+
+/* Find the trace files <trace_id>_<pid>.json or .bin written by forked children. */
+static std::list<std::string> get_child_trace_files(std::string trace_id, bool binary)
+{
+	std::list<std::string> filenames;
+	std::string dir_name = ".";
+	std::string prefix = trace_id + "_";
+	std::string suffix = binary ? ".bin" : ".json";
+
+	size_t pos = trace_id.find_last_of('/');
+	if (pos != std::string::npos) {
+		dir_name = trace_id.substr(0, pos + 1);
+		prefix = trace_id.substr(pos + 1) + "_";
+	}
+
+	DIR *dir = opendir(dir_name.c_str());
+	if (dir == nullptr)
+		return filenames;
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != nullptr) {
+		std::string name = entry->d_name;
+		if (name.length() <= prefix.length() + suffix.length() ||
+		    name.compare(0, prefix.length(), prefix) ||
+		    name.compare(name.length() - suffix.length(), suffix.length(), suffix))
+			continue;
+
+		std::string pid = name.substr(prefix.length(),
+		                              name.length() - prefix.length() - suffix.length());
+		if (pid.find_first_not_of("0123456789") != std::string::npos)
+			continue;
+
+		filenames.push_back(pos == std::string::npos ? name : dir_name + name);
+	}
+	closedir(dir);
+	filenames.sort();
+
+	return filenames;
+}
+
+static void write_header_object(FILE *trace_file, json_object *obj, bool binary)
+{
+	std::string json_str = json_object_to_json_string(obj);
+
+	if (binary) {
+		struct iovec iov = { (void *)json_str.c_str(), json_str.length() + 1 };
+		trace_binary_write_record(fileno(trace_file), TRACE_BINARY_JSON, -1, 0, &iov, 1);
+		return;
+	}
+	fwrite(json_str.c_str(), sizeof(char), json_str.length(), trace_file);
+	fputs(",\n", trace_file);
+}
+
 int tracer(int argc, char *argv[], bool retrace)
 {
 	char *exec[argc];
@@ -249,7 +373,8 @@ int tracer(int argc, char *argv[], bool retrace)
 		trace_id = trace_id.substr(timestamp_start_pos) + "_trace";
 	}
 	setenv("TRACE_ID", trace_id.c_str(), 0);
-	std::string trace_filename = trace_id + ".json";
+	bool binary = getenv("V4L2_TRACER_OPTION_BINARY") != nullptr;
+	std::string trace_filename = trace_id + (binary ? ".bin" : ".json");
 	FILE *trace_file = fopen(trace_filename.c_str(), "w");
 	if (trace_file == nullptr) {
 		fprintf(stderr, "Could not open trace file: %s\n", trace_filename.c_str());
@@ -257,11 +382,17 @@ int tracer(int argc, char *argv[], bool retrace)
 		return errno;
 	}
 
-	/* Open the json array.*/
-	fputs("[\n", trace_file);
+	/* Remove the traces of children from an earlier run with the same trace id. */
+	for (auto &child_filename : get_child_trace_files(trace_id, binary))
+		unlink(child_filename.c_str());
+
+	/* Open the json array or write the binary trace header. */
+	if (binary)
+		trace_binary_write_header(fileno(trace_file));
+	else
+		fputs("[\n", trace_file);
 
 	/* Add v4l-utils package and git info to the top of the trace file. */
-	std::string json_str;
 	json_object *v4l2_tracer_info_obj = json_object_new_object();
 	json_object_object_add(v4l2_tracer_info_obj, "package_version",
 	                       json_object_new_string(PACKAGE_VERSION));
@@ -273,9 +404,7 @@ int tracer(int argc, char *argv[], bool retrace)
 	                       json_object_new_string(STRING(GIT_SHA)));
 	json_object_object_add(v4l2_tracer_info_obj, "git_commit_date",
 	                       json_object_new_string(STRING(GIT_COMMIT_DATE)));
-	json_str = json_object_to_json_string(v4l2_tracer_info_obj);
-	fwrite(json_str.c_str(), sizeof(char), json_str.length(), trace_file);
-	fputs(",\n", trace_file);
+	write_header_object(trace_file, v4l2_tracer_info_obj, binary);
 	json_object_put(v4l2_tracer_info_obj);
 
 	/* Add v4l2-tracer command line to the top of the trace file. */
@@ -289,9 +418,7 @@ int tracer(int argc, char *argv[], bool retrace)
 	const time_t current_time = time(nullptr);
 	json_object_object_add(tracee_obj, "Timestamp", json_object_new_string(ctime(&current_time)));
 
-	json_str = json_object_to_json_string(tracee_obj);
-	fwrite(json_str.c_str(), sizeof(char), json_str.length(), trace_file);
-	fputs(",\n", trace_file);
+	write_header_object(trace_file, tracee_obj, binary);
 	json_object_put(tracee_obj);
 	fclose(trace_file);
 
@@ -333,6 +460,9 @@ int tracer(int argc, char *argv[], bool retrace)
 			fprintf(stderr, "\n");
 		}
 
+		/* Children of the tracee are traced to separate files. */
+		setenv("V4L2_TRACER_TRACEE_PID", std::to_string(getpid()).c_str(), 1);
+
 		execvpe(exec[0], (char* const*) exec, environ);
 		line_info("\n\tCould not execute application \'%s\'", exec[0]);
 		perror(" ");
@@ -348,10 +478,8 @@ int tracer(int argc, char *argv[], bool retrace)
 	fprintf(stderr, "Tracee exited with status: %d\n", exec_result);
 
 	/* Close the json-array and the trace file. */
-	trace_file = fopen(trace_filename.c_str(), "r+");
-	fseek(trace_file, -2L, SEEK_END);
-	fputs("\n]\n", trace_file);
-	fclose(trace_file);
+	if (!binary)
+		close_json_array(trace_filename);
 
 	if (retrace)
 		fprintf(stderr, "Retrace complete: ");
@@ -360,6 +488,27 @@ int tracer(int argc, char *argv[], bool retrace)
 	fprintf(stderr, "%s", trace_filename.c_str());
 	fprintf(stderr, "\n");
 
+	std::list<std::string> child_filenames = get_child_trace_files(trace_id, binary);
+	for (auto &child_filename : child_filenames) {
+		if (!binary)
+			close_json_array(child_filename);
+		fprintf(stderr, "Child process traced to: %s\n", child_filename.c_str());
+	}
+
+	/* Compare the timing of the retrace with the trace. */
+	if (retrace && getenv("V4L2_TRACER_OPTION_TIMING") != nullptr && !binary) {
+		fprintf(stderr, "\n");
+		report(argv[optind], trace_filename);
+	}
+
+	if (binary) {
+		fprintf(stderr, "Convert it to JSON with: v4l2-tracer convert %s\n",
+		        trace_filename.c_str());
+		for (auto &child_filename : child_filenames)
+			fprintf(stderr, "                         v4l2-tracer convert %s\n",
+			        child_filename.c_str());
+	}
+
 	unsetenv("LD_PRELOAD");
 	return exec_result;
 }
@@ -411,6 +560,14 @@ int main(int argc, char *argv[])
 		ret = retrace(argv[optind]);
 	} else if (command == "clean") {
 		ret = clean (argv[optind]);
+	} else if (command == "convert") {
+		ret = convert(argv[optind]);
+	} else if (command == "report") {
+		if (optind + 1 == argc) {
+			print_usage();
+			return ret;
+		}
+		ret = report(argv[optind], argv[optind + 1]);
 	} else {
 		if (is_debug()) {
 			line_info("Invalid command");